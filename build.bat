@@ -5,7 +5,13 @@ IF NOT EXIST build MKDIR build
 pushd build
 
 rem C4201: Using nameless struct 
+rem -arch:AVX2: Vector kernels of the lockstep emulator
 
-cl -Zi -W4 -wd4201 ..\src\main.cpp
+cl -Zi -W4 -wd4201 -arch:AVX2 ..\src\main.cpp
 
-popd
\ No newline at end of file
+rem Emulator library: emulator_static.lib, and emulator.dll with its import library emulator.lib
+cl -c -Zi -W4 -wd4201 -Fo:emulator_api.obj ..\src\emulator_api.cpp
+lib -nologo emulator_api.obj -OUT:emulator_static.lib
+cl -LD -Zi -W4 -wd4201 -DEMU_BUILD_DLL -Fo:emulator_dll.obj ..\src\emulator_api.cpp -Fe:emulator.dll
+
+popd
@@ -0,0 +1,294 @@
+#include "common.cpp"
+
+// Register and memory accesses of decoded instructions
+
+enum RegisterId
+{
+    // NOTE: General purpose registers use the same indices as 16-bit RMField registers.
+    // 8-bit registers are tracked as the 16-bit register that contains them.
+    REGID_AX, REGID_CX, REGID_DX, REGID_BX, REGID_SP, REGID_BP, REGID_SI, REGID_DI,
+
+    // Segment registers, in segment register index order
+    REGID_ES, REGID_CS, REGID_SS, REGID_DS,
+
+    REGID_COUNT
+};
+
+typedef u16 RegisterSet;
+static_assert(REGID_COUNT <= 16, "RegisterSet is too small");
+
+#define REGSET(id) ((RegisterSet)(1 << (id)))
+
+static const char* registerIdNames[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds"};
+
+// Registers used to compute the effective address of each RMField memory form
+static const RegisterSet effectiveAddressRegisters[] = {
+    REGSET(REGID_BX) | REGSET(REGID_SI),
+    REGSET(REGID_BX) | REGSET(REGID_DI),
+    REGSET(REGID_BP) | REGSET(REGID_SI),
+    REGSET(REGID_BP) | REGSET(REGID_DI),
+    REGSET(REGID_SI),
+    REGSET(REGID_DI),
+    REGSET(REGID_BP),
+    REGSET(REGID_BX),
+};
+
+struct InstructionAccess
+{
+    RegisterSet reads;
+    RegisterSet writes;
+
+    bool memoryRead;
+    bool memoryWrite;
+    bool memoryWide;
+
+    // Set for MEM_DIRECT operands
+    bool hasDirectAddress;
+    u16 directAddress;
+};
+
+inline RegisterId GetRegisterId(Operand* operand, bool wide)
+{
+    if (operand->type == OP_SEGMENT_REGISTER) return (RegisterId)(REGID_ES + operand->regmemIndex);
+
+    // NOTE: AL..BL are 0..3 and AH..BH are 4..7, both halves belong to the same 16-bit register.
+    return (RegisterId)(wide ? operand->regmemIndex : (operand->regmemIndex & 0b11));
+}
+
+inline bool IsDirectAddress(Operand* operand)
+{
+    return (operand->type == OP_MEMORY && operand->modField == MEMORY_0BIT_MODE && operand->regmemIndex == MEM_DIRECT);
+}
+
+void AccessOperand(InstructionAccess* access, Operand* operand, bool wide, bool read, bool write)
+{
+    switch (operand->type)
+    {
+        case OP_REGISTER:
+        case OP_SEGMENT_REGISTER:
+        {
+            RegisterSet set = REGSET(GetRegisterId(operand, wide));
+            if (read) access->reads |= set;
+            if (write) access->writes |= set;
+        }
+        break;
+        case OP_MEMORY:
+        {
+            if (IsDirectAddress(operand))
+            {
+                access->hasDirectAddress = true;
+                access->directAddress = operand->value;
+            }
+            else
+            {
+                access->reads |= effectiveAddressRegisters[operand->regmemIndex];
+            }
+
+            access->memoryRead |= read;
+            access->memoryWrite |= write;
+            access->memoryWide = wide;
+        }
+        break;
+        case OP_IMMEDIATE:
+        break;
+    }
+}
+
+/// @brief Determines which registers and memory an instruction reads and writes
+/// @param instruction decoded instruction
+/// @return explicit and implicit accesses. Flags are not tracked.
+InstructionAccess GetInstructionAccess(Instruction* instruction)
+{
+    InstructionAccess access {0};
+
+    Operand* dest = &instruction->opDest;
+    Operand* src = &instruction->opSrc;
+    bool wide = instruction->isWide;
+
+    const RegisterSet stack = REGSET(REGID_SP);
+    const RegisterSet accumulator = REGSET(REGID_AX);
+
+    switch (instruction->type)
+    {
+        case DIS_MOV:
+            AccessOperand(&access, dest, wide, false, true);
+            AccessOperand(&access, src, wide, true, false);
+        break;
+
+        case DIS_ADD: case DIS_ADC: case DIS_SUB: case DIS_SBB:
+        case DIS_AND: case DIS_OR: case DIS_XOR:
+        case DIS_SHL: case DIS_SHR: case DIS_SAR:
+        case DIS_ROL: case DIS_ROR: case DIS_RCL: case DIS_RCR:
+            AccessOperand(&access, dest, wide, true, true);
+            // NOTE: Shift counts (CL or 1) are always byte sized.
+            AccessOperand(&access, src, (instruction->type >= DIS_SHL && instruction->type <= DIS_RCR) ? false : wide, true, false);
+        break;
+
+        case DIS_CMP:
+        case DIS_TEST:
+            AccessOperand(&access, dest, wide, true, false);
+            AccessOperand(&access, src, wide, true, false);
+        break;
+
+        case DIS_INC: case DIS_DEC: case DIS_NOT: case DIS_NEG:
+            AccessOperand(&access, dest, wide, true, true);
+        break;
+
+        case DIS_XCHG:
+            AccessOperand(&access, dest, wide, true, true);
+            AccessOperand(&access, src, wide, true, true);
+        break;
+
+        case DIS_PUSH:
+            AccessOperand(&access, dest, true, true, false);
+            access.reads |= stack;
+            access.writes |= stack;
+        break;
+        case DIS_POP:
+            AccessOperand(&access, dest, true, false, true);
+            access.reads |= stack;
+            access.writes |= stack;
+        break;
+
+        case DIS_MUL: case DIS_IMUL:
+            AccessOperand(&access, dest, wide, true, false);
+            access.reads |= accumulator;
+            access.writes |= accumulator | (wide ? REGSET(REGID_DX) : 0);
+        break;
+        case DIS_DIV: case DIS_IDIV:
+            AccessOperand(&access, dest, wide, true, false);
+            access.reads |= accumulator | (wide ? REGSET(REGID_DX) : 0);
+            access.writes |= accumulator | (wide ? REGSET(REGID_DX) : 0);
+        break;
+
+        case DIS_LEA:
+        {
+            AccessOperand(&access, dest, true, false, true);
+
+            // NOTE: Only the address is computed, memory is not accessed.
+            if (!IsDirectAddress(src)) access.reads |= effectiveAddressRegisters[src->regmemIndex];
+        }
+        break;
+        case DIS_LDS:
+        case DIS_LES:
+            AccessOperand(&access, dest, true, false, true);
+            AccessOperand(&access, src, true, true, false);
+            access.writes |= REGSET(instruction->type == DIS_LDS ? REGID_DS : REGID_ES);
+        break;
+
+        case DIS_IN:
+            AccessOperand(&access, dest, wide, false, true);
+            AccessOperand(&access, src, true, true, false);
+        break;
+        case DIS_OUT:
+            AccessOperand(&access, dest, true, true, false);
+            AccessOperand(&access, src, wide, true, false);
+        break;
+
+        case DIS_CBW:
+        case DIS_AAA: case DIS_AAS: case DIS_DAA: case DIS_DAS: case DIS_AAM: case DIS_AAD:
+            access.reads |= accumulator;
+            access.writes |= accumulator;
+        break;
+        case DIS_CWD:
+            access.reads |= accumulator;
+            access.writes |= REGSET(REGID_DX);
+        break;
+        case DIS_XLAT:
+            access.reads |= accumulator | REGSET(REGID_BX) | REGSET(REGID_DS);
+            access.writes |= accumulator;
+            access.memoryRead = true;
+        break;
+        case DIS_LAHF:
+            access.writes |= accumulator;
+        break;
+        case DIS_SAHF:
+            access.reads |= accumulator;
+        break;
+
+        case DIS_MOVSB: case DIS_MOVSW:
+            access.reads |= REGSET(REGID_SI) | REGSET(REGID_DI) | REGSET(REGID_DS) | REGSET(REGID_ES);
+            access.writes |= REGSET(REGID_SI) | REGSET(REGID_DI);
+            access.memoryRead = access.memoryWrite = true;
+        break;
+        case DIS_CMPSB: case DIS_CMPSW:
+            access.reads |= REGSET(REGID_SI) | REGSET(REGID_DI) | REGSET(REGID_DS) | REGSET(REGID_ES);
+            access.writes |= REGSET(REGID_SI) | REGSET(REGID_DI);
+            access.memoryRead = true;
+        break;
+        case DIS_SCASB: case DIS_SCASW:
+            access.reads |= accumulator | REGSET(REGID_DI) | REGSET(REGID_ES);
+            access.writes |= REGSET(REGID_DI);
+            access.memoryRead = true;
+        break;
+        case DIS_LODSB: case DIS_LODSW:
+            access.reads |= REGSET(REGID_SI) | REGSET(REGID_DS);
+            access.writes |= accumulator | REGSET(REGID_SI);
+            access.memoryRead = true;
+        break;
+        case DIS_STOSB: case DIS_STOSW:
+            access.reads |= accumulator | REGSET(REGID_DI) | REGSET(REGID_ES);
+            access.writes |= REGSET(REGID_DI);
+            access.memoryWrite = true;
+        break;
+
+        case DIS_LOOP: case DIS_LOOPZ: case DIS_LOOPNZ:
+            access.reads |= REGSET(REGID_CX);
+            access.writes |= REGSET(REGID_CX);
+        break;
+        case DIS_JCXZ:
+            access.reads |= REGSET(REGID_CX);
+        break;
+
+        case DIS_CALL:
+            AccessOperand(&access, dest, true, true, false);
+            access.reads |= stack;
+            access.writes |= stack;
+            if (instruction->isFar)
+            {
+                access.reads |= REGSET(REGID_CS);
+                access.writes |= REGSET(REGID_CS);
+            }
+        break;
+        case DIS_JMP:
+            AccessOperand(&access, dest, true, true, false);
+            if (instruction->isFar) access.writes |= REGSET(REGID_CS);
+        break;
+
+        case DIS_RET: case DIS_INT: case DIS_INTO: case DIS_IRET:
+        case DIS_PUSHF: case DIS_POPF:
+            access.reads |= stack;
+            access.writes |= stack;
+            if (instruction->type == DIS_RET && instruction->isFar) access.writes |= REGSET(REGID_CS);
+        break;
+
+        default:
+        break;
+    }
+
+    if (access.memoryRead || access.memoryWrite)
+    {
+        if (instruction->type >= DIS_MOVSB && instruction->type <= DIS_STOSW)
+        {
+            access.memoryWide = ((instruction->type - DIS_MOVSB) & 0b1);
+        }
+
+        // NOTE: The override replaces DS for string sources and XLAT. SCAS and STOS only use ES:DI, which is fixed.
+        InstructionType type = instruction->type;
+        bool fixedSegment = (type == DIS_SCASB || type == DIS_SCASW || type == DIS_STOSB || type == DIS_STOSW);
+        if ((instruction->prefixes & PREFIX_SEGMENT) && !fixedSegment)
+        {
+            bool implicitDS = ((type >= DIS_MOVSB && type <= DIS_LODSW) || type == DIS_XLAT);
+            if (implicitDS) access.reads &= ~REGSET(REGID_DS);
+            access.reads |= REGSET(REGID_ES + instruction->segmentOverride);
+        }
+    }
+
+    if (instruction->prefixes & PREFIX_ANY_REP)
+    {
+        access.reads |= REGSET(REGID_CX);
+        access.writes |= REGSET(REGID_CX);
+    }
+
+    return access;
+}
@@ -0,0 +1,157 @@
+#include "common.cpp"
+
+// Bump allocator for everything a pass allocates while working on one image: the file contents, the decoded
+// instructions and side tables.
+//
+// Memory comes from a list of chunks. Allocating moves a pointer forward in the current chunk and takes the next
+// chunk when it is full. Nothing is freed on its own, Arena_Reset() makes all of it available again in O(1) and
+// keeps the chunks, so a worker that resets between files stops allocating once it has seen its largest file.
+
+#define ARENA_DEFAULT_CHUNK_SIZE (1 << 20)
+#define ARENA_ALIGNMENT 16
+
+// NOTE: Aligned so that the data after the header is aligned as well.
+struct alignas(ARENA_ALIGNMENT) ArenaChunk
+{
+    ArenaChunk* next;
+    u64 size; // Bytes after the header
+    u64 used;
+};
+
+struct Arena
+{
+    ArenaChunk* first;
+    ArenaChunk* current;
+    u64 chunkSize; // Minimum size of new chunks
+    u64 usedBefore; // Bytes used in the chunks before current, since the last reset
+
+    // Totals since Arena_Init()
+    u64 allocationCount;
+    u64 peakUsed;
+    u64 reserved; // Bytes in all chunks
+    u32 chunkCount;
+};
+
+struct ArenaMetrics
+{
+    u64 allocationCount;
+    u64 peakUsed;
+    u64 reserved;
+    u32 chunkCount;
+};
+
+/// @param chunkSize minimum size of each chunk, 0 for the default
+void Arena_Init(Arena* arena, u64 chunkSize = 0)
+{
+    *arena = {};
+    arena->chunkSize = (chunkSize ? chunkSize : ARENA_DEFAULT_CHUNK_SIZE);
+}
+
+void Arena_Free(Arena* arena)
+{
+    ArenaChunk* chunk = arena->first;
+    while (chunk)
+    {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *arena = {};
+}
+
+inline u8* Arena_ChunkData(ArenaChunk* chunk)
+{
+    return (u8*)(chunk + 1);
+}
+
+/// @brief Moves to a chunk after the current one with at least size bytes free, allocates it if there is none
+void Arena_NextChunk(Arena* arena, u64 size)
+{
+    ArenaChunk* next = (arena->current ? arena->current->next : arena->first);
+    if (arena->current) arena->usedBefore += arena->current->used;
+
+    // NOTE: Chunks after the current one are left over from before the last reset.
+    if (next && next->size >= size)
+    {
+        next->used = 0;
+        arena->current = next;
+        return;
+    }
+
+    u64 chunkSize = (size > arena->chunkSize ? size : arena->chunkSize);
+    ArenaChunk* chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + chunkSize);
+    chunk->size = chunkSize;
+    chunk->used = 0;
+    chunk->next = next;
+
+    if (arena->current) arena->current->next = chunk;
+    else arena->first = chunk;
+    arena->current = chunk;
+
+    arena->reserved += chunkSize;
+    ++arena->chunkCount;
+}
+
+/// @brief Allocates size bytes, aligned to ARENA_ALIGNMENT. The contents are not cleared.
+void* Arena_Push(Arena* arena, u64 size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(u64)(ARENA_ALIGNMENT - 1);
+    if (!arena->current || arena->current->size - arena->current->used < size) Arena_NextChunk(arena, size);
+
+    ArenaChunk* chunk = arena->current;
+    void* result = Arena_ChunkData(chunk) + chunk->used;
+    chunk->used += size;
+
+    ++arena->allocationCount;
+    u64 used = arena->usedBefore + chunk->used;
+    if (used > arena->peakUsed) arena->peakUsed = used;
+    return result;
+}
+
+/// @brief Resizes an allocation, in place if it is the last one in the current chunk
+/// @return the allocation, moved if it did not fit. The old contents are kept.
+void* Arena_Grow(Arena* arena, void* data, u64 oldSize, u64 newSize)
+{
+    oldSize = (oldSize + ARENA_ALIGNMENT - 1) & ~(u64)(ARENA_ALIGNMENT - 1);
+    newSize = (newSize + ARENA_ALIGNMENT - 1) & ~(u64)(ARENA_ALIGNMENT - 1);
+
+    ArenaChunk* chunk = arena->current;
+    bool last = (chunk && (u8*)data + oldSize == Arena_ChunkData(chunk) + chunk->used);
+    if (last && chunk->used - oldSize + newSize <= chunk->size)
+    {
+        chunk->used = chunk->used - oldSize + newSize;
+
+        u64 used = arena->usedBefore + chunk->used;
+        if (used > arena->peakUsed) arena->peakUsed = used;
+        return data;
+    }
+
+    void* result = Arena_Push(arena, newSize);
+    memcpy(result, data, (oldSize < newSize ? oldSize : newSize));
+    return result;
+}
+
+/// @brief Makes all memory available again, keeping the chunks
+void Arena_Reset(Arena* arena)
+{
+    // NOTE: The other chunks are cleared when they are reached again.
+    arena->current = arena->first;
+    if (arena->first) arena->first->used = 0;
+    arena->usedBefore = 0;
+}
+
+/// @brief Adds the metrics of an arena to a total: counts add up, the peak is the largest
+void Arena_AddMetrics(Arena* arena, ArenaMetrics* total)
+{
+    total->allocationCount += arena->allocationCount;
+    if (arena->peakUsed > total->peakUsed) total->peakUsed = arena->peakUsed;
+    total->reserved += arena->reserved;
+    total->chunkCount += arena->chunkCount;
+}
+
+void Arena_PrintMetrics(ArenaMetrics* metrics)
+{
+    printf("; arena: %llu allocations, peak %.1f KiB, %u chunks, %.1f KiB reserved\n",
+        (unsigned long long)metrics->allocationCount, metrics->peakUsed / 1024.0, metrics->chunkCount,
+        metrics->reserved / 1024.0);
+}
@@ -0,0 +1,121 @@
+#include "common.cpp"
+
+// Basic blocks and the control flow graph of a decoded image
+
+#define BLOCK_NONE 0xFFFFFFFF
+
+struct BasicBlock
+{
+    u32 first; // Index of the first instruction
+    u32 count;
+
+    // NOTE: Indirect jumps and returns have no known successors.
+    u32 successors[2];
+    u32 successorCount;
+    u32 predecessorCount;
+};
+
+struct ControlFlowGraph
+{
+    BasicBlock* blocks;
+    u32 blockCount;
+
+    u32* blockOfInstruction;
+};
+
+inline bool EndsBasicBlock(InstructionType type)
+{
+    return (IsConditionalJump(type) || IsLoopInstruction(type) ||
+            type == DIS_JMP || type == DIS_RET || type == DIS_IRET || type == DIS_HLT);
+}
+
+inline bool FallsThrough(InstructionType type)
+{
+    return (type != DIS_JMP && type != DIS_RET && type != DIS_IRET && type != DIS_HLT);
+}
+
+/// @brief Splits the decoded image into basic blocks at branch targets and after control transfers
+/// @param decoded decoded image
+/// @param[out] graph blocks in image order. Free with FreeControlFlowGraph().
+void BuildControlFlowGraph(DecodedImage* decoded, ControlFlowGraph* graph)
+{
+    *graph = {};
+    graph->blockOfInstruction = (u32*)malloc((decoded->count + 1) * sizeof(u32));
+
+    // Mark leaders. blockOfInstruction temporarily holds 1 for leaders.
+    u32* isLeader = graph->blockOfInstruction;
+    memset(isLeader, 0, (decoded->count + 1) * sizeof(u32));
+    if (decoded->count > 0) isLeader[0] = 1;
+
+    for (u32 index = 0; index < decoded->count; ++index)
+    {
+        Instruction* instruction = &decoded->instructions[index];
+
+        u32 target;
+        if (GetBranchTarget(instruction, &target))
+        {
+            i64 targetIndex = FindInstruction(decoded, target);
+            if (targetIndex >= 0) isLeader[targetIndex] = 1;
+        }
+
+        if (EndsBasicBlock(instruction->type)) isLeader[index + 1] = 1;
+    }
+
+    u32 blockCount = 0;
+    for (u32 index = 0; index < decoded->count; ++index) blockCount += isLeader[index];
+
+    graph->blocks = (BasicBlock*)malloc((blockCount + 1) * sizeof(BasicBlock));
+
+    // Assign instructions to blocks
+    for (u32 index = 0; index < decoded->count; ++index)
+    {
+        if (isLeader[index])
+        {
+            BasicBlock* block = &graph->blocks[graph->blockCount++];
+            *block = {};
+            block->first = index;
+        }
+
+        BasicBlock* current = &graph->blocks[graph->blockCount - 1];
+        ++current->count;
+        graph->blockOfInstruction[index] = graph->blockCount - 1;
+    }
+
+    // Connect blocks
+    for (u32 blockIndex = 0; blockIndex < graph->blockCount; ++blockIndex)
+    {
+        BasicBlock* block = &graph->blocks[blockIndex];
+        Instruction* last = &decoded->instructions[block->first + block->count - 1];
+
+        if (FallsThrough(last->type) && blockIndex + 1 < graph->blockCount)
+        {
+            block->successors[block->successorCount++] = blockIndex + 1;
+        }
+
+        u32 target;
+        if (GetBranchTarget(last, &target))
+        {
+            i64 targetIndex = FindInstruction(decoded, target);
+            if (targetIndex >= 0)
+            {
+                u32 targetBlock = graph->blockOfInstruction[targetIndex];
+                if (block->successorCount == 0 || block->successors[0] != targetBlock)
+                {
+                    block->successors[block->successorCount++] = targetBlock;
+                }
+            }
+        }
+
+        for (u32 successorIndex = 0; successorIndex < block->successorCount; ++successorIndex)
+        {
+            ++graph->blocks[block->successors[successorIndex]].predecessorCount;
+        }
+    }
+}
+
+void FreeControlFlowGraph(ControlFlowGraph* graph)
+{
+    free(graph->blocks);
+    free(graph->blockOfInstruction);
+    *graph = {};
+}
@@ -0,0 +1,230 @@
+#include "common.cpp"
+
+// Static 8086 clock estimates, from the instruction timing tables in the 8086 Family User's Manual.
+//
+// NOTE: Transfers of words at odd addresses (+4 per transfer) are not known statically and are not counted.
+// Instructions with a range of timings (multiply, divide) use the middle of the range.
+
+struct ClockEstimate
+{
+    u32 clocks;      // Branch not taken, or the only timing
+    u32 takenClocks; // Branch taken. Same as clocks for non-branch instructions.
+};
+
+/// @brief Clocks needed to compute the effective address of a memory operand
+u32 EffectiveAddressClocks(Operand* operand)
+{
+    Assert(operand->type == OP_MEMORY);
+
+    if (operand->modField == MEMORY_0BIT_MODE && operand->regmemIndex == MEM_DIRECT) return 6;
+
+    bool hasDisplacement = (operand->modField == MEMORY_8BIT_MODE || operand->modField == MEMORY_16BIT_MODE);
+
+    switch (operand->regmemIndex)
+    {
+        case MEM_BP_DI:
+        case MEM_BX_SI:
+            return (hasDisplacement ? 11 : 7);
+        case MEM_BP_SI:
+        case MEM_BX_DI:
+            return (hasDisplacement ? 12 : 8);
+        default: // Base or index only
+            return (hasDisplacement ? 9 : 5);
+    }
+}
+
+/// @brief Estimates the clocks of a single instruction
+ClockEstimate EstimateClocks(Instruction* instruction)
+{
+    Operand* dest = &instruction->opDest;
+    Operand* src = &instruction->opSrc;
+    bool wide = instruction->isWide;
+
+    bool destMemory = (instruction->operandCount >= 1 && dest->type == OP_MEMORY);
+    bool srcMemory = (instruction->operandCount >= 2 && src->type == OP_MEMORY);
+    u32 ea = (destMemory ? EffectiveAddressClocks(dest) : (srcMemory ? EffectiveAddressClocks(src) : 0));
+
+    // NOTE: The accumulator forms of MOV with a direct address are 3 bytes long, the general form is 4.
+    Operand* memory = (destMemory ? dest : src);
+    Operand* other = (destMemory ? src : dest);
+    bool accumulatorForm = (instruction->length - instruction->prefixLength == 3 && (destMemory || srcMemory) && IsDirectAddress(memory) &&
+                           other->type == OP_REGISTER && other->regmemIndex == REG_AX);
+
+    u32 clocks = 0;
+    u32 takenClocks = 0;
+    bool isBranch = false;
+
+    switch (instruction->type)
+    {
+        case DIS_MOV:
+            if (accumulatorForm) clocks = 10;
+            else if (destMemory) clocks = (src->type == OP_IMMEDIATE ? 10 : 9) + ea;
+            else if (srcMemory) clocks = 8 + ea;
+            else if (src->type == OP_IMMEDIATE) clocks = 4;
+            else clocks = 2;
+        break;
+
+        case DIS_ADD: case DIS_ADC: case DIS_SUB: case DIS_SBB:
+        case DIS_AND: case DIS_OR: case DIS_XOR:
+            if (destMemory) clocks = (src->type == OP_IMMEDIATE ? 17 : 16) + ea;
+            else if (srcMemory) clocks = 9 + ea;
+            else if (src->type == OP_IMMEDIATE) clocks = 4;
+            else clocks = 3;
+        break;
+
+        case DIS_CMP:
+            if (destMemory) clocks = (src->type == OP_IMMEDIATE ? 10 : 9) + ea;
+            else if (srcMemory) clocks = 9 + ea;
+            else if (src->type == OP_IMMEDIATE) clocks = 4;
+            else clocks = 3;
+        break;
+
+        case DIS_TEST:
+            if (destMemory || srcMemory) clocks = (src->type == OP_IMMEDIATE ? 11 : 9) + ea;
+            else if (src->type == OP_IMMEDIATE) clocks = (dest->regmemIndex == REG_AX && instruction->length == (wide ? 3 : 2) ? 4 : 5);
+            else clocks = 3;
+        break;
+
+        case DIS_INC: case DIS_DEC:
+            if (destMemory) clocks = 15 + ea;
+            else clocks = (wide ? 2 : 3);
+        break;
+
+        case DIS_NEG: case DIS_NOT:
+            clocks = (destMemory ? 16 + ea : 3);
+        break;
+
+        case DIS_SHL: case DIS_SHR: case DIS_SAR:
+        case DIS_ROL: case DIS_ROR: case DIS_RCL: case DIS_RCR:
+        {
+            // NOTE: Shifts by CL take 4 more clocks per bit, the count is not known statically.
+            bool byCL = (src->type == OP_REGISTER);
+            if (destMemory) clocks = (byCL ? 20 : 15) + ea;
+            else clocks = (byCL ? 8 : 2);
+        }
+        break;
+
+        case DIS_MUL:  clocks = (wide ? 126 : 74) + (destMemory ? ea + 6 : 0); break;
+        case DIS_IMUL: clocks = (wide ? 141 : 89) + (destMemory ? ea + 6 : 0); break;
+        case DIS_DIV:  clocks = (wide ? 153 : 85) + (destMemory ? ea + 6 : 0); break;
+        case DIS_IDIV: clocks = (wide ? 175 : 107) + (destMemory ? ea + 6 : 0); break;
+
+        case DIS_XCHG:
+            if (destMemory || srcMemory) clocks = 17 + ea;
+            else if (wide && (dest->regmemIndex == REG_AX || src->regmemIndex == REG_AX) && instruction->length == 1) clocks = 3;
+            else clocks = 4;
+        break;
+
+        case DIS_PUSH:
+            if (destMemory) clocks = 16 + ea;
+            else clocks = (dest->type == OP_SEGMENT_REGISTER ? 10 : 11);
+        break;
+        case DIS_POP:
+            clocks = (destMemory ? 17 + ea : 8);
+        break;
+        case DIS_PUSHF: clocks = 10; break;
+        case DIS_POPF:  clocks = 8; break;
+
+        case DIS_LEA: clocks = 2 + ea; break;
+        case DIS_LDS: case DIS_LES: clocks = 16 + ea; break;
+        case DIS_LAHF: case DIS_SAHF: clocks = 4; break;
+        case DIS_XLAT: clocks = 11; break;
+
+        case DIS_IN:  clocks = (src->type == OP_IMMEDIATE ? 10 : 8); break;
+        case DIS_OUT: clocks = (dest->type == OP_IMMEDIATE ? 10 : 8); break;
+
+        case DIS_CBW: clocks = 2; break;
+        case DIS_CWD: clocks = 5; break;
+        case DIS_AAA: case DIS_AAS: case DIS_DAA: case DIS_DAS: clocks = 4; break;
+        case DIS_AAM: clocks = 83; break;
+        case DIS_AAD: clocks = 60; break;
+
+        // NOTE: Counted once, REP repetitions are not known statically.
+        case DIS_MOVSB: case DIS_MOVSW: clocks = 18; break;
+        case DIS_CMPSB: case DIS_CMPSW: clocks = 22; break;
+        case DIS_SCASB: case DIS_SCASW: clocks = 15; break;
+        case DIS_LODSB: case DIS_LODSW: clocks = 12; break;
+        case DIS_STOSB: case DIS_STOSW: clocks = 11; break;
+
+        case DIS_LOOP:   isBranch = true; clocks = 5; takenClocks = 17; break;
+        case DIS_LOOPZ:  isBranch = true; clocks = 6; takenClocks = 18; break;
+        case DIS_LOOPNZ: isBranch = true; clocks = 5; takenClocks = 19; break;
+        case DIS_JCXZ:   isBranch = true; clocks = 6; takenClocks = 18; break;
+
+        case DIS_JMP:  clocks = (instruction->isFar ? 24 + ea : (destMemory ? 18 + ea : 11)); break;
+        case DIS_CALL: clocks = (instruction->isFar ? 37 + ea : (destMemory ? 21 + ea : 16)); break;
+        case DIS_RET:
+        {
+            bool popsImmediate = (instruction->operandCount > 0);
+            clocks = (instruction->isFar ? (popsImmediate ? 17 : 18) : (popsImmediate ? 12 : 8));
+        }
+        break;
+        case DIS_IRET: clocks = 24; break;
+        case DIS_INT:  clocks = (dest->value == 3 && instruction->length - instruction->prefixLength == 1 ? 52 : 51); break;
+        case DIS_INTO: isBranch = true; clocks = 4; takenClocks = 53; break;
+
+        case DIS_CLC: case DIS_CMC: case DIS_STC: case DIS_CLD: case DIS_STD:
+        case DIS_CLI: case DIS_STI: case DIS_HLT:
+            clocks = 2;
+        break;
+        case DIS_WAIT: clocks = 3; break;
+
+        default:
+            if (IsConditionalJump(instruction->type))
+            {
+                isBranch = true;
+                clocks = 4;
+                takenClocks = 16;
+            }
+        break;
+    }
+
+    // Prefixes take 2 clocks each. For a segment override this is the +2 of the effective address timings.
+    u32 prefixClocks = 0;
+    if (instruction->prefixes & PREFIX_LOCK) prefixClocks += 2;
+    if (instruction->prefixes & PREFIX_ANY_REP) prefixClocks += 2;
+    if (instruction->prefixes & PREFIX_SEGMENT) prefixClocks += 2;
+
+    ClockEstimate result;
+    result.clocks = clocks + prefixClocks;
+    result.takenClocks = (isBranch ? takenClocks : clocks) + prefixClocks;
+    return result;
+}
+
+struct BlockClocks
+{
+    u32 block;
+    u32 clocks;      // All instructions, last branch not taken
+    u32 takenClocks; // All instructions, last branch taken
+};
+
+/// @brief Sums the clock estimates of every block
+/// @param[out] result one entry per block, in block order
+void EstimateBlockClocks(DecodedImage* decoded, ControlFlowGraph* graph, BlockClocks* result)
+{
+    for (u32 blockIndex = 0; blockIndex < graph->blockCount; ++blockIndex)
+    {
+        BasicBlock* block = &graph->blocks[blockIndex];
+        BlockClocks* clocks = &result[blockIndex];
+        *clocks = {};
+        clocks->block = blockIndex;
+
+        for (u32 index = block->first; index < block->first + block->count; ++index)
+        {
+            ClockEstimate estimate = EstimateClocks(&decoded->instructions[index]);
+            bool isLast = (index == block->first + block->count - 1);
+
+            clocks->clocks += estimate.clocks;
+            clocks->takenClocks += (isLast ? estimate.takenClocks : estimate.clocks);
+        }
+    }
+}
+
+int CompareBlockClocks(const void* a, const void* b)
+{
+    u32 clocksA = ((BlockClocks*)a)->takenClocks;
+    u32 clocksB = ((BlockClocks*)b)->takenClocks;
+    if (clocksA != clocksB) return (clocksA < clocksB) - (clocksA > clocksB);
+
+    return (((BlockClocks*)a)->block > ((BlockClocks*)b)->block) - (((BlockClocks*)a)->block < ((BlockClocks*)b)->block);
+}
@@ -5,7 +5,22 @@
 
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int8_t i8;
 typedef int16_t i16;
+typedef int32_t i32;
+typedef int64_t i64;
+
+/// @brief Skips leading spaces and tabs and cuts off trailing ones. The text is modified.
+inline char* TrimWhitespace(char* text)
+{
+    while (*text == ' ' || *text == '\t') ++text;
+
+    char* end = text + strlen(text);
+    while (end > text && (end[-1] == ' ' || end[-1] == '\t')) *--end = 0;
+
+    return text;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "common.cpp"
+
+// Executed-code bitmap: one bit per byte of the address space, set where an instruction that ran starts.
+//
+// Linear disassembly decodes data as if it were code, and following branches statically misses the targets of
+// indirect jumps and calls (JMP/CALL through a register or memory). A run of the program knows where the code is.
+// The emulator sets the bit of every instruction it executes, a single OR per instruction, so it can stay on for
+// long runs. The listing then decodes only from set bits and prints the bytes in between as data, without decoding
+// them.
+//
+// Programs are loaded at physical address 0, so the bit of a physical address is also the bit of its file offset.
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define COVERAGE_SIZE (1 << 20) // Bytes covered, the 8086 address space
+#define COVERAGE_WORD_COUNT (COVERAGE_SIZE / 64)
+
+#define COVERAGE_MAGIC 0x56433638 // "86CV"
+#define COVERAGE_VERSION 1
+
+#pragma pack(push, 1)
+// Followed by the bitmap, COVERAGE_WORD_COUNT little-endian words
+struct CoverageFileHeader
+{
+    u32 magic;
+    u16 version;
+    u16 headerSize;
+    u32 size; // Bytes covered
+    u32 instructionStarts; // Set bits
+};
+#pragma pack(pop)
+
+/// @return a cleared bitmap, free with free()
+u64* Coverage_Alloc()
+{
+    return (u64*)calloc(COVERAGE_WORD_COUNT, sizeof(u64));
+}
+
+inline bool Coverage_IsCode(u64* coverage, u32 offset)
+{
+    return offset < COVERAGE_SIZE && ((coverage[offset >> 6] >> (offset & 63)) & 1);
+}
+
+inline u32 Coverage_LowestBit(u64 word)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (u32)index;
+#else
+    return (u32)__builtin_ctzll(word);
+#endif
+}
+
+/// @brief Finds the next instruction start, a word of the bitmap at a time
+/// @return the first offset in [offset, end) with its bit set, end if there is none
+u32 Coverage_NextCode(u64* coverage, u32 offset, u32 end)
+{
+    u32 limit = (end < COVERAGE_SIZE ? end : COVERAGE_SIZE);
+    if (offset >= limit) return end;
+
+    u32 wordIndex = offset >> 6;
+    u64 word = coverage[wordIndex] & (~0ull << (offset & 63));
+    while (!word)
+    {
+        if (++wordIndex >= (limit + 63) >> 6) return end;
+        word = coverage[wordIndex];
+    }
+
+    u32 next = (wordIndex << 6) + Coverage_LowestBit(word);
+    return (next < limit ? next : end);
+}
+
+u32 Coverage_CountStarts(u64* coverage)
+{
+    u32 count = 0;
+    for (u32 index = 0; index < COVERAGE_WORD_COUNT; ++index)
+    {
+        for (u64 word = coverage[index]; word; word &= word - 1) ++count;
+    }
+    return count;
+}
+
+bool Coverage_WriteFile(u64* coverage, char* fileName)
+{
+    FILE* file;
+    fopen_s(&file, fileName, "wb");
+    if (!file) return false;
+
+    CoverageFileHeader header {0};
+    header.magic = COVERAGE_MAGIC;
+    header.version = COVERAGE_VERSION;
+    header.headerSize = sizeof(CoverageFileHeader);
+    header.size = COVERAGE_SIZE;
+    header.instructionStarts = Coverage_CountStarts(coverage);
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(coverage, sizeof(u64), COVERAGE_WORD_COUNT, file);
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+    return success;
+}
+
+/// @brief Loads a bitmap written by Coverage_WriteFile()
+/// @param[out] coverage COVERAGE_WORD_COUNT words, see Coverage_Alloc()
+/// @return false if the file is not a coverage file
+bool Coverage_ReadFile(char* fileName, u64* coverage)
+{
+    ByteStream file;
+    if (!LoadFile(fileName, &file)) return false;
+
+    CoverageFileHeader* header = (CoverageFileHeader*)file.data;
+    bool valid = (file.size >= sizeof(CoverageFileHeader) && header->magic == COVERAGE_MAGIC &&
+                  header->version == COVERAGE_VERSION && header->size == COVERAGE_SIZE &&
+                  file.size >= header->headerSize + COVERAGE_WORD_COUNT * sizeof(u64));
+
+    if (valid) memcpy(coverage, file.data + header->headerSize, COVERAGE_WORD_COUNT * sizeof(u64));
+
+    free(file.data);
+    return valid;
+}
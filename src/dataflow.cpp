@@ -0,0 +1,507 @@
+#include "common.cpp"
+
+// Static constant propagation over the control flow graph.
+//
+// Every register is tracked as a known-bits value: a bit of the value is meaningful only if the same bit
+// is set in the known mask. This handles 8-bit halves without extra states, and the meet of two values
+// keeps only the bits that are known and equal in both. Each register can lose at most 16 bits of
+// knowledge, so every block is re-evaluated a bounded number of times.
+
+struct KnownValue
+{
+    u16 value;
+    u16 known;
+};
+
+struct RegisterState
+{
+    KnownValue registers[REGID_COUNT];
+};
+
+struct DataflowBlock
+{
+    RegisterState in;
+    RegisterState out;
+
+    // Registers written in the block, and registers whose incoming value the block may depend on
+    RegisterSet defs;
+    RegisterSet uses;
+
+    bool reached;
+    bool evaluated;
+};
+
+struct DataflowResult
+{
+    DataflowBlock* blocks;
+    u32 blockEvaluations;
+};
+
+inline KnownValue KnownConstant(u16 value) { return {value, 0xFFFF}; }
+inline KnownValue KnownNothing() { return {0, 0}; }
+
+inline bool IsKnown(KnownValue value, bool wide)
+{
+    u16 mask = (wide ? 0xFFFF : 0x00FF);
+    return ((value.known & mask) == mask);
+}
+
+inline KnownValue MeetKnownValues(KnownValue a, KnownValue b)
+{
+    KnownValue result;
+    result.known = a.known & b.known & ~(a.value ^ b.value);
+    result.value = a.value & result.known;
+    return result;
+}
+
+inline bool KnownValuesEqual(KnownValue a, KnownValue b)
+{
+    return (a.known == b.known && (a.value & a.known) == (b.value & b.known));
+}
+
+void SetRegistersUnknown(RegisterState* state, RegisterSet registers)
+{
+    for (int id = 0; id < REGID_COUNT; ++id)
+    {
+        if (registers & REGSET(id)) state->registers[id] = KnownNothing();
+    }
+}
+
+/// @brief Reads an operand as a known-bits value. 8-bit values are returned in the low byte.
+KnownValue Dataflow_ReadOperand(RegisterState* state, Operand* operand, bool wide)
+{
+    switch (operand->type)
+    {
+        case OP_IMMEDIATE:
+            return KnownConstant(wide ? operand->value : operand->valueLow);
+
+        case OP_SEGMENT_REGISTER:
+            return state->registers[GetRegisterId(operand, true)];
+
+        case OP_REGISTER:
+        {
+            KnownValue full = state->registers[GetRegisterId(operand, wide)];
+            if (wide) return full;
+
+            bool high = (operand->regmemIndex >= 4);
+            KnownValue result;
+            result.value = (high ? (full.value >> 8) : full.value) & 0xFF;
+            result.known = (high ? (full.known >> 8) : full.known) & 0xFF;
+            return result;
+        }
+
+        default:
+            return KnownNothing();
+    }
+}
+
+/// @brief Writes a known-bits value to a register operand. Memory writes are not tracked.
+void Dataflow_WriteOperand(RegisterState* state, Operand* operand, bool wide, KnownValue value)
+{
+    if (operand->type != OP_REGISTER && operand->type != OP_SEGMENT_REGISTER) return;
+
+    KnownValue* target = &state->registers[GetRegisterId(operand, wide || operand->type == OP_SEGMENT_REGISTER)];
+    if (wide || operand->type == OP_SEGMENT_REGISTER)
+    {
+        *target = value;
+        return;
+    }
+
+    int shift = (operand->regmemIndex >= 4 ? 8 : 0);
+    u16 mask = (u16)(0xFF << shift);
+    target->value = (u16)((target->value & ~mask) | ((value.value & 0xFF) << shift));
+    target->known = (u16)((target->known & ~mask) | ((value.known & 0xFF) << shift));
+}
+
+/// @brief Computes the effective address of a memory operand if all of its registers are known
+bool Dataflow_EffectiveAddress(RegisterState* state, Operand* operand, u16* address)
+{
+    if (operand->type != OP_MEMORY) return false;
+
+    if (IsDirectAddress(operand))
+    {
+        *address = operand->value;
+        return true;
+    }
+
+    u16 displacement = 0;
+    if (operand->modField == MEMORY_8BIT_MODE) displacement = (u16)(i16)(i8)operand->valueLow;
+    else if (operand->modField == MEMORY_16BIT_MODE) displacement = operand->value;
+
+    u16 sum = displacement;
+    RegisterSet registers = effectiveAddressRegisters[operand->regmemIndex];
+    for (int id = 0; id < REGID_COUNT; ++id)
+    {
+        if (!(registers & REGSET(id))) continue;
+        if (!IsKnown(state->registers[id], true)) return false;
+
+        sum += state->registers[id].value;
+    }
+
+    *address = sum;
+    return true;
+}
+
+KnownValue Dataflow_Arithmetic(InstructionType type, KnownValue a, KnownValue b, bool wide)
+{
+    u16 mask = (wide ? 0xFFFF : 0x00FF);
+
+    // Logic operations can produce known bits from partially known inputs
+    if (type == DIS_AND)
+    {
+        KnownValue result;
+        result.known = ((a.known & b.known) | (a.known & ~a.value) | (b.known & ~b.value)) & mask;
+        result.value = (a.value & b.value) & result.known;
+        return result;
+    }
+    if (type == DIS_OR)
+    {
+        KnownValue result;
+        result.known = ((a.known & b.known) | (a.known & a.value) | (b.known & b.value)) & mask;
+        result.value = (a.value | b.value) & result.known;
+        return result;
+    }
+    if (type == DIS_XOR)
+    {
+        KnownValue result;
+        result.known = (a.known & b.known) & mask;
+        result.value = (a.value ^ b.value) & result.known;
+        return result;
+    }
+
+    if (!IsKnown(a, wide) || !IsKnown(b, wide)) return KnownNothing();
+
+    u16 result;
+    switch (type)
+    {
+        case DIS_ADD: result = a.value + b.value; break;
+        case DIS_SUB: result = a.value - b.value; break;
+        default: return KnownNothing();
+    }
+    return {(u16)(result & mask), mask};
+}
+
+KnownValue Dataflow_Shift(InstructionType type, KnownValue a, KnownValue count, bool wide)
+{
+    if (!IsKnown(a, wide) || !IsKnown(count, false)) return KnownNothing();
+
+    int bits = (wide ? 16 : 8);
+    u16 mask = (wide ? 0xFFFF : 0x00FF);
+    u32 value = a.value & mask;
+    u32 shift = count.value & 0xFF;
+
+    switch (type)
+    {
+        case DIS_SHL: value = (shift >= 16 ? 0 : value << shift); break;
+        case DIS_SHR: value = (shift >= 16 ? 0 : value >> shift); break;
+        case DIS_SAR:
+        {
+            i32 signedValue = (wide ? (i32)(i16)value : (i32)(i8)value);
+            value = (u32)(signedValue >> (shift > 15 ? 15 : shift));
+        }
+        break;
+        case DIS_ROL: shift %= bits; value = (value << shift) | (value >> ((bits - shift) % bits)); break;
+        case DIS_ROR: shift %= bits; value = (value >> shift) | (value << ((bits - shift) % bits)); break;
+        default: return KnownNothing();
+    }
+    return {(u16)(value & mask), mask};
+}
+
+inline void SetAllOperandWritesUnknown(RegisterState* state, Instruction* instruction, InstructionAccess* access)
+{
+    RegisterSet writes = access->writes;
+
+    // 8-bit register destinations only lose the half that is written
+    Operand* dest = &instruction->opDest;
+    if (!instruction->isWide && dest->type == OP_REGISTER && instruction->operandCount > 0)
+    {
+        RegisterId id = GetRegisterId(dest, false);
+        if (writes & REGSET(id))
+        {
+            Dataflow_WriteOperand(state, dest, false, KnownNothing());
+            writes &= ~REGSET(id);
+        }
+    }
+
+    SetRegistersUnknown(state, writes);
+}
+
+/// @brief Applies the effect of a single instruction to the register state
+void Dataflow_Step(RegisterState* state, Instruction* instruction)
+{
+    Operand* dest = &instruction->opDest;
+    Operand* src = &instruction->opSrc;
+    bool wide = instruction->isWide;
+    KnownValue* sp = &state->registers[REGID_SP];
+
+    switch (instruction->type)
+    {
+        case DIS_MOV:
+            Dataflow_WriteOperand(state, dest, wide, Dataflow_ReadOperand(state, src, wide));
+        return;
+
+        case DIS_ADD: case DIS_SUB: case DIS_AND: case DIS_OR: case DIS_XOR:
+        {
+            KnownValue result;
+            bool sameRegister = (dest->type == OP_REGISTER && src->type == OP_REGISTER && dest->regmemIndex == src->regmemIndex);
+            if (sameRegister && (instruction->type == DIS_SUB || instruction->type == DIS_XOR))
+            {
+                // NOTE: Common idiom for clearing a register, the result does not depend on the value.
+                result = KnownConstant(0);
+            }
+            else
+            {
+                result = Dataflow_Arithmetic(instruction->type,
+                    Dataflow_ReadOperand(state, dest, wide), Dataflow_ReadOperand(state, src, wide), wide);
+            }
+            Dataflow_WriteOperand(state, dest, wide, result);
+        }
+        return;
+
+        case DIS_CMP:
+        case DIS_TEST:
+        return;
+
+        case DIS_INC: case DIS_DEC: case DIS_NEG: case DIS_NOT:
+        {
+            KnownValue value = Dataflow_ReadOperand(state, dest, wide);
+            u16 mask = (wide ? 0xFFFF : 0x00FF);
+            if (IsKnown(value, wide))
+            {
+                u16 result = value.value;
+                if (instruction->type == DIS_INC) ++result;
+                else if (instruction->type == DIS_DEC) --result;
+                else if (instruction->type == DIS_NEG) result = (u16)-result;
+                else result = ~result;
+
+                value = {(u16)(result & mask), mask};
+            }
+            else if (instruction->type == DIS_NOT)
+            {
+                value.value = ~value.value & value.known;
+            }
+            else
+            {
+                value = KnownNothing();
+            }
+            Dataflow_WriteOperand(state, dest, wide, value);
+        }
+        return;
+
+        case DIS_SHL: case DIS_SHR: case DIS_SAR: case DIS_ROL: case DIS_ROR:
+            Dataflow_WriteOperand(state, dest, wide, Dataflow_Shift(instruction->type,
+                Dataflow_ReadOperand(state, dest, wide), Dataflow_ReadOperand(state, src, false), wide));
+        return;
+
+        case DIS_XCHG:
+        {
+            KnownValue destValue = Dataflow_ReadOperand(state, dest, wide);
+            KnownValue srcValue = Dataflow_ReadOperand(state, src, wide);
+            Dataflow_WriteOperand(state, dest, wide, srcValue);
+            Dataflow_WriteOperand(state, src, wide, destValue);
+        }
+        return;
+
+        case DIS_LEA:
+        {
+            u16 address;
+            if (Dataflow_EffectiveAddress(state, src, &address))
+                Dataflow_WriteOperand(state, dest, true, KnownConstant(address));
+            else
+                Dataflow_WriteOperand(state, dest, true, KnownNothing());
+        }
+        return;
+
+        case DIS_CBW:
+        {
+            KnownValue* ax = &state->registers[REGID_AX];
+            bool signKnown = (ax->known & 0x80);
+            u16 high = ((ax->value & 0x80) ? 0xFF00 : 0x0000);
+            ax->known = (u16)((ax->known & 0x00FF) | (signKnown ? 0xFF00 : 0));
+            ax->value = (u16)(((ax->value & 0x00FF) | high) & ax->known);
+        }
+        return;
+        case DIS_CWD:
+        {
+            KnownValue ax = state->registers[REGID_AX];
+            if (ax.known & 0x8000)
+                state->registers[REGID_DX] = KnownConstant((ax.value & 0x8000) ? 0xFFFF : 0);
+            else
+                state->registers[REGID_DX] = KnownNothing();
+        }
+        return;
+
+        case DIS_PUSH:
+        case DIS_PUSHF:
+            if (IsKnown(*sp, true)) sp->value -= 2;
+        return;
+        case DIS_POP:
+        case DIS_POPF:
+            if (instruction->type == DIS_POP) Dataflow_WriteOperand(state, dest, true, KnownNothing());
+            if (IsKnown(*sp, true)) sp->value += 2;
+        return;
+
+        case DIS_LOOP: case DIS_LOOPZ: case DIS_LOOPNZ:
+        {
+            KnownValue* cx = &state->registers[REGID_CX];
+            if (IsKnown(*cx, true)) --cx->value;
+            else *cx = KnownNothing();
+        }
+        return;
+
+        case DIS_CALL:
+        case DIS_INT:
+        case DIS_INTO:
+            // NOTE: The callee may change any register. Stack and code segment are assumed to be preserved.
+            SetRegistersUnknown(state, (RegisterSet)~(REGSET(REGID_SP) | REGSET(REGID_CS) | REGSET(REGID_SS)));
+        return;
+
+        default:
+        {
+            InstructionAccess access = GetInstructionAccess(instruction);
+            SetAllOperandWritesUnknown(state, instruction, &access);
+        }
+        return;
+    }
+}
+
+/// @brief Computes the def/use register sets of a block
+void Dataflow_ComputeDefUse(DecodedImage* decoded, BasicBlock* block, DataflowBlock* result)
+{
+    result->defs = 0;
+    result->uses = 0;
+
+    for (u32 index = block->first; index < block->first + block->count; ++index)
+    {
+        Instruction* instruction = &decoded->instructions[index];
+        InstructionAccess access = GetInstructionAccess(instruction);
+
+        result->uses |= access.reads;
+
+        // NOTE: 8-bit writes keep the other half, so the incoming value still matters.
+        if (!instruction->isWide) result->uses |= access.writes;
+
+        result->defs |= access.writes;
+
+        if (instruction->type == DIS_CALL || instruction->type == DIS_INT || instruction->type == DIS_INTO)
+        {
+            result->defs |= (RegisterSet)~(REGSET(REGID_SP) | REGSET(REGID_CS) | REGSET(REGID_SS));
+        }
+    }
+
+    result->defs &= (RegisterSet)(REGSET(REGID_COUNT) - 1);
+}
+
+void Dataflow_EvaluateBlock(DecodedImage* decoded, BasicBlock* block, DataflowBlock* result)
+{
+    result->out = result->in;
+    for (u32 index = block->first; index < block->first + block->count; ++index)
+    {
+        Dataflow_Step(&result->out, &decoded->instructions[index]);
+    }
+    result->evaluated = true;
+}
+
+/// @brief Merges a state into a block's input
+/// @return registers whose input changed
+RegisterSet Dataflow_MergeInput(DataflowBlock* block, RegisterState* incoming)
+{
+    if (!block->reached)
+    {
+        block->in = *incoming;
+        block->reached = true;
+        return (RegisterSet)(REGSET(REGID_COUNT) - 1);
+    }
+
+    RegisterSet changed = 0;
+    for (int id = 0; id < REGID_COUNT; ++id)
+    {
+        KnownValue merged = MeetKnownValues(block->in.registers[id], incoming->registers[id]);
+        if (!KnownValuesEqual(merged, block->in.registers[id]))
+        {
+            block->in.registers[id] = merged;
+            changed |= REGSET(id);
+        }
+    }
+    return changed;
+}
+
+/// @brief Runs constant propagation to a fixed point
+/// @param decoded decoded image
+/// @param graph control flow graph of the image
+/// @param[out] result per-block input and output states. Free with Dataflow_Free().
+void Dataflow_Run(DecodedImage* decoded, ControlFlowGraph* graph, DataflowResult* result)
+{
+    *result = {};
+    result->blocks = (DataflowBlock*)calloc(graph->blockCount + 1, sizeof(DataflowBlock));
+
+    u32* worklist = (u32*)malloc((graph->blockCount + 1) * sizeof(u32));
+    bool* queued = (bool*)calloc(graph->blockCount + 1, sizeof(bool));
+    RegisterSet* changedInputs = (RegisterSet*)calloc(graph->blockCount + 1, sizeof(RegisterSet));
+    u32 head = 0;
+    u32 queuedCount = 0;
+
+    // Entry points (the image start and blocks only reachable through indirect jumps) start with nothing known
+    RegisterState unknown {0};
+    for (u32 blockIndex = 0; blockIndex < graph->blockCount; ++blockIndex)
+    {
+        DataflowBlock* block = &result->blocks[blockIndex];
+        Dataflow_ComputeDefUse(decoded, &graph->blocks[blockIndex], block);
+
+        if (blockIndex == 0 || graph->blocks[blockIndex].predecessorCount == 0)
+        {
+            changedInputs[blockIndex] = Dataflow_MergeInput(block, &unknown);
+            worklist[(head + queuedCount++) % graph->blockCount] = blockIndex;
+            queued[blockIndex] = true;
+        }
+    }
+
+    while (queuedCount > 0)
+    {
+        u32 blockIndex = worklist[head];
+        head = (head + 1) % graph->blockCount;
+        --queuedCount;
+        queued[blockIndex] = false;
+
+        BasicBlock* block = &graph->blocks[blockIndex];
+        DataflowBlock* state = &result->blocks[blockIndex];
+
+        if (!state->evaluated || (changedInputs[blockIndex] & state->uses))
+        {
+            Dataflow_EvaluateBlock(decoded, block, state);
+            ++result->blockEvaluations;
+        }
+        else
+        {
+            // Registers the block neither reads nor writes pass through unchanged, no need to re-evaluate
+            for (int id = 0; id < REGID_COUNT; ++id)
+            {
+                if (!(state->defs & REGSET(id))) state->out.registers[id] = state->in.registers[id];
+            }
+        }
+        changedInputs[blockIndex] = 0;
+
+        for (u32 successorIndex = 0; successorIndex < block->successorCount; ++successorIndex)
+        {
+            u32 successor = block->successors[successorIndex];
+            RegisterSet changed = Dataflow_MergeInput(&result->blocks[successor], &state->out);
+            changedInputs[successor] |= changed;
+
+            if (changed && !queued[successor])
+            {
+                worklist[(head + queuedCount++) % graph->blockCount] = successor;
+                queued[successor] = true;
+            }
+        }
+    }
+
+    free(changedInputs);
+    free(queued);
+    free(worklist);
+}
+
+void Dataflow_Free(DataflowResult* result)
+{
+    free(result->blocks);
+    *result = {};
+}
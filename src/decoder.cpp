@@ -0,0 +1,758 @@
+#include "common.cpp"
+
+struct ByteStream
+{
+    u8* data;
+    u32 size;
+    u32 position;
+};
+
+inline u8 Load8BitValue(ByteStream* stream)
+{
+    // NOTE: Reading past the end yields zeroes, truncated instructions are decoded as-is.
+    if (stream->position >= stream->size)
+    {
+        ++stream->position;
+        return 0;
+    }
+    return stream->data[stream->position++];
+}
+
+inline u16 Load16BitValue(ByteStream* stream)
+{
+    u16 value = 0;
+    *((u8 *)(&value) + 0) = Load8BitValue(stream);
+    *((u8 *)(&value) + 1) = Load8BitValue(stream);
+    return value;
+}
+
+/// @brief Loads memory 
+/// @param stream assembled code, positioned after the operand byte
+/// @param[out] operand output location for operand data
+void LoadMemoryOperand(ByteStream* stream, Operand* operand, OperandByte operandByte)
+{
+    // TODO: This function changes the operand type for registers.
+    // Maybe it should do the same with memory operands.
+
+    operand->type = OP_MEMORY;
+    operand->modField = operandByte.mod;
+    operand->regmemIndex = operandByte.rm;
+
+    switch (operand->modField)
+    {
+        case REGISTER_MODE:
+            operand->type = OP_REGISTER;
+        break;
+        case MEMORY_8BIT_MODE:
+            operand->valueLow = (i8)Load8BitValue(stream);
+        break;
+        case MEMORY_0BIT_MODE:
+            if (operand->regmemIndex != MEM_DIRECT) break;
+        // fallthrough
+        case MEMORY_16BIT_MODE:
+                operand->value = (i16)Load16BitValue(stream);
+        break;
+    }
+}
+
+/// @brief Loads immediate operand value
+/// @param stream assembled code, positioned after the operand byte
+/// @param[out] operand operand to load value into
+/// @param wideOperation if true, 2 bytes are loaded. Otherwise - 1 byte.
+/// @param signExtend if true, loads 1 byte and sign extends it to 2 bytes
+void LoadImmediateOperand(ByteStream* stream, Operand* operand, bool wideOperation, bool signExtend)
+{
+    operand->type = OP_IMMEDIATE;
+
+    if (signExtend)
+    {
+        operand->valueLow = (i8)Load8BitValue(stream);
+        operand->valueHigh = (((operand->valueLow >> 7) & 0b1) ? 0xFF : 0x00);
+    }
+    else if (wideOperation)
+    {
+        operand->value = (i16)Load16BitValue(stream);
+    }
+    else
+    {
+        operand->valueLow = (i8)Load8BitValue(stream);
+    }
+}
+
+bool DecodeSingleByteInstruction(u8 opcode, Instruction* instruction)
+{
+    switch (opcode)
+    {
+        case INST_XLAT:  instruction->type = DIS_XLAT; break;
+        case INST_DAA:   instruction->type = DIS_DAA; break;
+        case INST_AAA:   instruction->type = DIS_AAA; break;
+        case INST_AAS:   instruction->type = DIS_AAS; break;
+        case INST_DAS:   instruction->type = DIS_DAS; break;
+        case INST_CBW:   instruction->type = DIS_CBW; break;
+        case INST_CWD:   instruction->type = DIS_CWD; break;
+        case INST_INTO:  instruction->type = DIS_INTO; break;
+        case INST_IRET:  instruction->type = DIS_IRET; break;
+        case INST_CLC:   instruction->type = DIS_CLC; break;
+        case INST_CMC:   instruction->type = DIS_CMC; break;
+        case INST_STC:   instruction->type = DIS_STC; break;
+        case INST_CLD:   instruction->type = DIS_CLD; break;
+        case INST_STD:   instruction->type = DIS_STD; break;
+        case INST_CLI:   instruction->type = DIS_CLI; break;
+        case INST_STI:   instruction->type = DIS_STI; break;
+        case INST_HLT:   instruction->type = DIS_HLT; break;
+        case INST_WAIT:  instruction->type = DIS_WAIT; break;
+        case INST_PUSHF: instruction->type = DIS_PUSHF; break;
+        case INST_POPF:  instruction->type = DIS_POPF; break;
+        case INST_SAHF:  instruction->type = DIS_SAHF; break;
+        case INST_LAHF:  instruction->type = DIS_LAHF; break;
+
+        case INST_MOVSB: instruction->type = DIS_MOVSB; break;
+        case INST_MOVSW: instruction->type = DIS_MOVSW; break;
+        case INST_CMPSB: instruction->type = DIS_CMPSB; break;
+        case INST_CMPSW: instruction->type = DIS_CMPSW; break;
+        case INST_SCASB: instruction->type = DIS_SCASB; break;
+        case INST_SCASW: instruction->type = DIS_SCASW; break;
+        case INST_LODSB: instruction->type = DIS_LODSB; break;
+        case INST_LODSW: instruction->type = DIS_LODSW; break;
+        case INST_STOSB: instruction->type = DIS_STOSB; break;
+        case INST_STOSW: instruction->type = DIS_STOSW; break;
+
+        case INST_INT3:
+            instruction->type = DIS_INT;
+            instruction->operandCount = 1;
+            instruction->opDest = InitImmediateOperand(3);
+            break;
+
+        case INST_RET_INTERSEGMENT: 
+            instruction->type = DIS_RET;
+            instruction->isFar = true;
+            break;
+        case INST_RET_WITHIN_SEGMENT: 
+            instruction->type = DIS_RET; 
+            break;
+        
+        default: return false;
+    }
+    return true;
+}
+
+/// @brief Adds a prefix byte to the instruction
+/// @return false if the byte is not a prefix
+bool DecodePrefix(u8 opcode, Instruction* instruction)
+{
+    if (opcode == INST_LOCK)
+    {
+        instruction->type = DIS_LOCK;
+        instruction->prefixes |= PREFIX_LOCK;
+    }
+    else if (opcode == INST_REP || opcode == INST_REPNE)
+    {
+        // NOTE: The last repeat prefix wins.
+        instruction->type = DIS_REP;
+        instruction->prefixes &= ~PREFIX_ANY_REP;
+        instruction->prefixes |= (opcode == INST_REP ? PREFIX_REP : PREFIX_REPNE);
+    }
+    else if ((opcode & MASK_INST_SEGMENT_PREFIX) == INST_SEGMENT_PREFIX)
+    {
+        instruction->type = DIS_SEGMENT;
+        instruction->prefixes |= PREFIX_SEGMENT;
+        instruction->segmentOverride = ((opcode >> 3) & 0b11);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static const InstructionType instructionSubtypes[] = {
+    DIS_ADD, DIS_OR, DIS_ADC, DIS_SBB, DIS_AND, DIS_SUB, DIS_XOR, DIS_CMP
+};
+
+/// @brief Decodes a single instruction at the current stream position
+/// @param stream assembled code. The position is advanced past the instruction.
+/// @param[out] instruction decoded instruction, including its offset and length
+/// @return false if the opcode is not recognized
+bool DecodeInstruction(ByteStream* stream, Instruction* instruction)
+{
+    *instruction = {};
+    instruction->offset = stream->position;
+
+    u8 opcode = Load8BitValue(stream);
+    while (stream->position - 1 - instruction->offset < PREFIX_MAX_COUNT && DecodePrefix(opcode, instruction))
+    {
+        if (stream->position >= stream->size)
+        {
+            // Prefixes without an instruction after them
+            instruction->length = instruction->prefixLength = (u8)(stream->position - instruction->offset);
+            return true;
+        }
+        opcode = Load8BitValue(stream);
+    }
+    instruction->prefixLength = (u8)(stream->position - 1 - instruction->offset);
+    instruction->type = DIS_NOOP;
+
+    bool recognized = true;
+    Instruction extraPrefix = {};
+    if (DecodePrefix(opcode, &extraPrefix))
+    {
+        // Prefix past PREFIX_MAX_COUNT
+        recognized = false;
+    }
+    else if (DecodeSingleByteInstruction(opcode, instruction))
+    {
+        // Success
+    }
+    else if (opcode == INST_AAM) // AAM
+    {
+        Load8BitValue(stream);
+        // STUDY: It's supposed to be 0b00001010, but it's different. Trash data?
+        //Assert(nextByte == 0b00001010);
+        instruction->type = DIS_AAM;
+    }
+    else if (opcode == INST_AAD) // AAD
+    {
+        Load8BitValue(stream);
+        // STUDY: It's supposed to be 0b00001010, but it's different. Trash data?
+        //Assert(nextByte == 0b00001010);
+        instruction->type = DIS_AAD;
+    }
+    else if (opcode == INST_LEA || opcode == INST_LDS || opcode == INST_LES)
+    {
+        OperandByte instOperand = Inst_ParseOperand(Load8BitValue(stream));
+
+        if (opcode == INST_LEA)
+            instruction->type = DIS_LEA;
+        else if (opcode == INST_LDS)
+            instruction->type = DIS_LDS;
+        else
+            instruction->type = DIS_LES;
+
+        instruction->isWide = true;
+        instruction->operandCount = 2;
+        instruction->opDest = InitRegisterOperand(instOperand.reg);
+        LoadMemoryOperand(stream, &instruction->opSrc, instOperand);
+    }
+    else if (opcode == INST_INT)
+    {
+        instruction->type = DIS_INT;
+        instruction->operandCount = 1;
+        instruction->opDest = InitImmediateOperand(Load8BitValue(stream));
+    }
+    else if (opcode == INST_MOV_REGMEM_SR || opcode == INST_MOV_SR_REGMEM)
+    {
+        OperandByte operand = Inst_ParseOperand(Load8BitValue(stream));
+        instruction->type = DIS_MOV;
+        instruction->operandCount = 2;
+        instruction->isWide = true;
+
+        bool toSegmentRegister = ((opcode >> 1) & 0b1);
+
+        Operand* segment;
+        Operand* regmem;
+        if (toSegmentRegister)
+        {
+            segment = &instruction->opDest;
+            regmem = &instruction->opSrc;
+        }
+        else
+        {
+            segment = &instruction->opSrc;
+            regmem = &instruction->opDest;
+        }
+
+        // NOTE: There are only 4 segment registers, reg values 100-111 are not used.
+        if (operand.reg & 0b100) recognized = false;
+        segment->type = OP_SEGMENT_REGISTER;
+        segment->regmemIndex = (RMField)(operand.reg & 0b11);
+        LoadMemoryOperand(stream, regmem, operand);
+    }
+    else if ((opcode & 0b11000100) == 0b00000000)
+    {
+        instruction->isWide = (opcode & 0b1);
+        instruction->type = instructionSubtypes[((opcode >> 3) & 0b111)];
+
+        bool directionBit = (opcode >> 1) & 0b1;
+        OperandByte instOperand = Inst_ParseOperand(Load8BitValue(stream));
+
+        instruction->operandCount = 2;
+        Operand *op1;
+        Operand *op2;
+
+        if (directionBit)
+        {
+            op1 = &instruction->opDest;
+            op2 = &instruction->opSrc;
+        }
+        else
+        {
+            op2 = &instruction->opDest;
+            op1 = &instruction->opSrc;
+        }
+        *op1 = InitRegisterOperand(instOperand.reg);
+        LoadMemoryOperand(stream, op2, instOperand);
+    }
+    else if ((opcode & 0b11110000) == 0b01010000) // Push/pop register
+    {
+        bool isPop = ((opcode >> 3) & 0b1);
+        RMField reg = (RMField)(opcode & 0b111);
+
+        instruction->type = (isPop? DIS_POP : DIS_PUSH);
+        instruction->operandCount = 1;
+        instruction->isWide = true;
+        instruction->opDest = InitRegisterOperand(reg);
+    }
+    else if ((opcode & 0b11100110) == 0b00000110) // Push/pop segment register
+    {
+        bool isPop = (opcode & 0b1);
+        u8 segreg = ((opcode >> 3) & 0b11);
+
+        instruction->type = (isPop? DIS_POP : DIS_PUSH);
+        instruction->operandCount = 1;
+        instruction->isWide = true;
+        instruction->opDest = InitSegmentRegisterOperand((RMField)segreg);
+    }
+    else if ((opcode & 0b11110100) == 0b11100100) // IN/OUT fixed port
+    {
+        bool variableBit = ((opcode >> 3) & 0b1);
+        bool typeBit = ((opcode >> 1) & 0b1);
+
+        instruction->type = (typeBit? DIS_OUT : DIS_IN);
+        instruction->isWide = (opcode & 0b1);
+
+        // FIXME: Operands should be unsigned
+        instruction->operandCount = 2;
+        Operand* op1;
+        Operand* op2;
+    
+        if (typeBit)
+        {
+            op2 = &instruction->opDest;
+            op1 = &instruction->opSrc;
+        }
+        else
+        {
+            op1 = &instruction->opDest;
+            op2 = &instruction->opSrc;
+        }
+
+        *op1 = InitRegisterOperand(REG_AX);
+        if (variableBit)
+        {
+            *op2 = InitRegisterOperand(REG_DX);
+        }
+        else
+        {
+            LoadImmediateOperand(stream, op2, false, false);
+        }
+    }
+    else if ((opcode & 0b11111100) == (0b10000100))
+    {
+        instruction->isWide = (opcode & 0b1);
+        instruction->type = ((opcode >> 1) & 0b1) ? DIS_XCHG : DIS_TEST;
+
+        OperandByte instOperand = Inst_ParseOperand(Load8BitValue(stream));
+
+        instruction->operandCount = 2;
+        instruction->opDest = InitRegisterOperand(instOperand.reg);
+        LoadMemoryOperand(stream, &instruction->opSrc, instOperand);
+    }
+    else if ((opcode & MASK_INST_1BYTE_REG) == INST_XCHG_ACC_WITH_REG)
+    {
+        instruction->type = DIS_XCHG;
+        instruction->operandCount = 2;
+        instruction->isWide = true;
+        instruction->opDest = InitRegisterOperand(REG_AX);
+        instruction->opSrc = InitRegisterOperand((RMField)(opcode & 0b111));
+    }
+    else if ((opcode & MASK_INST_1BYTE_REG) == INST_INC_REG)
+    {
+        instruction->type = DIS_INC;
+        instruction->isWide = true;
+        instruction->operandCount = 1;
+        instruction->opDest = InitRegisterOperand((RMField)(opcode & 0b111));
+    }
+    else if ((opcode & MASK_INST_1BYTE_REG) == INST_DEC_REG)
+    {
+        instruction->type = DIS_DEC;
+        instruction->isWide = true;
+        instruction->operandCount = 1;
+        instruction->opDest = InitRegisterOperand((RMField)(opcode & 0b111));
+    }
+    else if ((opcode & 0b11000100) == 0b00000100) // Immediate to accumulator
+    {
+        instruction->isWide = (opcode & 0b1);
+        u8 instructionType = ((opcode >> 3) & 0b111);
+        instruction->type = instructionSubtypes[instructionType];
+
+        instruction->operandCount = 2;
+        instruction->opDest = InitRegisterOperand(REG_AX); // Same ID as REG_AL
+        LoadImmediateOperand(stream, &instruction->opSrc, instruction->isWide, false);
+    }
+    else if ((opcode & 0b11111100) == 0b10000000) // Immediate to register/memory
+    {
+        bool signBit = ((opcode >> 1) & 0b1);
+        instruction->isWide = (opcode & 0b1);
+
+        OperandByte instructionOperand = Inst_ParseOperand(Load8BitValue(stream));
+
+        // NOTE: For immediate instructions, the REG part of the operand byte determines the operation type.
+        instruction->type = instructionSubtypes[instructionOperand.reg];
+
+        instruction->operandCount = 2;
+        instruction->opDest.outputWidth = true;
+        LoadMemoryOperand(stream, &instruction->opDest, instructionOperand);
+        LoadImmediateOperand(stream, &instruction->opSrc, instruction->isWide, signBit);
+    }
+    else if ((opcode & 0b11111100) == 0b11010000) // Logic operations
+    {
+        InstructionType logicSubtypes[] = {DIS_ROL, DIS_ROR, DIS_RCL, DIS_RCR, DIS_SHL, DIS_SHR, DIS_NOOP, DIS_SAR};
+        OperandByte operand = Inst_ParseOperand(Load8BitValue(stream));
+
+        instruction->type = logicSubtypes[operand.reg];
+        instruction->isWide = (opcode & 0b1);
+
+        instruction->operandCount = 2;
+        instruction->opDest.outputWidth = true;
+        LoadMemoryOperand(stream, &instruction->opDest, operand);
+
+        bool shiftByCLValue = ((opcode >> 1) & 0b1);
+        if (shiftByCLValue)
+        {
+            instruction->opSrc = InitRegisterOperand(REG_CX);
+        }
+        else
+        {
+            instruction->opSrc = InitImmediateOperand(1);
+        }
+    }
+    else if ((opcode & 0b11111110) == 0b11000110) // MOVE immediate to register/memory
+    {
+        instruction->type = DIS_MOV;
+        instruction->isWide = (opcode & 0b1);
+
+        OperandByte instOperand = Inst_ParseOperand((u8)Load8BitValue(stream));
+
+        // NOTE: Other reg values are not used. The operands are still loaded so that the length is right.
+        if (instOperand.reg != 0b000) recognized = false;
+
+        instruction->operandCount = 2;
+        instruction->opSrc.outputWidth = true;
+        LoadMemoryOperand(stream, &instruction->opDest, instOperand);
+        LoadImmediateOperand(stream, &instruction->opSrc, instruction->isWide, false);
+    }
+    else if ((opcode & 0b11111100) == 0b10001000)
+    {
+        instruction->type = DIS_MOV;
+        instruction->isWide = (opcode & 0b1);
+        bool switchOperands = ((opcode >> 1) & 0b1);
+
+        OperandByte instOperand = Inst_ParseOperand(Load8BitValue(stream));
+
+        instruction->operandCount = 2;
+
+        Operand* op1;
+        Operand* op2;
+        if (switchOperands)
+        {
+            op1 = &instruction->opDest;
+            op2 = &instruction->opSrc;
+        }
+        else
+        {
+            op1 = &instruction->opSrc;
+            op2 = &instruction->opDest;
+        }
+        *op1 = InitRegisterOperand(instOperand.reg);
+        LoadMemoryOperand(stream, op2, instOperand);
+    }
+    else if ((opcode & 0b11111100) == 0b10100000) // MOV accumulator-memory
+    {
+        // NOTE: The direction bit here has opposite meaning to the standard one, and it's written as 2 separate commands in the manual.
+        instruction->type = DIS_MOV;
+        bool directionBit = ((opcode >> 1) & 0b1);
+        instruction->isWide = (opcode & 0b1);
+
+        instruction->operandCount = 2;
+        Operand* op1;
+        Operand* op2;
+
+        if (directionBit)
+        {
+            op2 = &instruction->opDest;
+            op1 = &instruction->opSrc;
+        }
+        else
+        {
+            op1 = &instruction->opDest;
+            op2 = &instruction->opSrc;
+        }
+
+        *op1 = InitRegisterOperand(REG_AX);
+        op2->type = OP_MEMORY;
+        op2->regmemIndex = MEM_DIRECT;
+        op2->value = (i16)Load16BitValue(stream);
+    }
+    else if ((opcode & 0b11110111) == 0b11000010) // RET/RETF adding immediate to SP
+    {
+        instruction->type = DIS_RET;
+        instruction->isFar = ((opcode >> 3) & 0b1);
+        instruction->operandCount = 1;
+        instruction->opDest = InitImmediateOperand((i16)Load16BitValue(stream));
+    }
+    else if ((opcode & 0b11110000) == 0b10110000) // MOV imm -> reg
+    {
+        instruction->type = DIS_MOV;
+        instruction->isWide = ((opcode >> 3) & 0b1);
+        instruction->operandCount = 2;
+        instruction->opDest = InitRegisterOperand((RMField)(opcode & 0b111));
+        LoadImmediateOperand(stream, &instruction->opSrc, instruction->isWide, false);
+    }
+    else if ((opcode & 0b11110000) == 0b01110000)
+    {
+        InstructionType jumpSuptypes[] = {
+            DIS_JO, DIS_JNO, DIS_JB, DIS_JNB, DIS_JE, DIS_JNE, DIS_JBE, DIS_JNBE,
+            DIS_JS, DIS_JNS, DIS_JP, DIS_JNP, DIS_JL, DIS_JNL, DIS_JLE, DIS_JNLE
+        };
+        // TODO: Jump labels
+
+        u8 jumpType = (opcode & 0b1111);
+
+        instruction->type = jumpSuptypes[jumpType];
+        instruction->operandCount = 1;
+        instruction->opDest = InitImmediateOperand(((i8)Load8BitValue(stream) + 2));
+    }
+    else if ((opcode & 0b11111100) == 0b11100000)
+    {
+        InstructionType loopTypes[] = { DIS_LOOPNZ, DIS_LOOPZ, DIS_LOOP, DIS_JCXZ};
+
+        instruction->type = loopTypes[(opcode & 0b11)];
+        instruction->operandCount = 1;
+        instruction->opDest = InitImmediateOperand((i8)Load8BitValue(stream) + 2);
+    }
+    else if ((opcode & 0b11111111) == 0b10001111) // pop
+    {
+        OperandByte instOperand = Inst_ParseOperand(Load8BitValue(stream));
+        if (instOperand.reg != 0b000) recognized = false; // NOTE: Other values are not used.
+
+        instruction->type = DIS_POP;
+        instruction->operandCount = 1;
+        instruction->isWide = true;
+        instruction->opDest.outputWidth = true;
+        LoadMemoryOperand(stream, &instruction->opDest, instOperand);
+    }
+    else if ((opcode & 0b11111110) == 0b11111110)
+    {
+        InstructionType instructionSubtypesInc[] = {DIS_INC, DIS_DEC, DIS_CALL, DIS_CALL, DIS_JMP, DIS_JMP, DIS_PUSH, DIS_NOOP};
+
+        OperandByte instructionOperand = Inst_ParseOperand(Load8BitValue(stream));
+
+        if (instructionOperand.reg == 0b111) recognized = false; // NOTE: Not used.
+
+        instruction->isWide = (opcode & 0b1);
+        instruction->type = instructionSubtypesInc[instructionOperand.reg];
+
+        // NOTE: reg 011 and 101 are the intersegment forms, their operand is a CS:IP pair in memory.
+        if (instructionOperand.reg == 0b011 || instructionOperand.reg == 0b101)
+        {
+            if (instructionOperand.mod == REGISTER_MODE) recognized = false;
+            else instruction->isFar = true;
+        }
+
+        instruction->operandCount = 1;
+        LoadMemoryOperand(stream, &instruction->opDest, instructionOperand);
+
+        if (instructionOperand.reg == 0b110 || 
+            instructionOperand.reg == 0b000 || 
+            instructionOperand.reg == 0b001) // push/inc/dec
+        {
+            instruction->opDest.outputWidth = true;
+        }
+    }
+    else if ((opcode & 0b11111110) == 0b10101000) // TEST imm, ax
+    {
+        instruction->type = DIS_TEST;
+        instruction->isWide = (opcode & 0b1);
+        instruction->operandCount = 2;
+        instruction->opDest = InitRegisterOperand(REG_AX);
+        LoadImmediateOperand(stream, &instruction->opSrc, instruction->isWide, false);
+    }
+    else if ((opcode & 0b11111110) == 0b11110110)
+    {
+        InstructionType types[] = {DIS_TEST, DIS_NOOP, DIS_NOT, DIS_NEG, DIS_MUL, DIS_IMUL, DIS_DIV, DIS_IDIV};
+
+        OperandByte operand = Inst_ParseOperand(Load8BitValue(stream));
+
+        instruction->type = types[operand.reg];
+        instruction->isWide = (opcode & 0b1);
+
+        if (operand.reg == 0b000)
+        {
+            instruction->operandCount = 2;
+            LoadMemoryOperand(stream, &instruction->opDest, operand);
+            instruction->opDest.outputWidth = true;
+            LoadImmediateOperand(stream, &instruction->opSrc, instruction->isWide, false);
+        }
+        else
+        {
+            instruction->operandCount = 1;
+            instruction->opDest.outputWidth = true;
+            LoadMemoryOperand(stream, &instruction->opDest, operand);
+        }
+    }
+    else
+    {
+        recognized = false;
+    }
+
+    // NOTE: Invalid encodings of known opcodes are listed and skipped like unknown opcodes, keeping their length.
+    if (!recognized) instruction->type = DIS_NOOP;
+
+    instruction->length = (u8)(stream->position - instruction->offset);
+    return recognized;
+}
+
+/// @brief Width used to print and compare an operand, same rules as PrintInstruction
+inline bool GetOperandWidth(Instruction* instruction, int operandIndex)
+{
+    switch (instruction->type)
+    {
+        case DIS_SHL: case DIS_SHR: case DIS_SAR: case DIS_ROL: case DIS_ROR: case DIS_RCL: case DIS_RCR:
+            return (operandIndex == 0 ? instruction->isWide : false);
+        case DIS_IN:
+            return (operandIndex == 0 ? instruction->isWide : true);
+        case DIS_OUT:
+            return (operandIndex == 0 ? true : instruction->isWide);
+        default:
+            return instruction->isWide;
+    }
+}
+
+inline bool IsLoopInstruction(InstructionType type)
+{
+    return (type == DIS_LOOP || type == DIS_LOOPZ || type == DIS_LOOPNZ || type == DIS_JCXZ);
+}
+
+inline bool IsConditionalJump(InstructionType type)
+{
+    return (type >= DIS_JE && type <= DIS_JNS);
+}
+
+/// @brief Displacement of a relative branch from the start of the instruction, its prefixes included
+/// NOTE: The decoder stores the displacement relative to the opcode, prefixes come before it.
+inline i32 BranchDisplacement(Instruction* instruction)
+{
+    return instruction->prefixLength + (i16)instruction->opDest.value;
+}
+
+/// @brief Computes the target of a relative branch
+/// @param[out] target image offset the branch jumps to
+/// @return false if the instruction is not a relative branch
+bool GetBranchTarget(Instruction* instruction, u32* target)
+{
+    if (!IsConditionalJump(instruction->type) && !IsLoopInstruction(instruction->type)) return false;
+
+    *target = (u32)(instruction->offset + BranchDisplacement(instruction));
+    return true;
+}
+
+struct DecodedImage
+{
+    Instruction* instructions;
+    u32 count;
+    u32 capacity;
+    Arena* arena; // Owner of instructions, null if they were allocated with malloc()
+};
+
+/// @brief Decodes the whole image into an array of instructions
+/// @param image assembled code
+/// @param[out] decoded decoded instructions in image order. Free with FreeDecodedImage().
+/// @param arena allocates the instructions if set, they are then freed with the arena
+/// @return number of instructions with an unrecognized encoding, they are decoded as far as possible
+u32 DecodeImage(ByteStream image, DecodedImage* decoded, Arena* arena = nullptr)
+{
+    u32 unrecognizedCount = 0;
+    *decoded = {};
+    decoded->arena = arena;
+
+    // NOTE: Most instructions are 2-3 bytes long, this avoids most reallocations.
+    decoded->capacity = image.size / 2 + 16;
+    if (arena) decoded->instructions = (Instruction*)Arena_Push(arena, decoded->capacity * sizeof(Instruction));
+    else decoded->instructions = (Instruction*)malloc(decoded->capacity * sizeof(Instruction));
+
+    image.position = 0;
+    while (image.position < image.size)
+    {
+        if (decoded->count == decoded->capacity)
+        {
+            // NOTE: There are at most as many instructions as bytes, this also keeps the capacity in 32 bits.
+            u64 oldSize = decoded->capacity * sizeof(Instruction);
+            decoded->capacity = (decoded->capacity > image.size / 2 ? image.size + 1 : decoded->capacity * 2);
+            if (arena)
+            {
+                decoded->instructions = (Instruction*)Arena_Grow(arena, decoded->instructions, oldSize,
+                    decoded->capacity * sizeof(Instruction));
+            }
+            else
+            {
+                decoded->instructions = (Instruction*)realloc(decoded->instructions, decoded->capacity * sizeof(Instruction));
+            }
+        }
+
+        if (!DecodeInstruction(&image, &decoded->instructions[decoded->count++])) ++unrecognizedCount;
+    }
+    return unrecognizedCount;
+}
+
+void FreeDecodedImage(DecodedImage* decoded)
+{
+    if (!decoded->arena) free(decoded->instructions);
+    *decoded = {};
+}
+
+/// @brief Finds the instruction that starts at the given image offset
+/// @return instruction index or -1 if no instruction starts there
+i64 FindInstruction(DecodedImage* decoded, u32 offset)
+{
+    u32 low = 0;
+    u32 high = decoded->count;
+    while (low < high)
+    {
+        u32 middle = low + (high - low) / 2;
+        u32 instructionOffset = decoded->instructions[middle].offset;
+
+        if (instructionOffset == offset) return middle;
+        if (instructionOffset < offset) low = middle + 1;
+        else high = middle;
+    }
+    return -1;
+}
+
+/// @brief Reads an entire file into memory
+/// @param[out] stream stream over the file contents. Free data with free(), unless it is in the arena.
+/// @param arena allocates the contents if set
+/// @return false if the file could not be read
+bool LoadFile(char* fileName, ByteStream* stream, Arena* arena = nullptr)
+{
+    *stream = {};
+
+    FILE* file;
+    fopen_s(&file, fileName, "rb");
+    if (!file) return false;
+
+    _fseeki64(file, 0, SEEK_END);
+    i64 size = _ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+
+    // NOTE: File offsets are 32-bit.
+    bool success = false;
+    if (size >= 0 && size <= UINT32_MAX)
+    {
+        stream->data = (u8*)(arena ? Arena_Push(arena, size ? size : 1) : malloc(size ? size : 1));
+        stream->size = (u32)size;
+        success = (fread(stream->data, 1, (size_t)size, file) == (size_t)size);
+    }
+
+    fclose(file);
+    return success;
+}
@@ -0,0 +1,374 @@
+#include "common.cpp"
+
+// Instruction-level diff of two images.
+//
+// Instructions are compared by a hash of the mnemonic, prefixes and operands. Relative branch displacements are left
+// out, so code that only moved does not show up as changed.
+//
+// Alignment: common prefix and suffix are matched first. The rest is split at anchors, windows of instructions
+// whose rolling hash occurs exactly once in both ranges, taking the longest run of anchors that is in order in both
+// (patience diff). The gaps between anchors are aligned the same way, and gaps that are small enough with an exact
+// longest common subsequence. Ranges without any anchor are reported as replaced, which keeps the time near linear.
+
+#define DIFF_WINDOW 8             // Instructions per anchor window
+#define DIFF_EXACT_LIMIT (1 << 16) // Largest gap (length product) aligned exactly
+
+enum DiffKind
+{
+    DIFF_EQUAL,
+    DIFF_REMOVED,
+    DIFF_INSERTED,
+    DIFF_CHANGED,
+};
+
+struct DiffEntry
+{
+    DiffKind kind;
+    u32 a; // Instruction index in the old image, for DIFF_EQUAL, DIFF_REMOVED and DIFF_CHANGED
+    u32 b; // Instruction index in the new image, for DIFF_EQUAL, DIFF_INSERTED and DIFF_CHANGED
+};
+
+struct DiffResult
+{
+    DiffEntry* entries;
+    u32 count;
+    u32 capacity;
+
+    u32 counts[4]; // Entries per DiffKind
+};
+
+struct DiffInput
+{
+    u64* a;
+    u64* b;
+};
+
+// FNV-1a
+inline u64 HashMix(u64 hash, u32 value)
+{
+    return (hash ^ value) * 0x100000001B3ull;
+}
+
+u64 Diff_HashInstruction(Instruction* instruction)
+{
+    u64 hash = 0xCBF29CE484222325ull;
+    hash = HashMix(hash, instruction->type);
+    hash = HashMix(hash, instruction->isWide);
+    hash = HashMix(hash, instruction->isFar);
+    hash = HashMix(hash, instruction->prefixes);
+    hash = HashMix(hash, instruction->segmentOverride);
+    hash = HashMix(hash, instruction->operandCount);
+
+    u32 target;
+    bool relative = GetBranchTarget(instruction, &target);
+
+    Operand* operands[] = {&instruction->opDest, &instruction->opSrc};
+    for (int operandIndex = 0; operandIndex < instruction->operandCount; ++operandIndex)
+    {
+        Operand* operand = operands[operandIndex];
+        hash = HashMix(hash, operand->type);
+        hash = HashMix(hash, operand->regmemIndex);
+        hash = HashMix(hash, operand->modField);
+        if (!(relative && operandIndex == 0)) hash = HashMix(hash, operand->value);
+    }
+    return hash;
+}
+
+void Diff_Add(DiffResult* result, DiffKind kind, u32 a, u32 b)
+{
+    if (result->count == result->capacity)
+    {
+        result->capacity = (result->capacity ? result->capacity * 2 : 1024);
+        result->entries = (DiffEntry*)realloc(result->entries, result->capacity * sizeof(DiffEntry));
+    }
+    result->entries[result->count++] = {kind, a, b};
+}
+
+/// @brief Longest common subsequence by dynamic programming, for small ranges
+void Diff_AlignExact(DiffInput* input, u32 aStart, u32 aEnd, u32 bStart, u32 bEnd, DiffResult* result)
+{
+    u32 aLength = aEnd - aStart;
+    u32 bLength = bEnd - bStart;
+    u32 stride = bLength + 1;
+
+    // lengths[i * stride + j]: LCS of a[aStart + i..] and b[bStart + j..]
+    u32* lengths = (u32*)calloc((aLength + 1) * stride, sizeof(u32));
+    for (u32 i = aLength; i-- > 0;)
+    {
+        for (u32 j = bLength; j-- > 0;)
+        {
+            if (input->a[aStart + i] == input->b[bStart + j]) lengths[i * stride + j] = lengths[(i + 1) * stride + j + 1] + 1;
+            else
+            {
+                u32 down = lengths[(i + 1) * stride + j];
+                u32 right = lengths[i * stride + j + 1];
+                lengths[i * stride + j] = (down >= right ? down : right);
+            }
+        }
+    }
+
+    u32 i = 0;
+    u32 j = 0;
+    while (i < aLength && j < bLength)
+    {
+        if (input->a[aStart + i] == input->b[bStart + j])
+        {
+            Diff_Add(result, DIFF_EQUAL, aStart + i++, bStart + j++);
+        }
+        else if (lengths[(i + 1) * stride + j] >= lengths[i * stride + j + 1])
+        {
+            Diff_Add(result, DIFF_REMOVED, aStart + i++, 0);
+        }
+        else
+        {
+            Diff_Add(result, DIFF_INSERTED, 0, bStart + j++);
+        }
+    }
+    while (i < aLength) Diff_Add(result, DIFF_REMOVED, aStart + i++, 0);
+    while (j < bLength) Diff_Add(result, DIFF_INSERTED, 0, bStart + j++);
+
+    free(lengths);
+}
+
+// Occurrences of a window hash in both ranges
+struct DiffSlot
+{
+    u64 hash;
+    u32 aCount;
+    u32 bCount;
+    u32 aPosition;
+    u32 bPosition;
+};
+
+struct DiffAnchor
+{
+    u32 a;
+    u32 b;
+};
+
+int CompareAnchors(const void* left, const void* right)
+{
+    u32 a = ((DiffAnchor*)left)->a;
+    u32 b = ((DiffAnchor*)right)->a;
+    return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+/// @brief Finds windows that occur once in each range, and keeps the longest chain of them in order in both
+/// @param[out] anchors sorted by both positions, windows do not overlap
+/// @return number of anchors
+u32 Diff_FindAnchors(DiffInput* input, u32 aStart, u32 aEnd, u32 bStart, u32 bEnd, u32 window, DiffAnchor* anchors)
+{
+    u32 aWindows = aEnd - aStart - window + 1;
+    u32 bWindows = bEnd - bStart - window + 1;
+
+    u32 slotCount = 1;
+    while (slotCount < 2 * (aWindows + bWindows)) slotCount *= 2;
+    DiffSlot* slots = (DiffSlot*)calloc(slotCount, sizeof(DiffSlot));
+
+    // Polynomial rolling hash over the instruction hashes of a window
+    const u64 base = 0x100000001B3ull;
+    u64 power = 1;
+    for (u32 index = 1; index < window; ++index) power *= base;
+
+    for (int side = 0; side < 2; ++side)
+    {
+        u64* hashes = (side == 0 ? input->a : input->b);
+        u32 start = (side == 0 ? aStart : bStart);
+        u32 windows = (side == 0 ? aWindows : bWindows);
+
+        u64 rolling = 0;
+        for (u32 index = 0; index < window - 1; ++index) rolling = rolling * base + hashes[start + index];
+
+        for (u32 position = start; position < start + windows; ++position)
+        {
+            rolling = rolling * base + hashes[position + window - 1];
+
+            // NOTE: Zero marks an empty slot.
+            u64 key = (rolling ? rolling : 1);
+            u32 slotIndex = (u32)(key >> 32 ^ key) & (slotCount - 1);
+            while (slots[slotIndex].hash != 0 && slots[slotIndex].hash != key) slotIndex = (slotIndex + 1) & (slotCount - 1);
+
+            DiffSlot* slot = &slots[slotIndex];
+            slot->hash = key;
+            if (side == 0) { ++slot->aCount; slot->aPosition = position; }
+            else { ++slot->bCount; slot->bPosition = position; }
+
+            rolling -= hashes[position] * power;
+        }
+    }
+
+    // Unique windows in old image order. Windows with the same rolling hash are compared, a collision is no anchor.
+    u32 candidateCount = 0;
+    DiffAnchor* candidates = (DiffAnchor*)malloc(aWindows * sizeof(DiffAnchor));
+    for (u32 slotIndex = 0; slotIndex < slotCount; ++slotIndex)
+    {
+        DiffSlot* slot = &slots[slotIndex];
+        if (slot->aCount == 1 && slot->bCount == 1 &&
+            memcmp(input->a + slot->aPosition, input->b + slot->bPosition, window * sizeof(u64)) == 0)
+        {
+            candidates[candidateCount++] = {slot->aPosition, slot->bPosition};
+        }
+    }
+    free(slots);
+
+    qsort(candidates, candidateCount, sizeof(DiffAnchor), CompareAnchors);
+
+    // Longest increasing subsequence of new image positions (patience sorting)
+    u32* tails = (u32*)malloc((candidateCount + 1) * sizeof(u32));     // Candidate ending the best chain of each length
+    u32* previous = (u32*)malloc((candidateCount + 1) * sizeof(u32));  // Candidate before each one in its chain
+    u32 chainLength = 0;
+    for (u32 index = 0; index < candidateCount; ++index)
+    {
+        u32 low = 0;
+        u32 high = chainLength;
+        while (low < high)
+        {
+            u32 middle = low + (high - low) / 2;
+            if (candidates[tails[middle]].b < candidates[index].b) low = middle + 1;
+            else high = middle;
+        }
+
+        previous[index] = (low > 0 ? tails[low - 1] : UINT32_MAX);
+        tails[low] = index;
+        if (low == chainLength) ++chainLength;
+    }
+
+    u32 chain = (chainLength > 0 ? tails[chainLength - 1] : UINT32_MAX);
+    for (u32 index = chainLength; index > 0; --index)
+    {
+        anchors[index - 1] = candidates[chain];
+        chain = previous[chain];
+    }
+    free(tails);
+    free(previous);
+    free(candidates);
+
+    // Drop anchors that overlap the one before
+    u32 anchorCount = 0;
+    for (u32 index = 0; index < chainLength; ++index)
+    {
+        if (anchorCount > 0 && (anchors[index].a < anchors[anchorCount - 1].a + window ||
+                                anchors[index].b < anchors[anchorCount - 1].b + window)) continue;
+        anchors[anchorCount++] = anchors[index];
+    }
+    return anchorCount;
+}
+
+void Diff_Align(DiffInput* input, u32 aStart, u32 aEnd, u32 bStart, u32 bEnd, DiffResult* result)
+{
+    // Common prefix and suffix
+    while (aStart < aEnd && bStart < bEnd && input->a[aStart] == input->b[bStart]) Diff_Add(result, DIFF_EQUAL, aStart++, bStart++);
+
+    u32 suffix = 0;
+    while (aStart < aEnd - suffix && bStart < bEnd - suffix && input->a[aEnd - suffix - 1] == input->b[bEnd - suffix - 1]) ++suffix;
+
+    u32 aLength = aEnd - suffix - aStart;
+    u32 bLength = bEnd - suffix - bStart;
+
+    if (aLength == 0 || bLength == 0 || (u64)aLength * bLength <= DIFF_EXACT_LIMIT)
+    {
+        Diff_AlignExact(input, aStart, aEnd - suffix, bStart, bEnd - suffix, result);
+    }
+    else
+    {
+        // Long windows first, single instructions if no window is unique
+        u32 shorter = (aLength < bLength ? aLength : bLength);
+        u32 window = (shorter >= DIFF_WINDOW ? DIFF_WINDOW : 1);
+
+        DiffAnchor* anchors = (DiffAnchor*)malloc((aLength + 1) * sizeof(DiffAnchor));
+        u32 anchorCount = Diff_FindAnchors(input, aStart, aEnd - suffix, bStart, bEnd - suffix, window, anchors);
+        if (anchorCount == 0 && window > 1)
+        {
+            window = 1;
+            anchorCount = Diff_FindAnchors(input, aStart, aEnd - suffix, bStart, bEnd - suffix, window, anchors);
+        }
+
+        if (anchorCount == 0)
+        {
+            for (u32 index = aStart; index < aEnd - suffix; ++index) Diff_Add(result, DIFF_REMOVED, index, 0);
+            for (u32 index = bStart; index < bEnd - suffix; ++index) Diff_Add(result, DIFF_INSERTED, 0, index);
+        }
+        else
+        {
+            u32 a = aStart;
+            u32 b = bStart;
+            for (u32 anchorIndex = 0; anchorIndex < anchorCount; ++anchorIndex)
+            {
+                DiffAnchor* anchor = &anchors[anchorIndex];
+                Diff_Align(input, a, anchor->a, b, anchor->b, result);
+
+                for (u32 index = 0; index < window; ++index) Diff_Add(result, DIFF_EQUAL, anchor->a + index, anchor->b + index);
+                a = anchor->a + window;
+                b = anchor->b + window;
+            }
+            Diff_Align(input, a, aEnd - suffix, b, bEnd - suffix, result);
+        }
+        free(anchors);
+    }
+
+    for (u32 index = 0; index < suffix; ++index) Diff_Add(result, DIFF_EQUAL, aEnd - suffix + index, bEnd - suffix + index);
+}
+
+/// @brief Aligns the instructions of two images
+/// @param[out] result entries in order of both images. A removed and an inserted instruction of the same type at
+/// the same place in a replaced range are reported as one changed instruction. Free with Diff_Free().
+void Diff_Run(DecodedImage* a, DecodedImage* b, DiffResult* result)
+{
+    *result = {};
+
+    DiffInput input;
+    input.a = (u64*)malloc((a->count + 1) * sizeof(u64));
+    input.b = (u64*)malloc((b->count + 1) * sizeof(u64));
+    for (u32 index = 0; index < a->count; ++index) input.a[index] = Diff_HashInstruction(&a->instructions[index]);
+    for (u32 index = 0; index < b->count; ++index) input.b[index] = Diff_HashInstruction(&b->instructions[index]);
+
+    DiffResult aligned {0};
+    Diff_Align(&input, 0, a->count, 0, b->count, &aligned);
+    free(input.a);
+    free(input.b);
+
+    // Pair up removed and inserted instructions of each replaced range
+    for (u32 index = 0; index < aligned.count;)
+    {
+        if (aligned.entries[index].kind == DIFF_EQUAL)
+        {
+            Diff_Add(result, DIFF_EQUAL, aligned.entries[index].a, aligned.entries[index].b);
+            ++index;
+            continue;
+        }
+
+        u32 removedStart = index;
+        while (index < aligned.count && aligned.entries[index].kind == DIFF_REMOVED) ++index;
+        u32 insertedStart = index;
+        while (index < aligned.count && aligned.entries[index].kind == DIFF_INSERTED) ++index;
+        u32 removedCount = insertedStart - removedStart;
+        u32 insertedCount = index - insertedStart;
+
+        u32 pairs = (removedCount < insertedCount ? removedCount : insertedCount);
+        for (u32 pair = 0; pair < pairs; ++pair)
+        {
+            u32 oldIndex = aligned.entries[removedStart + pair].a;
+            u32 newIndex = aligned.entries[insertedStart + pair].b;
+            if (a->instructions[oldIndex].type == b->instructions[newIndex].type)
+            {
+                Diff_Add(result, DIFF_CHANGED, oldIndex, newIndex);
+            }
+            else
+            {
+                Diff_Add(result, DIFF_REMOVED, oldIndex, 0);
+                Diff_Add(result, DIFF_INSERTED, 0, newIndex);
+            }
+        }
+        for (u32 extra = pairs; extra < removedCount; ++extra) Diff_Add(result, DIFF_REMOVED, aligned.entries[removedStart + extra].a, 0);
+        for (u32 extra = pairs; extra < insertedCount; ++extra) Diff_Add(result, DIFF_INSERTED, 0, aligned.entries[insertedStart + extra].b);
+    }
+    free(aligned.entries);
+
+    for (u32 index = 0; index < result->count; ++index) ++result->counts[result->entries[index].kind];
+}
+
+void Diff_Free(DiffResult* result)
+{
+    free(result->entries);
+    *result = {};
+}
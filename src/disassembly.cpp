@@ -35,6 +35,8 @@ enum Inst_1Byte
     INST_HLT   = 0b11110100, // Halt
     INST_WAIT  = 0b10011011, // Wait
     INST_LOCK  = 0b11110000, // Bus lock prefix
+    INST_REPNE = 0b11110010, // Repeat while not equal prefix
+    INST_REP   = 0b11110011, // Repeat (while equal) prefix
 
     INST_MOVSB = 0b10100100,
     INST_MOVSW = 0b10100101,
@@ -62,6 +64,10 @@ enum Inst_1Byte
     INST_MOV_SR_REGMEM = 0b10001100
 };
 
+// Segment override prefixes: 001 sr 110
+#define MASK_INST_SEGMENT_PREFIX 0b11100111
+#define INST_SEGMENT_PREFIX      0b00100110
+
 #define MASK_INST_1BYTE_REG 0b11111000
 enum Inst_1ByteRegisterInstructions
 {
@@ -283,6 +289,20 @@ static const char* operationNames[] = {
     "cld", "std", "cli", "sti", "hlt", "wait", "esc", "lock", "segment"
 };
 
+enum InstructionPrefix
+{
+    PREFIX_LOCK    = 0b0001,
+    PREFIX_REP     = 0b0010, // REP/REPE/REPZ (F3)
+    PREFIX_REPNE   = 0b0100, // REPNE/REPNZ (F2)
+    PREFIX_SEGMENT = 0b1000, // Segment override, see Instruction::segmentOverride
+};
+
+#define PREFIX_ANY_REP (PREFIX_REP | PREFIX_REPNE)
+
+// NOTE: The 8086 takes any number of prefixes. A longer run ends in an unrecognized instruction at the first prefix
+// past the limit, so instructions fit the u8 length fields and the 16-byte fetch window of the emulator.
+#define PREFIX_MAX_COUNT 10
+
 struct Instruction
 {
     InstructionType type;
@@ -292,6 +312,17 @@ struct Instruction
     Operand opSrc;
 
     bool isWide;
+    bool isFar; // Intersegment CALL/JMP through an m16:16 operand, or RETF
+
+    // NOTE: Prefixes are part of the instruction they apply to. DIS_LOCK, DIS_REP and DIS_SEGMENT are only used for
+    // prefixes that are not followed by an instruction (at the end of the image).
+    u8 prefixes;        // InstructionPrefix bits
+    u8 segmentOverride; // Segment register index (ES, CS, SS, DS), used with PREFIX_SEGMENT
+    u8 prefixLength;    // Prefix bytes at the start of the instruction, included in length
+
+    // Location of the encoded instruction in the source image
+    u32 offset;
+    u8 length;
 };
 
 OperandByte Inst_ParseOperand(u8 byte)
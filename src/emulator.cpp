@@ -0,0 +1,954 @@
+#include "common.cpp"
+
+// Instruction-pointer driven emulator. Instructions are fetched from emulated memory and decoded as they execute,
+// so a Machine can run any code it jumps to and several machines can share one loaded image.
+//
+// Memory operands are resolved through a table of the 24 effective address forms.
+// String instructions use DS:SI (or the segment override) and ES:DI, repeated runs are executed in bulk where possible.
+// Direct CALL/JMP are not decoded. Far CALL/JMP through memory (FF /3, FF /5) load CS:IP from the operand, RETF pops
+// both.
+// IN, OUT and INT go to the handlers in MachineIO, interrupt vectors in memory are not used.
+
+enum MachineStatus
+{
+    MACHINE_RUNNING,
+    MACHINE_HALTED,      // HLT, or IP left the loaded code
+    MACHINE_UNSUPPORTED, // Instruction that is not emulated
+    MACHINE_DIVIDE_ERROR,
+    MACHINE_BREAKPOINT,  // Stopped before the instruction at CS:IP
+    MACHINE_WATCHPOINT,  // Stopped after the instruction at watchIp accessed a watched byte
+};
+
+static const char* machineStatusNames[] = {"running", "halted", "unsupported instruction", "divide error", "breakpoint",
+                                           "watchpoint"};
+
+struct Machine;
+struct FusionCache;
+u64 Fusion_Run(Machine* machine, u64 maxInstructions); // fusion.cpp
+
+// Handlers for port I/O and software interrupts. IN, OUT and INT stop the machine as unsupported without a handler.
+struct MachineIO
+{
+    void* user;
+    u16 (*portIn)(void* user, u16 port, bool wide);
+    void (*portOut)(void* user, u16 port, u16 value, bool wide);
+    bool (*interrupt)(void* user, Machine* machine, u8 vector); // Returns false if the interrupt is not handled
+};
+
+struct Machine
+{
+    CPU cpu;
+    u16 ip;
+    Memory memory;
+
+    u32 codeEnd; // The machine halts when IP reaches this offset
+    u64 instructionCount;
+    MachineStatus status;
+
+    // Memory operand of the executing instruction
+    u16 operandSegment;
+    u16 operandOffset;
+
+    bool skipBreakpoint; // Set when resuming, the breakpoint at CS:IP does not stop the machine again
+    u16 watchIp;         // IP of the instruction that hit a watchpoint
+
+    MachineIO* io; // Optional
+    u64* coverage; // Optional, bit per physical byte where an executed instruction starts, see coverage.cpp
+    FusionCache* fusion; // Optional, Emulator_Run() executes cached blocks with fused pairs, see fusion.cpp
+};
+
+/// @brief Sets up a machine at 0000:0000 over a shared image. Segment registers and SP start at 0.
+void Machine_Init(Machine* machine, MemoryImage* image, u32 codeEnd)
+{
+    machine->cpu = {};
+    machine->ip = 0;
+    Memory_Init(&machine->memory, image);
+
+    machine->codeEnd = codeEnd;
+    machine->instructionCount = 0;
+    machine->status = MACHINE_RUNNING;
+    machine->operandSegment = 0;
+    machine->operandOffset = 0;
+    machine->skipBreakpoint = false;
+    machine->watchIp = 0;
+    machine->io = nullptr;
+    machine->coverage = nullptr;
+    machine->fusion = nullptr;
+}
+
+/// @brief Continues after a breakpoint or watchpoint
+void Machine_Resume(Machine* machine)
+{
+    if (machine->status != MACHINE_BREAKPOINT && machine->status != MACHINE_WATCHPOINT) return;
+
+    machine->skipBreakpoint = (machine->status == MACHINE_BREAKPOINT);
+    machine->status = MACHINE_RUNNING;
+}
+
+void Machine_Free(Machine* machine)
+{
+    Memory_Free(&machine->memory);
+}
+
+inline bool IsParityEven(u16 value)
+{
+    u8 bits = (u8)value;
+    bits ^= bits >> 4;
+    bits ^= bits >> 2;
+    bits ^= bits >> 1;
+    return !(bits & 1);
+}
+
+inline void Emulator_SetResultFlags(CPU* cpu, u16 result, bool wide)
+{
+    cpu->zero = (result == 0);
+    cpu->sign = ((result >> (wide ? 15 : 7)) & 1);
+    cpu->parity = IsParityEven(result);
+}
+
+/// @brief Flags in the 8086 FLAGS register layout, as pushed by PUSHF
+u16 Emulator_GetFlagsWord(CPU* cpu)
+{
+    return (u16)(0xF002 | (cpu->carry << 0) | (cpu->parity << 2) | (cpu->auxCarry << 4) | (cpu->zero << 6) |
+                 (cpu->sign << 7) | (cpu->trap << 8) | (cpu->interruptEnable << 9) | (cpu->direction << 10) |
+                 (cpu->overflow << 11));
+}
+
+void Emulator_SetFlagsWord(CPU* cpu, u16 flags)
+{
+    cpu->carry = (flags >> 0) & 1;
+    cpu->parity = (flags >> 2) & 1;
+    cpu->auxCarry = (flags >> 4) & 1;
+    cpu->zero = (flags >> 6) & 1;
+    cpu->sign = (flags >> 7) & 1;
+    cpu->trap = (flags >> 8) & 1;
+    cpu->interruptEnable = (flags >> 9) & 1;
+    cpu->direction = (flags >> 10) & 1;
+    cpu->overflow = (flags >> 11) & 1;
+}
+
+/// @brief Addition or subtraction with carry/borrow in
+/// @param setCarry false for INC and DEC, which leave the carry flag unchanged
+u16 Emulator_AddSub(CPU* cpu, bool subtract, u16 a, u16 b, bool carryIn, bool wide, bool setCarry)
+{
+    u32 mask = (wide ? 0xFFFF : 0xFF);
+    u32 signBit = (wide ? 0x8000 : 0x80);
+
+    u32 result = (subtract ? (u32)a - b - carryIn : (u32)a + b + carryIn);
+    if (setCarry) cpu->carry = (result > mask); // A borrow wraps the result around to a large value
+    result &= mask;
+
+    u32 overflow = (subtract ? (a ^ b) & (a ^ result) : (a ^ result) & (b ^ result));
+    cpu->overflow = ((overflow & signBit) != 0);
+    cpu->auxCarry = (((a ^ b ^ result) & 0x10) != 0);
+    Emulator_SetResultFlags(cpu, (u16)result, wide);
+    return (u16)result;
+}
+
+u16 Emulator_Logic(CPU* cpu, InstructionType type, u16 a, u16 b, bool wide)
+{
+    u16 result = (type == DIS_OR ? a | b : (type == DIS_XOR ? a ^ b : a & b));
+    cpu->carry = false;
+    cpu->overflow = false;
+    cpu->auxCarry = false;
+    Emulator_SetResultFlags(cpu, result, wide);
+    return result;
+}
+
+/// @brief Shifts and rotates. The count is not masked, as on the 8086.
+u16 Emulator_Shift(CPU* cpu, InstructionType type, u16 value, u8 count, bool wide)
+{
+    if (count == 0) return value;
+
+    u32 mask = (wide ? 0xFFFF : 0xFF);
+    u32 signBit = (wide ? 0x8000 : 0x80);
+    u32 result = value;
+
+    for (u32 step = 0; step < count; ++step)
+    {
+        bool carry;
+        switch (type)
+        {
+            case DIS_SHL: carry = (result & signBit); result = (result << 1) & mask; break;
+            case DIS_SHR: carry = (result & 1); result >>= 1; break;
+            case DIS_SAR: carry = (result & 1); result = (result >> 1) | (result & signBit); break;
+            case DIS_ROL: carry = (result & signBit); result = ((result << 1) | carry) & mask; break;
+            case DIS_ROR: carry = (result & 1); result = (result >> 1) | (carry ? signBit : 0); break;
+            case DIS_RCL: carry = (result & signBit); result = ((result << 1) | cpu->carry) & mask; break;
+            default:      carry = (result & 1); result = (result >> 1) | (cpu->carry ? signBit : 0); break; // RCR
+        }
+        cpu->carry = carry;
+    }
+
+    // NOTE: The overflow flag is only defined for single bit shifts, this is what it is set to for those.
+    bool resultSign = ((result & signBit) != 0);
+    switch (type)
+    {
+        case DIS_SHL: case DIS_ROL: case DIS_RCL: cpu->overflow = (resultSign != cpu->carry); break;
+        case DIS_SHR: cpu->overflow = ((value & signBit) != 0); break;
+        case DIS_SAR: cpu->overflow = false; break;
+        default: cpu->overflow = (resultSign != ((result & (signBit >> 1)) != 0)); break;
+    }
+
+    if (type == DIS_SHL || type == DIS_SHR || type == DIS_SAR) Emulator_SetResultFlags(cpu, (u16)result, wide);
+    return (u16)result;
+}
+
+inline bool Emulator_Condition(CPU* cpu, InstructionType type)
+{
+    bool less = (cpu->sign != cpu->overflow);
+    switch (type)
+    {
+        case DIS_JO:   return cpu->overflow;
+        case DIS_JNO:  return !cpu->overflow;
+        case DIS_JB:   return cpu->carry;
+        case DIS_JNB:  return !cpu->carry;
+        case DIS_JE:   return cpu->zero;
+        case DIS_JNE:  return !cpu->zero;
+        case DIS_JBE:  return cpu->carry || cpu->zero;
+        case DIS_JNBE: return !cpu->carry && !cpu->zero;
+        case DIS_JS:   return cpu->sign;
+        case DIS_JNS:  return !cpu->sign;
+        case DIS_JP:   return cpu->parity;
+        case DIS_JNP:  return !cpu->parity;
+        case DIS_JL:   return less;
+        case DIS_JNL:  return !less;
+        case DIS_JLE:  return less || cpu->zero;
+        case DIS_JNLE: return !less && !cpu->zero;
+        default:       return false;
+    }
+}
+
+// Effective address forms, indexed by mod * 8 + r/m for the three memory modes. Unused registers and displacements
+// are masked out instead of branched on.
+struct EffectiveAddressForm
+{
+    u8 base;  // Register index, used when baseMask is set
+    u8 index;
+    u8 segment; // Default segment register index: SS for BP based forms, DS otherwise
+    u16 baseMask;
+    u16 indexMask;
+    u16 displacement8Mask;  // Selects the sign extended 8-bit displacement
+    u16 displacement16Mask; // Selects the 16-bit displacement or direct address
+};
+
+#define EA_NO_REGISTER 0xFF
+#define EA_FORM(base, index, displacementBits, segment) \
+    { (u8)((base) & 7), (u8)((index) & 7), (u8)((segment) - REGID_ES), \
+      (u16)((base) == EA_NO_REGISTER ? 0 : 0xFFFF), (u16)((index) == EA_NO_REGISTER ? 0 : 0xFFFF), \
+      (u16)((displacementBits) == 8 ? 0xFFFF : 0), (u16)((displacementBits) == 16 ? 0xFFFF : 0) }
+
+static const EffectiveAddressForm effectiveAddressForms[3 * 8] = {
+    // mod = 00
+    EA_FORM(REG_BX, REG_SI, 0, REGID_DS), EA_FORM(REG_BX, REG_DI, 0, REGID_DS),
+    EA_FORM(REG_BP, REG_SI, 0, REGID_SS), EA_FORM(REG_BP, REG_DI, 0, REGID_SS),
+    EA_FORM(REG_SI, EA_NO_REGISTER, 0, REGID_DS), EA_FORM(REG_DI, EA_NO_REGISTER, 0, REGID_DS),
+    EA_FORM(EA_NO_REGISTER, EA_NO_REGISTER, 16, REGID_DS), EA_FORM(REG_BX, EA_NO_REGISTER, 0, REGID_DS),
+    // mod = 01
+    EA_FORM(REG_BX, REG_SI, 8, REGID_DS), EA_FORM(REG_BX, REG_DI, 8, REGID_DS),
+    EA_FORM(REG_BP, REG_SI, 8, REGID_SS), EA_FORM(REG_BP, REG_DI, 8, REGID_SS),
+    EA_FORM(REG_SI, EA_NO_REGISTER, 8, REGID_DS), EA_FORM(REG_DI, EA_NO_REGISTER, 8, REGID_DS),
+    EA_FORM(REG_BP, EA_NO_REGISTER, 8, REGID_SS), EA_FORM(REG_BX, EA_NO_REGISTER, 8, REGID_DS),
+    // mod = 10
+    EA_FORM(REG_BX, REG_SI, 16, REGID_DS), EA_FORM(REG_BX, REG_DI, 16, REGID_DS),
+    EA_FORM(REG_BP, REG_SI, 16, REGID_SS), EA_FORM(REG_BP, REG_DI, 16, REGID_SS),
+    EA_FORM(REG_SI, EA_NO_REGISTER, 16, REGID_DS), EA_FORM(REG_DI, EA_NO_REGISTER, 16, REGID_DS),
+    EA_FORM(REG_BP, EA_NO_REGISTER, 16, REGID_SS), EA_FORM(REG_BX, EA_NO_REGISTER, 16, REGID_DS),
+};
+
+/// @brief Offset part of the effective address of a memory operand, wraps around at 64 KiB
+inline u16 Emulator_EffectiveOffset(CPU* cpu, Operand* operand)
+{
+    const EffectiveAddressForm* form = &effectiveAddressForms[operand->modField * 8 + operand->regmemIndex];
+    u16 displacement8 = (u16)(i16)(i8)operand->valueLow;
+
+    return (u16)((cpu->reg16[form->base] & form->baseMask) + (cpu->reg16[form->index] & form->indexMask) +
+                 (displacement8 & form->displacement8Mask) + (operand->value & form->displacement16Mask));
+}
+
+/// @brief Segment of a memory operand, with the segment override of the instruction if it has one
+inline u16 Emulator_EffectiveSegment(CPU* cpu, Instruction* instruction, Operand* operand)
+{
+    const EffectiveAddressForm* form = &effectiveAddressForms[operand->modField * 8 + operand->regmemIndex];
+    u8 segment = ((instruction->prefixes & PREFIX_SEGMENT) ? instruction->segmentOverride : form->segment);
+    return cpu->regseg[segment];
+}
+
+u16 Emulator_ReadOperand(Machine* machine, Operand* operand, bool wide)
+{
+    if (operand->type == OP_IMMEDIATE) return (wide ? operand->value : operand->valueLow);
+    if (operand->type == OP_MEMORY)
+    {
+        if (wide) return Memory_Read16(&machine->memory, machine->operandSegment, machine->operandOffset);
+        return Memory_Read8(&machine->memory, PhysicalAddress(machine->operandSegment, machine->operandOffset));
+    }
+
+    void* pointer = machine->cpu.GetPointerToRegister(operand, wide || operand->type == OP_SEGMENT_REGISTER);
+    return (wide || operand->type == OP_SEGMENT_REGISTER ? *(u16*)pointer : *(u8*)pointer);
+}
+
+void Emulator_WriteOperand(Machine* machine, Operand* operand, bool wide, u16 value)
+{
+    if (operand->type == OP_MEMORY)
+    {
+        if (wide) Memory_Write16(&machine->memory, machine->operandSegment, machine->operandOffset, value);
+        else Memory_Write8(&machine->memory, PhysicalAddress(machine->operandSegment, machine->operandOffset), (u8)value);
+        return;
+    }
+
+    void* pointer = machine->cpu.GetPointerToRegister(operand, wide || operand->type == OP_SEGMENT_REGISTER);
+    if (wide || operand->type == OP_SEGMENT_REGISTER) *(u16*)pointer = value;
+    else *(u8*)pointer = (u8)value;
+}
+
+inline void Emulator_Push(Machine* machine, u16 value)
+{
+    machine->cpu.sp -= 2;
+    Memory_Write16(&machine->memory, machine->cpu.ss, machine->cpu.sp, value);
+}
+
+inline u16 Emulator_Pop(Machine* machine)
+{
+    u16 value = Memory_Read16(&machine->memory, machine->cpu.ss, machine->cpu.sp);
+    machine->cpu.sp += 2;
+    return value;
+}
+
+/// @brief MUL, IMUL, DIV and IDIV on AX (and DX for words)
+/// @return false on a divide error
+bool Emulator_MultiplyDivide(CPU* cpu, InstructionType type, u16 operand, bool wide)
+{
+    if (type == DIS_MUL || type == DIS_IMUL)
+    {
+        if (wide)
+        {
+            u32 result = (type == DIS_MUL ? (u32)cpu->ax * operand : (u32)((i32)(i16)cpu->ax * (i16)operand));
+            cpu->ax = (u16)result;
+            cpu->dx = (u16)(result >> 16);
+            cpu->carry = (type == DIS_MUL ? cpu->dx != 0 : (i32)result != (i16)cpu->ax);
+        }
+        else
+        {
+            u16 result = (type == DIS_MUL ? (u16)(cpu->al * (u8)operand) : (u16)((i8)cpu->al * (i8)operand));
+            cpu->ax = result;
+            cpu->carry = (type == DIS_MUL ? cpu->ah != 0 : (i16)result != (i8)cpu->al);
+        }
+        cpu->overflow = cpu->carry;
+        return true;
+    }
+
+    if (operand == 0) return false;
+
+    if (type == DIS_DIV)
+    {
+        if (wide)
+        {
+            u32 dividend = ((u32)cpu->dx << 16) | cpu->ax;
+            u32 quotient = dividend / operand;
+            if (quotient > 0xFFFF) return false;
+            cpu->dx = (u16)(dividend % operand);
+            cpu->ax = (u16)quotient;
+        }
+        else
+        {
+            u16 quotient = cpu->ax / (u8)operand;
+            if (quotient > 0xFF) return false;
+            cpu->ah = (u8)(cpu->ax % (u8)operand);
+            cpu->al = (u8)quotient;
+        }
+    }
+    else // IDIV
+    {
+        if (wide)
+        {
+            i32 dividend = (i32)(((u32)cpu->dx << 16) | cpu->ax);
+            if (dividend == INT32_MIN && (i16)operand == -1) return false;
+            i32 quotient = dividend / (i16)operand;
+            if (quotient > 32767 || quotient < -32768) return false;
+            cpu->dx = (u16)(dividend % (i16)operand);
+            cpu->ax = (u16)quotient;
+        }
+        else
+        {
+            i16 dividend = (i16)cpu->ax;
+            i16 quotient = dividend / (i8)operand;
+            if (quotient > 127 || quotient < -128) return false;
+            cpu->ah = (u8)(dividend % (i8)operand);
+            cpu->al = (u8)quotient;
+        }
+    }
+    return true;
+}
+
+inline bool IsStringInstruction(InstructionType type)
+{
+    return (type >= DIS_MOVSB && type <= DIS_STOSW);
+}
+
+/// @brief Segment of the source operand (SI) of a string instruction, DS unless overridden
+inline u16 GetStringSourceSegment(CPU* cpu, Instruction* instruction)
+{
+    return ((instruction->prefixes & PREFIX_SEGMENT) ? cpu->regseg[instruction->segmentOverride] : cpu->ds);
+}
+
+/// @brief Executes a single iteration of a string instruction
+void Emulator_StringElement(Machine* machine, Instruction* instruction)
+{
+    CPU* cpu = &machine->cpu;
+    Memory* memory = &machine->memory;
+    InstructionType type = instruction->type;
+
+    bool wide = (type == DIS_MOVSW || type == DIS_CMPSW || type == DIS_SCASW || type == DIS_LODSW || type == DIS_STOSW);
+    u16 step = (u16)(cpu->direction ? -(wide ? 2 : 1) : (wide ? 2 : 1));
+
+    u16 sourceSegment = GetStringSourceSegment(cpu, instruction);
+    u32 source = PhysicalAddress(sourceSegment, cpu->si);
+    u32 target = PhysicalAddress(cpu->es, cpu->di);
+
+    switch (type)
+    {
+        case DIS_MOVSB: Memory_Write8(memory, target, Memory_Read8(memory, source)); break;
+        case DIS_MOVSW: Memory_Write16(memory, cpu->es, cpu->di, Memory_Read16(memory, sourceSegment, cpu->si)); break;
+        case DIS_STOSB: Memory_Write8(memory, target, cpu->al); break;
+        case DIS_STOSW: Memory_Write16(memory, cpu->es, cpu->di, cpu->ax); break;
+        case DIS_LODSB: cpu->al = Memory_Read8(memory, source); break;
+        case DIS_LODSW: cpu->ax = Memory_Read16(memory, sourceSegment, cpu->si); break;
+        case DIS_SCASB: Emulator_AddSub(cpu, true, cpu->al, Memory_Read8(memory, target), false, false, true); break;
+        case DIS_SCASW: Emulator_AddSub(cpu, true, cpu->ax, Memory_Read16(memory, cpu->es, cpu->di), false, true, true); break;
+        case DIS_CMPSB: Emulator_AddSub(cpu, true, Memory_Read8(memory, source), Memory_Read8(memory, target), false, false, true); break;
+        case DIS_CMPSW:
+            Emulator_AddSub(cpu, true, Memory_Read16(memory, sourceSegment, cpu->si), Memory_Read16(memory, cpu->es, cpu->di),
+                false, true, true);
+        break;
+        default: break;
+    }
+
+    bool usesSource = (type != DIS_STOSB && type != DIS_STOSW && type != DIS_SCASB && type != DIS_SCASW);
+    bool usesTarget = (type != DIS_LODSB && type != DIS_LODSW);
+    if (usesSource) cpu->si += step;
+    if (usesTarget) cpu->di += step;
+}
+
+/// @brief Bytes from an address to the end of its page or its segment, whichever comes first
+inline u32 StringSpan(u16 segment, u16 offset)
+{
+    u32 toPageEnd = PAGE_SIZE - (PhysicalAddress(segment, offset) & PAGE_MASK);
+    u32 toSegmentEnd = 0x10000 - offset;
+    return (toPageEnd < toSegmentEnd ? toPageEnd : toSegmentEnd);
+}
+
+/// @brief Index of the first element where a repeated compare stops
+/// @return count if the compare does not stop within the elements
+u32 FindStringStop(u8* a, u8* b, u32 count, bool wide, bool stopWhenEqual)
+{
+    u32 size = (wide ? 2 : 1);
+    u32 bytes = count * size;
+    u32 index = 0;
+
+    if (!stopWhenEqual)
+    {
+        // First mismatch, 8 bytes at a time
+        while (index + 8 <= bytes)
+        {
+            u64 x, y;
+            memcpy(&x, a + index, 8);
+            memcpy(&y, b + index, 8);
+            if (x != y) break;
+            index += 8;
+        }
+        while (index < bytes && a[index] == b[index]) ++index;
+        return index / size;
+    }
+
+    for (u32 element = 0; element < count; ++element)
+    {
+        if (memcmp(a + element * size, b + element * size, size) == 0) return element;
+    }
+    return count;
+}
+
+/// @brief Executes up to CX iterations of a string instruction at once, one page and segment span at a time
+/// @return false if no span could be processed in bulk, the caller then executes a single element
+bool Emulator_StringSpan(Machine* machine, Instruction* instruction, bool* stopped)
+{
+    CPU* cpu = &machine->cpu;
+    Memory* memory = &machine->memory;
+    InstructionType type = instruction->type;
+    *stopped = false;
+
+    // NOTE: Backward runs, logged writes and watched memory go one element at a time.
+    if (cpu->direction || memory->writeLog || memory->watch) return false;
+
+    bool wide = (type == DIS_MOVSW || type == DIS_CMPSW || type == DIS_SCASW || type == DIS_LODSW || type == DIS_STOSW);
+    u32 size = (wide ? 2 : 1);
+    bool usesSource = (type != DIS_STOSB && type != DIS_STOSW && type != DIS_SCASB && type != DIS_SCASW);
+    bool usesTarget = (type != DIS_LODSB && type != DIS_LODSW);
+
+    u16 sourceSegment = GetStringSourceSegment(cpu, instruction);
+    u32 source = PhysicalAddress(sourceSegment, cpu->si);
+    u32 target = PhysicalAddress(cpu->es, cpu->di);
+
+    u32 count = cpu->cx;
+    if (usesSource && StringSpan(sourceSegment, cpu->si) / size < count) count = StringSpan(sourceSegment, cpu->si) / size;
+    if (usesTarget && StringSpan(cpu->es, cpu->di) / size < count) count = StringSpan(cpu->es, cpu->di) / size;
+
+    // A forward copy onto the bytes just ahead of the source repeats them, keep each span within that distance
+    if ((type == DIS_MOVSB || type == DIS_MOVSW) && target > source && target < source + count * size)
+        count = (target - source) / size;
+    if (count == 0) return false;
+
+    u32 bytes = count * size;
+    u32 processed = count;
+    switch (type)
+    {
+        case DIS_MOVSB: case DIS_MOVSW:
+        {
+            u8* targetBytes = Memory_PrepareWrite(memory, target >> PAGE_SHIFT) + (target & PAGE_MASK);
+            u8* sourceBytes = memory->readPages[source >> PAGE_SHIFT] + (source & PAGE_MASK);
+            memmove(targetBytes, sourceBytes, bytes);
+        }
+        break;
+
+        case DIS_STOSB:
+            memset(Memory_PrepareWrite(memory, target >> PAGE_SHIFT) + (target & PAGE_MASK), cpu->al, bytes);
+        break;
+        case DIS_STOSW:
+        {
+            u8* targetBytes = Memory_PrepareWrite(memory, target >> PAGE_SHIFT) + (target & PAGE_MASK);
+            for (u32 index = 0; index < bytes; index += 2)
+            {
+                targetBytes[index] = cpu->al;
+                targetBytes[index + 1] = cpu->ah;
+            }
+        }
+        break;
+
+        case DIS_LODSB: case DIS_LODSW:
+        {
+            u16 last = (u16)(cpu->si + bytes - size);
+            cpu->ax = (wide ? Memory_Read16(memory, sourceSegment, last)
+                            : (u16)((cpu->ax & 0xFF00) | Memory_Read8(memory, PhysicalAddress(sourceSegment, last))));
+        }
+        break;
+
+        case DIS_SCASB: case DIS_SCASW: case DIS_CMPSB: case DIS_CMPSW:
+        {
+            bool stopWhenEqual = (instruction->prefixes & PREFIX_REPNE);
+            u8* targetBytes = memory->readPages[target >> PAGE_SHIFT] + (target & PAGE_MASK);
+
+            u32 stop;
+            if (type == DIS_SCASB && stopWhenEqual)
+            {
+                u8* found = (u8*)memchr(targetBytes, cpu->al, bytes);
+                stop = (found ? (u32)(found - targetBytes) : count);
+            }
+            else
+            {
+                u8 pattern[PAGE_SIZE];
+                u8* sourceBytes = pattern;
+                if (type == DIS_CMPSB || type == DIS_CMPSW)
+                {
+                    sourceBytes = memory->readPages[source >> PAGE_SHIFT] + (source & PAGE_MASK);
+                }
+                else
+                {
+                    // Compare against the accumulator repeated over the span
+                    for (u32 index = 0; index < bytes; ++index) pattern[index] = (wide && (index & 1) ? cpu->ah : cpu->al);
+                }
+                stop = FindStringStop(sourceBytes, targetBytes, count, wide, stopWhenEqual);
+            }
+
+            // Flags come from the last compared element
+            *stopped = (stop < count);
+            processed = (*stopped ? stop + 1 : count);
+
+            u32 lastOffset = (processed - 1) * size;
+            u16 left = (type == DIS_SCASB || type == DIS_SCASW ? cpu->ax
+                                                               : Memory_Read16(memory, sourceSegment, (u16)(cpu->si + lastOffset)));
+            u16 right = Memory_Read16(memory, cpu->es, (u16)(cpu->di + lastOffset));
+            if (!wide)
+            {
+                left &= 0xFF;
+                right &= 0xFF;
+            }
+            Emulator_AddSub(cpu, true, left, right, false, wide, true);
+        }
+        break;
+
+        default:
+            return false;
+    }
+
+    cpu->cx -= (u16)processed;
+    if (usesSource) cpu->si += (u16)(processed * size);
+    if (usesTarget) cpu->di += (u16)(processed * size);
+    return true;
+}
+
+/// @brief Executes a string instruction, repeated while CX is not zero (and the compare condition holds)
+void Emulator_ExecuteString(Machine* machine, Instruction* instruction)
+{
+    CPU* cpu = &machine->cpu;
+    InstructionType type = instruction->type;
+    if (!(instruction->prefixes & PREFIX_ANY_REP))
+    {
+        Emulator_StringElement(machine, instruction);
+        return;
+    }
+
+    bool whileEqual = (instruction->prefixes & PREFIX_REP);
+    bool compares = (type == DIS_SCASB || type == DIS_SCASW || type == DIS_CMPSB || type == DIS_CMPSW);
+    while (cpu->cx != 0)
+    {
+        bool stopped;
+        if (Emulator_StringSpan(machine, instruction, &stopped))
+        {
+            if (stopped) break;
+            continue;
+        }
+
+        Emulator_StringElement(machine, instruction);
+        --cpu->cx;
+        if (compares && cpu->zero != whileEqual) break;
+
+        // Stop at the element that hit a watchpoint, resuming continues with the remaining ones like after an
+        // interrupt
+        if (machine->memory.watch && machine->memory.watch->hit)
+        {
+            if (cpu->cx != 0) machine->ip = (u16)instruction->offset;
+            break;
+        }
+    }
+}
+
+/// @brief Executes a decoded instruction. IP must already point past the instruction.
+/// @return false if the instruction could not be executed, the machine status says why
+bool Emulator_Execute(Machine* machine, Instruction* instruction)
+{
+    CPU* cpu = &machine->cpu;
+    Operand* dest = &instruction->opDest;
+    Operand* src = &instruction->opSrc;
+    bool wide = instruction->isWide;
+
+    // NOTE: An instruction has at most one memory operand.
+    for (int index = 0; index < instruction->operandCount; ++index)
+    {
+        Operand* operand = (index == 0 ? dest : src);
+        if (operand->type != OP_MEMORY) continue;
+        machine->operandSegment = Emulator_EffectiveSegment(cpu, instruction, operand);
+        machine->operandOffset = Emulator_EffectiveOffset(cpu, operand);
+    }
+
+    switch (instruction->type)
+    {
+        case DIS_MOV:
+            Emulator_WriteOperand(machine, dest, wide, Emulator_ReadOperand(machine, src, wide));
+        break;
+
+        case DIS_LEA:
+            if (src->type != OP_MEMORY)
+            {
+                machine->status = MACHINE_UNSUPPORTED;
+                return false;
+            }
+            Emulator_WriteOperand(machine, dest, true, Emulator_EffectiveOffset(cpu, src));
+        break;
+        case DIS_LDS: case DIS_LES:
+        {
+            if (src->type != OP_MEMORY)
+            {
+                machine->status = MACHINE_UNSUPPORTED;
+                return false;
+            }
+            Emulator_WriteOperand(machine, dest, true, Memory_Read16(&machine->memory, machine->operandSegment, machine->operandOffset));
+            u16 segment = Memory_Read16(&machine->memory, machine->operandSegment, (u16)(machine->operandOffset + 2));
+            if (instruction->type == DIS_LDS) cpu->ds = segment;
+            else cpu->es = segment;
+        }
+        break;
+        case DIS_XLAT:
+        {
+            u16 segment = ((instruction->prefixes & PREFIX_SEGMENT) ? cpu->regseg[instruction->segmentOverride] : cpu->ds);
+            cpu->al = Memory_Read8(&machine->memory, PhysicalAddress(segment, (u16)(cpu->bx + cpu->al)));
+        }
+        break;
+
+        case DIS_XCHG:
+        {
+            u16 destValue = Emulator_ReadOperand(machine, dest, wide);
+            Emulator_WriteOperand(machine, dest, wide, Emulator_ReadOperand(machine, src, wide));
+            Emulator_WriteOperand(machine, src, wide, destValue);
+        }
+        break;
+
+        case DIS_ADD: case DIS_ADC: case DIS_SUB: case DIS_SBB: case DIS_CMP:
+        {
+            bool subtract = (instruction->type == DIS_SUB || instruction->type == DIS_SBB || instruction->type == DIS_CMP);
+            bool carryIn = ((instruction->type == DIS_ADC || instruction->type == DIS_SBB) && cpu->carry);
+
+            u16 result = Emulator_AddSub(cpu, subtract, Emulator_ReadOperand(machine, dest, wide),
+                Emulator_ReadOperand(machine, src, wide), carryIn, wide, true);
+            if (instruction->type != DIS_CMP) Emulator_WriteOperand(machine, dest, wide, result);
+        }
+        break;
+
+        case DIS_AND: case DIS_OR: case DIS_XOR: case DIS_TEST:
+        {
+            u16 result = Emulator_Logic(cpu, instruction->type, Emulator_ReadOperand(machine, dest, wide),
+                Emulator_ReadOperand(machine, src, wide), wide);
+            if (instruction->type != DIS_TEST) Emulator_WriteOperand(machine, dest, wide, result);
+        }
+        break;
+
+        case DIS_INC: case DIS_DEC:
+            Emulator_WriteOperand(machine, dest, wide, Emulator_AddSub(cpu, instruction->type == DIS_DEC,
+                Emulator_ReadOperand(machine, dest, wide), 1, false, wide, false));
+        break;
+
+        case DIS_NEG:
+            Emulator_WriteOperand(machine, dest, wide, Emulator_AddSub(cpu, true, 0,
+                Emulator_ReadOperand(machine, dest, wide), false, wide, true));
+        break;
+
+        case DIS_NOT:
+            Emulator_WriteOperand(machine, dest, wide, (u16)~Emulator_ReadOperand(machine, dest, wide));
+        break;
+
+        case DIS_SHL: case DIS_SHR: case DIS_SAR: case DIS_ROL: case DIS_ROR: case DIS_RCL: case DIS_RCR:
+            Emulator_WriteOperand(machine, dest, wide, Emulator_Shift(cpu, instruction->type,
+                Emulator_ReadOperand(machine, dest, wide), (u8)Emulator_ReadOperand(machine, src, false), wide));
+        break;
+
+        case DIS_MUL: case DIS_IMUL: case DIS_DIV: case DIS_IDIV:
+            if (!Emulator_MultiplyDivide(cpu, instruction->type, Emulator_ReadOperand(machine, dest, wide), wide))
+            {
+                machine->status = MACHINE_DIVIDE_ERROR;
+                return false;
+            }
+        break;
+
+        case DIS_CBW: cpu->ah = ((cpu->al & 0x80) ? 0xFF : 0); break;
+        case DIS_CWD: cpu->dx = ((cpu->ax & 0x8000) ? 0xFFFF : 0); break;
+
+        case DIS_PUSH: Emulator_Push(machine, Emulator_ReadOperand(machine, dest, true)); break;
+        case DIS_POP:  Emulator_WriteOperand(machine, dest, true, Emulator_Pop(machine)); break;
+        case DIS_PUSHF: Emulator_Push(machine, Emulator_GetFlagsWord(cpu)); break;
+        case DIS_POPF:  Emulator_SetFlagsWord(cpu, Emulator_Pop(machine)); break;
+
+        case DIS_LAHF: cpu->ah = (u8)Emulator_GetFlagsWord(cpu); break;
+        case DIS_SAHF: Emulator_SetFlagsWord(cpu, (u16)((Emulator_GetFlagsWord(cpu) & 0xFF00) | cpu->ah)); break;
+
+        case DIS_CLC: cpu->carry = false; break;
+        case DIS_STC: cpu->carry = true; break;
+        case DIS_CMC: cpu->carry = !cpu->carry; break;
+        case DIS_CLD: cpu->direction = false; break;
+        case DIS_STD: cpu->direction = true; break;
+        case DIS_CLI: cpu->interruptEnable = false; break;
+        case DIS_STI: cpu->interruptEnable = true; break;
+
+        case DIS_CALL:
+        case DIS_JMP:
+        {
+            // NOTE: The target is read before the return address is pushed, which may overwrite it.
+            u16 target = Emulator_ReadOperand(machine, dest, true);
+            u16 segment = cpu->cs;
+            if (instruction->isFar)
+            {
+                segment = Memory_Read16(&machine->memory, machine->operandSegment, (u16)(machine->operandOffset + 2));
+            }
+            if (instruction->type == DIS_CALL)
+            {
+                if (instruction->isFar) Emulator_Push(machine, cpu->cs);
+                Emulator_Push(machine, machine->ip);
+            }
+            cpu->cs = segment;
+            machine->ip = target;
+        }
+        break;
+        case DIS_RET:
+            machine->ip = Emulator_Pop(machine);
+            if (instruction->isFar) cpu->cs = Emulator_Pop(machine);
+            if (instruction->operandCount > 0) cpu->sp += dest->value;
+        break;
+
+        case DIS_LOOP: case DIS_LOOPZ: case DIS_LOOPNZ:
+        {
+            --cpu->cx;
+            bool taken = (cpu->cx != 0);
+            if (instruction->type == DIS_LOOPZ) taken = taken && cpu->zero;
+            if (instruction->type == DIS_LOOPNZ) taken = taken && !cpu->zero;
+            if (taken) machine->ip = (u16)(instruction->offset + BranchDisplacement(instruction));
+        }
+        break;
+        case DIS_JCXZ:
+            if (cpu->cx == 0) machine->ip = (u16)(instruction->offset + BranchDisplacement(instruction));
+        break;
+
+        case DIS_HLT:
+            machine->status = MACHINE_HALTED;
+        break;
+
+        case DIS_IN: case DIS_OUT:
+        {
+            MachineIO* io = machine->io;
+            bool isIn = (instruction->type == DIS_IN);
+            Operand* port = (isIn ? src : dest);
+            u16 portNumber = (port->type == OP_IMMEDIATE ? port->valueLow : cpu->dx);
+
+            if (!io || !(isIn ? (void*)io->portIn : (void*)io->portOut))
+            {
+                machine->status = MACHINE_UNSUPPORTED;
+                return false;
+            }
+
+            if (isIn)
+            {
+                u16 value = io->portIn(io->user, portNumber, wide);
+                if (wide) cpu->ax = value;
+                else cpu->al = (u8)value;
+            }
+            else
+            {
+                io->portOut(io->user, portNumber, (wide ? cpu->ax : cpu->al), wide);
+            }
+        }
+        break;
+
+        case DIS_INT: case DIS_INTO:
+        {
+            if (instruction->type == DIS_INTO && !cpu->overflow) break;
+
+            u8 vector = (instruction->type == DIS_INTO ? 4 : dest->valueLow);
+            if (!machine->io || !machine->io->interrupt || !machine->io->interrupt(machine->io->user, machine, vector))
+            {
+                machine->status = MACHINE_UNSUPPORTED;
+                return false;
+            }
+        }
+        break;
+
+        case DIS_WAIT:
+        break;
+
+        default:
+            if (IsStringInstruction(instruction->type))
+            {
+                Emulator_ExecuteString(machine, instruction);
+                break;
+            }
+
+            if (!IsConditionalJump(instruction->type))
+            {
+                machine->status = MACHINE_UNSUPPORTED;
+                return false;
+            }
+
+            if (Emulator_Condition(cpu, instruction->type))
+            {
+                machine->ip = (u16)(instruction->offset + BranchDisplacement(instruction));
+            }
+        break;
+    }
+    return true;
+}
+
+/// @brief Decodes the instruction at CS:ip without executing it
+/// @return false if the opcode is not recognized
+bool Emulator_FetchAt(Machine* machine, u16 ip, Instruction* instruction)
+{
+    // NOTE: 8086 instructions are at most 6 bytes long plus up to PREFIX_MAX_COUNT prefixes, see DecodeInstruction().
+    u8 code[16];
+    Memory_ReadBlock(&machine->memory, PhysicalAddress(machine->cpu.cs, ip), code, sizeof(code));
+
+    ByteStream stream = {code, sizeof(code), 0};
+    bool recognized = DecodeInstruction(&stream, instruction);
+    instruction->offset = ip;
+    return recognized;
+}
+
+/// @brief Decodes the instruction at CS:IP without executing it
+inline bool Emulator_Fetch(Machine* machine, Instruction* instruction)
+{
+    return Emulator_FetchAt(machine, machine->ip, instruction);
+}
+
+/// @brief Fetches, decodes and executes one instruction at CS:IP
+/// @param[out] instruction the decoded instruction, optional
+/// @return false if the machine is not running or stopped at this instruction
+bool Emulator_Step(Machine* machine, Instruction* instruction = nullptr)
+{
+    if (machine->status != MACHINE_RUNNING) return false;
+    if (machine->ip >= machine->codeEnd)
+    {
+        machine->status = MACHINE_HALTED;
+        return false;
+    }
+
+    Instruction decoded;
+    if (!instruction) instruction = &decoded;
+
+    // NOTE: Only pages with a breakpoint need the exact check.
+    u32 pc = PhysicalAddress(machine->cpu.cs, machine->ip);
+    bool skipBreakpoint = machine->skipBreakpoint;
+    machine->skipBreakpoint = false;
+    if ((machine->memory.watchPages[pc >> PAGE_SHIFT] & WATCH_EXECUTE) && !skipBreakpoint &&
+        Memory_IsWatched(&machine->memory, pc, WATCH_EXECUTE))
+    {
+        machine->status = MACHINE_BREAKPOINT;
+        return false;
+    }
+
+    if (!Emulator_Fetch(machine, instruction))
+    {
+        machine->status = MACHINE_UNSUPPORTED;
+        return false;
+    }
+
+    machine->ip = (u16)(machine->ip + instruction->length);
+    bool executed = Emulator_Execute(machine, instruction);
+
+    MemoryWatch* watch = machine->memory.watch;
+    if (watch && watch->hit)
+    {
+        watch->hit = false;
+        if (executed)
+        {
+            machine->status = MACHINE_WATCHPOINT;
+            machine->watchIp = (u16)instruction->offset;
+        }
+    }
+
+    if (!executed)
+    {
+        machine->ip = (u16)instruction->offset;
+        return false;
+    }
+
+    if (machine->coverage) machine->coverage[pc >> 6] |= 1ull << (pc & 63);
+    ++machine->instructionCount;
+    return (machine->status == MACHINE_RUNNING);
+}
+
+/// @brief Runs until the machine stops or the instruction budget is used up
+/// @return number of instructions executed
+u64 Emulator_Run(Machine* machine, u64 maxInstructions)
+{
+    // NOTE: Breakpoints and watchpoints are checked per instruction, only Emulator_Step() does that.
+    if (machine->fusion && !machine->memory.watch) return Fusion_Run(machine, maxInstructions);
+
+    u64 start = machine->instructionCount;
+    while (machine->instructionCount - start < maxInstructions && Emulator_Step(machine))
+    {
+    }
+    return machine->instructionCount - start;
+}
+
+/// @brief Prints the status, position, instruction count and registers on one line, without a newline
+void Emulator_PrintState(Machine* machine)
+{
+    CPU* cpu = &machine->cpu;
+    Print("%s at %04x:%04x after %llu instructions, ax=%04x bx=%04x cx=%04x dx=%04x sp=%04x bp=%04x si=%04x di=%04x flags=",
+        machineStatusNames[machine->status], cpu->cs, machine->ip, (unsigned long long)machine->instructionCount,
+        cpu->ax, cpu->bx, cpu->cx, cpu->dx, cpu->sp, cpu->bp, cpu->si, cpu->di);
+    PrintFlags(*cpu);
+}
@@ -0,0 +1,210 @@
+// Library build of the emulator, see emulator_api.h. Compiled on its own instead of main.cpp.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.cpp"
+#include "arena.cpp"
+#include "disassembly.cpp"
+#include "decoder.cpp"
+#include "printing.cpp"
+#include "access.cpp"
+#include "memory.cpp"
+
+#include "simulation.cpp"
+#include "emulator.cpp"
+#include "fusion.cpp"
+
+#include "emulator_api.h"
+
+struct emu_machine
+{
+    Machine machine; // NOTE: Must be first, interrupt callbacks get the Machine* back as the emu_machine*.
+    MemoryImage image; // Empty, every page is written through the machine
+    MemoryWatch watch;
+
+    MachineIO io;
+    emu_callbacks callbacks;
+};
+
+static u16 Api_PortIn(void* user, u16 port, bool wide)
+{
+    emu_callbacks* callbacks = &((emu_machine*)user)->callbacks;
+    return callbacks->port_in(callbacks->user, port, wide);
+}
+
+static void Api_PortOut(void* user, u16 port, u16 value, bool wide)
+{
+    emu_callbacks* callbacks = &((emu_machine*)user)->callbacks;
+    callbacks->port_out(callbacks->user, port, value, wide);
+}
+
+static bool Api_Interrupt(void* user, Machine* machine, u8 vector)
+{
+    emu_callbacks* callbacks = &((emu_machine*)user)->callbacks;
+    return callbacks->interrupt(callbacks->user, (emu_machine*)machine, vector) != 0;
+}
+
+emu_machine* emu_create(void)
+{
+    emu_machine* result = (emu_machine*)calloc(1, sizeof(emu_machine));
+    if (!result) return nullptr;
+
+    MemoryImage_Init(&result->image);
+    MemoryWatch_Init(&result->watch);
+    Machine_Init(&result->machine, &result->image, 0x10000);
+
+    result->io.user = result;
+    result->machine.io = &result->io;
+    return result;
+}
+
+void emu_destroy(emu_machine* machine)
+{
+    if (!machine) return;
+
+    Machine_Free(&machine->machine);
+    MemoryWatch_Free(&machine->watch);
+    MemoryImage_Free(&machine->image);
+    free(machine);
+}
+
+void emu_write(emu_machine* machine, uint32_t address, const void* data, uint32_t size)
+{
+    Memory* memory = &machine->machine.memory;
+    for (u32 index = 0; index < size;)
+    {
+        u32 physical = (address + index) & MEMORY_ADDRESS_MASK;
+        u32 count = PAGE_SIZE - (physical & PAGE_MASK);
+        if (count > size - index) count = size - index;
+
+        memcpy(Memory_PrepareWrite(memory, physical >> PAGE_SHIFT) + (physical & PAGE_MASK), (u8*)data + index, count);
+        index += count;
+    }
+}
+
+void emu_read(emu_machine* machine, uint32_t address, void* target, uint32_t size)
+{
+    Memory_ReadBlock(&machine->machine.memory, address, (u8*)target, size);
+}
+
+void emu_load(emu_machine* machine, uint32_t address, const void* data, uint32_t size)
+{
+    emu_write(machine, address, data, size);
+}
+
+uint8_t emu_read8(emu_machine* machine, uint32_t address)
+{
+    u8 value;
+    emu_read(machine, address, &value, 1);
+    return value;
+}
+
+void emu_write8(emu_machine* machine, uint32_t address, uint8_t value)
+{
+    emu_write(machine, address, &value, 1);
+}
+
+uint8_t* emu_memory(emu_machine* machine, uint32_t address, int writable, uint32_t* available)
+{
+    Memory* memory = &machine->machine.memory;
+    address &= MEMORY_ADDRESS_MASK;
+    u32 page = address >> PAGE_SHIFT;
+
+    if (available) *available = PAGE_SIZE - (address & PAGE_MASK);
+    u8* contents = (writable ? Memory_PrepareWrite(memory, page) : memory->readPages[page]);
+    return contents + (address & PAGE_MASK);
+}
+
+void emu_set_code_end(emu_machine* machine, uint32_t code_end)
+{
+    machine->machine.codeEnd = code_end;
+}
+
+void emu_set_callbacks(emu_machine* machine, const emu_callbacks* callbacks)
+{
+    if (callbacks) machine->callbacks = *callbacks;
+    else machine->callbacks = {};
+
+    machine->io.portIn = (machine->callbacks.port_in ? Api_PortIn : nullptr);
+    machine->io.portOut = (machine->callbacks.port_out ? Api_PortOut : nullptr);
+    machine->io.interrupt = (machine->callbacks.interrupt ? Api_Interrupt : nullptr);
+}
+
+uint64_t emu_run(emu_machine* machine, uint64_t max_instructions)
+{
+    return Emulator_Run(&machine->machine, max_instructions);
+}
+
+uint64_t emu_run_until(emu_machine* machine, uint64_t max_instructions, emu_condition condition, void* user)
+{
+    Machine* target = &machine->machine;
+    u64 start = target->instructionCount;
+    while (target->instructionCount - start < max_instructions && !(condition && condition(user, machine)) &&
+           Emulator_Step(target))
+    {
+    }
+    return target->instructionCount - start;
+}
+
+emu_status emu_get_status(emu_machine* machine)
+{
+    // NOTE: emu_status lists the machine states in the same order.
+    static_assert(EMU_UNSUPPORTED == (int)MACHINE_UNSUPPORTED && EMU_WATCHPOINT == (int)MACHINE_WATCHPOINT,
+                  "emu_status does not match MachineStatus");
+    return (emu_status)machine->machine.status;
+}
+
+uint64_t emu_instruction_count(emu_machine* machine)
+{
+    return machine->machine.instructionCount;
+}
+
+void emu_resume(emu_machine* machine)
+{
+    Machine_Resume(&machine->machine);
+}
+
+uint16_t emu_get_register(emu_machine* machine, emu_register reg)
+{
+    CPU* cpu = &machine->machine.cpu;
+    if (reg <= EMU_DI) return cpu->reg16[reg];
+    if (reg <= EMU_DS) return cpu->regseg[reg - EMU_ES];
+    if (reg == EMU_IP) return machine->machine.ip;
+    if (reg == EMU_FLAGS) return Emulator_GetFlagsWord(cpu);
+    return 0;
+}
+
+void emu_set_register(emu_machine* machine, emu_register reg, uint16_t value)
+{
+    CPU* cpu = &machine->machine.cpu;
+    if (reg <= EMU_DI) cpu->reg16[reg] = value;
+    else if (reg <= EMU_DS) cpu->regseg[reg - EMU_ES] = value;
+    else if (reg == EMU_IP) machine->machine.ip = value;
+    else if (reg == EMU_FLAGS) Emulator_SetFlagsWord(cpu, value);
+}
+
+int emu_add_watch(emu_machine* machine, uint32_t address, uint32_t size, int flags)
+{
+    // NOTE: emu_watch_flags are the matching WatchFlags bits, other bits would set internal ones such as WATCH_CODE.
+    static_assert(EMU_WATCH_READ == (int)WATCH_READ && EMU_WATCH_WRITE == (int)WATCH_WRITE &&
+                  EMU_WATCH_EXECUTE == (int)WATCH_EXECUTE, "emu_watch_flags does not match WatchFlags");
+    const int knownFlags = EMU_WATCH_READ | EMU_WATCH_WRITE | EMU_WATCH_EXECUTE;
+    if (flags == 0 || (flags & ~knownFlags)) return 0;
+
+    // NOTE: The watch must not change while attached.
+    Memory_AttachWatch(&machine->machine.memory, nullptr);
+    MemoryWatch_Add(&machine->watch, address, size, (u8)flags);
+    Memory_AttachWatch(&machine->machine.memory, &machine->watch);
+    return 1;
+}
+
+void emu_clear_watches(emu_machine* machine)
+{
+    Memory_AttachWatch(&machine->machine.memory, nullptr);
+    MemoryWatch_Free(&machine->watch);
+    MemoryWatch_Init(&machine->watch);
+}
@@ -0,0 +1,117 @@
+#ifndef EMULATOR_API_H
+#define EMULATOR_API_H
+
+// C interface of the 8086 emulator, for embedding it in other programs.
+//
+// A machine has its own 1 MiB address space, registers and optional callbacks for port I/O and software
+// interrupts. Build emulator_api.cpp as a static library, or as a DLL with EMU_BUILD_DLL defined.
+
+#include <stdint.h>
+
+#if defined(EMU_BUILD_DLL)
+#define EMU_API __declspec(dllexport)
+#elif defined(EMU_USE_DLL)
+#define EMU_API __declspec(dllimport)
+#else
+#define EMU_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct emu_machine emu_machine;
+
+typedef enum emu_status
+{
+    EMU_RUNNING,
+    EMU_HALTED,      // HLT, or IP reached the end of the code
+    EMU_UNSUPPORTED, // Bytes that are not a valid instruction, an instruction that is not emulated, or an IN/OUT/INT without a callback
+    EMU_DIVIDE_ERROR,
+    EMU_BREAKPOINT,
+    EMU_WATCHPOINT,
+} emu_status;
+
+typedef enum emu_register
+{
+    EMU_AX, EMU_CX, EMU_DX, EMU_BX, EMU_SP, EMU_BP, EMU_SI, EMU_DI,
+    EMU_ES, EMU_CS, EMU_SS, EMU_DS,
+    EMU_IP,
+    EMU_FLAGS, // 8086 FLAGS layout
+} emu_register;
+
+typedef enum emu_watch_flags
+{
+    EMU_WATCH_READ    = 1,
+    EMU_WATCH_WRITE   = 2,
+    EMU_WATCH_EXECUTE = 4,
+} emu_watch_flags;
+
+// Any callback may be null. The machine stops with EMU_UNSUPPORTED on an instruction whose callback is missing.
+typedef struct emu_callbacks
+{
+    void* user;
+
+    // wide is 1 for word transfers (AX), 0 for byte transfers (AL)
+    uint16_t (*port_in)(void* user, uint16_t port, int wide);
+    void (*port_out)(void* user, uint16_t port, uint16_t value, int wide);
+
+    // INT n, INT3 and INTO with OF set. The callback may change registers and memory of the machine.
+    // Return 0 if the interrupt is not handled.
+    int (*interrupt)(void* user, emu_machine* machine, uint8_t vector);
+} emu_callbacks;
+
+// Stops emu_run_until() when it returns non-zero, checked before every instruction
+typedef int (*emu_condition)(void* user, emu_machine* machine);
+
+/// @brief Creates a machine with zeroed memory and registers. Returns null if out of memory.
+EMU_API emu_machine* emu_create(void);
+EMU_API void emu_destroy(emu_machine* machine);
+
+/// @brief Copies data into memory at a physical address. Wraps around at 1 MiB.
+EMU_API void emu_load(emu_machine* machine, uint32_t address, const void* data, uint32_t size);
+
+/// @brief The machine halts when IP reaches this offset. The default 0x10000 never halts.
+EMU_API void emu_set_code_end(emu_machine* machine, uint32_t code_end);
+
+EMU_API void emu_set_callbacks(emu_machine* machine, const emu_callbacks* callbacks);
+
+/// @brief Runs until the machine stops or max_instructions have executed. Any memory contents are safe to run, code
+/// that cannot be decoded or emulated stops the machine with EMU_UNSUPPORTED at that instruction.
+/// @return number of instructions executed
+EMU_API uint64_t emu_run(emu_machine* machine, uint64_t max_instructions);
+/// @brief Like emu_run(), also stops when condition returns non-zero. A null condition runs until the machine stops.
+EMU_API uint64_t emu_run_until(emu_machine* machine, uint64_t max_instructions, emu_condition condition, void* user);
+
+EMU_API emu_status emu_get_status(emu_machine* machine);
+EMU_API uint64_t emu_instruction_count(emu_machine* machine);
+
+/// @brief Continues a machine stopped at a breakpoint or watchpoint
+EMU_API void emu_resume(emu_machine* machine);
+
+EMU_API uint16_t emu_get_register(emu_machine* machine, emu_register reg);
+EMU_API void emu_set_register(emu_machine* machine, emu_register reg, uint16_t value);
+
+// Physical addresses, wrap around at 1 MiB. These do not trigger watchpoints.
+EMU_API uint8_t emu_read8(emu_machine* machine, uint32_t address);
+EMU_API void emu_write8(emu_machine* machine, uint32_t address, uint8_t value);
+EMU_API void emu_read(emu_machine* machine, uint32_t address, void* target, uint32_t size);
+EMU_API void emu_write(emu_machine* machine, uint32_t address, const void* data, uint32_t size);
+
+/// @brief Direct access to the memory page containing an address, without copying
+/// @param writable non-zero to write through the pointer, the page is then private to the machine
+/// @param available receives the number of bytes from address to the end of the page
+/// @return pointer valid until the next call into the machine. Do not write through a read-only pointer.
+EMU_API uint8_t* emu_memory(emu_machine* machine, uint32_t address, int writable, uint32_t* available);
+
+/// @brief Adds breakpoints (EMU_WATCH_EXECUTE) or watchpoints to a physical address range
+/// @param flags one or more emu_watch_flags
+/// @return 0 if flags is zero or has bits that are not emu_watch_flags, nothing is added then
+EMU_API int emu_add_watch(emu_machine* machine, uint32_t address, uint32_t size, int flags);
+EMU_API void emu_clear_watches(emu_machine* machine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
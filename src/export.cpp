@@ -0,0 +1,358 @@
+#include "common.cpp"
+
+// Binary export of the decoded instruction stream.
+//
+// File layout (little endian):
+// - ExportHeader
+// - ExportRecord[recordCount] at recordsOffset, each recordSize bytes apart
+// - ExportSymbol[symbolCount] at symbolsOffset, sorted by offset
+//
+// Readers must step through records using header.recordSize so that newer versions can append fields to
+// the end of a record without breaking older readers.
+
+#define EXPORT_MAGIC 0x58443638 // "86DX"
+#define EXPORT_VERSION 2
+
+#define EXPORT_OPERAND_NONE 0xFF
+
+enum ExportRecordFlags
+{
+    EXPORT_RECORD_WIDE         = 0b01,
+    EXPORT_RECORD_UNRECOGNIZED = 0b10, // Opcode was not decoded, the record covers the prefixes and the opcode byte
+    EXPORT_RECORD_FAR          = 0b100, // Intersegment CALL/JMP/RET
+};
+
+enum ExportOperandFlags
+{
+    EXPORT_OPERAND_OUTPUT_WIDTH = 0b1,
+};
+
+enum ExportSymbolKind
+{
+    EXPORT_SYMBOL_JUMP_TARGET = 0b01, // Target of a conditional jump
+    EXPORT_SYMBOL_LOOP_TARGET = 0b10, // Target of LOOP/LOOPZ/LOOPNZ/JCXZ
+};
+
+#pragma pack(push, 1)
+struct ExportHeader
+{
+    u32 magic;
+    u16 version;
+    u16 headerSize;
+
+    u32 imageSize;      // Size of the decoded source image in bytes
+
+    u32 recordSize;
+    u32 recordCount;
+    u32 recordsOffset;
+
+    u32 symbolSize;
+    u32 symbolCount;
+    u32 symbolsOffset;  // 0 if the symbol table was not written
+};
+
+struct ExportOperand
+{
+    u8 type;   // OperandType, or EXPORT_OPERAND_NONE
+    u8 regmem; // RMField: register index or effective address form
+    u8 mod;    // ModField, only meaningful for memory operands
+    u8 flags;  // ExportOperandFlags
+    u16 value; // Immediate, displacement or direct address
+};
+
+struct ExportRecord
+{
+    u32 offset; // Offset of the first byte of the instruction in the image
+    u8 length;
+    u8 type;    // InstructionType
+    u8 flags;   // ExportRecordFlags
+    u8 operandCount;
+
+    ExportOperand dest;
+    ExportOperand src;
+
+    u8 prefixes;        // InstructionPrefix bits
+    u8 segmentOverride;
+    u8 prefixLength;
+};
+
+struct ExportSymbol
+{
+    u32 offset;
+    u16 kind;           // ExportSymbolKind bits
+    u16 referenceCount; // Saturates at 0xFFFF
+};
+#pragma pack(pop)
+
+static_assert(sizeof(ExportHeader) == 36, "Export header layout changed");
+static_assert(sizeof(ExportRecord) == 23, "Export record layout changed");
+static_assert(sizeof(ExportSymbol) == 8, "Export symbol layout changed");
+
+ExportOperand Export_PackOperand(Operand* operand, bool present)
+{
+    ExportOperand result {0};
+    if (!present)
+    {
+        result.type = EXPORT_OPERAND_NONE;
+        return result;
+    }
+
+    result.type = (u8)operand->type;
+    result.regmem = (u8)operand->regmemIndex;
+    result.mod = (u8)operand->modField;
+    result.flags = (operand->outputWidth ? EXPORT_OPERAND_OUTPUT_WIDTH : 0);
+    result.value = operand->value;
+    return result;
+}
+
+Operand Export_UnpackOperand(ExportOperand* packed)
+{
+    Operand result {0};
+    if (packed->type == EXPORT_OPERAND_NONE) return result;
+
+    result.type = (OperandType)packed->type;
+    result.regmemIndex = (RMField)packed->regmem;
+    result.modField = (ModField)packed->mod;
+    result.outputWidth = (packed->flags & EXPORT_OPERAND_OUTPUT_WIDTH);
+    result.value = packed->value;
+    return result;
+}
+
+ExportRecord Export_PackInstruction(Instruction* instruction, bool recognized)
+{
+    ExportRecord result {0};
+    result.offset = instruction->offset;
+    result.length = instruction->length;
+    result.type = (u8)instruction->type;
+    result.flags = (u8)((instruction->isWide ? EXPORT_RECORD_WIDE : 0) | (recognized ? 0 : EXPORT_RECORD_UNRECOGNIZED) |
+                        (instruction->isFar ? EXPORT_RECORD_FAR : 0));
+    result.operandCount = (u8)instruction->operandCount;
+    result.dest = Export_PackOperand(&instruction->opDest, instruction->operandCount >= 1);
+    result.src = Export_PackOperand(&instruction->opSrc, instruction->operandCount >= 2);
+    result.prefixes = instruction->prefixes;
+    result.segmentOverride = instruction->segmentOverride;
+    result.prefixLength = instruction->prefixLength;
+    return result;
+}
+
+int Export_CompareSymbols(const void* a, const void* b)
+{
+    u32 offsetA = ((ExportSymbol*)a)->offset;
+    u32 offsetB = ((ExportSymbol*)b)->offset;
+    return (offsetA > offsetB) - (offsetA < offsetB);
+}
+
+/// @brief Decodes the image and writes it in the binary export format
+/// @param image assembled code
+/// @param fileName output file
+/// @param writeSymbols if true, a symbol table of branch targets is appended
+/// @return false if the output could not be written
+bool Export_WriteFile(ByteStream image, char* fileName, bool writeSymbols)
+{
+    FILE* file;
+    fopen_s(&file, fileName, "wb");
+    if (!file) return false;
+
+    ExportHeader header {0};
+    header.magic = EXPORT_MAGIC;
+    header.version = EXPORT_VERSION;
+    header.headerSize = sizeof(ExportHeader);
+    header.imageSize = image.size;
+    header.recordSize = sizeof(ExportRecord);
+    header.recordsOffset = sizeof(ExportHeader);
+    header.symbolSize = sizeof(ExportSymbol);
+
+    // NOTE: The header is rewritten once the counts are known.
+    fwrite(&header, sizeof(header), 1, file);
+
+    u32 symbolCapacity = 256;
+    u32 symbolCount = 0;
+    ExportSymbol* symbols = (ExportSymbol*)malloc(symbolCapacity * sizeof(ExportSymbol));
+
+    image.position = 0;
+    while (image.position < image.size)
+    {
+        Instruction instruction;
+        bool recognized = DecodeInstruction(&image, &instruction);
+
+        ExportRecord record = Export_PackInstruction(&instruction, recognized);
+        fwrite(&record, sizeof(record), 1, file);
+        ++header.recordCount;
+
+        u32 target;
+        if (writeSymbols && GetBranchTarget(&instruction, &target))
+        {
+            if (symbolCount == symbolCapacity)
+            {
+                symbolCapacity *= 2;
+                symbols = (ExportSymbol*)realloc(symbols, symbolCapacity * sizeof(ExportSymbol));
+            }
+
+            ExportSymbol* symbol = &symbols[symbolCount++];
+            symbol->offset = target;
+            symbol->kind = (IsLoopInstruction(instruction.type) ? EXPORT_SYMBOL_LOOP_TARGET : EXPORT_SYMBOL_JUMP_TARGET);
+            symbol->referenceCount = 1;
+        }
+    }
+
+    if (writeSymbols)
+    {
+        // Merge references to the same target into a single symbol
+        qsort(symbols, symbolCount, sizeof(ExportSymbol), Export_CompareSymbols);
+
+        u32 uniqueCount = 0;
+        for (u32 index = 0; index < symbolCount; ++index)
+        {
+            if (uniqueCount > 0 && symbols[uniqueCount - 1].offset == symbols[index].offset)
+            {
+                ExportSymbol* merged = &symbols[uniqueCount - 1];
+                merged->kind |= symbols[index].kind;
+                if (merged->referenceCount < 0xFFFF) ++merged->referenceCount;
+            }
+            else
+            {
+                symbols[uniqueCount++] = symbols[index];
+            }
+        }
+
+        header.symbolCount = uniqueCount;
+        header.symbolsOffset = header.recordsOffset + header.recordCount * header.recordSize;
+        fwrite(symbols, sizeof(ExportSymbol), uniqueCount, file);
+    }
+    free(symbols);
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+    return success;
+}
+
+// Reader API. Works directly on the file contents (read or memory-mapped), nothing is copied or parsed.
+
+struct ExportView
+{
+    ExportHeader* header;
+    u8* records;
+    ExportSymbol* symbols;
+};
+
+bool Export_IsValidOperand(ExportOperand* operand, bool present)
+{
+    if (!present) return (operand->type == EXPORT_OPERAND_NONE);
+
+    u8 registerCount = (operand->type == OP_SEGMENT_REGISTER ? 4 : 8);
+    return operand->type <= OP_SEGMENT_REGISTER && operand->regmem < registerCount && operand->mod <= REGISTER_MODE &&
+           (operand->flags & ~EXPORT_OPERAND_OUTPUT_WIDTH) == 0;
+}
+
+/// @brief Checks that every field of a record is in range, so it can be converted with Export_ToInstruction()
+bool Export_IsValidRecord(ExportHeader* header, ExportRecord* record)
+{
+    u8 knownFlags = EXPORT_RECORD_WIDE | EXPORT_RECORD_UNRECOGNIZED | EXPORT_RECORD_FAR;
+    u8 knownPrefixes = PREFIX_LOCK | PREFIX_ANY_REP | PREFIX_SEGMENT;
+
+    return record->type <= DIS_SEGMENT && record->operandCount <= 2 && (record->flags & ~knownFlags) == 0 &&
+           Export_IsValidOperand(&record->dest, record->operandCount >= 1) &&
+           Export_IsValidOperand(&record->src, record->operandCount >= 2) &&
+           (record->prefixes & ~knownPrefixes) == 0 && record->segmentOverride < 4 &&
+           record->length > 0 && record->prefixLength <= record->length &&
+           (u64)record->offset + record->length <= header->imageSize;
+}
+
+/// @brief Validates an export file and sets up a view into it
+/// @param data contents of the export file
+/// @param size size of the contents in bytes
+/// @param[out] view view into data
+/// @return false if the data is not a supported export file, or a record or symbol has a field out of range
+bool Export_OpenView(void* data, u64 size, ExportView* view)
+{
+    *view = {};
+    if (size < sizeof(ExportHeader)) return false;
+
+    ExportHeader* header = (ExportHeader*)data;
+    if (header->magic != EXPORT_MAGIC) return false;
+    if (header->version != EXPORT_VERSION) return false;
+    if (header->headerSize < sizeof(ExportHeader)) return false;
+    if (header->recordSize < sizeof(ExportRecord)) return false;
+
+    u64 recordsEnd = (u64)header->recordsOffset + (u64)header->recordCount * header->recordSize;
+    if (recordsEnd > size) return false;
+
+    if (header->symbolsOffset)
+    {
+        if (header->symbolSize < sizeof(ExportSymbol)) return false;
+
+        u64 symbolsEnd = (u64)header->symbolsOffset + (u64)header->symbolCount * header->symbolSize;
+        if (symbolsEnd > size) return false;
+
+        for (u32 index = 0; index < header->symbolCount; ++index)
+        {
+            ExportSymbol* symbol = (ExportSymbol*)((u8*)data + header->symbolsOffset + (u64)index * header->symbolSize);
+            u16 knownKinds = EXPORT_SYMBOL_JUMP_TARGET | EXPORT_SYMBOL_LOOP_TARGET;
+            if (symbol->kind == 0 || (symbol->kind & ~knownKinds) != 0) return false;
+        }
+
+        view->symbols = (ExportSymbol*)((u8*)data + header->symbolsOffset);
+    }
+
+    // NOTE: Records are cast into enums and used as table indices when printed, a corrupted file must not get that far.
+    u8* records = (u8*)data + header->recordsOffset;
+    for (u32 index = 0; index < header->recordCount; ++index)
+    {
+        if (!Export_IsValidRecord(header, (ExportRecord*)(records + (u64)index * header->recordSize))) return false;
+    }
+
+    view->header = header;
+    view->records = records;
+    return true;
+}
+
+inline ExportRecord* Export_GetRecord(ExportView* view, u32 index)
+{
+    Assert(index < view->header->recordCount);
+    return (ExportRecord*)(view->records + (u64)index * view->header->recordSize);
+}
+
+inline ExportSymbol* Export_GetSymbol(ExportView* view, u32 index)
+{
+    Assert(view->symbols && index < view->header->symbolCount);
+    return (ExportSymbol*)((u8*)view->symbols + (u64)index * view->header->symbolSize);
+}
+
+/// @brief Finds the record of the instruction that starts at the given image offset
+/// @return record index or -1 if no instruction starts there
+i64 Export_FindRecord(ExportView* view, u32 offset)
+{
+    u32 low = 0;
+    u32 high = view->header->recordCount;
+    while (low < high)
+    {
+        u32 middle = low + (high - low) / 2;
+        u32 recordOffset = Export_GetRecord(view, middle)->offset;
+
+        if (recordOffset == offset) return middle;
+        if (recordOffset < offset) low = middle + 1;
+        else high = middle;
+    }
+    return -1;
+}
+
+/// @param record a record of a view opened with Export_OpenView(), which checked its fields
+Instruction Export_ToInstruction(ExportRecord* record)
+{
+    Instruction result {};
+    result.prefixes = record->prefixes;
+    result.segmentOverride = record->segmentOverride;
+    result.prefixLength = record->prefixLength;
+    result.type = (InstructionType)record->type;
+    result.operandCount = record->operandCount;
+    result.isWide = (record->flags & EXPORT_RECORD_WIDE);
+    result.isFar = (record->flags & EXPORT_RECORD_FAR);
+    result.opDest = Export_UnpackOperand(&record->dest);
+    result.opSrc = Export_UnpackOperand(&record->src);
+    result.offset = record->offset;
+    result.length = record->length;
+    return result;
+}
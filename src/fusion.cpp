@@ -0,0 +1,429 @@
+#include "common.cpp"
+
+// Block cache with fused instruction pairs for Emulator_Run().
+//
+// Emulator_Step() decodes every instruction each time it runs it and then dispatches it through the full execute
+// switch, with every flag computed eagerly. Here straight-line code is decoded once into a block, which ends at the
+// first control transfer, and a pre-pass over the block fuses common pairs into one handler:
+//
+// - ALU operation + conditional jump, LOOP or JCXZ: cmp/jcc, dec/jnz, inc or add/loop, test/jz, ...
+// - MOV reg, imm + ALU operation
+//
+// Only register and immediate operands are fused, so fused pairs never access memory. A fused ALU operation keeps
+// its operands and result as pending flags instead of computing the flags, and the branch computes only the
+// condition it tests from them. The next fused ALU operation replaces the pending flags, which makes them free in
+// tight loops. They are written to the CPU before any other instruction executes and before Fusion_Run() returns,
+// so the architectural state is exact whenever it can be observed: by unfused instructions, interrupt and port
+// handlers, and after a run or slice.
+//
+// Blocks are kept per CS:IP until code changes. The bytes of decoded blocks are marked in memory (WATCH_CODE) and a
+// write to them increments the memory's code generation, which makes the cached blocks stale. A block also stops
+// early after such a write, so self-modifying code runs the new instructions like Emulator_Step() would.
+
+#define FUSION_SLOT_COUNT 1024 // Direct mapped by physical address, power of two
+#define FUSION_MAX_INSTRUCTIONS 32 // Per block
+#define FUSION_CACHE_LIMIT (4 << 20) // Bytes of blocks after which the cache starts over
+#define FUSION_CHUNK_SIZE (64 * 1024)
+
+enum FusionKind
+{
+    FUSION_NONE,       // Single instruction, executed by Emulator_Execute()
+    FUSION_ALU_BRANCH, // ALU operation + conditional jump, LOOP or JCXZ
+    FUSION_MOV_ALU,    // MOV reg, imm + ALU operation
+};
+
+struct FusionOp
+{
+    FusionKind kind;
+    Instruction first;
+    Instruction second; // Fused pairs only
+};
+
+struct FusionBlock
+{
+    u16 cs;
+    u16 ip;
+    u32 generation; // Memory::codeGeneration when the block was decoded
+    u32 opCount;    // 0 if the first instruction cannot be decoded or is past the end of the code
+    FusionOp ops[1];
+};
+
+struct FusionCache
+{
+    FusionBlock* slots[FUSION_SLOT_COUNT];
+    Arena arena;
+    u64 allocated; // Bytes of blocks since the cache started over
+};
+
+enum PendingFlagsKind
+{
+    PENDING_NONE, // The flags in the CPU are current
+    PENDING_ADD,
+    PENDING_SUB,  // SUB and CMP
+    PENDING_INC,  // INC and DEC keep the carry flag, which is current in the CPU
+    PENDING_DEC,
+    PENDING_LOGIC // AND, OR, XOR and TEST
+};
+
+// Flags of the last fused ALU operation, computed when they are needed
+struct PendingFlags
+{
+    PendingFlagsKind kind;
+    bool wide;
+    u16 a;
+    u16 b;
+    u16 result;
+};
+
+void Fusion_Attach(Machine* machine)
+{
+    FusionCache* cache = (FusionCache*)calloc(1, sizeof(FusionCache));
+    Arena_Init(&cache->arena, FUSION_CHUNK_SIZE);
+    machine->fusion = cache;
+}
+
+void Fusion_Detach(Machine* machine)
+{
+    if (!machine->fusion) return;
+
+    Arena_Free(&machine->fusion->arena);
+    free(machine->fusion);
+    machine->fusion = nullptr;
+}
+
+inline bool Fusion_EndsBlock(InstructionType type)
+{
+    return (IsConditionalJump(type) || IsLoopInstruction(type) || IsStringInstruction(type) || type == DIS_JMP ||
+            type == DIS_CALL || type == DIS_RET || type == DIS_IRET || type == DIS_HLT || type == DIS_INT ||
+            type == DIS_INTO);
+}
+
+inline bool Fusion_IsAlu(Instruction* instruction)
+{
+    switch (instruction->type)
+    {
+        case DIS_ADD: case DIS_SUB: case DIS_CMP: case DIS_AND: case DIS_OR: case DIS_XOR: case DIS_TEST:
+        case DIS_INC: case DIS_DEC:
+        break;
+        default: return false;
+    }
+
+    return (instruction->prefixes == 0 && instruction->opDest.type == OP_REGISTER &&
+            (instruction->operandCount == 1 || instruction->opSrc.type == OP_REGISTER ||
+             instruction->opSrc.type == OP_IMMEDIATE));
+}
+
+inline bool Fusion_IsBranch(Instruction* instruction)
+{
+    return (instruction->prefixes == 0 &&
+            (IsConditionalJump(instruction->type) || IsLoopInstruction(instruction->type)));
+}
+
+inline bool Fusion_IsMoveImmediate(Instruction* instruction)
+{
+    return (instruction->type == DIS_MOV && instruction->prefixes == 0 && instruction->opDest.type == OP_REGISTER &&
+            instruction->opSrc.type == OP_IMMEDIATE);
+}
+
+/// @brief Writes pending flags to the CPU
+void Fusion_MaterializeFlags(CPU* cpu, PendingFlags* pending)
+{
+    switch (pending->kind)
+    {
+        case PENDING_NONE: return;
+        case PENDING_LOGIC:
+            cpu->carry = false;
+            cpu->overflow = false;
+            cpu->auxCarry = false;
+            Emulator_SetResultFlags(cpu, pending->result, pending->wide);
+        break;
+        default:
+        {
+            bool subtract = (pending->kind == PENDING_SUB || pending->kind == PENDING_DEC);
+            bool setCarry = (pending->kind == PENDING_ADD || pending->kind == PENDING_SUB);
+            Emulator_AddSub(cpu, subtract, pending->a, pending->b, false, pending->wide, setCarry);
+        }
+        break;
+    }
+    pending->kind = PENDING_NONE;
+}
+
+inline bool Fusion_Carry(CPU* cpu, PendingFlags* pending)
+{
+    switch (pending->kind)
+    {
+        case PENDING_ADD: return (pending->result < pending->a); // The masked sum wrapped around
+        case PENDING_SUB: return (pending->a < pending->b);
+        case PENDING_LOGIC: return false;
+        default: return cpu->carry;
+    }
+}
+
+inline bool Fusion_Overflow(PendingFlags* pending)
+{
+    u16 signBit = (pending->wide ? 0x8000 : 0x80);
+    u16 a = pending->a;
+    u16 b = pending->b;
+    u16 result = pending->result;
+
+    switch (pending->kind)
+    {
+        case PENDING_ADD: case PENDING_INC: return ((a ^ result) & (b ^ result) & signBit) != 0;
+        case PENDING_SUB: case PENDING_DEC: return ((a ^ b) & (a ^ result) & signBit) != 0;
+        default: return false;
+    }
+}
+
+inline bool Fusion_Sign(PendingFlags* pending)
+{
+    return ((pending->result >> (pending->wide ? 15 : 7)) & 1);
+}
+
+/// @brief Condition of a conditional jump, from pending flags. Only the flags it tests are computed.
+inline bool Fusion_Condition(CPU* cpu, PendingFlags* pending, InstructionType type)
+{
+    switch (type)
+    {
+        case DIS_JO:   return Fusion_Overflow(pending);
+        case DIS_JNO:  return !Fusion_Overflow(pending);
+        case DIS_JB:   return Fusion_Carry(cpu, pending);
+        case DIS_JNB:  return !Fusion_Carry(cpu, pending);
+        case DIS_JE:   return pending->result == 0;
+        case DIS_JNE:  return pending->result != 0;
+        case DIS_JBE:  return Fusion_Carry(cpu, pending) || pending->result == 0;
+        case DIS_JNBE: return !Fusion_Carry(cpu, pending) && pending->result != 0;
+        case DIS_JS:   return Fusion_Sign(pending);
+        case DIS_JNS:  return !Fusion_Sign(pending);
+        case DIS_JP:   return IsParityEven(pending->result);
+        case DIS_JNP:  return !IsParityEven(pending->result);
+        case DIS_JL:   return Fusion_Sign(pending) != Fusion_Overflow(pending);
+        case DIS_JNL:  return Fusion_Sign(pending) == Fusion_Overflow(pending);
+        case DIS_JLE:  return Fusion_Sign(pending) != Fusion_Overflow(pending) || pending->result == 0;
+        case DIS_JNLE: return Fusion_Sign(pending) == Fusion_Overflow(pending) && pending->result != 0;
+        default:       return false;
+    }
+}
+
+/// @brief Executes an ALU operation on registers and immediates, leaving its flags pending
+inline void Fusion_Alu(Machine* machine, Instruction* instruction, PendingFlags* pending)
+{
+    bool wide = instruction->isWide;
+    u16 a = Emulator_ReadOperand(machine, &instruction->opDest, wide);
+    u16 b = (instruction->operandCount > 1 ? Emulator_ReadOperand(machine, &instruction->opSrc, wide) : 1);
+
+    PendingFlagsKind kind;
+    u16 result;
+    switch (instruction->type)
+    {
+        case DIS_ADD: kind = PENDING_ADD; result = (u16)(a + b); break;
+        case DIS_SUB: case DIS_CMP: kind = PENDING_SUB; result = (u16)(a - b); break;
+        case DIS_INC: kind = PENDING_INC; result = (u16)(a + 1); break;
+        case DIS_DEC: kind = PENDING_DEC; result = (u16)(a - 1); break;
+        case DIS_OR:  kind = PENDING_LOGIC; result = (a | b); break;
+        case DIS_XOR: kind = PENDING_LOGIC; result = (a ^ b); break;
+        default:      kind = PENDING_LOGIC; result = (a & b); break; // AND, TEST
+    }
+    if (!wide) result &= 0xFF;
+
+    // NOTE: The carry flag of other pending operations is not in the CPU yet.
+    bool keepsCarry = (kind == PENDING_INC || kind == PENDING_DEC);
+    if (keepsCarry && pending->kind != PENDING_INC && pending->kind != PENDING_DEC) Fusion_MaterializeFlags(&machine->cpu, pending);
+
+    pending->kind = kind;
+    pending->wide = wide;
+    pending->a = a;
+    pending->b = b;
+    pending->result = result;
+
+    if (instruction->type != DIS_CMP && instruction->type != DIS_TEST)
+    {
+        Emulator_WriteOperand(machine, &instruction->opDest, wide, result);
+    }
+}
+
+/// @brief Executes a conditional jump, LOOP or JCXZ after a fused ALU operation
+inline void Fusion_Branch(Machine* machine, Instruction* instruction, PendingFlags* pending)
+{
+    CPU* cpu = &machine->cpu;
+    bool taken;
+    switch (instruction->type)
+    {
+        case DIS_LOOP:   taken = (--cpu->cx != 0); break;
+        case DIS_LOOPZ:  taken = (--cpu->cx != 0) && pending->result == 0; break;
+        case DIS_LOOPNZ: taken = (--cpu->cx != 0) && pending->result != 0; break;
+        case DIS_JCXZ:   taken = (cpu->cx == 0); break;
+        default:         taken = Fusion_Condition(cpu, pending, instruction->type); break;
+    }
+
+    machine->ip = (u16)(taken ? instruction->offset + BranchDisplacement(instruction)
+                              : instruction->offset + instruction->length);
+}
+
+/// @brief Counts an executed instruction, like Emulator_Step()
+inline void Fusion_Retire(Machine* machine, Instruction* instruction)
+{
+    if (machine->coverage)
+    {
+        u32 pc = PhysicalAddress(machine->cpu.cs, (u16)instruction->offset);
+        machine->coverage[pc >> 6] |= 1ull << (pc & 63);
+    }
+    ++machine->instructionCount;
+}
+
+/// @brief Decodes the block at CS:IP and fuses its pairs
+FusionBlock* Fusion_DecodeBlock(FusionCache* cache, Machine* machine)
+{
+    Instruction decoded[FUSION_MAX_INSTRUCTIONS];
+    u32 count = 0;
+
+    u16 ip = machine->ip;
+    while (count < FUSION_MAX_INSTRUCTIONS && ip < machine->codeEnd)
+    {
+        Instruction* instruction = &decoded[count];
+        if (!Emulator_FetchAt(machine, ip, instruction)) break;
+        Memory_MarkCode(&machine->memory, PhysicalAddress(machine->cpu.cs, ip), instruction->length);
+
+        ++count;
+        if (Fusion_EndsBlock(instruction->type)) break;
+        ip = (u16)(ip + instruction->length);
+    }
+
+    FusionOp ops[FUSION_MAX_INSTRUCTIONS];
+    u32 opCount = 0;
+    for (u32 index = 0; index < count;)
+    {
+        FusionOp* op = &ops[opCount++];
+        op->kind = FUSION_NONE;
+        op->first = decoded[index];
+
+        // NOTE: An ALU operation that can fuse with the branch after it is left to the branch.
+        if (index + 1 < count)
+        {
+            Instruction* next = &decoded[index + 1];
+            bool nextFuses = (index + 2 < count && Fusion_IsAlu(next) && Fusion_IsBranch(&decoded[index + 2]));
+
+            if (Fusion_IsAlu(&op->first) && Fusion_IsBranch(next)) op->kind = FUSION_ALU_BRANCH;
+            else if (Fusion_IsMoveImmediate(&op->first) && Fusion_IsAlu(next) && !nextFuses) op->kind = FUSION_MOV_ALU;
+        }
+
+        if (op->kind != FUSION_NONE) op->second = decoded[index + 1];
+        index += (op->kind != FUSION_NONE ? 2 : 1);
+    }
+
+    u64 size = sizeof(FusionBlock) + (opCount > 1 ? opCount - 1 : 0) * sizeof(FusionOp);
+    if (cache->allocated + size > FUSION_CACHE_LIMIT)
+    {
+        Arena_Reset(&cache->arena);
+        memset(cache->slots, 0, sizeof(cache->slots));
+        cache->allocated = 0;
+    }
+    cache->allocated += size;
+
+    FusionBlock* block = (FusionBlock*)Arena_Push(&cache->arena, size);
+    block->cs = machine->cpu.cs;
+    block->ip = machine->ip;
+    block->generation = machine->memory.codeGeneration;
+    block->opCount = opCount;
+    memcpy(block->ops, ops, opCount * sizeof(FusionOp));
+    return block;
+}
+
+inline FusionBlock* Fusion_FindBlock(FusionCache* cache, Machine* machine)
+{
+    u32 slot = PhysicalAddress(machine->cpu.cs, machine->ip) & (FUSION_SLOT_COUNT - 1);
+    FusionBlock* block = cache->slots[slot];
+    if (block && block->cs == machine->cpu.cs && block->ip == machine->ip &&
+        block->generation == machine->memory.codeGeneration)
+    {
+        return block;
+    }
+
+    block = Fusion_DecodeBlock(cache, machine);
+    cache->slots[slot] = block;
+    return block;
+}
+
+/// @brief Executes one op of a block. A pair runs fused only if both instructions fit in the budget.
+/// @return false if the block cannot continue with the next op
+inline bool Fusion_ExecuteOp(Machine* machine, FusionOp* op, u64 remaining, PendingFlags* pending)
+{
+    Instruction* first = &op->first;
+    if (first->offset >= machine->codeEnd)
+    {
+        machine->status = MACHINE_HALTED;
+        return false;
+    }
+
+    if (op->kind == FUSION_NONE || remaining < 2 || op->second.offset >= machine->codeEnd)
+    {
+        Fusion_MaterializeFlags(&machine->cpu, pending);
+
+        u16 next = (u16)(first->offset + first->length);
+        machine->ip = next;
+        if (!Emulator_Execute(machine, first))
+        {
+            machine->ip = (u16)first->offset;
+            return false;
+        }
+        Fusion_Retire(machine, first);
+
+        // NOTE: The second instruction of a pair that was not fused starts the next block.
+        return (op->kind == FUSION_NONE && machine->ip == next);
+    }
+
+    Instruction* second = &op->second;
+    if (op->kind == FUSION_ALU_BRANCH)
+    {
+        Fusion_Alu(machine, first, pending);
+        Fusion_Branch(machine, second, pending);
+    }
+    else
+    {
+        Emulator_WriteOperand(machine, &first->opDest, first->isWide,
+            Emulator_ReadOperand(machine, &first->opSrc, first->isWide));
+        Fusion_Alu(machine, second, pending);
+        machine->ip = (u16)(second->offset + second->length);
+    }
+
+    Fusion_Retire(machine, first);
+    Fusion_Retire(machine, second);
+    return true;
+}
+
+/// @brief Emulator_Run() with cached blocks and fused pairs, see the top of the file
+/// @return number of instructions executed
+u64 Fusion_Run(Machine* machine, u64 maxInstructions)
+{
+    FusionCache* cache = machine->fusion;
+    PendingFlags pending = {};
+    u64 start = machine->instructionCount;
+    machine->skipBreakpoint = false;
+
+    while (machine->status == MACHINE_RUNNING && machine->instructionCount - start < maxInstructions)
+    {
+        FusionBlock* block = Fusion_FindBlock(cache, machine);
+        if (block->opCount == 0)
+        {
+            // NOTE: Emulator_Step() halts at the end of the code and reports instructions that are not recognized.
+            Fusion_MaterializeFlags(&machine->cpu, &pending);
+            Emulator_Step(machine);
+            continue;
+        }
+
+        for (u32 index = 0; index < block->opCount; ++index)
+        {
+            u64 remaining = maxInstructions - (machine->instructionCount - start);
+            if (remaining == 0 || !Fusion_ExecuteOp(machine, &block->ops[index], remaining, &pending)) break;
+
+            // NOTE: The rest of the block is stale after a write to code or a change of CS.
+            if (machine->status != MACHINE_RUNNING || machine->memory.codeGeneration != block->generation ||
+                machine->cpu.cs != block->cs)
+            {
+                break;
+            }
+        }
+    }
+
+    Fusion_MaterializeFlags(&machine->cpu, &pending);
+    return machine->instructionCount - start;
+}
@@ -0,0 +1,255 @@
+#include "common.cpp"
+
+// Length-only decoding: finds instruction boundaries without building Instruction records.
+//
+// The length of an instruction follows from its opcode and, for opcodes with an operand byte, the mod and r/m
+// fields of that byte. Both are folded into one table indexed by a pair of bytes. A block of the image is first
+// mapped to the length of the instruction that would start at each byte (8 positions per AVX2 gather), then a
+// short walk follows the lengths from the first byte and marks the boundaries. Prefixes map to length 0 and belong
+// to the instruction after them, up to PREFIX_MAX_COUNT of them.
+//
+// The lengths match DecodeInstruction(), including truncated instructions at the end of the image, which is
+// checked by Lengths_Verify().
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define LENGTHS_BLOCK_SIZE 16384
+
+// Per opcode
+#define LENGTH_IMMEDIATE_MASK    0x07 // Bytes after the opcode and operand byte, without displacement
+#define LENGTH_OPERAND_BYTE      0x08
+#define LENGTH_PREFIX            0x10
+#define LENGTH_IMMEDIATE_IF_REG0 0x20 // TEST r/m, imm: only reg 000 of the operand byte has the immediate
+
+static u8 opcodeLengths[256];
+static u8 displacementLengths[256]; // Per operand byte
+
+// Instruction length for an opcode and the byte after it, 0 for prefixes.
+// NOTE: Padded so that 32-bit gathers can read any entry.
+static u8 pairLengths[65536 + 3];
+static std::once_flag lengthTablesBuilt;
+
+/// @brief Fills the tables from the opcode patterns of DecodeInstruction(), checked in the same order
+void Lengths_BuildTables()
+{
+    for (u32 opcode = 0; opcode < 256; ++opcode)
+    {
+        u8 info = 0;
+        bool wide = (opcode & 0b1);
+        Instruction probe = {};
+
+        if (DecodePrefix((u8)opcode, &probe)) info = LENGTH_PREFIX;
+        else if (DecodeSingleByteInstruction((u8)opcode, &probe)) info = 0;
+        else if (opcode == INST_AAM || opcode == INST_AAD || opcode == INST_INT) info = 1;
+        else if (opcode == INST_LEA || opcode == INST_LDS || opcode == INST_LES) info = LENGTH_OPERAND_BYTE;
+        else if (opcode == INST_MOV_REGMEM_SR || opcode == INST_MOV_SR_REGMEM) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & 0b11000100) == 0b00000000) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & 0b11110000) == 0b01010000) info = 0;
+        else if ((opcode & 0b11100110) == 0b00000110) info = 0;
+        else if ((opcode & 0b11110100) == 0b11100100) info = (((opcode >> 3) & 0b1) ? 0 : 1);
+        else if ((opcode & 0b11111100) == 0b10000100) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & MASK_INST_1BYTE_REG) == INST_XCHG_ACC_WITH_REG) info = 0;
+        else if ((opcode & MASK_INST_1BYTE_REG) == INST_INC_REG) info = 0;
+        else if ((opcode & MASK_INST_1BYTE_REG) == INST_DEC_REG) info = 0;
+        else if ((opcode & 0b11000100) == 0b00000100) info = (wide ? 2 : 1);
+        else if ((opcode & 0b11111100) == 0b10000000) info = LENGTH_OPERAND_BYTE | (((opcode >> 1) & 0b1) || !wide ? 1 : 2);
+        else if ((opcode & 0b11111100) == 0b11010000) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & 0b11111110) == 0b11000110) info = LENGTH_OPERAND_BYTE | (wide ? 2 : 1);
+        else if ((opcode & 0b11111100) == 0b10001000) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & 0b11111100) == 0b10100000) info = 2;
+        else if ((opcode & 0b11110111) == 0b11000010) info = 2;
+        else if ((opcode & 0b11110000) == 0b10110000) info = (((opcode >> 3) & 0b1) ? 2 : 1);
+        else if ((opcode & 0b11110000) == 0b01110000) info = 1;
+        else if ((opcode & 0b11111100) == 0b11100000) info = 1;
+        else if (opcode == 0b10001111) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & 0b11111110) == 0b11111110) info = LENGTH_OPERAND_BYTE;
+        else if ((opcode & 0b11111110) == 0b10101000) info = (wide ? 2 : 1);
+        else if ((opcode & 0b11111110) == 0b11110110) info = LENGTH_OPERAND_BYTE | LENGTH_IMMEDIATE_IF_REG0 | (wide ? 2 : 1);
+
+        opcodeLengths[opcode] = info;
+    }
+
+    for (u32 operand = 0; operand < 256; ++operand)
+    {
+        OperandByte fields = Inst_ParseOperand((u8)operand);
+        if (fields.mod == MEMORY_8BIT_MODE) displacementLengths[operand] = 1;
+        else if (fields.mod == MEMORY_16BIT_MODE) displacementLengths[operand] = 2;
+        else if (fields.mod == MEMORY_0BIT_MODE && fields.rm == MEM_DIRECT) displacementLengths[operand] = 2;
+        else displacementLengths[operand] = 0;
+    }
+
+    for (u32 pair = 0; pair < 65536; ++pair)
+    {
+        u8 opcode = (u8)(pair & 0xFF);
+        u8 operand = (u8)(pair >> 8);
+        u8 info = opcodeLengths[opcode];
+        if (info & LENGTH_PREFIX)
+        {
+            pairLengths[pair] = 0;
+            continue;
+        }
+
+        u32 immediate = (info & LENGTH_IMMEDIATE_MASK);
+        if ((info & LENGTH_IMMEDIATE_IF_REG0) && ((operand >> 3) & 0b111) != 0) immediate = 0;
+
+        u32 length = 1 + immediate;
+        if (info & LENGTH_OPERAND_BYTE) length += 1 + displacementLengths[operand];
+        pairLengths[pair] = (u8)length;
+    }
+}
+
+/// @brief Length of the instruction at every position of [start, end), 0 for prefixes
+void Lengths_MapBlock(u8* data, u32 size, u32 start, u32 end, u8* lengths)
+{
+    u32 position = start;
+
+#if defined(__AVX2__)
+    // NOTE: Each step reads bytes [position, position + 33).
+    for (; position + 32 <= end && position + 33 <= size; position += 32)
+    {
+        __m256i result[4];
+        for (u32 group = 0; group < 4; ++group)
+        {
+            u8* bytes = data + position + group * 8;
+            __m256i opcodes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)bytes));
+            __m256i operands = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(bytes + 1)));
+            __m256i pairs = _mm256_or_si256(opcodes, _mm256_slli_epi32(operands, 8));
+            result[group] = _mm256_and_si256(_mm256_i32gather_epi32((int*)pairLengths, pairs, 1), _mm256_set1_epi32(0xFF));
+        }
+
+        // Narrow to bytes. Packing works within 128-bit lanes, the permute puts the groups back in order.
+        __m256i words01 = _mm256_packus_epi32(result[0], result[1]);
+        __m256i words23 = _mm256_packus_epi32(result[2], result[3]);
+        __m256i bytes = _mm256_packus_epi16(words01, words23);
+        bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*)(lengths + position - start), bytes);
+    }
+#endif
+
+    for (; position < end; ++position)
+    {
+        // NOTE: The decoder reads zeroes past the end.
+        u8 operand = (position + 1 < size ? data[position + 1] : 0);
+        lengths[position - start] = pairLengths[data[position] | (operand << 8)];
+    }
+}
+
+struct InstructionBoundaries
+{
+    u64* bitmap; // Bit per byte of the image, set where an instruction starts
+    u32 size;    // Bytes in the image
+    u32 count;   // Instructions
+};
+
+/// @brief Packs byte marks (0 or 1) into bitmap words
+/// @param count multiple of 64
+void Lengths_PackMarks(u8* marks, u32 count, u64* bitmap)
+{
+    for (u32 index = 0; index < count; index += 64)
+    {
+#if defined(__AVX2__)
+        __m256i low = _mm256_loadu_si256((__m256i*)(marks + index));
+        __m256i high = _mm256_loadu_si256((__m256i*)(marks + index + 32));
+        u32 lowBits = (u32)_mm256_movemask_epi8(_mm256_slli_epi16(low, 7));
+        u32 highBits = (u32)_mm256_movemask_epi8(_mm256_slli_epi16(high, 7));
+        bitmap[index / 64] = ((u64)highBits << 32) | lowBits;
+#else
+        u64 word = 0;
+        for (u32 bit = 0; bit < 64; ++bit) word |= ((u64)marks[index + bit] << bit);
+        bitmap[index / 64] = word;
+#endif
+    }
+}
+
+/// @brief Finds where every instruction of an image starts, as DecodeImage() would decode it
+/// @param[out] boundaries free with Lengths_Free()
+void Lengths_FindBoundaries(ByteStream image, InstructionBoundaries* boundaries)
+{
+    std::call_once(lengthTablesBuilt, Lengths_BuildTables);
+
+    boundaries->size = image.size;
+    boundaries->count = 0;
+    boundaries->bitmap = (u64*)calloc(image.size / 64 + 1, sizeof(u64));
+
+    // Both indexed from the start of the block
+    u8* lengths = (u8*)malloc(LENGTHS_BLOCK_SIZE);
+    u8* marks = (u8*)malloc(LENGTHS_BLOCK_SIZE);
+
+    u32 position = 0;
+    u32 prefixCount = 0; // Prefixes before the byte at position
+
+    for (u32 blockStart = 0; blockStart < image.size; blockStart += LENGTHS_BLOCK_SIZE)
+    {
+        u32 blockEnd = (image.size - blockStart > LENGTHS_BLOCK_SIZE ? blockStart + LENGTHS_BLOCK_SIZE : image.size);
+        if (position >= blockEnd) continue;
+
+        u32 mapStart = (position > blockStart ? position : blockStart);
+        Lengths_MapBlock(image.data, image.size, mapStart, blockEnd, lengths + (mapStart - blockStart));
+        memset(marks, 0, LENGTHS_BLOCK_SIZE);
+
+        // NOTE: An instruction can end past the block, the walk then continues in a later block.
+        // Branchless, instruction lengths are too irregular to predict.
+        u32 count = boundaries->count;
+        while (position < blockEnd)
+        {
+            u8 start = (prefixCount == 0 ? 1 : 0);
+            marks[position - blockStart] = start;
+            count += start;
+
+            // NOTE: A prefix past PREFIX_MAX_COUNT is a one byte instruction of its own.
+            u8 length = lengths[position - blockStart];
+            bool prefix = (length == 0 && prefixCount < PREFIX_MAX_COUNT);
+            prefixCount = (prefix ? prefixCount + 1 : 0);
+            position += (length == 0 ? 1 : length);
+        }
+        boundaries->count = count;
+
+        // NOTE: Blocks start on a bitmap word, the marks past the end of the image are zero.
+        u32 markCount = ((blockEnd - blockStart) + 63) & ~63u;
+        Lengths_PackMarks(marks, markCount, boundaries->bitmap + blockStart / 64);
+    }
+
+    free(marks);
+    free(lengths);
+}
+
+void Lengths_Free(InstructionBoundaries* boundaries)
+{
+    free(boundaries->bitmap);
+    *boundaries = {};
+}
+
+inline bool Lengths_IsBoundary(InstructionBoundaries* boundaries, u32 offset)
+{
+    return (boundaries->bitmap[offset >> 6] >> (offset & 63)) & 1;
+}
+
+/// @brief Checks the boundaries against the full decoder
+/// @param[out] mismatch first offset where they disagree
+/// @return true if they agree
+bool Lengths_Verify(ByteStream image, InstructionBoundaries* boundaries, u32* mismatch)
+{
+    DecodedImage decoded;
+    DecodeImage(image, &decoded);
+
+    bool agree = (decoded.count == boundaries->count);
+    *mismatch = image.size;
+    u32 index = 0;
+    for (u32 offset = 0; offset < image.size; ++offset)
+    {
+        bool decodedStart = (index < decoded.count && decoded.instructions[index].offset == offset);
+        if (decodedStart) ++index;
+
+        if (decodedStart != Lengths_IsBoundary(boundaries, offset))
+        {
+            agree = false;
+            *mismatch = offset;
+            break;
+        }
+    }
+
+    FreeDecodedImage(&decoded);
+    return agree;
+}
@@ -0,0 +1,739 @@
+#include "common.cpp"
+
+// Lockstep execution of many CPU instances over the same decoded instruction stream.
+//
+// Register files are stored as structure of arrays: one array per register with one 16-bit entry per lane,
+// so an ALU operation on 16 lanes is a handful of AVX2 instructions. Every lane has its own instruction index.
+// Each step executes the lowest instruction index of all running lanes, masked to the lanes that are at that
+// index. Lanes that take a different branch simply wait until the others catch up, which reconverges them at
+// the next common instruction for structured code.
+//
+// Only register and immediate operands are supported. Lanes that reach an instruction with a memory operand or
+// an unsupported instruction stop with LANE_UNSUPPORTED.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define LANE_WIDTH 16
+#define LANE_PC_DONE 0xFFFFFFFF
+
+// Flag bits, in the same order as the CPU flag bit fields
+#define LANE_FLAG_CARRY     0x0001
+#define LANE_FLAG_PARITY    0x0002
+#define LANE_FLAG_AUX_CARRY 0x0004
+#define LANE_FLAG_ZERO      0x0008
+#define LANE_FLAG_SIGN      0x0010
+#define LANE_FLAG_OVERFLOW  0x0020
+
+enum LaneStatus
+{
+    LANE_RUNNING,
+    LANE_HALTED,      // HLT, or ran past the end of the image
+    LANE_UNSUPPORTED, // Reached an instruction that lockstep execution does not support
+    LANE_STEP_LIMIT,
+};
+
+static const char* laneStatusNames[] = {"running", "halted", "unsupported", "step limit"};
+
+// Vector helpers. Every lane is a 16-bit value, masks are 0xFFFF (true) or 0 (false) per lane.
+#if defined(__AVX2__)
+
+typedef __m256i LaneVector;
+
+inline LaneVector LV_Load(u16* source) { return _mm256_loadu_si256((__m256i*)source); }
+inline void LV_Store(u16* target, LaneVector value) { _mm256_storeu_si256((__m256i*)target, value); }
+inline LaneVector LV_Set(u16 value) { return _mm256_set1_epi16((short)value); }
+inline LaneVector LV_Add(LaneVector a, LaneVector b) { return _mm256_add_epi16(a, b); }
+inline LaneVector LV_Sub(LaneVector a, LaneVector b) { return _mm256_sub_epi16(a, b); }
+inline LaneVector LV_And(LaneVector a, LaneVector b) { return _mm256_and_si256(a, b); }
+inline LaneVector LV_Or(LaneVector a, LaneVector b) { return _mm256_or_si256(a, b); }
+inline LaneVector LV_Xor(LaneVector a, LaneVector b) { return _mm256_xor_si256(a, b); }
+inline LaneVector LV_AndNot(LaneVector a, LaneVector b) { return _mm256_andnot_si256(b, a); } // a & ~b
+inline LaneVector LV_ShiftLeft(LaneVector a, int count) { return _mm256_sll_epi16(a, _mm_cvtsi32_si128(count)); }
+inline LaneVector LV_ShiftRight(LaneVector a, int count) { return _mm256_srl_epi16(a, _mm_cvtsi32_si128(count)); }
+inline LaneVector LV_ShiftRightSigned(LaneVector a, int count) { return _mm256_sra_epi16(a, _mm_cvtsi32_si128(count)); }
+inline LaneVector LV_Equal(LaneVector a, LaneVector b) { return _mm256_cmpeq_epi16(a, b); }
+inline LaneVector LV_MaxUnsigned(LaneVector a, LaneVector b) { return _mm256_max_epu16(a, b); }
+inline LaneVector LV_MinUnsigned(LaneVector a, LaneVector b) { return _mm256_min_epu16(a, b); }
+inline LaneVector LV_Select(LaneVector mask, LaneVector a, LaneVector b) { return _mm256_blendv_epi8(b, a, mask); }
+inline bool LV_IsZero(LaneVector a) { return _mm256_testz_si256(a, a); }
+
+/// @brief Mask of the lanes whose instruction index equals pc
+inline LaneVector LV_LanesAt(u32* lanePc, u32 pc)
+{
+    __m256i target = _mm256_set1_epi32((int)pc);
+    __m256i low = _mm256_cmpeq_epi32(_mm256_loadu_si256((__m256i*)lanePc), target);
+    __m256i high = _mm256_cmpeq_epi32(_mm256_loadu_si256((__m256i*)(lanePc + 8)), target);
+
+    // NOTE: Packing works within 128-bit halves, the permute restores lane order.
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0b11011000);
+}
+
+/// @brief pc = mask ? (taken ? target : next) : pc, count += mask
+inline void LV_UpdatePc(u32* lanePc, u32* laneCount, LaneVector mask, LaneVector taken, u32 next, u32 target)
+{
+    __m256i nextVector = _mm256_set1_epi32((int)next);
+    __m256i targetVector = _mm256_set1_epi32((int)target);
+
+    for (int half = 0; half < 2; ++half)
+    {
+        __m256i mask32 = _mm256_cvtepi16_epi32(half ? _mm256_extracti128_si256(mask, 1) : _mm256_castsi256_si128(mask));
+        __m256i taken32 = _mm256_cvtepi16_epi32(half ? _mm256_extracti128_si256(taken, 1) : _mm256_castsi256_si128(taken));
+
+        __m256i* pcs = (__m256i*)(lanePc + half * 8);
+        __m256i* counts = (__m256i*)(laneCount + half * 8);
+
+        __m256i newPc = _mm256_blendv_epi8(nextVector, targetVector, taken32);
+        _mm256_storeu_si256(pcs, _mm256_blendv_epi8(_mm256_loadu_si256(pcs), newPc, mask32));
+        _mm256_storeu_si256(counts, _mm256_sub_epi32(_mm256_loadu_si256(counts), mask32));
+    }
+}
+
+inline u32 LV_MinPc(u32* lanePc, u32 laneCount)
+{
+    __m256i minimum = _mm256_set1_epi32(-1);
+    for (u32 lane = 0; lane < laneCount; lane += 8)
+        minimum = _mm256_min_epu32(minimum, _mm256_loadu_si256((__m256i*)(lanePc + lane)));
+
+    u32 values[8];
+    _mm256_storeu_si256((__m256i*)values, minimum);
+
+    u32 result = values[0];
+    for (int index = 1; index < 8; ++index) result = (values[index] < result ? values[index] : result);
+    return result;
+}
+
+#else
+
+// Portable fallback with the same semantics, one lane at a time
+struct LaneVector { u16 lane[LANE_WIDTH]; };
+
+#define LV_EACH(expression) LaneVector result; for (int i = 0; i < LANE_WIDTH; ++i) result.lane[i] = (u16)(expression); return result;
+
+inline LaneVector LV_Load(u16* source) { LaneVector result; memcpy(result.lane, source, sizeof(result.lane)); return result; }
+inline void LV_Store(u16* target, LaneVector value) { memcpy(target, value.lane, sizeof(value.lane)); }
+inline LaneVector LV_Set(u16 value) { LV_EACH(value) }
+inline LaneVector LV_Add(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] + b.lane[i]) }
+inline LaneVector LV_Sub(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] - b.lane[i]) }
+inline LaneVector LV_And(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] & b.lane[i]) }
+inline LaneVector LV_Or(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] | b.lane[i]) }
+inline LaneVector LV_Xor(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] ^ b.lane[i]) }
+inline LaneVector LV_AndNot(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] & ~b.lane[i]) }
+inline LaneVector LV_ShiftLeft(LaneVector a, int count) { LV_EACH(count > 15 ? 0 : a.lane[i] << count) }
+inline LaneVector LV_ShiftRight(LaneVector a, int count) { LV_EACH(count > 15 ? 0 : a.lane[i] >> count) }
+inline LaneVector LV_ShiftRightSigned(LaneVector a, int count) { LV_EACH((i16)a.lane[i] >> (count > 15 ? 15 : count)) }
+inline LaneVector LV_Equal(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] == b.lane[i] ? 0xFFFF : 0) }
+inline LaneVector LV_MaxUnsigned(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] > b.lane[i] ? a.lane[i] : b.lane[i]) }
+inline LaneVector LV_MinUnsigned(LaneVector a, LaneVector b) { LV_EACH(a.lane[i] < b.lane[i] ? a.lane[i] : b.lane[i]) }
+inline LaneVector LV_Select(LaneVector mask, LaneVector a, LaneVector b) { LV_EACH(mask.lane[i] ? a.lane[i] : b.lane[i]) }
+inline LaneVector LV_LanesAt(u32* lanePc, u32 pc) { LV_EACH(lanePc[i] == pc ? 0xFFFF : 0) }
+
+#undef LV_EACH
+
+inline bool LV_IsZero(LaneVector a)
+{
+    for (int i = 0; i < LANE_WIDTH; ++i) if (a.lane[i]) return false;
+    return true;
+}
+
+inline void LV_UpdatePc(u32* lanePc, u32* laneCount, LaneVector mask, LaneVector taken, u32 next, u32 target)
+{
+    for (int i = 0; i < LANE_WIDTH; ++i)
+    {
+        if (!mask.lane[i]) continue;
+        lanePc[i] = (taken.lane[i] ? target : next);
+        ++laneCount[i];
+    }
+}
+
+inline u32 LV_MinPc(u32* lanePc, u32 laneCount)
+{
+    u32 result = LANE_PC_DONE;
+    for (u32 lane = 0; lane < laneCount; ++lane) result = (lanePc[lane] < result ? lanePc[lane] : result);
+    return result;
+}
+
+#endif
+
+inline LaneVector LV_Zero() { return LV_Set(0); }
+inline LaneVector LV_Not(LaneVector a) { return LV_Xor(a, LV_Set(0xFFFF)); }
+inline LaneVector LV_NonZero(LaneVector a) { return LV_Not(LV_Equal(a, LV_Zero())); }
+inline LaneVector LV_LessUnsigned(LaneVector a, LaneVector b) { return LV_Not(LV_Equal(LV_MaxUnsigned(a, b), a)); }
+inline LaneVector LV_HasFlag(LaneVector flags, u16 flag) { return LV_NonZero(LV_And(flags, LV_Set(flag))); }
+
+inline LaneVector LV_ParityEven(LaneVector value)
+{
+    LaneVector bits = LV_And(value, LV_Set(0xFF));
+    bits = LV_Xor(bits, LV_ShiftRight(bits, 4));
+    bits = LV_Xor(bits, LV_ShiftRight(bits, 2));
+    bits = LV_Xor(bits, LV_ShiftRight(bits, 1));
+    return LV_Equal(LV_And(bits, LV_Set(1)), LV_Zero());
+}
+
+/// @brief Flags that depend only on the result: zero, sign and parity
+inline LaneVector LV_ResultFlags(LaneVector result, bool wide)
+{
+    LaneVector flags = LV_And(LV_Equal(result, LV_Zero()), LV_Set(LANE_FLAG_ZERO));
+    flags = LV_Or(flags, LV_And(LV_HasFlag(result, wide ? 0x8000 : 0x80), LV_Set(LANE_FLAG_SIGN)));
+    flags = LV_Or(flags, LV_And(LV_ParityEven(result), LV_Set(LANE_FLAG_PARITY)));
+    return flags;
+}
+
+struct LockstepMachine
+{
+    u32 laneCount; // Padded to a multiple of LANE_WIDTH
+    u32 activeLaneCount;
+
+    u16* registers; // [REGID_COUNT][laneCount], general registers then segment registers
+    u16* flags;
+    u32* pc;
+    u32* instructionCount;
+    u8* status;
+};
+
+inline u16* Lockstep_Register(LockstepMachine* machine, int id) { return machine->registers + (u64)id * machine->laneCount; }
+
+void Lockstep_Init(LockstepMachine* machine, u32 laneCount)
+{
+    *machine = {};
+    machine->activeLaneCount = laneCount;
+    machine->laneCount = (laneCount + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH;
+
+    u32 count = machine->laneCount;
+    machine->registers = (u16*)calloc((u64)REGID_COUNT * count, sizeof(u16));
+    machine->flags = (u16*)calloc(count, sizeof(u16));
+    machine->pc = (u32*)calloc(count, sizeof(u32));
+    machine->instructionCount = (u32*)calloc(count, sizeof(u32));
+    machine->status = (u8*)calloc(count, sizeof(u8));
+
+    // Padding lanes never run
+    for (u32 lane = laneCount; lane < count; ++lane)
+    {
+        machine->pc[lane] = LANE_PC_DONE;
+        machine->status[lane] = LANE_HALTED;
+    }
+}
+
+void Lockstep_Free(LockstepMachine* machine)
+{
+    free(machine->registers);
+    free(machine->flags);
+    free(machine->pc);
+    free(machine->instructionCount);
+    free(machine->status);
+    *machine = {};
+}
+
+enum LaneOperandKind
+{
+    LANE_OPERAND_IMMEDIATE,
+    LANE_OPERAND_WORD,      // 16-bit register
+    LANE_OPERAND_LOW_BYTE,  // AL, CL, DL, BL
+    LANE_OPERAND_HIGH_BYTE, // AH, CH, DH, BH
+};
+
+struct LaneOperand
+{
+    LaneOperandKind kind;
+    u16* values;
+    u16 immediate;
+};
+
+bool Lockstep_PrepareOperand(LockstepMachine* machine, Operand* operand, bool wide, LaneOperand* result)
+{
+    *result = {};
+    switch (operand->type)
+    {
+        case OP_IMMEDIATE:
+            result->kind = LANE_OPERAND_IMMEDIATE;
+            result->immediate = (wide ? operand->value : operand->valueLow);
+            return true;
+        case OP_REGISTER:
+            result->values = Lockstep_Register(machine, GetRegisterId(operand, wide));
+            result->kind = (wide ? LANE_OPERAND_WORD : (operand->regmemIndex >= 4 ? LANE_OPERAND_HIGH_BYTE : LANE_OPERAND_LOW_BYTE));
+            return true;
+        case OP_SEGMENT_REGISTER:
+            result->values = Lockstep_Register(machine, GetRegisterId(operand, true));
+            result->kind = LANE_OPERAND_WORD;
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline LaneVector Lockstep_Read(LaneOperand* operand, u32 lane)
+{
+    switch (operand->kind)
+    {
+        case LANE_OPERAND_IMMEDIATE: return LV_Set(operand->immediate);
+        case LANE_OPERAND_WORD: return LV_Load(operand->values + lane);
+        case LANE_OPERAND_LOW_BYTE: return LV_And(LV_Load(operand->values + lane), LV_Set(0xFF));
+        default: return LV_ShiftRight(LV_Load(operand->values + lane), 8);
+    }
+}
+
+inline void Lockstep_Write(LaneOperand* operand, u32 lane, LaneVector mask, LaneVector value)
+{
+    if (operand->kind == LANE_OPERAND_IMMEDIATE) return;
+
+    LaneVector old = LV_Load(operand->values + lane);
+    LaneVector merged;
+    switch (operand->kind)
+    {
+        case LANE_OPERAND_WORD: merged = value; break;
+        case LANE_OPERAND_LOW_BYTE: merged = LV_Or(LV_And(old, LV_Set(0xFF00)), LV_And(value, LV_Set(0xFF))); break;
+        default: merged = LV_Or(LV_And(old, LV_Set(0x00FF)), LV_ShiftLeft(value, 8)); break;
+    }
+    LV_Store(operand->values + lane, LV_Select(mask, merged, old));
+}
+
+/// @brief Addition or subtraction with carry/borrow in, computing all arithmetic flags
+LaneVector Lockstep_AddSub(bool subtract, LaneVector a, LaneVector b, LaneVector carryIn, bool wide, LaneVector* flags)
+{
+    LaneVector carryValue = LV_And(carryIn, LV_Set(1));
+    LaneVector result = (subtract ? LV_Sub(LV_Sub(a, b), carryValue) : LV_Add(LV_Add(a, b), carryValue));
+
+    LaneVector carry;
+    if (wide)
+    {
+        // NOTE: With a carry in, a result equal to the input means the operation wrapped around fully.
+        if (subtract)
+            carry = LV_Or(LV_LessUnsigned(a, b), LV_And(carryIn, LV_Equal(a, b)));
+        else
+            carry = LV_Or(LV_LessUnsigned(result, a), LV_And(carryIn, LV_Equal(result, a)));
+    }
+    else
+    {
+        // 8-bit operands are zero extended, so the carry or borrow ends up in bit 8
+        carry = LV_HasFlag(result, 0x100);
+        result = LV_And(result, LV_Set(0xFF));
+    }
+
+    u16 signBit = (wide ? 0x8000 : 0x80);
+    LaneVector overflow = (subtract ? LV_And(LV_Xor(a, b), LV_Xor(a, result)) : LV_And(LV_Xor(a, result), LV_Xor(b, result)));
+
+    *flags = LV_ResultFlags(result, wide);
+    *flags = LV_Or(*flags, LV_And(carry, LV_Set(LANE_FLAG_CARRY)));
+    *flags = LV_Or(*flags, LV_And(LV_HasFlag(overflow, signBit), LV_Set(LANE_FLAG_OVERFLOW)));
+    *flags = LV_Or(*flags, LV_And(LV_HasFlag(LV_Xor(LV_Xor(a, b), result), 0x10), LV_Set(LANE_FLAG_AUX_CARRY)));
+    return result;
+}
+
+/// @brief Shift by a per-lane count (already limited to 17). Lanes with a count of 0 must be masked out.
+LaneVector Lockstep_Shift(InstructionType type, LaneVector value, LaneVector count, bool wide, LaneVector* flags)
+{
+    u16 signBit = (wide ? 0x8000 : 0x80);
+    if (!wide && type == DIS_SAR)
+    {
+        // Sign extend 8-bit values so the arithmetic shift fills with the right bit
+        value = LV_Sub(LV_Xor(value, LV_Set(0x80)), LV_Set(0x80));
+    }
+    else if (!wide && type == DIS_SHL)
+    {
+        // Shift left within the upper byte so bits leave at bit 15 like 16-bit values
+        value = LV_ShiftLeft(value, 8);
+        signBit = 0x8000;
+    }
+
+    // Shift by count - 1 first, the next bit to leave is the carry
+    LaneVector shifted = value;
+    LaneVector remaining = LV_Sub(count, LV_Set(1));
+    for (int bit = 0; bit < 5; ++bit)
+    {
+        LaneVector select = LV_HasFlag(remaining, (u16)(1 << bit));
+        LaneVector step;
+        if (type == DIS_SHL) step = LV_ShiftLeft(shifted, 1 << bit);
+        else if (type == DIS_SHR) step = LV_ShiftRight(shifted, 1 << bit);
+        else step = LV_ShiftRightSigned(shifted, 1 << bit);
+        shifted = LV_Select(select, step, shifted);
+    }
+
+    LaneVector carry;
+    LaneVector result;
+    LaneVector overflow;
+    if (type == DIS_SHL)
+    {
+        carry = LV_HasFlag(shifted, 0x8000);
+        result = LV_ShiftLeft(shifted, 1);
+        overflow = LV_Xor(LV_HasFlag(result, 0x8000), carry);
+        if (!wide) result = LV_ShiftRight(result, 8);
+    }
+    else
+    {
+        carry = LV_HasFlag(shifted, 1);
+        result = (type == DIS_SHR ? LV_ShiftRight(shifted, 1) : LV_ShiftRightSigned(shifted, 1));
+        overflow = (type == DIS_SHR ? LV_HasFlag(value, signBit) : LV_Zero());
+    }
+    result = LV_And(result, LV_Set(wide ? 0xFFFF : 0x00FF));
+
+    *flags = LV_ResultFlags(result, wide);
+    *flags = LV_Or(*flags, LV_And(carry, LV_Set(LANE_FLAG_CARRY)));
+    *flags = LV_Or(*flags, LV_And(overflow, LV_Set(LANE_FLAG_OVERFLOW)));
+    return result;
+}
+
+/// @brief Mask of lanes where a conditional jump is taken
+LaneVector Lockstep_Condition(InstructionType type, LaneVector flags)
+{
+    LaneVector carry = LV_HasFlag(flags, LANE_FLAG_CARRY);
+    LaneVector zero = LV_HasFlag(flags, LANE_FLAG_ZERO);
+    LaneVector sign = LV_HasFlag(flags, LANE_FLAG_SIGN);
+    LaneVector overflow = LV_HasFlag(flags, LANE_FLAG_OVERFLOW);
+    LaneVector parity = LV_HasFlag(flags, LANE_FLAG_PARITY);
+    LaneVector less = LV_Xor(sign, overflow);
+
+    switch (type)
+    {
+        case DIS_JO:   return overflow;
+        case DIS_JNO:  return LV_Not(overflow);
+        case DIS_JB:   return carry;
+        case DIS_JNB:  return LV_Not(carry);
+        case DIS_JE:   return zero;
+        case DIS_JNE:  return LV_Not(zero);
+        case DIS_JBE:  return LV_Or(carry, zero);
+        case DIS_JNBE: return LV_Not(LV_Or(carry, zero));
+        case DIS_JS:   return sign;
+        case DIS_JNS:  return LV_Not(sign);
+        case DIS_JP:   return parity;
+        case DIS_JNP:  return LV_Not(parity);
+        case DIS_JL:   return less;
+        case DIS_JNL:  return LV_Not(less);
+        case DIS_JLE:  return LV_Or(less, zero);
+        case DIS_JNLE: return LV_Not(LV_Or(less, zero));
+        default:       return LV_Zero();
+    }
+}
+
+bool Lockstep_IsSupported(Instruction* instruction)
+{
+    switch (instruction->type)
+    {
+        case DIS_MOV: case DIS_XCHG:
+        case DIS_ADD: case DIS_ADC: case DIS_SUB: case DIS_SBB: case DIS_CMP:
+        case DIS_AND: case DIS_OR: case DIS_XOR: case DIS_TEST:
+        case DIS_INC: case DIS_DEC: case DIS_NEG: case DIS_NOT:
+        case DIS_SHL: case DIS_SHR: case DIS_SAR:
+        case DIS_CLC: case DIS_STC: case DIS_CMC: case DIS_HLT:
+        case DIS_LOOP: case DIS_LOOPZ: case DIS_LOOPNZ: case DIS_JCXZ:
+        break;
+        default:
+            if (!IsConditionalJump(instruction->type)) return false;
+        break;
+    }
+
+    Operand* operands[] = {&instruction->opDest, &instruction->opSrc};
+    for (int index = 0; index < instruction->operandCount; ++index)
+    {
+        if (operands[index]->type == OP_MEMORY) return false;
+    }
+    return true;
+}
+
+/// @brief Executes one instruction for every lane whose instruction index is pc
+void Lockstep_Execute(LockstepMachine* machine, Instruction* instruction, u32 pc, u32 target)
+{
+    if (!Lockstep_IsSupported(instruction))
+    {
+        for (u32 lane = 0; lane < machine->laneCount; ++lane)
+        {
+            if (machine->pc[lane] != pc) continue;
+            machine->status[lane] = LANE_UNSUPPORTED;
+            machine->pc[lane] = LANE_PC_DONE;
+        }
+        return;
+    }
+
+    InstructionType type = instruction->type;
+    bool wide = instruction->isWide;
+
+    LaneOperand dest {};
+    LaneOperand src {};
+    if (instruction->operandCount >= 1) Lockstep_PrepareOperand(machine, &instruction->opDest, GetOperandWidth(instruction, 0), &dest);
+    if (instruction->operandCount >= 2) Lockstep_PrepareOperand(machine, &instruction->opSrc, GetOperandWidth(instruction, 1), &src);
+
+    u16* cx = Lockstep_Register(machine, REGID_CX);
+    u32 next = (type == DIS_HLT ? LANE_PC_DONE : pc + 1);
+
+    for (u32 lane = 0; lane < machine->laneCount; lane += LANE_WIDTH)
+    {
+        LaneVector mask = LV_LanesAt(machine->pc + lane, pc);
+        if (LV_IsZero(mask)) continue;
+
+        LaneVector oldFlags = LV_Load(machine->flags + lane);
+        LaneVector newFlags = oldFlags;
+        LaneVector taken = LV_Zero();
+
+        // Flags written by the operation, everything else keeps its value
+        u16 affected = 0;
+        LaneVector flags;
+
+        switch (type)
+        {
+            case DIS_MOV:
+                Lockstep_Write(&dest, lane, mask, Lockstep_Read(&src, lane));
+            break;
+
+            case DIS_XCHG:
+            {
+                LaneVector destValue = Lockstep_Read(&dest, lane);
+                LaneVector srcValue = Lockstep_Read(&src, lane);
+                Lockstep_Write(&dest, lane, mask, srcValue);
+                Lockstep_Write(&src, lane, mask, destValue);
+            }
+            break;
+
+            case DIS_ADD: case DIS_ADC: case DIS_SUB: case DIS_SBB: case DIS_CMP:
+            {
+                bool subtract = (type == DIS_SUB || type == DIS_SBB || type == DIS_CMP);
+                bool useCarry = (type == DIS_ADC || type == DIS_SBB);
+                LaneVector carryIn = (useCarry ? LV_HasFlag(oldFlags, LANE_FLAG_CARRY) : LV_Zero());
+
+                LaneVector result = Lockstep_AddSub(subtract, Lockstep_Read(&dest, lane), Lockstep_Read(&src, lane), carryIn, wide, &flags);
+                if (type != DIS_CMP) Lockstep_Write(&dest, lane, mask, result);
+
+                affected = LANE_FLAG_CARRY | LANE_FLAG_PARITY | LANE_FLAG_AUX_CARRY | LANE_FLAG_ZERO | LANE_FLAG_SIGN | LANE_FLAG_OVERFLOW;
+            }
+            break;
+
+            case DIS_INC: case DIS_DEC: case DIS_NEG:
+            {
+                LaneVector value = Lockstep_Read(&dest, lane);
+                LaneVector result;
+                if (type == DIS_NEG)
+                {
+                    result = Lockstep_AddSub(true, LV_Zero(), value, LV_Zero(), wide, &flags);
+                    affected = LANE_FLAG_CARRY | LANE_FLAG_PARITY | LANE_FLAG_AUX_CARRY | LANE_FLAG_ZERO | LANE_FLAG_SIGN | LANE_FLAG_OVERFLOW;
+                }
+                else
+                {
+                    // NOTE: INC and DEC leave the carry flag unchanged.
+                    result = Lockstep_AddSub(type == DIS_DEC, value, LV_Set(1), LV_Zero(), wide, &flags);
+                    affected = LANE_FLAG_PARITY | LANE_FLAG_AUX_CARRY | LANE_FLAG_ZERO | LANE_FLAG_SIGN | LANE_FLAG_OVERFLOW;
+                }
+                Lockstep_Write(&dest, lane, mask, result);
+            }
+            break;
+
+            case DIS_AND: case DIS_OR: case DIS_XOR: case DIS_TEST:
+            {
+                LaneVector a = Lockstep_Read(&dest, lane);
+                LaneVector b = Lockstep_Read(&src, lane);
+                LaneVector result = (type == DIS_OR ? LV_Or(a, b) : (type == DIS_XOR ? LV_Xor(a, b) : LV_And(a, b)));
+                if (type != DIS_TEST) Lockstep_Write(&dest, lane, mask, result);
+
+                // Carry and overflow are cleared, auxiliary carry is undefined and cleared as well
+                flags = LV_ResultFlags(result, wide);
+                affected = LANE_FLAG_CARRY | LANE_FLAG_PARITY | LANE_FLAG_AUX_CARRY | LANE_FLAG_ZERO | LANE_FLAG_SIGN | LANE_FLAG_OVERFLOW;
+            }
+            break;
+
+            case DIS_NOT:
+                Lockstep_Write(&dest, lane, mask, LV_Not(Lockstep_Read(&dest, lane)));
+            break;
+
+            case DIS_SHL: case DIS_SHR: case DIS_SAR:
+            {
+                LaneVector count = LV_MinUnsigned(Lockstep_Read(&src, lane), LV_Set(17));
+
+                // NOTE: A shift by 0 changes nothing, not even the flags.
+                LaneVector shiftMask = LV_AndNot(mask, LV_Equal(count, LV_Zero()));
+                LaneVector result = Lockstep_Shift(type, Lockstep_Read(&dest, lane), count, wide, &flags);
+                Lockstep_Write(&dest, lane, shiftMask, result);
+
+                affected = LANE_FLAG_CARRY | LANE_FLAG_PARITY | LANE_FLAG_ZERO | LANE_FLAG_SIGN | LANE_FLAG_OVERFLOW;
+                flags = LV_Select(shiftMask, flags, oldFlags);
+            }
+            break;
+
+            case DIS_CLC: newFlags = LV_AndNot(oldFlags, LV_Set(LANE_FLAG_CARRY)); break;
+            case DIS_STC: newFlags = LV_Or(oldFlags, LV_Set(LANE_FLAG_CARRY)); break;
+            case DIS_CMC: newFlags = LV_Xor(oldFlags, LV_Set(LANE_FLAG_CARRY)); break;
+
+            case DIS_LOOP: case DIS_LOOPZ: case DIS_LOOPNZ:
+            {
+                LaneVector count = LV_Sub(LV_Load(cx + lane), LV_Set(1));
+                LV_Store(cx + lane, LV_Select(mask, count, LV_Load(cx + lane)));
+
+                taken = LV_NonZero(count);
+                if (type == DIS_LOOPZ) taken = LV_And(taken, LV_HasFlag(oldFlags, LANE_FLAG_ZERO));
+                if (type == DIS_LOOPNZ) taken = LV_AndNot(taken, LV_HasFlag(oldFlags, LANE_FLAG_ZERO));
+            }
+            break;
+            case DIS_JCXZ:
+                taken = LV_Equal(LV_Load(cx + lane), LV_Zero());
+            break;
+
+            case DIS_HLT:
+            break;
+
+            default:
+                taken = Lockstep_Condition(type, oldFlags);
+            break;
+        }
+
+        if (affected)
+        {
+            newFlags = LV_Or(LV_AndNot(oldFlags, LV_Set(affected)), LV_And(flags, LV_Set(affected)));
+        }
+        LV_Store(machine->flags + lane, LV_Select(mask, newFlags, oldFlags));
+
+        LV_UpdatePc(machine->pc + lane, machine->instructionCount + lane, mask, taken, next, target);
+    }
+}
+
+struct LockstepStats
+{
+    u64 steps;
+    u64 instructions;
+};
+
+/// @brief Runs all lanes until they stop or the step limit is reached
+/// @param decoded shared instruction stream
+/// @param machine lanes with their initial state
+/// @param maxSteps maximum number of lockstep steps (one instruction for a group of lanes each)
+LockstepStats Lockstep_Run(DecodedImage* decoded, LockstepMachine* machine, u64 maxSteps)
+{
+    LockstepStats stats {0};
+
+    // Branch targets as instruction indices. Branches out of the image halt the lane.
+    u32* targets = (u32*)malloc((decoded->count + 1) * sizeof(u32));
+    for (u32 index = 0; index < decoded->count; ++index)
+    {
+        u32 targetOffset;
+        targets[index] = LANE_PC_DONE;
+        if (GetBranchTarget(&decoded->instructions[index], &targetOffset))
+        {
+            i64 targetIndex = FindInstruction(decoded, targetOffset);
+            if (targetIndex >= 0) targets[index] = (u32)targetIndex;
+        }
+    }
+
+    while (stats.steps < maxSteps)
+    {
+        u32 pc = LV_MinPc(machine->pc, machine->laneCount);
+        if (pc == LANE_PC_DONE) break;
+
+        if (pc >= decoded->count)
+        {
+            for (u32 lane = 0; lane < machine->laneCount; ++lane)
+            {
+                if (machine->pc[lane] == pc) machine->pc[lane] = LANE_PC_DONE;
+            }
+            continue;
+        }
+
+        Lockstep_Execute(machine, &decoded->instructions[pc], pc, targets[pc]);
+        ++stats.steps;
+    }
+
+    for (u32 lane = 0; lane < machine->activeLaneCount; ++lane)
+    {
+        stats.instructions += machine->instructionCount[lane];
+        if (machine->status[lane] != LANE_RUNNING) continue;
+
+        machine->status[lane] = (machine->pc[lane] == LANE_PC_DONE ? LANE_HALTED : LANE_STEP_LIMIT);
+    }
+
+    free(targets);
+    return stats;
+}
+
+/// @brief Lane flags from the 8086 FLAGS register layout, as used by state files
+inline u16 Lockstep_FlagsFromWord(u16 word)
+{
+    u16 flags = 0;
+    if (word & 0x0001) flags |= LANE_FLAG_CARRY;
+    if (word & 0x0004) flags |= LANE_FLAG_PARITY;
+    if (word & 0x0010) flags |= LANE_FLAG_AUX_CARRY;
+    if (word & 0x0040) flags |= LANE_FLAG_ZERO;
+    if (word & 0x0080) flags |= LANE_FLAG_SIGN;
+    if (word & 0x0800) flags |= LANE_FLAG_OVERFLOW;
+    return flags;
+}
+
+/// @brief Reads initial lane states. Each line is one lane: "ax=1 cx=0x10 ds=0x2000 flags=0x0040".
+/// Registers that are not listed start at 0, empty lines and lines starting with ';' are skipped.
+/// @return number of lanes, 0 if the file could not be read or has a line that is not a lane state
+u32 Lockstep_LoadStates(char* fileName, LockstepMachine* machine)
+{
+    ByteStream file;
+    if (!LoadFile(fileName, &file)) return 0;
+
+    // Count lanes first so the register file is allocated once
+    u32 laneCount = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        u32 lane = 0;
+        u32 lineNumber = 0;
+        char line[1024];
+        u32 position = 0;
+
+        while (position < file.size)
+        {
+            u32 length = 0;
+            while (position < file.size && file.data[position] != '\n')
+            {
+                if (length < sizeof(line) - 1) line[length++] = (char)file.data[position];
+                ++position;
+            }
+            ++position;
+            ++lineNumber;
+
+            // NOTE: CRLF files leave a '\r' at the end of every line, blank lines would otherwise count as lanes.
+            if (length > 0 && line[length - 1] == '\r') --length;
+            line[length] = 0;
+
+            char* text = TrimWhitespace(line);
+            if (text[0] == 0 || text[0] == ';') continue;
+
+            if (pass == 1)
+            {
+                char* token = strtok(text, " \t,");
+                while (token)
+                {
+                    char* value = strchr(token, '=');
+                    if (value) *value++ = 0;
+
+                    int id = 0;
+                    while (id < REGID_COUNT && strcmp(token, registerIdNames[id]) != 0) ++id;
+
+                    if (!value || (id == REGID_COUNT && strcmp(token, "flags") != 0))
+                    {
+                        printf("%s:%u: Unknown register: %s\n", fileName, lineNumber, token);
+                        Lockstep_Free(machine);
+                        free(file.data);
+                        return 0;
+                    }
+
+                    u16 number = (u16)strtol(value, nullptr, 0);
+                    if (id == REGID_COUNT) machine->flags[lane] = Lockstep_FlagsFromWord(number);
+                    else Lockstep_Register(machine, id)[lane] = number;
+
+                    token = strtok(nullptr, " \t,");
+                }
+            }
+            ++lane;
+        }
+
+        if (pass == 0)
+        {
+            laneCount = lane;
+            if (laneCount == 0) break;
+            Lockstep_Init(machine, laneCount);
+        }
+    }
+
+    free(file.data);
+    return laneCount;
+}
+
+/// @brief Copies a lane into a CPU struct, e.g. for printing
+CPU Lockstep_GetLane(LockstepMachine* machine, u32 lane)
+{
+    CPU cpu {0};
+    for (int index = 0; index < 8; ++index) cpu.reg16[index] = Lockstep_Register(machine, index)[lane];
+    for (int index = 0; index < 4; ++index) cpu.regseg[index] = Lockstep_Register(machine, REGID_ES + index)[lane];
+    cpu.flags = machine->flags[lane];
+    return cpu;
+}
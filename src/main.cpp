@@ -1,1111 +1,1084 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #include "common.cpp"
+#include "arena.cpp"
 #include "disassembly.cpp"
+#include "decoder.cpp"
+#include "printing.cpp"
+#include "export.cpp"
+#include "access.cpp"
+#include "xref.cpp"
+#include "blocks.cpp"
+#include "dataflow.cpp"
+#include "clocks.cpp"
+#include "search.cpp"
+#include "diff.cpp"
+#include "stats.cpp"
+#include "lengths.cpp"
+#include "pipeline.cpp"
+#include "regions.cpp"
+#include "coverage.cpp"
+#include "syntax.cpp"
+#include "memory.cpp"
 
 #include "simulation.cpp"
+#include "emulator.cpp"
+#include "fusion.cpp"
+#include "scheduler.cpp"
+#include "snapshot.cpp"
+#include "reverse.cpp"
+#include "lockstep.cpp"
+#include "server.cpp"
 
-static char* const registers8bit[] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
-static char* const registers16bit[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
-static char* const registersSegment[] = {"es", "cs", "ss", "ds"};
-static char* const effectiveAddressTable[] = { "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx" };
+#define global_variable static
 
-inline u8 Load8BitValue(FILE* file)
-{
-    return (u8)fgetc(file);
-}
+#define MAX_REPEATED_OPTION 16 // Times -t, -q and -s can be given
 
-inline u16 Load16BitValue(FILE* file)
+void PrintDataflowAnnotation(RegisterState* before, RegisterState* after, Instruction* instruction)
 {
-    u16 value = 0;
-    *((u8 *)(&value) + 0) = (u8)fgetc(file);
-    *((u8 *)(&value) + 1) = (u8)fgetc(file);
-    return value;
+    static const char* lowNames[] = {"al", "cl", "dl", "bl"};
+    static const char* highNames[] = {"ah", "ch", "dh", "bh"};
+
+    InstructionAccess access = GetInstructionAccess(instruction);
+    char* separator = " ; ";
+
+    for (int id = 0; id < REGID_COUNT; ++id)
+    {
+        if (!(access.writes & REGSET(id))) continue;
+
+        KnownValue value = after->registers[id];
+        if (IsKnown(value, true))
+        {
+            printf("%s%s = 0x%04x", separator, registerIdNames[id], value.value);
+        }
+        else if (id < 4 && (value.known & 0x00FF) == 0x00FF)
+        {
+            printf("%s%s = 0x%02x", separator, lowNames[id], value.value & 0xFF);
+        }
+        else if (id < 4 && (value.known & 0xFF00) == 0xFF00)
+        {
+            printf("%s%s = 0x%02x", separator, highNames[id], value.value >> 8);
+        }
+        else continue;
+
+        separator = ", ";
+    }
+
+    // Direct addresses are already printed as constants
+    Operand* operands[] = {&instruction->opDest, &instruction->opSrc};
+    for (int operandIndex = 0; operandIndex < instruction->operandCount; ++operandIndex)
+    {
+        u16 address;
+        Operand* operand = operands[operandIndex];
+        if (operand->type == OP_MEMORY && !IsDirectAddress(operand) && Dataflow_EffectiveAddress(before, operand, &address))
+        {
+            printf("%sea = 0x%04x", separator, address);
+            separator = ", ";
+        }
+    }
 }
 
-/// @brief Loads memory 
-/// @param file handle to assembled file
-/// @param[out] operand output location for operand data
-void LoadMemoryOperand(FILE* file, Operand* operand, OperandByte operandByte)
+/// @brief Prints the listing annotated with the results of constant propagation
+void PrintDataflowListing(char* fileName, ByteStream image)
 {
-    // TODO: This function changes the operand type for registers.
-    // Maybe it should do the same with memory operands.
+    DecodedImage decoded;
+    DecodeImage(image, &decoded);
 
-    operand->type = OP_MEMORY;
-    operand->modField = operandByte.mod;
-    operand->regmemIndex = operandByte.rm;
+    ControlFlowGraph graph;
+    BuildControlFlowGraph(&decoded, &graph);
 
-    switch (operand->modField)
+    DataflowResult dataflow;
+    Dataflow_Run(&decoded, &graph, &dataflow);
+
+    printf("; Disassembly: %s\n", fileName);
+    printf("; Dataflow: %u instructions, %u blocks, %u block evaluations\n", decoded.count, graph.blockCount, dataflow.blockEvaluations);
+    printf("bits 16\n");
+
+    for (u32 blockIndex = 0; blockIndex < graph.blockCount; ++blockIndex)
     {
-        case REGISTER_MODE:
-            operand->type = OP_REGISTER;
-        break;
-        case MEMORY_8BIT_MODE:
-            operand->valueLow = (i8)Load8BitValue(file);
-        break;
-        case MEMORY_0BIT_MODE:
-            if (operand->regmemIndex != MEM_DIRECT) break;
-        // fallthrough
-        case MEMORY_16BIT_MODE:
-                operand->value = (i16)Load16BitValue(file);
-        break;
+        BasicBlock* block = &graph.blocks[blockIndex];
+        DataflowBlock* blockState = &dataflow.blocks[blockIndex];
+
+        RegisterState state = blockState->in;
+        for (u32 index = block->first; index < block->first + block->count; ++index)
+        {
+            Instruction* instruction = &decoded.instructions[index];
+            if (instruction->type == DIS_NOOP) printf("; %x", image.data[instruction->offset + instruction->prefixLength]);
+
+            PrintInstruction(instruction);
+
+            RegisterState before = state;
+            Dataflow_Step(&state, instruction);
+
+            // NOTE: Blocks that are only reachable from unreachable code have no state.
+            if (blockState->reached) PrintDataflowAnnotation(&before, &state, instruction);
+            printf("\n");
+        }
     }
+
+    Dataflow_Free(&dataflow);
+    FreeControlFlowGraph(&graph);
+    FreeDecodedImage(&decoded);
 }
 
-/// @brief Loads immediate operand value
-/// @param file handle to assembled file
-/// @param[out] operand operand to load value into
-/// @param wideOperation if true, 2 bytes are loaded. Otherwise - 1 byte.
-/// @param signExtend if true, loads 1 byte and sign extends it to 2 bytes
-void LoadImmediateOperand(FILE* file, Operand* operand, bool wideOperation, bool signExtend)
+/// @brief Prints the listing with static clock estimates per instruction and per block, followed by a report
+/// of the most expensive blocks and loops
+void PrintClocksListing(char* fileName, ByteStream image)
 {
-    operand->type = OP_IMMEDIATE;
+    DecodedImage decoded;
+    DecodeImage(image, &decoded);
+
+    ControlFlowGraph graph;
+    BuildControlFlowGraph(&decoded, &graph);
 
-    if (signExtend)
+    BlockClocks* blockClocks = (BlockClocks*)malloc((graph.blockCount + 1) * sizeof(BlockClocks));
+    EstimateBlockClocks(&decoded, &graph, blockClocks);
+
+    printf("; Disassembly: %s\n", fileName);
+    printf("bits 16\n");
+
+    for (u32 blockIndex = 0; blockIndex < graph.blockCount; ++blockIndex)
     {
-        operand->valueLow = (i8)Load8BitValue(file);
-        if ((operand->valueLow >> 7) & 0b1)
+        BasicBlock* block = &graph.blocks[blockIndex];
+        BlockClocks* clocks = &blockClocks[blockIndex];
+        Instruction* last = &decoded.instructions[block->first + block->count - 1];
+
+        printf("\n; block %u (0x%04x): %u instructions, %u clocks", blockIndex,
+            decoded.instructions[block->first].offset, block->count, clocks->clocks);
+        if (clocks->takenClocks != clocks->clocks) printf(", %u if %s is taken", clocks->takenClocks, operationNames[last->type]);
+        printf("\n");
+
+        for (u32 index = block->first; index < block->first + block->count; ++index)
         {
-            operand->valueHigh = 127i8;
+            Instruction* instruction = &decoded.instructions[index];
+            if (instruction->type == DIS_NOOP) printf("; %x", image.data[instruction->offset + instruction->prefixLength]);
+
+            PrintInstruction(instruction);
+
+            ClockEstimate estimate = EstimateClocks(instruction);
+            if (estimate.takenClocks != estimate.clocks)
+                printf(" ; %u/%u clocks", estimate.clocks, estimate.takenClocks);
+            else
+                printf(" ; %u clocks", estimate.clocks);
+
+            printf("\n");
         }
     }
-    else if (wideOperation)
+
+    // Loops are found from back edges. The body is the range of blocks from the target to the branch, and its cost
+    // is the straight-line path through it with the back edge taken.
+    printf("\n; Loops:\n");
+    u32 loopCount = 0;
+    for (u32 blockIndex = 0; blockIndex < graph.blockCount; ++blockIndex)
     {
-        operand->value = (i16)Load16BitValue(file);
+        BasicBlock* block = &graph.blocks[blockIndex];
+        for (u32 successorIndex = 0; successorIndex < block->successorCount; ++successorIndex)
+        {
+            u32 head = block->successors[successorIndex];
+            if (head > blockIndex) continue;
+
+            u32 iterationClocks = blockClocks[blockIndex].takenClocks;
+            for (u32 bodyIndex = head; bodyIndex < blockIndex; ++bodyIndex) iterationClocks += blockClocks[bodyIndex].clocks;
+
+            printf(";   blocks %u-%u (0x%04x-0x%04x): %u clocks per iteration\n", head, blockIndex,
+                decoded.instructions[graph.blocks[head].first].offset, decoded.instructions[block->first + block->count - 1].offset,
+                iterationClocks);
+            ++loopCount;
+        }
     }
-    else
+    if (loopCount == 0) printf(";   none\n");
+
+    qsort(blockClocks, graph.blockCount, sizeof(BlockClocks), CompareBlockClocks);
+
+    u32 reportCount = (graph.blockCount < 10 ? graph.blockCount : 10);
+    printf("\n; Most expensive blocks:\n");
+    for (u32 rank = 0; rank < reportCount; ++rank)
     {
-        operand->valueLow = (i8)Load8BitValue(file);
+        BlockClocks* clocks = &blockClocks[rank];
+        BasicBlock* block = &graph.blocks[clocks->block];
+        printf(";   block %u (0x%04x): %u clocks, %u instructions\n", clocks->block,
+            decoded.instructions[block->first].offset, clocks->takenClocks, block->count);
     }
-}
 
-#define global_variable static
+    free(blockClocks);
+    FreeControlFlowGraph(&graph);
+    FreeDecodedImage(&decoded);
+}
 
-void PrintAddressOperand(char* effectiveAddress, i8 displacement)
+/// @brief Prints the registers, flags and memory an executed instruction changed, and where it jumped
+void PrintExecutionAnnotation(CPU* before, Machine* machine, Instruction* instruction, MemoryWriteLog* writes)
 {
-    if (displacement == 0)
+    static const char* lowNames[] = {"al", "cl", "dl", "bl"};
+    static const char* highNames[] = {"ah", "ch", "dh", "bh"};
+
+    CPU* after = &machine->cpu;
+    char* separator = "; ";
+
+    for (int index = 0; index < 8; ++index)
     {
-        printf("[%s]", effectiveAddress);
+        u16 changed = before->reg16[index] ^ after->reg16[index];
+        if (!changed) continue;
+
+        // NOTE: Byte instructions name the half of their register operand they wrote, e.g. not cl for REP STOSB.
+        u16 value = after->reg16[index];
+        bool byteRegister = (!instruction->isWide && instruction->opDest.type == OP_REGISTER && index < 4);
+        if (byteRegister && !(changed & 0xFF00))
+        {
+            printf("%s%s := %d (0x%x)", separator, lowNames[index], value & 0xFF, value & 0xFF);
+        }
+        else if (byteRegister && !(changed & 0x00FF))
+        {
+            printf("%s%s := %d (0x%x)", separator, highNames[index], value >> 8, value >> 8);
+        }
+        else
+        {
+            printf("%s%s := %d (0x%x)", separator, registers16bit[index], value, value);
+        }
+        separator = " | ";
     }
-    else
+
+    for (int index = 0; index < 4; ++index)
     {
-        printf("[%s %s %d]", effectiveAddress, 
-            (displacement >= 0 ? "+" : "-"), 
-            (displacement < 0 ? -displacement : displacement));
+        if (before->regseg[index] == after->regseg[index]) continue;
+        printf("%s%s := %d (0x%x)", separator, registersSegment[index], after->regseg[index], after->regseg[index]);
+        separator = " | ";
     }
-}
 
-void PrintAddressOperand(char* effectiveAddress, i16 displacement)
-{
-    if (displacement == 0)
+    // NOTE: Single byte and word writes are shown as values, longer ones (string instructions) as a range.
+    bool word = (writes->count == 2 && writes->addresses[1] == ((writes->addresses[0] + 1) & MEMORY_ADDRESS_MASK));
+    if (writes->count == 1 || word)
     {
-        printf("[%s]", effectiveAddress);
+        u16 value = Memory_Read8(&machine->memory, writes->addresses[0]);
+        if (word) value |= (u16)(Memory_Read8(&machine->memory, writes->addresses[1]) << 8);
+        printf("%s[0x%05x] := %d (0x%x)", separator, writes->addresses[0], value, value);
+        separator = " | ";
     }
-    else
+    else if (writes->count > 0)
     {
-        printf("[%s %s %d]", effectiveAddress, 
-            (displacement >= 0 ? "+" : "-"), 
-            (displacement < 0 ? -displacement : displacement));
+        printf("%s%u bytes written from 0x%05x", separator, writes->count, writes->addresses[0]);
+        separator = " | ";
+    }
+
+    if (machine->ip != (u16)(instruction->offset + instruction->length))
+    {
+        printf("%sip := 0x%04x", separator, machine->ip);
+        separator = " | ";
+    }
+
+    if (before->flags != after->flags)
+    {
+        printf("%sFlags: ", separator); PrintFlags(*before);
+        printf("->"); PrintFlags(*after);
     }
 }
 
-void PrintOperand(Operand operand, bool wideOperation)
+/// @brief Prints the listing and executes each instruction in listing order on a Machine, annotated with what it
+/// changed. Branches are executed but the listing does not follow them, see RunProgram() for that.
+void PrintExecutionListing(char* fileName, ByteStream image)
 {
-    switch (operand.type)
+    MemoryImage memoryImage;
+    MemoryImage_Init(&memoryImage);
+    MemoryImage_Load(&memoryImage, 0, image.data, image.size);
+
+    Machine machine;
+    Machine_Init(&machine, &memoryImage, image.size);
+
+    MemoryWriteLog writes = {};
+    machine.memory.writeLog = &writes;
+
+    printf("; Disassembly: %s\n", fileName);
+    printf("bits 16\n");
+
+    while (image.position < image.size)
     {
-        case OP_REGISTER:
-        {
-            // NOTE: Size of registers is implicitly known, so size specification is not needed
-            char* const* registerNames = (wideOperation? registers16bit : registers8bit);
-            printf("%s", registerNames[operand.regmemIndex]);
-        }
-        break;
-        case OP_SEGMENT_REGISTER:
-        {
-            printf("%s", registersSegment[operand.regmemIndex]);
-        }
-        break;
-        case OP_IMMEDIATE:
-        {
-            if (operand.outputWidth)
-            {
-                printf(wideOperation? "word " : "byte ");
-            }
-            printf("%d", (wideOperation? (i16)operand.value : (i8)operand.valueLow));
-        }
-        break;
-        case OP_MEMORY:
+        Instruction instruction;
+        bool recognized = DecodeInstruction(&image, &instruction);
+        if (!recognized) printf("; %x", image.data[instruction.offset + instruction.prefixLength]);
+
+        PrintInstruction(&instruction);
+
+        if (recognized)
         {
-            if (operand.outputWidth)
-            {
-                printf(wideOperation? "word " : "byte ");
-            }
-            if (operand.modField == MEMORY_0BIT_MODE)
-            {
-                if (operand.regmemIndex == MEM_DIRECT)
-                {
-                    printf("[%d]", (i16)operand.value);
-                }
-                else
-                {
-                    printf("[%s]", effectiveAddressTable[operand.regmemIndex]);
-                }
-            }
-            else if (operand.modField == MEMORY_8BIT_MODE)
-            {
-                PrintAddressOperand(effectiveAddressTable[operand.regmemIndex], (i8)operand.valueLow);
-            }
-            else if (operand.modField == MEMORY_16BIT_MODE)
-            {
-                PrintAddressOperand(effectiveAddressTable[operand.regmemIndex], (i16)operand.value);
-            }
-            else
+            CPU before = machine.cpu;
+            writes.count = 0;
+
+            machine.ip = (u16)(instruction.offset + instruction.length);
+            bool executed = Emulator_Execute(&machine, &instruction);
+
+            PrintExecutionAnnotation(&before, &machine, &instruction, &writes);
+
+            // NOTE: The listing goes on after HLT and instructions that are not emulated.
+            if (!executed || machine.status != MACHINE_RUNNING)
             {
-                printf("; error: memory operand in register mode\n");
+                printf(" ; %s", machineStatusNames[machine.status]);
+                machine.status = MACHINE_RUNNING;
             }
         }
-        break;
+
+        printf("\n");
     }
+
+    CPU* cpu = &machine.cpu;
+    printf("\n");
+    printf("; Final state:\n");
+    printf("; AX: 0x%x (%d)\n", cpu->ax, cpu->ax);
+    printf("; BX: 0x%x (%d)\n", cpu->bx, cpu->bx);
+    printf("; CX: 0x%x (%d)\n", cpu->cx, cpu->cx);
+    printf("; DX: 0x%x (%d)\n", cpu->dx, cpu->dx);
+    printf("; SP: 0x%x (%d)\n", cpu->sp, cpu->sp);
+    printf("; BP: 0x%x (%d)\n", cpu->bp, cpu->bp);
+    printf("; SI: 0x%x (%d)\n", cpu->si, cpu->si);
+    printf("; DI: 0x%x (%d)\n", cpu->di, cpu->di);
+    printf("\n");
+    printf("; ES: 0x%x (%d)\n", cpu->es, cpu->es);
+    printf("; CS: 0x%x (%d)\n", cpu->cs, cpu->cs);
+    printf("; SS: 0x%x (%d)\n", cpu->ss, cpu->ss);
+    printf("; DS: 0x%x (%d)\n", cpu->ds, cpu->ds);
+    printf("\n");
+    printf("; Flags: "); PrintFlags(*cpu); printf("\n");
+
+    free(writes.addresses);
+    free(writes.values);
+    Machine_Free(&machine);
+    MemoryImage_Free(&memoryImage);
 }
 
-void PrintInstruction(Instruction* inst)
+/// @brief Prints the instructions that differ between two images
+void PrintDiff(char* oldFileName, ByteStream oldImage, char* newFileName, ByteStream newImage)
 {
-    Assert(inst->operandCount >= 0 && inst->operandCount <= 2);
+    DecodedImage a;
+    DecodedImage b;
+    DecodeImage(oldImage, &a);
+    DecodeImage(newImage, &b);
 
-    printf(operationNames[inst->type]);
-    printf(" ");
+    DiffResult diff;
+    Diff_Run(&a, &b, &diff);
 
-    switch (inst->type)
+    printf("; Diff: %s (%u instructions) -> %s (%u instructions)\n", oldFileName, a.count, newFileName, b.count);
+    printf("; %u changed, %u removed, %u inserted, %u equal\n", diff.counts[DIFF_CHANGED], diff.counts[DIFF_REMOVED],
+        diff.counts[DIFF_INSERTED], diff.counts[DIFF_EQUAL]);
+
+    for (u32 index = 0; index < diff.count; ++index)
     {
-        case DIS_JO:
-        case DIS_JNO:
-        case DIS_JB:
-        case DIS_JNB:
-        case DIS_JE:
-        case DIS_JNE:
-        case DIS_JBE:
-        case DIS_JNBE:
-        case DIS_JS:
-        case DIS_JNS:
-        case DIS_JP:
-        case DIS_JNP:
-        case DIS_JL:
-        case DIS_JNL:
-        case DIS_JLE:
-        case DIS_JNLE:
-        case DIS_LOOP:
-        case DIS_LOOPZ:
-        case DIS_LOOPNZ:
-        case DIS_JCXZ:
+        DiffEntry* entry = &diff.entries[index];
+        if (entry->kind == DIFF_REMOVED || entry->kind == DIFF_CHANGED)
         {
-            i8 displacement = inst->opDest.valueLow;
-            if (displacement >= 0)
-            {
-                printf(" $+%d", displacement);
-            }
-            else
-            {
-                printf(" $%d", displacement);
-            }
+            printf("%c 0x%04x: ", (entry->kind == DIFF_REMOVED ? '-' : '~'), a.instructions[entry->a].offset);
+            PrintInstruction(&a.instructions[entry->a]);
         }
-        break;
-        
-        case DIS_SHL:
-        case DIS_SHR:
-        case DIS_SAR:
-        case DIS_ROL:
-        case DIS_ROR:
-        case DIS_RCL:
-        case DIS_RCR:
+        if (entry->kind == DIFF_CHANGED) printf("  =>  ");
+        if (entry->kind == DIFF_INSERTED || entry->kind == DIFF_CHANGED)
         {
-            PrintOperand(inst->opDest, inst->isWide);
-            printf(", ");
-            PrintOperand(inst->opSrc, false);
+            if (entry->kind == DIFF_INSERTED) printf("+ ");
+            printf("0x%04x: ", b.instructions[entry->b].offset);
+            PrintInstruction(&b.instructions[entry->b]);
         }
-        break;
+        if (entry->kind != DIFF_EQUAL) printf("\n");
+    }
 
-        case DIS_IN:
-        {
-            PrintOperand(inst->opDest, inst->isWide);
-            printf(", ");
-            PrintOperand(inst->opSrc, true);
-        } 
-        break;
-        case DIS_OUT:
+    Diff_Free(&diff);
+    FreeDecodedImage(&a);
+    FreeDecodedImage(&b);
+}
+
+/// @brief Finds the instruction boundaries of each file with the length prescan and checks them against the decoder
+void PrintLengths(char** fileNames, u32 fileCount)
+{
+    for (u32 fileIndex = 0; fileIndex < fileCount; ++fileIndex)
+    {
+        ByteStream image;
+        if (!LoadFile(fileNames[fileIndex], &image))
         {
-            PrintOperand(inst->opDest, true);
-            printf(", ");
-            PrintOperand(inst->opSrc, inst->isWide);
+            printf("Failed to open file: %s\n", fileNames[fileIndex]);
+            continue;
         }
-        break;
 
-        default:
-        {
-            if (inst->operandCount == 1)
-            {
-                PrintOperand(inst->opDest, inst->isWide);
-            }
-            else if (inst->operandCount == 2)
-            {
-                PrintOperand(inst->opDest, inst->isWide);
-                printf(", ");
-                PrintOperand(inst->opSrc, inst->isWide);
-            }
+        InstructionBoundaries boundaries;
+        clock_t start = clock();
+        Lengths_FindBoundaries(image, &boundaries);
+        double milliseconds = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
 
-        }
-        break;
+        printf("; Lengths: %s (%u bytes, %u instructions, %.2f ms)\n", fileNames[fileIndex], image.size,
+            boundaries.count, milliseconds);
+
+        u32 mismatch;
+        if (Lengths_Verify(image, &boundaries, &mismatch)) printf("; matches the decoder\n");
+        else printf("; differs from the decoder at 0x%04x\n", mismatch);
+
+        Lengths_Free(&boundaries);
+        free(image.data);
     }
 }
 
-
-void PrintBinary(u16 value)
+/// @brief Runs every lane of the state file over the image in lockstep and prints the final state of each lane
+void PrintLockstepStates(char* fileName, ByteStream image, char* stateFileName)
 {
-    u16 index = (1 << 15);
-    while(index)
+    LockstepMachine machine;
+    u32 laneCount = Lockstep_LoadStates(stateFileName, &machine);
+    if (laneCount == 0)
     {
-        if (index == (1 << 7))
-            printf(" ");
+        printf("No valid lane states in: %s\n", stateFileName);
+        return;
+    }
+
+    DecodedImage decoded;
+    DecodeImage(image, &decoded);
 
-        printf((value & index) ? "1" : "0");
-        index >>= 1;
+    clock_t start = clock();
+    LockstepStats stats = Lockstep_Run(&decoded, &machine, 1000000);
+    double milliseconds = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+    printf("; Lockstep: %s, %u lanes\n", fileName, laneCount);
+    for (u32 lane = 0; lane < laneCount; ++lane)
+    {
+        CPU cpu = Lockstep_GetLane(&machine, lane);
+        printf("; lane %u (%s, %u instructions): ax=%04x bx=%04x cx=%04x dx=%04x sp=%04x bp=%04x si=%04x di=%04x "
+               "es=%04x cs=%04x ss=%04x ds=%04x flags=", lane, laneStatusNames[machine.status[lane]],
+               machine.instructionCount[lane], cpu.ax, cpu.bx, cpu.cx, cpu.dx, cpu.sp, cpu.bp, cpu.si, cpu.di,
+               cpu.es, cpu.cs, cpu.ss, cpu.ds);
+        PrintFlags(cpu);
+        printf("\n");
     }
+
+    printf("; %llu steps, %llu lane instructions, %.2f ms\n", (unsigned long long)stats.steps,
+        (unsigned long long)stats.instructions, milliseconds);
+
+    Lockstep_Free(&machine);
+    FreeDecodedImage(&decoded);
 }
 
-bool DecodeSingleByteInstruction(u8 opcode, Instruction* instruction)
+/// @brief Prints the machine state and the instruction it stops at
+void PrintMachineState(char* label, Machine* machine)
 {
-    switch (opcode)
+    printf("; %s: ", label);
+    Emulator_PrintState(machine);
+    printf("\n");
+
+    Instruction next;
+    if (machine->ip < machine->codeEnd && Emulator_Fetch(machine, &next))
     {
-        case INST_XLAT:  instruction->type = DIS_XLAT; break;
-        case INST_DAA:   instruction->type = DIS_DAA; break;
-        case INST_AAA:   instruction->type = DIS_AAA; break;
-        case INST_AAS:   instruction->type = DIS_AAS; break;
-        case INST_DAS:   instruction->type = DIS_DAS; break;
-        case INST_CBW:   instruction->type = DIS_CBW; break;
-        case INST_CWD:   instruction->type = DIS_CWD; break;
-        case INST_INTO:  instruction->type = DIS_INTO; break;
-        case INST_IRET:  instruction->type = DIS_IRET; break;
-        case INST_CLC:   instruction->type = DIS_CLC; break;
-        case INST_CMC:   instruction->type = DIS_CMC; break;
-        case INST_STC:   instruction->type = DIS_STC; break;
-        case INST_CLD:   instruction->type = DIS_CLD; break;
-        case INST_STD:   instruction->type = DIS_STD; break;
-        case INST_CLI:   instruction->type = DIS_CLI; break;
-        case INST_STI:   instruction->type = DIS_STI; break;
-        case INST_HLT:   instruction->type = DIS_HLT; break;
-        case INST_WAIT:  instruction->type = DIS_WAIT; break;
-        case INST_PUSHF: instruction->type = DIS_PUSHF; break;
-        case INST_POPF:  instruction->type = DIS_POPF; break;
-        case INST_SAHF:  instruction->type = DIS_SAHF; break;
-        case INST_LAHF:  instruction->type = DIS_LAHF; break;
-        case INST_LOCK:  instruction->type = DIS_LOCK; break;
-
-        case INST_MOVSB: instruction->type = DIS_MOVSB; break;
-        case INST_MOVSW: instruction->type = DIS_MOVSW; break;
-        case INST_CMPSB: instruction->type = DIS_CMPSB; break;
-        case INST_CMPSW: instruction->type = DIS_CMPSW; break;
-        case INST_SCASB: instruction->type = DIS_SCASB; break;
-        case INST_SCASW: instruction->type = DIS_SCASW; break;
-        case INST_LODSB: instruction->type = DIS_LODSB; break;
-        case INST_LODSW: instruction->type = DIS_LODSW; break;
-        case INST_STOSB: instruction->type = DIS_STOSB; break;
-        case INST_STOSW: instruction->type = DIS_STOSW; break;
-
-        case INST_INT3:
-            instruction->type = DIS_INT;
-            instruction->operandCount = 1;
-            instruction->opDest = InitImmediateOperand(3);
-            break;
-
-        case INST_RET_INTERSEGMENT: 
-        case INST_RET_WITHIN_SEGMENT: 
-            instruction->type = DIS_RET; 
-            break;
-        
-        default: return false;
+        printf(";   next: ");
+        PrintInstruction(&next);
+        printf("\n");
     }
-    return true;
 }
 
-int main(int argc, char** argv)
+/// @brief Prints the instruction at a breakpoint or the instruction that hit a watchpoint, and the registers
+void PrintWatchHit(Machine* machine)
 {
-    InstructionType instructionSubtypes[] = {
-        DIS_ADD, DIS_OR, DIS_ADC, DIS_SBB, DIS_AND, DIS_SUB, DIS_XOR, DIS_CMP
-    };
-
-    bool execute = false;
-    CPU cpu {0};
+    bool breakpoint = (machine->status == MACHINE_BREAKPOINT);
+    u16 ip = (breakpoint ? machine->ip : machine->watchIp);
+    MemoryWatch* watch = machine->memory.watch;
+
+    if (breakpoint) printf("; breakpoint at %04x:%04x: ", machine->cpu.cs, ip);
+    else printf("; %s of 0x%05x at %04x:%04x: ", (watch->hitKind == WATCH_READ ? "read" : "write"), watch->hitAddress,
+                machine->cpu.cs, ip);
+
+    Instruction instruction;
+    Emulator_FetchAt(machine, ip, &instruction);
+    PrintInstruction(&instruction);
+    printf("\n;   ");
+    Emulator_PrintState(machine);
+    printf("\n");
+}
 
-    if (argc > 2)
+/// @brief Parses a physical address, or segment:offset in hex
+bool ParseAddress(char* text, u32* address)
+{
+    char* end;
+    char* separator = strchr(text, ':');
+    if (separator)
     {
-        for (int argIndex = 1; argIndex < argc - 1; ++argIndex)
-        {
-            char* arg = argv[argIndex];
+        u32 segment = (u32)strtoul(text, &end, 16);
+        if (end != separator) return false;
+        u32 offset = (u32)strtoul(separator + 1, &end, 16);
+        if (*end != 0 || segment > 0xFFFF || offset > 0xFFFF) return false;
 
-            if (strcmp("-e", arg) == 0 || strcmp("-E", arg) == 0)
-            {
-                execute = true;
-            }
-        }
+        *address = PhysicalAddress((u16)segment, (u16)offset);
+        return true;
     }
 
-    if (argc >= 2)
+    *address = (u32)strtoul(text, &end, 0);
+    return (end != text && *end == 0 && *address < MEMORY_SIZE);
+}
+
+/// @brief Runs the image as a program, optionally resuming from and saving to a snapshot file
+/// @param commands time travel commands run after the program stops: "back <n>", "forward <n>", "write <address>"
+/// @param watch breakpoints and watchpoints for the run, optional. Hits are printed and the program continues.
+/// @param coverageFileName file to write the executed-code bitmap of the run to, optional
+/// @param fusion run cached blocks with fused instruction pairs, see fusion.cpp
+void RunProgram(char* fileName, ByteStream image, u64 instructionLimit, char* resumeFileName, char* snapshotFileName,
+                char** commands, int commandCount, MemoryWatch* watch, char* coverageFileName, bool fusion)
+{
+    MemoryImage memoryImage;
+    MemoryImage_Init(&memoryImage);
+    MemoryImage_Load(&memoryImage, 0, image.data, image.size);
+
+    Machine machine;
+    Machine_Init(&machine, &memoryImage, image.size);
+    if (coverageFileName) machine.coverage = Coverage_Alloc();
+    if (fusion) Fusion_Attach(&machine);
+
+    if (resumeFileName && !Snapshot_ReadFile(&machine, resumeFileName))
     {
-        char* fileName = argv[argc - 1];
-        FILE* file;
-        fopen_s(&file, fileName, "rb"); // TODO: Handle returned error?
+        printf("Not a snapshot of %s: %s\n", fileName, resumeFileName);
+    }
+    else
+    {
+        u64 resumedAt = machine.instructionCount;
+        u64 budget = (instructionLimit > 0 ? instructionLimit : UINT64_MAX);
 
-        if (file)
+        Timeline timeline;
+        if (commandCount > 0) Timeline_Init(&timeline, &machine, TIMELINE_DEFAULT_INTERVAL);
+
+        Memory_AttachWatch(&machine.memory, watch);
+        for (u64 executed = 0;;)
         {
-            printf("; Disassembly: %s\n", fileName);
-            printf("bits 16\n");
+            if (commandCount > 0) executed += Timeline_Run(&timeline, budget - executed);
+            else executed += Emulator_Run(&machine, budget - executed);
 
-            int input;
-            // NOTE: fgetc is important here otherwise the loop might not end.
-            while((input = fgetc(file)) != EOF)
-            {
-                u8 opcode = (u8)input;
+            if (machine.status != MACHINE_BREAKPOINT && machine.status != MACHINE_WATCHPOINT) break;
+            PrintWatchHit(&machine);
+            Machine_Resume(&machine);
+        }
 
-                Instruction instruction {0};
+        // NOTE: Time travel replays and undoes instructions, which must not hit the watch again.
+        Memory_AttachWatch(&machine.memory, nullptr);
 
-                if (DecodeSingleByteInstruction(opcode, &instruction))
-                {
-                    // Success
-                }
-                else if (opcode == INST_AAM) // AAM
-                {
-                    Load8BitValue(file);
-                    // STUDY: It's supposed to be 0b00001010, but it's different. Trash data?
-                    //Assert(nextByte == 0b00001010);
-                    instruction.type = DIS_AAM;
-                }
-                else if (opcode == INST_AAD) // AAD
-                {
-                    Load8BitValue(file);
-                    // STUDY: It's supposed to be 0b00001010, but it's different. Trash data?
-                    //Assert(nextByte == 0b00001010);
-                    instruction.type = DIS_AAD;
-                }
-                else if (opcode == INST_LEA || opcode == INST_LDS || opcode == INST_LES)
-                {
-                    OperandByte instOperand = Inst_ParseOperand(Load8BitValue(file));
-
-                    if (opcode == INST_LEA)
-                        instruction.type = DIS_LEA;
-                    else if (opcode == INST_LDS)
-                        instruction.type = DIS_LDS;
-                    else
-                        instruction.type = DIS_LES;
-
-                    instruction.isWide = true;
-                    instruction.operandCount = 2;
-                    instruction.opDest = InitRegisterOperand(instOperand.reg);
-                    LoadMemoryOperand(file, &instruction.opSrc, instOperand);
-                }
-                else if (opcode == INST_INT)
+        PrintMachineState(fileName, &machine);
+        if (resumeFileName) printf("; resumed from %s at %llu instructions\n", resumeFileName, (unsigned long long)resumedAt);
+
+        for (int commandIndex = 0; commandIndex < commandCount; ++commandIndex)
+        {
+            char* command = commands[commandIndex];
+            char* argumentText = strchr(command, ' ');
+            u64 argument = (argumentText ? strtoull(argumentText + 1, nullptr, 0) : 0);
+
+            if (argumentText && strncmp(command, "back ", 5) == 0)
+            {
+                Timeline_Seek(&timeline, (argument < machine.instructionCount ? machine.instructionCount - argument : 0));
+            }
+            else if (argumentText && strncmp(command, "forward ", 8) == 0)
+            {
+                Timeline_Run(&timeline, argument);
+            }
+            else if (argumentText && strncmp(command, "write ", 6) == 0)
+            {
+                if (!Timeline_RunBackToWrite(&timeline, (u32)argument))
                 {
-                    instruction.type = DIS_INT;
-                    instruction.operandCount = 1;
-                    instruction.opDest = InitImmediateOperand(Load8BitValue(file));
+                    printf("; %s: no earlier write\n", command);
+                    continue;
                 }
-                else if (opcode == INST_MOV_REGMEM_SR || opcode == INST_MOV_SR_REGMEM)
-                {
-                    OperandByte operand = Inst_ParseOperand(Load8BitValue(file));
-                    instruction.type = DIS_MOV;
-                    instruction.operandCount = 2;
-                    instruction.isWide = true;
+            }
+            else
+            {
+                printf("; %s: invalid command\n", command);
+                continue;
+            }
 
-                    bool toSegmentRegister = ((opcode >> 1) & 0b1);
+            PrintMachineState(commands[commandIndex], &machine);
+        }
 
-                    Operand* segment;
-                    Operand* regmem;
-                    if (toSegmentRegister)
-                    {
-                        segment = &instruction.opDest;
-                        regmem = &instruction.opSrc;
-                    }
-                    else
-                    {
-                        segment = &instruction.opSrc;
-                        regmem = &instruction.opDest;
-                    }
+        if (snapshotFileName)
+        {
+            // NOTE: The timeline write protects memory at every checkpoint, pages written before the last one are
+            // only found through it.
+            Snapshot* snapshot = Snapshot_Take(&machine, (commandCount > 0 ? timeline.current : nullptr));
+            if (!Snapshot_WriteFile(snapshot, &memoryImage, machine.codeEnd, snapshotFileName))
+            {
+                printf("Failed to write snapshot file: %s\n", snapshotFileName);
+            }
+            Snapshot_Free(snapshot);
+        }
 
-                    segment->type = OP_SEGMENT_REGISTER;
-                    segment->regmemIndex = operand.reg;
-                    LoadMemoryOperand(file, regmem, operand);
-                }
-                else if ((opcode & 0b11111110) == 0b11110010) instruction.type = DIS_REP;
-                else if ((opcode & 0b11000100) == 0b00000000)
-                {
-                    instruction.isWide = (opcode & 0b1);
-                    instruction.type = instructionSubtypes[((opcode >> 3) & 0b111)];
+        if (coverageFileName && !Coverage_WriteFile(machine.coverage, coverageFileName))
+        {
+            printf("Failed to write coverage file: %s\n", coverageFileName);
+        }
 
-                    bool directionBit = (opcode >> 1) & 0b1;
-                    OperandByte instOperand = Inst_ParseOperand(Load8BitValue(file));
+        if (commandCount > 0) Timeline_Free(&timeline);
+    }
 
-                    instruction.operandCount = 2;
-                    Operand *op1;
-                    Operand *op2;
+    free(machine.coverage);
+    Fusion_Detach(&machine);
 
-                    if (directionBit)
-                    {
-                        op1 = &instruction.opDest;
-                        op2 = &instruction.opSrc;
-                    }
-                    else
-                    {
-                        op2 = &instruction.opDest;
-                        op1 = &instruction.opSrc;
-                    }
-                    *op1 = InitRegisterOperand(instOperand.reg);
-                    LoadMemoryOperand(file, op2, instOperand);
-                }
-                else if ((opcode & 0b11110000) == 0b01010000) // Push/pop register
-                {
-                    bool isPop = ((opcode >> 3) & 0b1);
-                    RMField reg = (RMField)(opcode & 0b111);
+    Machine_Free(&machine);
+    MemoryImage_Free(&memoryImage);
+}
 
-                    instruction.type = (isPop? DIS_POP : DIS_PUSH);
-                    instruction.operandCount = 1;
-                    instruction.isWide = true;
-                    instruction.opDest = InitRegisterOperand(reg);
-                }
-                else if ((opcode & 0b11100110) == 0b00000110) // Push/pop segment register
-                {
-                    bool isPop = (opcode & 0b1);
-                    u8 segreg = ((opcode >> 3) & 0b11);
+int main(int argc, char** argv)
+{
+    bool execute = false;
+    bool readExport = false;
+    bool dataflow = false;
+    bool clocks = false;
+    char* exportFileName = nullptr;
+    char* lockstepStateFileName = nullptr;
+    char* xrefQueries[MAX_REPEATED_OPTION];
+    int xrefQueryCount = 0;
+
+    char* searchPatterns[MAX_REPEATED_OPTION];
+    int searchPatternCount = 0;
+
+    bool runPrograms = false;
+    u64 sliceInstructions = 100000;
+    u64 instructionLimit = 0;
+    char* resumeFileName = nullptr;
+    char* snapshotFileName = nullptr;
+    char* timeTravelCommands[MAX_REPEATED_OPTION];
+    int timeTravelCommandCount = 0;
+
+    MemoryWatch watch;
+    MemoryWatch_Init(&watch);
+    bool watching = false;
+
+    bool diff = false;
+    bool stats = false;
+    char* statsFileName = nullptr;
+    bool lengths = false;
+    bool pipelined = false;
+    char* syntax = nullptr;
+    bool addressColumn = false;
+    bool bytesColumn = false;
+    ImageRegion regions[REGION_MAX_COUNT];
+    u32 regionCount = 0;
+    bool linearSegments = false;
+    char* coverageFileName = nullptr;
+    char* writeCoverageFileName = nullptr;
+    bool fusion = true;
+
+    char* serverPath = nullptr;
+    char* clientPath = nullptr;
+
+    // NOTE: Options come first. Every other argument is an input file, single-file modes use the last one.
+    char** inputFiles = (char**)malloc(argc * sizeof(char*));
+    int inputFileCount = 0;
+
+    for (int argIndex = 1; argIndex < argc; ++argIndex)
+    {
+        char* arg = argv[argIndex];
 
-                    instruction.type = (isPop? DIS_POP : DIS_PUSH);
-                    instruction.operandCount = 1;
-                    instruction.isWide = true;
-                    instruction.opDest = InitSegmentRegisterOperand((RMField)segreg);
-                }
-                else if ((opcode & 0b11110100) == 0b11100100) // IN/OUT fixed port
-                {
-                    bool variableBit = ((opcode >> 3) & 0b1);
-                    bool typeBit = ((opcode >> 1) & 0b1);
-
-                    instruction.type = (typeBit? DIS_OUT : DIS_IN);
-                    instruction.isWide = (opcode & 0b1);
-
-                    // FIXME: Operands should be unsigned
-                    instruction.operandCount = 2;
-                    Operand* op1;
-                    Operand* op2;
-                    
-                    if (typeBit)
-                    {
-                        op2 = &instruction.opDest;
-                        op1 = &instruction.opSrc;
-                    }
-                    else
-                    {
-                        op1 = &instruction.opDest;
-                        op2 = &instruction.opSrc;
-                    }
+        // NOTE: An option past the limit would otherwise be taken as an input file.
+        bool repeated = (strcmp("-t", arg) == 0 && timeTravelCommandCount == MAX_REPEATED_OPTION) ||
+                        (strcmp("-q", arg) == 0 && xrefQueryCount == MAX_REPEATED_OPTION) ||
+                        (strcmp("-s", arg) == 0 && searchPatternCount == MAX_REPEATED_OPTION);
+        if (repeated)
+        {
+            printf("Too many %s options, at most %d\n", arg, MAX_REPEATED_OPTION);
+            free(inputFiles);
+            return 0;
+        }
 
-                    *op1 = InitRegisterOperand(REG_AX);
-                    if (variableBit)
-                    {
-                        *op2 = InitRegisterOperand(REG_DX);
-                    }
-                    else
-                    {
-                        LoadImmediateOperand(file, op2, false, false);
-                    }
-                }
-                else if ((opcode & 0b11111100) == (0b10000100))
-                {
-                    instruction.isWide = (opcode & 0b1);
-                    instruction.type = ((opcode >> 1) & 0b1) ? DIS_XCHG : DIS_TEST;
+        if (strcmp("-e", arg) == 0 || strcmp("-E", arg) == 0)
+        {
+            execute = true;
+        }
+        else if (strcmp("-x", arg) == 0 && argIndex + 1 < argc)
+        {
+            exportFileName = argv[++argIndex];
+        }
+        else if (strcmp("-r", arg) == 0)
+        {
+            readExport = true;
+        }
+        else if (strcmp("-d", arg) == 0)
+        {
+            dataflow = true;
+        }
+        else if (strcmp("-c", arg) == 0)
+        {
+            clocks = true;
+        }
+        else if (strcmp("-l", arg) == 0 && argIndex + 1 < argc)
+        {
+            lockstepStateFileName = argv[++argIndex];
+        }
+        else if (strcmp("-p", arg) == 0)
+        {
+            runPrograms = true;
+        }
+        else if (strcmp("-k", arg) == 0 && argIndex + 1 < argc)
+        {
+            sliceInstructions = strtoull(argv[++argIndex], nullptr, 0);
+        }
+        else if (strcmp("-n", arg) == 0 && argIndex + 1 < argc)
+        {
+            instructionLimit = strtoull(argv[++argIndex], nullptr, 0);
+        }
+        else if (strcmp("-S", arg) == 0 && argIndex + 1 < argc)
+        {
+            snapshotFileName = argv[++argIndex];
+        }
+        else if (strcmp("-R", arg) == 0 && argIndex + 1 < argc)
+        {
+            resumeFileName = argv[++argIndex];
+        }
+        else if (strcmp("-t", arg) == 0 && argIndex + 1 < argc)
+        {
+            timeTravelCommands[timeTravelCommandCount++] = argv[++argIndex];
+        }
+        else if ((strcmp("-b", arg) == 0 || strcmp("-w", arg) == 0 || strcmp("-a", arg) == 0) && argIndex + 1 < argc)
+        {
+            u8 flags = (arg[1] == 'b' ? WATCH_EXECUTE : (arg[1] == 'w' ? WATCH_WRITE : WATCH_READ | WATCH_WRITE));
+            u32 address;
+            if (ParseAddress(argv[++argIndex], &address))
+            {
+                MemoryWatch_Add(&watch, address, 1, flags);
+                watching = true;
+            }
+            else
+            {
+                printf("Invalid address: %s\n", argv[argIndex]);
+            }
+        }
+        else if (strcmp("--diff", arg) == 0)
+        {
+            diff = true;
+        }
+        else if (strcmp("--stats", arg) == 0)
+        {
+            stats = true;
+        }
+        else if (strcmp("--stats-file", arg) == 0 && argIndex + 1 < argc)
+        {
+            stats = true;
+            statsFileName = argv[++argIndex];
+        }
+        else if (strcmp("--lengths", arg) == 0)
+        {
+            lengths = true;
+        }
+        else if (strcmp("--pipeline", arg) == 0)
+        {
+            pipelined = true;
+        }
+        else if (strcmp("--syntax", arg) == 0 && argIndex + 1 < argc)
+        {
+            syntax = argv[++argIndex];
+        }
+        else if (strcmp("--addresses", arg) == 0)
+        {
+            addressColumn = true;
+        }
+        else if (strcmp("--bytes", arg) == 0)
+        {
+            bytesColumn = true;
+        }
+        else if (strcmp("--region", arg) == 0 && argIndex + 1 < argc)
+        {
+            char* text = argv[++argIndex];
+            if (regionCount < REGION_MAX_COUNT && Regions_Parse(text, &regions[regionCount])) ++regionCount;
+            else printf("Invalid region: %s\n", text);
+        }
+        else if (strcmp("--segments", arg) == 0)
+        {
+            linearSegments = true;
+        }
+        else if (strcmp("--coverage", arg) == 0 && argIndex + 1 < argc)
+        {
+            coverageFileName = argv[++argIndex];
+        }
+        else if (strcmp("--write-coverage", arg) == 0 && argIndex + 1 < argc)
+        {
+            writeCoverageFileName = argv[++argIndex];
+        }
+        else if (strcmp("--no-fusion", arg) == 0)
+        {
+            fusion = false;
+        }
+        else if (strcmp("-D", arg) == 0 && argIndex + 1 < argc)
+        {
+            serverPath = argv[++argIndex];
+        }
+        else if (strcmp("-C", arg) == 0 && argIndex + 1 < argc)
+        {
+            clientPath = argv[++argIndex];
+        }
+        else if (strcmp("-q", arg) == 0 && argIndex + 1 < argc)
+        {
+            xrefQueries[xrefQueryCount++] = argv[++argIndex];
+        }
+        else if (strcmp("-s", arg) == 0 && argIndex + 1 < argc)
+        {
+            searchPatterns[searchPatternCount++] = argv[++argIndex];
+        }
+        else
+        {
+            inputFiles[inputFileCount++] = arg;
+        }
+    }
 
-                    OperandByte instOperand = Inst_ParseOperand(Load8BitValue(file));
+    if (serverPath)
+    {
+        if (!Server_Run(serverPath)) printf("Failed to listen on: %s\n", serverPath);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.operandCount = 2;
-                    instruction.opDest = InitRegisterOperand(instOperand.reg);
-                    LoadMemoryOperand(file, &instruction.opSrc, instOperand);
-                }
-                else if ((opcode & MASK_INST_1BYTE_REG) == INST_XCHG_ACC_WITH_REG)
-                {
-                    instruction.type = DIS_XCHG;
-                    instruction.operandCount = 2;
-                    instruction.isWide = true;
-                    instruction.opDest = InitRegisterOperand(REG_AX);
-                    instruction.opSrc = InitRegisterOperand((RMField)(opcode & 0b111));
-                }
-                else if ((opcode & MASK_INST_1BYTE_REG) == INST_INC_REG)
-                {
-                    instruction.type = DIS_INC;
-                    instruction.isWide = true;
-                    instruction.operandCount = 1;
-                    instruction.opDest = InitRegisterOperand((RMField)(opcode & 0b111));
-                }
-                else if ((opcode & MASK_INST_1BYTE_REG) == INST_DEC_REG)
-                {
-                    instruction.type = DIS_DEC;
-                    instruction.isWide = true;
-                    instruction.operandCount = 1;
-                    instruction.opDest = InitRegisterOperand((RMField)(opcode & 0b111));
-                }
-                else if ((opcode & 0b11000100) == 0b00000100) // Immediate to accumulator
-                {
-                    instruction.isWide = (opcode & 0b1);
-                    u8 instructionType = ((opcode >> 3) & 0b111);
-                    instruction.type = instructionSubtypes[instructionType];
+    // NOTE: The remaining arguments are requests.
+    if (clientPath)
+    {
+        if (!Server_SendRequests(clientPath, inputFiles, inputFileCount)) printf("No response from server on: %s\n", clientPath);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.operandCount = 2;
-                    instruction.opDest = InitRegisterOperand(REG_AX); // Same ID as REG_AL
-                    LoadImmediateOperand(file, &instruction.opSrc, instruction.isWide, false);
-                }
-                else if ((opcode & 0b11111100) == 0b10000000) // Immediate to register/memory
-                {
-                    bool signBit = ((opcode >> 1) & 0b1);
-                    instruction.isWide = (opcode & 0b1);
+    if (inputFileCount >= 2 && diff)
+    {
+        char* oldFileName = inputFiles[inputFileCount - 2];
+        char* newFileName = inputFiles[inputFileCount - 1];
+        ByteStream oldImage;
+        ByteStream newImage;
 
-                    OperandByte instructionOperand = Inst_ParseOperand(Load8BitValue(file));
+        if (!LoadFile(oldFileName, &oldImage)) printf("Failed to open file: %s\n", oldFileName);
+        else if (!LoadFile(newFileName, &newImage)) printf("Failed to open file: %s\n", newFileName);
+        else
+        {
+            PrintDiff(oldFileName, oldImage, newFileName, newImage);
+            free(newImage.data);
+        }
 
-                    // NOTE: For immediate instructions, the REG part of the operand byte determines the operation type.
-                    instruction.type = instructionSubtypes[instructionOperand.reg];
+        free(oldImage.data);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.operandCount = 2;
-                    instruction.opDest.outputWidth = true;
-                    LoadMemoryOperand(file, &instruction.opDest, instructionOperand);
-                    LoadImmediateOperand(file, &instruction.opSrc, instruction.isWide, signBit);
-                }
-                else if ((opcode & 0b11111100) == 0b11010000) // Logic operations
-                {
-                    InstructionType logicSubtypes[] = {DIS_ROL, DIS_ROR, DIS_RCL, DIS_RCR, DIS_SHL, DIS_SHR, DIS_NOOP, DIS_SAR};
-                    OperandByte operand = Inst_ParseOperand(Load8BitValue(file));
+    if (inputFileCount > 0 && stats)
+    {
+        Stats_RunFiles(inputFiles, inputFileCount, statsFileName);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.type = logicSubtypes[operand.reg];
-                    instruction.isWide = (opcode & 0b1);
+    if (inputFileCount > 0 && lengths)
+    {
+        PrintLengths(inputFiles, inputFileCount);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.operandCount = 2;
-                    instruction.opDest.outputWidth = true;
-                    LoadMemoryOperand(file, &instruction.opDest, operand);
+    if (inputFileCount > 0 && pipelined)
+    {
+        char* fileName = inputFiles[inputFileCount - 1];
+        if (!Pipeline_PrintListing(fileName)) printf("Failed to open file: %s\n", fileName);
+        free(inputFiles);
+        return 0;
+    }
 
-                    bool shiftByCLValue = ((opcode >> 1) & 0b1);
-                    if (shiftByCLValue)
-                    {
-                        instruction.opSrc = InitRegisterOperand(REG_CX);
-                    }
-                    else
-                    {
-                        instruction.opSrc = InitImmediateOperand(1);
-                    }
-                }
-                else if ((opcode & 0b11111110) == 0b11000110) // MOVE immediate to register/memory
-                {
-                    instruction.type = DIS_MOV;
-                    instruction.isWide = (opcode & 0b1);
+    if (inputFileCount > 0 &&
+        (syntax || addressColumn || bytesColumn || regionCount > 0 || linearSegments || coverageFileName))
+    {
+        char* fileName = inputFiles[inputFileCount - 1];
+        ByteStream image;
+        u64* coverage = (coverageFileName ? Coverage_Alloc() : nullptr);
+        if (!LoadFile(fileName, &image)) printf("Failed to open file: %s\n", fileName);
+        else if (coverage && !Coverage_ReadFile(coverageFileName, coverage))
+        {
+            printf("Not a coverage file: %s\n", coverageFileName);
+            free(image.data);
+        }
+        else
+        {
+            // NOTE: Regions imply segment:offset addresses.
+            RegionMap regionMap = {};
+            if (regionCount > 0) Regions_Build(regions, regionCount, image.size, &regionMap);
+            else if (linearSegments) Regions_Build(nullptr, 0, image.size, &regionMap);
+            bool segmented = (regionMap.count > 0);
+
+            if (!Syntax_PrintFile(fileName, image, (syntax ? syntax : "nasm"), addressColumn || segmented, bytesColumn,
+                    (segmented ? &regionMap : nullptr), coverage))
+            {
+                printf("Unknown syntax: %s\n", syntax);
+            }
 
-                    OperandByte instOperand = Inst_ParseOperand((u8)Load8BitValue(file));
+            Regions_Free(&regionMap);
+            free(image.data);
+        }
+        free(coverage);
+        free(inputFiles);
+        return 0;
+    }
 
-                    Assert(instOperand.reg == 0b000);// NOTE: Other reg values are not used. 
+    if (inputFileCount > 0 && runPrograms)
+    {
+        Scheduler_RunFiles(inputFiles, inputFileCount, sliceInstructions, instructionLimit, fusion);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.operandCount = 2;
-                    instruction.opSrc.outputWidth = true;
-                    LoadMemoryOperand(file, &instruction.opDest, instOperand);
-                    LoadImmediateOperand(file, &instruction.opSrc, instruction.isWide, false);
-                }
-                else if ((opcode & 0b11111100) == 0b10001000)
-                {
-                    instruction.type = DIS_MOV;
-                    instruction.isWide = (opcode & 0b1);
-                    bool switchOperands = ((opcode >> 1) & 0b1);
+    if (inputFileCount > 0 && searchPatternCount > 0)
+    {
+        SearchAutomaton automaton;
+        int invalidPattern = Search_Compile(searchPatterns, searchPatternCount, &automaton);
+        if (invalidPattern >= 0)
+        {
+            printf("Invalid search pattern: %s\n", searchPatterns[invalidPattern]);
+        }
+        else
+        {
+            Search_RunFiles(&automaton, inputFiles, inputFileCount);
+        }
 
-                    OperandByte instOperand = Inst_ParseOperand(Load8BitValue(file));
+        Search_Free(&automaton);
+        free(inputFiles);
+        return 0;
+    }
 
-                    instruction.operandCount = 2;
+    if (inputFileCount > 0)
+    {
+        char* fileName = inputFiles[inputFileCount - 1];
+        ByteStream image;
 
-                    Operand* op1;
-                    Operand* op2;
-                    if (switchOperands)
-                    {
-                        op1 = &instruction.opDest;
-                        op2 = &instruction.opSrc;
-                    }
-                    else
-                    {
-                        op1 = &instruction.opSrc;
-                        op2 = &instruction.opDest;
-                    }
-                    *op1 = InitRegisterOperand(instOperand.reg);
-                    LoadMemoryOperand(file, op2, instOperand);
-                }
-                else if ((opcode & 0b11111100) == 0b10100000) // MOV accumulator-memory
+        if (LoadFile(fileName, &image))
+        {
+            if (readExport)
+            {
+                ExportView view;
+                if (Export_OpenView(image.data, image.size, &view))
                 {
-                    // NOTE: The direction bit here has opposite meaning to the standard one, and it's written as 2 separate commands in the manual.
-                    instruction.type = DIS_MOV;
-                    bool directionBit = ((opcode >> 1) & 0b1);
-                    instruction.isWide = (opcode & 0b1);
-
-                    instruction.operandCount = 2;
-                    Operand* op1;
-                    Operand* op2;
+                    printf("; Disassembly: %s (export v%d, %u instructions, %u symbols)\n", fileName,
+                        view.header->version, view.header->recordCount, view.header->symbolCount);
+                    printf("bits 16\n");
 
-                    if (directionBit)
+                    for (u32 index = 0; index < view.header->recordCount; ++index)
                     {
-                        op2 = &instruction.opDest;
-                        op1 = &instruction.opSrc;
+                        Instruction instruction = Export_ToInstruction(Export_GetRecord(&view, index));
+                        PrintInstruction(&instruction);
+                        printf("\n");
                     }
-                    else
-                    {
-                        op1 = &instruction.opDest;
-                        op2 = &instruction.opSrc;
-                    }
-
-                    *op1 = InitRegisterOperand(REG_AX);
-                    op2->type = OP_MEMORY;
-                    op2->regmemIndex = MEM_DIRECT;
-                    op2->value = (i16)Load16BitValue(file);
                 }
-                else if (opcode == 0b11000010) // RET - within seg adding immediate to SP
-                {
-                    instruction.type = DIS_RET;
-                    instruction.operandCount = 1;
-                    instruction.opDest = InitImmediateOperand((i16)Load16BitValue(file));
-                }
-                else if ((opcode & 0b11110000) == 0b10110000) // MOV imm -> reg
+                else
                 {
-                    instruction.type = DIS_MOV;
-                    instruction.isWide = ((opcode >> 3) & 0b1);
-                    instruction.operandCount = 2;
-                    instruction.opDest = InitRegisterOperand((RMField)(opcode & 0b111));
-                    LoadImmediateOperand(file, &instruction.opSrc, instruction.isWide, false);
+                    printf("Not a supported export file: %s\n", fileName);
                 }
-                else if ((opcode & 0b11110000) == 0b01110000)
-                {
-                    InstructionType jumpSuptypes[] = {
-                        DIS_JO, DIS_JNO, DIS_JB, DIS_JNB, DIS_JE, DIS_JNE, DIS_JBE, DIS_JNBE,
-                        DIS_JS, DIS_JNS, DIS_JP, DIS_JNP, DIS_JL, DIS_JNL, DIS_JLE, DIS_JNLE
-                    };
-                    // TODO: Jump labels
-
-                    u8 jumpType = (opcode & 0b1111);
 
-                    instruction.type = jumpSuptypes[jumpType];
-                    instruction.operandCount = 1;
-                    instruction.opDest = InitImmediateOperand(((i8)Load8BitValue(file) + 2));
-                }
-                else if ((opcode & 0b11111100) == 0b11100000)
-                {
-                    InstructionType loopTypes[] = { DIS_LOOPNZ, DIS_LOOPZ, DIS_LOOP, DIS_JCXZ};
+                free(image.data);
+                return 0;
+            }
 
-                    instruction.type = loopTypes[(opcode & 0b11)];
-                    instruction.operandCount = 1;
-                    instruction.opDest = InitImmediateOperand((i8)Load8BitValue(file) + 2);
-                }
-                else if ((opcode & 0b11111111) == 0b10001111) // pop
+            if (exportFileName)
+            {
+                if (!Export_WriteFile(image, exportFileName, true))
                 {
-                    OperandByte instOperand = Inst_ParseOperand(Load8BitValue(file));
-                    Assert(instOperand.reg == 0b000); // NOTE: Other values are not used.
-                    
-                    instruction.type = DIS_POP;
-                    instruction.operandCount = 1;
-                    instruction.isWide = true;
-                    instruction.opDest.outputWidth = true;
-                    LoadMemoryOperand(file, &instruction.opDest, instOperand);
+                    printf("Failed to write export file: %s\n", exportFileName);
                 }
-                else if ((opcode & 0b11111110) == 0b11111110)
-                {
-                    InstructionType instructionSubtypesInc[] = {DIS_INC, DIS_DEC, DIS_CALL, DIS_CALL, DIS_JMP, DIS_JMP, DIS_PUSH};
-
-                    OperandByte instructionOperand = Inst_ParseOperand(Load8BitValue(file));
-
-                    Assert(instructionOperand.reg != 0b111);
+            }
 
-                    instruction.isWide = (opcode & 0b1);
-                    instruction.type = instructionSubtypesInc[instructionOperand.reg];
+            if (xrefQueryCount > 0)
+            {
+                DecodedImage decoded;
+                DecodeImage(image, &decoded);
 
-                    instruction.operandCount = 1;
-                    LoadMemoryOperand(file, &instruction.opDest, instructionOperand);
+                XrefIndex index;
+                Xref_Build(&decoded, &index);
 
-                    if (instructionOperand.reg == 0b110 || 
-                        instructionOperand.reg == 0b000 || 
-                        instructionOperand.reg == 0b001) // push/inc/dec
+                for (int queryIndex = 0; queryIndex < xrefQueryCount; ++queryIndex)
+                {
+                    XrefQuery query;
+                    if (!Xref_ParseQuery(xrefQueries[queryIndex], &query))
                     {
-                        instruction.opDest.outputWidth = true;
+                        printf("; xref %s: invalid query\n", xrefQueries[queryIndex]);
+                        continue;
                     }
-                }
-                else if ((opcode & 0b11111110) == 0b10101000) // TEST imm, ax
-                {
-                    instruction.type = DIS_TEST;
-                    instruction.isWide = (opcode & 0b1);
-                    instruction.operandCount = 2;
-                    instruction.opDest = InitRegisterOperand(REG_AX);
-                    LoadImmediateOperand(file, &instruction.opSrc, instruction.isWide, false);
-                }
-                else if ((opcode & 0b11111110) == 0b11110110)
-                {
-                    InstructionType types[] = {DIS_TEST, DIS_NOOP, DIS_NOT, DIS_NEG, DIS_MUL, DIS_IMUL, DIS_DIV, DIS_IDIV};
-
-                    OperandByte operand = Inst_ParseOperand(Load8BitValue(file));
 
-                    instruction.type = types[operand.reg];
-                    instruction.isWide = (opcode & 0b1);
+                    XrefSpan result;
+                    Xref_Run(&index, &query, &result);
 
-                    if (operand.reg == 0b000)
-                    {
-                        instruction.operandCount = 2;
-                        LoadMemoryOperand(file, &instruction.opDest, operand);
-                        instruction.opDest.outputWidth = true;
-                        LoadImmediateOperand(file, &instruction.opSrc, instruction.isWide, false);
-                    }
-                    else
+                    printf("; xref %s: %u instructions\n", xrefQueries[queryIndex], result.count);
+                    for (u32 entryIndex = 0; entryIndex < result.count; ++entryIndex)
                     {
-                        instruction.operandCount = 1;
-                        instruction.opDest.outputWidth = true;
-                        LoadMemoryOperand(file, &instruction.opDest, operand);
+                        Instruction* instruction = &decoded.instructions[result.entries[entryIndex]];
+                        printf("0x%04x: ", instruction->offset);
+                        PrintInstruction(instruction);
+                        printf("\n");
                     }
-                }
-                else
-                {
-                    printf("; %x", opcode);
+                    free(result.entries);
                 }
 
-                PrintInstruction(&instruction);
+                Xref_Free(&index);
+                FreeDecodedImage(&decoded);
+                free(image.data);
+                return 0;
+            }
 
-                if (execute)
-                {
-                    switch(instruction.type)
-                    {
-                        case DIS_MOV:
-                        {
-
-                            if (instruction.opDest.type == OP_REGISTER &&
-                                instruction.opSrc.type == OP_IMMEDIATE)
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16 srcValue = instruction.opSrc.value;
-                                    *((u16*)dest) = srcValue;
-                                    printf("; %s := %d (0x%x)",
-                                        registers16bit[instruction.opDest.regmemIndex],
-                                        srcValue, srcValue);
-                                }
-                                else
-                                {
-                                    u8 srcValue = instruction.opSrc.valueLow;
-                                    *((u8*)dest) = srcValue;
-                                    printf("; %s := %d (0x%x)",
-                                        registers8bit[instruction.opDest.regmemIndex],
-                                        srcValue, srcValue);
-                                }
-                            }
-                            else if ((instruction.opSrc.type == OP_REGISTER || instruction.opSrc.type == OP_SEGMENT_REGISTER) &&
-                                (instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER))
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-                                void* src = cpu.GetPointerToRegister(&instruction.opSrc, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16 newValue = *((u16*)src);
-                                    *((u16*)dest) = newValue;
-
-                                    printf("; %s := %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers16bit[instruction.opDest.regmemIndex]), 
-                                        newValue, newValue);
-                                }
-                                else
-                                {
-                                    u8 newValue = *((u8*)src);
-                                    *((u8*)dest) = newValue;
-                                    printf("; %s := %d (0x%x)", 
-                                        registers8bit[instruction.opDest.regmemIndex], 
-                                        newValue, newValue);
-                                }
-                            }
-                            else
-                            {
-                                printf(" ; MOV - not implemented");
-                            }
-                        }
-                        break;
-                        case DIS_ADD:
-                        {
-                            if ((instruction.opSrc.type == OP_REGISTER || instruction.opSrc.type == OP_SEGMENT_REGISTER) &&
-                                (instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER))
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-                                void* src  = cpu.GetPointerToRegister(&instruction.opSrc, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16* src16  = (u16*)src;
-                                    u16* dest16 = (u16*)dest;
-
-                                    *dest16 += *src16;
-
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers16bit[instruction.opDest.regmemIndex]), 
-                                        *dest16, *dest16);
-                                    
-                                    printf(" | Flags: "); PrintFlags(cpu); 
-                                    cpu.sign = (*dest16 & 0x8000) >> 15;
-                                    cpu.zero = (*dest16 == 0); 
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                                else
-                                {
-                                    u8 operand = *((u8*)src);
-                                    u8* dest8 = ((u8*)dest);
-                                    
-                                    *dest8 += operand;
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers8bit[instruction.opDest.regmemIndex]), 
-                                        *dest8, *dest8);
-
-                                    printf(" | Flags: "); PrintFlags(cpu);
-                                    cpu.sign = (*dest8 & 0x80) >> 7;
-                                    cpu.zero = (*dest8 == 0);
-                                    printf("->"); PrintFlags(cpu);
-                                }
-
-                            }
-                            else if ((instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER)
-                                && instruction.opSrc.type == OP_IMMEDIATE)
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16* dest16 = (u16*)dest;
-
-                                    *dest16 += instruction.opSrc.value;
-
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers16bit[instruction.opDest.regmemIndex]), 
-                                        *dest16, *dest16);
-                                    
-                                    printf(" | Flags: "); PrintFlags(cpu); 
-                                    cpu.sign = (*dest16 & 0x8000) >> 15;
-                                    cpu.zero = (*dest16 == 0); 
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                                else
-                                {
-                                    u8* dest8 = ((u8*)dest);
-                                    
-                                    *dest8 += instruction.opSrc.valueLow;
-
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers8bit[instruction.opDest.regmemIndex]), 
-                                        *dest8, *dest8);
-
-                                    printf(" | Flags: "); PrintFlags(cpu);
-                                    cpu.sign = (*dest8 & 0x80) >> 7;
-                                    cpu.zero = (*dest8 == 0);
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                            }
-                            else
-                            {
-                                printf(" ; ADD - not implemented");
-                            }
-                        }
-                        break;
-                        case DIS_SUB:
-                        {
-                            if ((instruction.opSrc.type == OP_REGISTER || instruction.opSrc.type == OP_SEGMENT_REGISTER) &&
-                                (instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER))
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-                                void* src  = cpu.GetPointerToRegister(&instruction.opSrc, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16* src16  = (u16*)src;
-                                    u16* dest16 = (u16*)dest;
-
-                                    *dest16 -= *src16;
-
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers16bit[instruction.opDest.regmemIndex]), 
-                                        *dest16, *dest16);
-                                    
-                                    printf(" | Flags: "); PrintFlags(cpu); 
-                                    cpu.sign = (*dest16 & 0x8000) >> 15;
-                                    cpu.zero = (*dest16 == 0); 
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                                else
-                                {
-                                    u8 operand = *((u8*)src);
-                                    u8* dest8 = ((u8*)dest);
-                                    
-                                    *dest8 -= operand;
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers8bit[instruction.opDest.regmemIndex]), 
-                                        *dest8, *dest8);
-
-                                    printf(" | Flags: "); PrintFlags(cpu);
-                                    cpu.sign = (*dest8 & 0x80) >> 7;
-                                    cpu.zero = (*dest8 == 0);
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                            }
-                            else if ((instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER)
-                                && instruction.opSrc.type == OP_IMMEDIATE)
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16* dest16 = (u16*)dest;
-
-                                    *dest16 -= instruction.opSrc.value;
-
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers16bit[instruction.opDest.regmemIndex]), 
-                                        *dest16, *dest16);
-                                    
-                                    printf(" | Flags: "); PrintFlags(cpu); 
-                                    cpu.sign = (*dest16 & 0x8000) >> 15;
-                                    cpu.zero = (*dest16 == 0); 
-                                    cpu.parity = 0;
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                                else
-                                {
-                                    u8* dest8 = ((u8*)dest);
-                                    
-                                    *dest8 -= instruction.opSrc.valueLow;
-
-                                    printf("; %s -> %d (0x%x)", 
-                                        ((instruction.opDest.type == OP_SEGMENT_REGISTER) ? 
-                                            registersSegment[instruction.opDest.regmemIndex] : 
-                                            registers8bit[instruction.opDest.regmemIndex]), 
-                                        *dest8, *dest8);
-
-                                    printf(" | Flags: "); PrintFlags(cpu);
-                                    cpu.sign = (*dest8 & 0x80) >> 7;
-                                    cpu.zero = (*dest8 == 0);
-                                    cpu.parity = 0;
-                                    printf("->"); PrintFlags(cpu);
-                                }
-
-                            }
-                            else
-                            {
-                                printf(" ; SUB - not implemented");
-                            }
-                        }
-                        break;
-                        case DIS_CMP:
-                        {
-                            if ((instruction.opSrc.type == OP_REGISTER || instruction.opSrc.type == OP_SEGMENT_REGISTER) &&
-                                (instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER))
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-                                void* src  = cpu.GetPointerToRegister(&instruction.opSrc, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16* src16  = (u16*)src;
-                                    u16* dest16 = (u16*)dest;
-
-                                    printf("; Flags: "); PrintFlags(cpu); 
-                                    cpu.sign = (*dest16 & 0x8000) >> 15;
-                                    cpu.zero = (*src16 == *dest16);
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                                else
-                                {
-                                    u8* src8 = ((u8*)src);
-                                    u8* dest8 = ((u8*)dest);
-                                    
-                                    printf("; Flags: "); PrintFlags(cpu);
-                                    cpu.sign = (*dest8 & 0x80) >> 7;
-                                    cpu.zero = (*src8 == *dest8);
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                            }
-                            else if ((instruction.opDest.type == OP_REGISTER || instruction.opDest.type == OP_SEGMENT_REGISTER)
-                                && instruction.opSrc.type == OP_IMMEDIATE)
-                            {
-                                void* dest = cpu.GetPointerToRegister(&instruction.opDest, instruction.isWide);
-
-                                if (instruction.isWide)
-                                {
-                                    u16* dest16 = (u16*)dest;
-                                    
-                                    printf("; Flags: "); PrintFlags(cpu); 
-                                    cpu.sign = (*dest16 & 0x8000) >> 15;
-                                    cpu.zero = (*dest16 == instruction.opSrc.value); 
-                                    cpu.parity = 0;
-                                    printf("->"); PrintFlags(cpu);
-                                }
-                                else
-                                {
-                                    u8* dest8 = ((u8*)dest);
-
-                                    printf("; Flags: "); PrintFlags(cpu);
-                                    cpu.sign = (*dest8 & 0x80) >> 7;
-                                    cpu.zero = (*dest8 == instruction.opSrc.valueLow);
-                                    cpu.parity = 0;
-                                    printf("->"); PrintFlags(cpu);
-                                }
-
-                            }
-                            else
-                            {
-                                printf(" ; CMP - not implemented");
-                            }
-                        }
-                        break;
-                        default:
-                            printf(" ; not implemented");
-                        break;
-                    }
-                }
+            if (instructionLimit > 0 || resumeFileName || snapshotFileName || timeTravelCommandCount > 0 || watching ||
+                writeCoverageFileName)
+            {
+                RunProgram(fileName, image, instructionLimit, resumeFileName, snapshotFileName,
+                    timeTravelCommands, timeTravelCommandCount, (watching ? &watch : nullptr), writeCoverageFileName, fusion);
+                MemoryWatch_Free(&watch);
+                free(image.data);
+                return 0;
+            }
 
-                if (instruction.type != DIS_LOCK && instruction.type != DIS_REP)
-                    printf("\n");
+            if (lockstepStateFileName)
+            {
+                PrintLockstepStates(fileName, image, lockstepStateFileName);
+                free(image.data);
+                return 0;
             }
 
-            fclose(file);
+            if (clocks)
+            {
+                PrintClocksListing(fileName, image);
+                free(image.data);
+                return 0;
+            }
+
+            if (dataflow)
+            {
+                PrintDataflowListing(fileName, image);
+                free(image.data);
+                return 0;
+            }
 
             if (execute)
             {
+                PrintExecutionListing(fileName, image);
+                free(image.data);
+                return 0;
+            }
+
+            printf("; Disassembly: %s\n", fileName);
+            printf("bits 16\n");
+
+            while (image.position < image.size)
+            {
+                Instruction instruction;
+                if (!DecodeInstruction(&image, &instruction))
+                {
+                    printf("; %x", image.data[instruction.offset + instruction.prefixLength]);
+                }
+
+                PrintInstruction(&instruction);
                 printf("\n");
-                printf("; Final state:\n");
-                printf("; AX: 0x%x (%d)\n", cpu.ax, cpu.ax);
-                printf("; BX: 0x%x (%d)\n", cpu.bx, cpu.bx);
-                printf("; CX: 0x%x (%d)\n", cpu.cx, cpu.cx);
-                printf("; DX: 0x%x (%d)\n", cpu.dx, cpu.dx);
-                printf("; SP: 0x%x (%d)\n", cpu.sp, cpu.sp);
-                printf("; BP: 0x%x (%d)\n", cpu.bp, cpu.bp);
-                printf("; SI: 0x%x (%d)\n", cpu.si, cpu.si);
-                printf("; DI: 0x%x (%d)\n", cpu.di, cpu.di);
-                printf("\n");
-                printf("; ES: 0x%x (%d)\n", cpu.es, cpu.es);
-                printf("; CS: 0x%x (%d)\n", cpu.cs, cpu.cs);
-                printf("; SS: 0x%x (%d)\n", cpu.ss, cpu.ss);
-                printf("; DS: 0x%x (%d)\n", cpu.ds, cpu.ds);
-                printf("\n");
-                printf("; Flags: "); PrintFlags(cpu); printf("\n");
             }
+
+            free(image.data);
         }
         else
         {
@@ -1114,7 +1087,50 @@ int main(int argc, char** argv)
     }
     else
     {
-        printf("Usage: main.exe [-e] <filename>\n");
+        printf("Usage: main.exe [-e] [-x <export file>] [-r] [-q <query>]... [-d] [-c] [-l <state file>] <filename>\n");
+        printf("       main.exe -s <pattern> [-s <pattern>]... <filename>...\n");
+        printf("       main.exe -p [-k <slice>] [-n <limit>] [--no-fusion] <filename>...\n");
+        printf("       main.exe [-n <limit>] [-R <snapshot file>] [-S <snapshot file>] [-t <command>]...\n");
+        printf("                [-b|-w|-a <address>]... [--write-coverage <coverage file>]\n");
+        printf("                [--no-fusion] <filename>\n");
+        printf("       main.exe --diff <old file> <new file>\n");
+        printf("       main.exe --stats [--stats-file <output file>] <filename>...\n");
+        printf("       main.exe --lengths <filename>...\n");
+        printf("       main.exe --pipeline <filename>\n");
+        printf("       main.exe [--syntax nasm|masm|att|raw] [--addresses] [--bytes] [--segments | --region <offset>=<seg>:<off>...]\n");
+        printf("                [--coverage <coverage file>] <filename>\n");
+        printf("       main.exe -D <socket path>\n");
+        printf("       main.exe -C <socket path> <request>...\n");
         printf("    -e -- Execute\n");
+        printf("    -x -- Write the decoded instructions to a binary export file\n");
+        printf("    -r -- Read <filename> as a binary export file and print its listing\n");
+        printf("    -q -- Cross-reference query: bx, r:bx, w:bl, [1000], w:[1000]\n");
+        printf("    -d -- Annotate the listing with statically known register values\n");
+        printf("    -c -- Annotate the listing with static clock estimates per instruction and block\n");
+        printf("    -l -- Run one CPU per line of the state file (e.g. \"ax=1 cx=0x10\") in lockstep, print final states\n");
+        printf("    -p -- Run every file as a program on all cores, -k instructions at a time (default 100000)\n");
+        printf("    -n -- Run the program until it stops or executed <limit> instructions, print the final state\n");
+        printf("    -R -- Resume the program from a snapshot file\n");
+        printf("    -S -- Write a snapshot file of the state where the program stopped\n");
+        printf("    -t -- After the program stops: \"back <n>\", \"forward <n>\", \"write <address>\" (back to the last write)\n");
+        printf("    -b -- Run with a breakpoint on a byte (physical address or hex segment:offset), print every hit\n");
+        printf("    -w -- Run with a write watchpoint on a byte, print every hit\n");
+        printf("    -a -- Run with a read/write watchpoint on a byte, print every hit\n");
+        printf("    --no-fusion -- Run programs one instruction at a time instead of through fused instruction blocks\n");
+        printf("    --write-coverage -- Write a bitmap of the bytes where an executed instruction starts\n");
+        printf("    -s -- Search all files for an instruction sequence, e.g. \"mov ax, imm / int 0x21\"\n");
+        printf("    --diff -- Compare the instructions of two images, print removed, inserted and changed ones\n");
+        printf("    --stats -- Count instruction types, memory operand forms, prefixes and opcode bytes over all files\n");
+        printf("    --stats-file -- Also write every counter to a CSV file\n");
+        printf("    --lengths -- Find instruction starts from the instruction lengths only, check them against the decoder\n");
+        printf("    --pipeline -- Print the listing with reading, decoding and formatting on separate threads\n");
+        printf("    --syntax -- Print the listing in another syntax: nasm (default), masm, att or raw\n");
+        printf("    --addresses -- Start each line of the listing with the offset of the instruction\n");
+        printf("    --bytes -- Start each line of the listing with the bytes of the instruction\n");
+        printf("    --region -- Load the image from a file offset on at a hex segment:offset, e.g. 0x200=1000:0000\n");
+        printf("    --segments -- List segment:offset addresses and branch targets from physical address 0\n");
+        printf("    --coverage -- Decode only the instructions a run executed (--write-coverage), list the rest as data\n");
+        printf("    -D -- Run as a server on a Unix domain socket\n");
+        printf("    -C -- Send each following argument as a request to a server and print the responses\n");
     }
 }
\ No newline at end of file
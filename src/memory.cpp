@@ -0,0 +1,309 @@
+#include "common.cpp"
+
+// Emulated 1 MiB address space as a table of 4 KiB pages.
+//
+// A MemoryImage holds the loaded program and is shared read-only by every instance created from it. An instance
+// (Memory) starts with all of its pages pointing into the image and copies a page on the first write to it, so
+// creating an instance costs a page table and instances only pay for the pages they modify.
+
+#define MEMORY_SIZE 0x100000
+#define MEMORY_ADDRESS_MASK (MEMORY_SIZE - 1)
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define PAGE_COUNT (MEMORY_SIZE >> PAGE_SHIFT)
+
+// Backs every page that was never written, in images and instances
+static u8 zeroPage[PAGE_SIZE];
+
+struct MemoryImage
+{
+    u8* pages[PAGE_COUNT]; // zeroPage for pages without data
+    u32 pageCount;         // Pages with data
+};
+
+// Old values of written bytes, in write order
+struct MemoryWriteLog
+{
+    u32* addresses;
+    u8* values;
+    u32 count;
+    u32 capacity;
+};
+
+enum WatchFlags
+{
+    WATCH_READ    = 0b001,
+    WATCH_WRITE   = 0b010,
+    WATCH_EXECUTE = 0b100, // Breakpoint, checked by the emulator before an instruction
+    WATCH_CODE    = 0b1000, // Decoded into cached blocks (fusion.cpp), writes to those bytes invalidate the blocks
+};
+
+// Breakpoints and watchpoints
+struct MemoryWatch
+{
+    u8 pageFlags[PAGE_COUNT]; // WatchFlags of any byte on the page
+    u8* flags[PAGE_COUNT];    // WatchFlags of every byte, nullptr for pages without any
+
+    // First read or write watchpoint hit since it was last cleared
+    bool hit;
+    u32 hitAddress;
+    WatchFlags hitKind;
+};
+
+struct Memory
+{
+    MemoryImage* base;
+    MemoryWriteLog* writeLog; // Optional, records every write
+    MemoryWatch* watch;       // Optional
+
+    // WatchFlags of each page while a watch is attached, and WATCH_CODE. Accesses only look further on pages with a
+    // flag set.
+    u8 watchPages[PAGE_COUNT];
+
+    // Bit per byte of the pages with WATCH_CODE, set for bytes that cached blocks were decoded from
+    u64* codeBytes[PAGE_COUNT];
+    u32 codeGeneration; // Incremented by every write to those bytes
+
+    u8* readPages[PAGE_COUNT];    // Base, zero or private page
+    u8* privatePages[PAGE_COUNT]; // Copies owned by this instance
+    u32 privatePageCount;
+
+    // Private page, nullptr until the first write since the instance was created or write protected. A page with a
+    // write pointer is dirty, which is what snapshots use to find modified pages.
+    u8* writePages[PAGE_COUNT];
+};
+
+inline u32 PhysicalAddress(u16 segment, u16 offset)
+{
+    return (((u32)segment << 4) + offset) & MEMORY_ADDRESS_MASK;
+}
+
+void MemoryImage_Init(MemoryImage* image)
+{
+    *image = {};
+    for (u32 page = 0; page < PAGE_COUNT; ++page) image->pages[page] = zeroPage;
+}
+
+/// @brief Copies data into the image at a physical address. Wraps around at 1 MiB.
+void MemoryImage_Load(MemoryImage* image, u32 address, u8* data, u32 size)
+{
+    for (u32 index = 0; index < size; ++index)
+    {
+        u32 physical = (address + index) & MEMORY_ADDRESS_MASK;
+        u32 page = physical >> PAGE_SHIFT;
+
+        if (image->pages[page] == zeroPage)
+        {
+            image->pages[page] = (u8*)calloc(1, PAGE_SIZE);
+            ++image->pageCount;
+        }
+        image->pages[page][physical & PAGE_MASK] = data[index];
+    }
+}
+
+void MemoryImage_Free(MemoryImage* image)
+{
+    for (u32 page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (image->pages[page] != zeroPage) free(image->pages[page]);
+    }
+    *image = {};
+}
+
+/// @brief Creates an instance that shares every page with the image. The image must outlive the instance.
+void Memory_Init(Memory* memory, MemoryImage* base)
+{
+    memory->base = base;
+    memory->writeLog = nullptr;
+    memory->watch = nullptr;
+    memory->privatePageCount = 0;
+    memset(memory->watchPages, 0, sizeof(memory->watchPages));
+    memset(memory->codeBytes, 0, sizeof(memory->codeBytes));
+    memory->codeGeneration = 0;
+    memcpy(memory->readPages, base->pages, sizeof(memory->readPages));
+    memset(memory->privatePages, 0, sizeof(memory->privatePages));
+    memset(memory->writePages, 0, sizeof(memory->writePages));
+}
+
+void Memory_Free(Memory* memory)
+{
+    for (u32 page = 0; page < PAGE_COUNT; ++page)
+    {
+        free(memory->privatePages[page]);
+        free(memory->codeBytes[page]);
+    }
+    *memory = {};
+}
+
+/// @brief Makes a page writable: copies it on the first write, and marks it dirty
+u8* Memory_PrepareWrite(Memory* memory, u32 page)
+{
+    // NOTE: Snapshots replace whole pages through here without Memory_Write8().
+    if (memory->watchPages[page] & WATCH_CODE) ++memory->codeGeneration;
+
+    u8* copy = memory->privatePages[page];
+    if (!copy)
+    {
+        copy = (u8*)malloc(PAGE_SIZE);
+        memcpy(copy, memory->readPages[page], PAGE_SIZE);
+
+        memory->readPages[page] = copy;
+        memory->privatePages[page] = copy;
+        ++memory->privatePageCount;
+    }
+
+    memory->writePages[page] = copy;
+    return copy;
+}
+
+/// @brief Drops the private copy of a page, the page reads from the base image again
+void Memory_ReleasePage(Memory* memory, u32 page)
+{
+    if (!memory->privatePages[page]) return;
+    if (memory->watchPages[page] & WATCH_CODE) ++memory->codeGeneration;
+
+    free(memory->privatePages[page]);
+    memory->privatePages[page] = nullptr;
+    memory->writePages[page] = nullptr;
+    memory->readPages[page] = memory->base->pages[page];
+    --memory->privatePageCount;
+}
+
+/// @brief Clears the dirty state of every page. The next write to a page goes through Memory_PrepareWrite().
+void Memory_WriteProtect(Memory* memory)
+{
+    memset(memory->writePages, 0, sizeof(memory->writePages));
+}
+
+void Memory_LogWrite(MemoryWriteLog* log, u32 address, u8 oldValue)
+{
+    if (log->count == log->capacity)
+    {
+        log->capacity = (log->capacity ? log->capacity * 2 : 1024);
+        log->addresses = (u32*)realloc(log->addresses, log->capacity * sizeof(u32));
+        log->values = (u8*)realloc(log->values, log->capacity * sizeof(u8));
+    }
+
+    log->addresses[log->count] = address;
+    log->values[log->count] = oldValue;
+    ++log->count;
+}
+
+void MemoryWatch_Init(MemoryWatch* watch)
+{
+    *watch = {};
+}
+
+void MemoryWatch_Free(MemoryWatch* watch)
+{
+    for (u32 page = 0; page < PAGE_COUNT; ++page) free(watch->flags[page]);
+    *watch = {};
+}
+
+/// @brief Adds WatchFlags to the bytes of a physical address range. Wraps around at 1 MiB.
+void MemoryWatch_Add(MemoryWatch* watch, u32 address, u32 size, u8 flags)
+{
+    for (u32 index = 0; index < size; ++index)
+    {
+        u32 physical = (address + index) & MEMORY_ADDRESS_MASK;
+        u32 page = physical >> PAGE_SHIFT;
+
+        if (!watch->flags[page]) watch->flags[page] = (u8*)calloc(1, PAGE_SIZE);
+        watch->flags[page][physical & PAGE_MASK] |= flags;
+        watch->pageFlags[page] |= flags;
+    }
+}
+
+/// @brief Attaches a watch to an instance, or detaches it with nullptr. The watch must not change while attached.
+void Memory_AttachWatch(Memory* memory, MemoryWatch* watch)
+{
+    memory->watch = watch;
+    for (u32 page = 0; page < PAGE_COUNT; ++page)
+    {
+        memory->watchPages[page] = (u8)((watch ? watch->pageFlags[page] : 0) | (memory->watchPages[page] & WATCH_CODE));
+    }
+}
+
+/// @brief Marks bytes that a cached block was decoded from
+void Memory_MarkCode(Memory* memory, u32 address, u32 size)
+{
+    for (u32 index = 0; index < size; ++index)
+    {
+        u32 physical = (address + index) & MEMORY_ADDRESS_MASK;
+        u32 page = physical >> PAGE_SHIFT;
+
+        if (!memory->codeBytes[page]) memory->codeBytes[page] = (u64*)calloc(PAGE_SIZE / 64, sizeof(u64));
+        memory->codeBytes[page][(physical & PAGE_MASK) >> 6] |= 1ull << (physical & 63);
+        memory->watchPages[page] |= WATCH_CODE;
+    }
+}
+
+inline bool Memory_IsWatched(Memory* memory, u32 address, WatchFlags kind)
+{
+    u8* flags = memory->watch->flags[address >> PAGE_SHIFT];
+    return (flags && (flags[address & PAGE_MASK] & kind));
+}
+
+/// @brief Records the first hit, called for accesses to pages with a watch of that kind
+void Memory_CheckWatch(Memory* memory, u32 address, WatchFlags kind)
+{
+    MemoryWatch* watch = memory->watch;
+    if (watch->hit || !Memory_IsWatched(memory, address, kind)) return;
+
+    watch->hit = true;
+    watch->hitAddress = address;
+    watch->hitKind = kind;
+}
+
+/// @brief Called for writes to pages with a write watch or cached code
+void Memory_CheckWrite(Memory* memory, u32 address)
+{
+    u32 page = address >> PAGE_SHIFT;
+    u64* code = memory->codeBytes[page];
+    if (code && ((code[(address & PAGE_MASK) >> 6] >> (address & 63)) & 1)) ++memory->codeGeneration;
+
+    if (memory->watch && (memory->watchPages[page] & WATCH_WRITE)) Memory_CheckWatch(memory, address, WATCH_WRITE);
+}
+
+inline u8 Memory_Read8(Memory* memory, u32 address)
+{
+    address &= MEMORY_ADDRESS_MASK;
+    if (memory->watchPages[address >> PAGE_SHIFT] & WATCH_READ) Memory_CheckWatch(memory, address, WATCH_READ);
+    return memory->readPages[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
+
+inline void Memory_Write8(Memory* memory, u32 address, u8 value)
+{
+    address &= MEMORY_ADDRESS_MASK;
+    if (memory->watchPages[address >> PAGE_SHIFT] & (WATCH_WRITE | WATCH_CODE)) Memory_CheckWrite(memory, address);
+
+    u8* page = memory->writePages[address >> PAGE_SHIFT];
+    if (!page) page = Memory_PrepareWrite(memory, address >> PAGE_SHIFT);
+    if (memory->writeLog) Memory_LogWrite(memory->writeLog, address, page[address & PAGE_MASK]);
+    page[address & PAGE_MASK] = value;
+}
+
+// NOTE: Words are little endian and may cross a page boundary. The high byte is at the next offset in the same
+// segment, a word at offset 0xFFFF wraps around to segment:0000.
+inline u16 Memory_Read16(Memory* memory, u16 segment, u16 offset)
+{
+    return (u16)(Memory_Read8(memory, PhysicalAddress(segment, offset)) |
+                 (Memory_Read8(memory, PhysicalAddress(segment, (u16)(offset + 1))) << 8));
+}
+
+inline void Memory_Write16(Memory* memory, u16 segment, u16 offset, u16 value)
+{
+    Memory_Write8(memory, PhysicalAddress(segment, offset), (u8)(value & 0xFF));
+    Memory_Write8(memory, PhysicalAddress(segment, (u16)(offset + 1)), (u8)(value >> 8));
+}
+
+/// @brief Copies bytes out of the instance, e.g. to decode an instruction. Does not trigger watchpoints.
+void Memory_ReadBlock(Memory* memory, u32 address, u8* target, u32 size)
+{
+    for (u32 index = 0; index < size; ++index)
+    {
+        u32 physical = (address + index) & MEMORY_ADDRESS_MASK;
+        target[index] = memory->readPages[physical >> PAGE_SHIFT][physical & PAGE_MASK];
+    }
+}
@@ -0,0 +1,342 @@
+#include "common.cpp"
+
+// Streaming disassembly on three threads plus the caller: reading, decoding and formatting overlap instead of
+// running one after another.
+//
+// The reader reads the file in chunks, the decoder turns chunks into batches of instructions, the formatter prints
+// batches into text blocks and the calling thread writes the blocks to standard output. Neighbouring stages are
+// connected by bounded single-producer, single-consumer rings. A null item marks the end of the stream. A stage that
+// finds its ring full or empty retries a few times and then sleeps until the other side pushes or pops.
+//
+// Every stage measures the time it spends working, as opposed to waiting on a full or empty ring, so the stage
+// that limits throughput is the one that is busy close to all the time.
+
+#define PIPELINE_RING_SIZE 16 // Items in flight between two stages, power of two
+#define PIPELINE_CHUNK_SIZE (64 * 1024)
+#define PIPELINE_BATCH_SIZE 1024
+#define PIPELINE_SPIN_COUNT 64 // Attempts on a full or empty ring before a stage sleeps
+
+// NOTE: Head and tail are on separate cache lines, each is written by one thread only.
+struct PipelineRing
+{
+    void* items[PIPELINE_RING_SIZE];
+    alignas(64) std::atomic<u32> head; // Next item to pop, written by the consumer
+    alignas(64) std::atomic<u32> tail; // Next slot to push, written by the producer
+
+    // Only used once a stage sleeps
+    alignas(64) std::atomic<u32> sleeping;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+struct PipelineStage
+{
+    const char* name;
+    u64 items;
+    double busySeconds;
+    double totalSeconds;
+};
+
+bool PipelineRing_TryPush(PipelineRing* ring, void* item)
+{
+    u32 tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == PIPELINE_RING_SIZE) return false;
+
+    ring->items[tail % PIPELINE_RING_SIZE] = item;
+    ring->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool PipelineRing_TryPop(PipelineRing* ring, void** item)
+{
+    u32 head = ring->head.load(std::memory_order_relaxed);
+    if (head == ring->tail.load(std::memory_order_acquire)) return false;
+
+    *item = ring->items[head % PIPELINE_RING_SIZE];
+    ring->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+/// @brief Wakes the other stage if it sleeps on the ring. Called after every push and pop.
+inline void PipelineRing_Wake(PipelineRing* ring)
+{
+    // NOTE: Pairs with the fence in PipelineRing_Sleep(): either the sleeper sees the new head or tail before it
+    // waits, or this sees the sleeper and takes the lock, which it holds until it waits.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->sleeping.load(std::memory_order_relaxed) == 0) return;
+
+    std::lock_guard<std::mutex> lock(ring->lock);
+    ring->changed.notify_all();
+}
+
+/// @brief Sleeps until attempt() succeeds, attempt is a TryPush or TryPop on the ring
+template <typename Attempt>
+void PipelineRing_Sleep(PipelineRing* ring, Attempt attempt)
+{
+    std::unique_lock<std::mutex> lock(ring->lock);
+    ring->sleeping.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ring->changed.wait(lock, attempt);
+    ring->sleeping.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void PipelineRing_Push(PipelineRing* ring, void* item)
+{
+    u32 spin = 0;
+    while (!PipelineRing_TryPush(ring, item))
+    {
+        if (++spin < PIPELINE_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        PipelineRing_Sleep(ring, [ring, item] { return PipelineRing_TryPush(ring, item); });
+        break;
+    }
+    PipelineRing_Wake(ring);
+}
+
+void* PipelineRing_Pop(PipelineRing* ring)
+{
+    void* item;
+    u32 spin = 0;
+    while (!PipelineRing_TryPop(ring, &item))
+    {
+        if (++spin < PIPELINE_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        PipelineRing_Sleep(ring, [ring, &item] { return PipelineRing_TryPop(ring, &item); });
+        break;
+    }
+    PipelineRing_Wake(ring);
+    return item;
+}
+
+inline double Pipeline_Seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct PipelineChunk
+{
+    u8* data;
+    u32 size;
+    bool last;
+};
+
+struct PipelineBatch
+{
+    Instruction instructions[PIPELINE_BATCH_SIZE];
+    u8 unknownOpcodes[PIPELINE_BATCH_SIZE]; // Opcode byte of unrecognized instructions
+    bool recognized[PIPELINE_BATCH_SIZE];
+    u32 count;
+};
+
+struct Pipeline
+{
+    FILE* file;
+
+    PipelineRing chunks;
+    PipelineRing batches;
+    PipelineRing blocks; // OutputBuffer*
+
+    PipelineStage reader;
+    PipelineStage decoder;
+    PipelineStage formatter;
+    PipelineStage writer;
+};
+
+void Pipeline_Reader(Pipeline* pipeline)
+{
+    PipelineStage* stage = &pipeline->reader;
+    double start = Pipeline_Seconds();
+
+    for (bool last = false; !last;)
+    {
+        double busyStart = Pipeline_Seconds();
+        PipelineChunk* chunk = (PipelineChunk*)malloc(sizeof(PipelineChunk));
+        chunk->data = (u8*)malloc(PIPELINE_CHUNK_SIZE);
+        chunk->size = (u32)fread(chunk->data, 1, PIPELINE_CHUNK_SIZE, pipeline->file);
+        chunk->last = last = (chunk->size < PIPELINE_CHUNK_SIZE);
+        stage->busySeconds += Pipeline_Seconds() - busyStart;
+
+        ++stage->items;
+        PipelineRing_Push(&pipeline->chunks, chunk);
+    }
+    PipelineRing_Push(&pipeline->chunks, nullptr);
+
+    stage->totalSeconds = Pipeline_Seconds() - start;
+}
+
+void Pipeline_Decoder(Pipeline* pipeline)
+{
+    PipelineStage* stage = &pipeline->decoder;
+    double start = Pipeline_Seconds();
+
+    // Unread bytes of the previous chunks followed by the current chunk. An instruction that continues in the
+    // next chunk stays in the buffer until that chunk arrives.
+    u8* buffer = nullptr;
+    u32 bufferSize = 0;
+    u32 bufferOffset = 0; // File offset of the start of the buffer
+
+    PipelineBatch* batch = nullptr;
+    while (PipelineChunk* chunk = (PipelineChunk*)PipelineRing_Pop(&pipeline->chunks))
+    {
+        double busyStart = Pipeline_Seconds();
+
+        buffer = (u8*)realloc(buffer, bufferSize + chunk->size + 1);
+        memcpy(buffer + bufferSize, chunk->data, chunk->size);
+        bufferSize += chunk->size;
+
+        ByteStream stream = {buffer, bufferSize, 0};
+        while (stream.position < stream.size)
+        {
+            if (!batch)
+            {
+                batch = (PipelineBatch*)malloc(sizeof(PipelineBatch));
+                batch->count = 0;
+            }
+
+            u32 instructionStart = stream.position;
+            Instruction* instruction = &batch->instructions[batch->count];
+            bool recognized = DecodeInstruction(&stream, instruction);
+
+            // NOTE: Truncated instructions and trailing prefixes are only final at the end of the file.
+            bool truncated = (stream.position > stream.size || instruction->length == instruction->prefixLength);
+            if (truncated && !chunk->last)
+            {
+                stream.position = instructionStart;
+                break;
+            }
+
+            instruction->offset += bufferOffset;
+            batch->recognized[batch->count] = recognized;
+            batch->unknownOpcodes[batch->count] = buffer[instructionStart + instruction->prefixLength];
+            if (++batch->count == PIPELINE_BATCH_SIZE)
+            {
+                stage->items += batch->count;
+                stage->busySeconds += Pipeline_Seconds() - busyStart;
+                PipelineRing_Push(&pipeline->batches, batch);
+                busyStart = Pipeline_Seconds();
+                batch = nullptr;
+            }
+        }
+
+        // NOTE: A truncated instruction at the end of the file leaves the position past the end.
+        u32 consumed = (stream.position < bufferSize ? stream.position : bufferSize);
+        memmove(buffer, buffer + consumed, bufferSize - consumed);
+        bufferSize -= consumed;
+        bufferOffset += consumed;
+
+        free(chunk->data);
+        free(chunk);
+        stage->busySeconds += Pipeline_Seconds() - busyStart;
+    }
+
+    if (batch && batch->count > 0)
+    {
+        stage->items += batch->count;
+        PipelineRing_Push(&pipeline->batches, batch);
+    }
+    else free(batch);
+    PipelineRing_Push(&pipeline->batches, nullptr);
+
+    free(buffer);
+    stage->totalSeconds = Pipeline_Seconds() - start;
+}
+
+void Pipeline_Formatter(Pipeline* pipeline)
+{
+    PipelineStage* stage = &pipeline->formatter;
+    double start = Pipeline_Seconds();
+
+    while (PipelineBatch* batch = (PipelineBatch*)PipelineRing_Pop(&pipeline->batches))
+    {
+        double busyStart = Pipeline_Seconds();
+
+        OutputBuffer* block = (OutputBuffer*)calloc(1, sizeof(OutputBuffer));
+        printTarget = block;
+        for (u32 index = 0; index < batch->count; ++index)
+        {
+            if (!batch->recognized[index]) Print("; %x", batch->unknownOpcodes[index]);
+            PrintInstruction(&batch->instructions[index]);
+            Print("\n");
+        }
+        printTarget = nullptr;
+        free(batch);
+
+        ++stage->items;
+        stage->busySeconds += Pipeline_Seconds() - busyStart;
+        PipelineRing_Push(&pipeline->blocks, block);
+    }
+    PipelineRing_Push(&pipeline->blocks, nullptr);
+
+    stage->totalSeconds = Pipeline_Seconds() - start;
+}
+
+void Pipeline_PrintStage(PipelineStage* stage, const char* unit)
+{
+    double utilisation = (stage->totalSeconds > 0 ? 100.0 * stage->busySeconds / stage->totalSeconds : 0);
+    printf("; %-10s %10llu %-13s %8.2f ms busy %6.1f%%\n", stage->name, (unsigned long long)stage->items, unit,
+        stage->busySeconds * 1000.0, utilisation);
+}
+
+/// @brief Prints the listing of a file like the default mode, with reading, decoding and formatting on separate threads
+/// @return false if the file could not be opened
+bool Pipeline_PrintListing(char* fileName)
+{
+    Pipeline* pipeline = new Pipeline();
+    fopen_s(&pipeline->file, fileName, "rb");
+    if (!pipeline->file)
+    {
+        delete pipeline;
+        return false;
+    }
+
+    pipeline->reader.name = "reader";
+    pipeline->decoder.name = "decoder";
+    pipeline->formatter.name = "formatter";
+    pipeline->writer.name = "writer";
+
+    printf("; Disassembly: %s\n", fileName);
+    printf("bits 16\n");
+    fflush(stdout);
+
+    std::thread reader(Pipeline_Reader, pipeline);
+    std::thread decoder(Pipeline_Decoder, pipeline);
+    std::thread formatter(Pipeline_Formatter, pipeline);
+
+    // The calling thread is the writer
+    PipelineStage* stage = &pipeline->writer;
+    double start = Pipeline_Seconds();
+    while (OutputBuffer* block = (OutputBuffer*)PipelineRing_Pop(&pipeline->blocks))
+    {
+        double busyStart = Pipeline_Seconds();
+        fwrite(block->data, 1, block->size, stdout);
+        free(block->data);
+        free(block);
+
+        ++stage->items;
+        stage->busySeconds += Pipeline_Seconds() - busyStart;
+    }
+    fflush(stdout);
+    stage->totalSeconds = Pipeline_Seconds() - start;
+
+    reader.join();
+    decoder.join();
+    formatter.join();
+    fclose(pipeline->file);
+
+    printf("; pipeline: %.2f ms\n", stage->totalSeconds * 1000.0);
+    Pipeline_PrintStage(&pipeline->reader, "chunks");
+    Pipeline_PrintStage(&pipeline->decoder, "instructions");
+    Pipeline_PrintStage(&pipeline->formatter, "blocks");
+    Pipeline_PrintStage(&pipeline->writer, "blocks");
+
+    delete pipeline;
+    return true;
+}
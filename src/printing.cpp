@@ -0,0 +1,261 @@
+#include "common.cpp"
+
+static char* const registers8bit[] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+static char* const registers16bit[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+static char* const registersSegment[] = {"es", "cs", "ss", "ds"};
+static char* const effectiveAddressTable[] = { "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx" };
+static char* const segmentOverrideNames[] = {"es:", "cs:", "ss:", "ds:"};
+
+struct OutputBuffer
+{
+    char* data;
+    u32 size;
+    u32 capacity;
+};
+
+// Output of the Print functions: standard output, or a buffer set by a thread that collects its output (the server)
+static thread_local OutputBuffer* printTarget = nullptr;
+
+void Print(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    OutputBuffer* target = printTarget;
+    if (!target)
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    va_list retry;
+    va_copy(retry, args);
+
+    u32 available = target->capacity - target->size;
+    int length = vsnprintf(target->data + target->size, available, format, args);
+    if (length > 0 && (u32)length >= available)
+    {
+        while (target->capacity - target->size <= (u32)length) target->capacity = (target->capacity ? target->capacity * 2 : 4096);
+        target->data = (char*)realloc(target->data, target->capacity);
+        vsnprintf(target->data + target->size, target->capacity - target->size, format, retry);
+    }
+    if (length > 0) target->size += (u32)length;
+
+    va_end(retry);
+    va_end(args);
+}
+
+void PrintAddressOperand(const char* segment, char* effectiveAddress, i8 displacement)
+{
+    if (displacement == 0)
+    {
+        Print("[%s%s]", segment, effectiveAddress);
+    }
+    else
+    {
+        Print("[%s%s %s %d]", segment, effectiveAddress, 
+            (displacement >= 0 ? "+" : "-"), 
+            (displacement < 0 ? -displacement : displacement));
+    }
+}
+
+void PrintAddressOperand(const char* segment, char* effectiveAddress, i16 displacement)
+{
+    if (displacement == 0)
+    {
+        Print("[%s%s]", segment, effectiveAddress);
+    }
+    else
+    {
+        Print("[%s%s %s %d]", segment, effectiveAddress, 
+            (displacement >= 0 ? "+" : "-"), 
+            (displacement < 0 ? -displacement : displacement));
+    }
+}
+
+/// @param segment segment override of a memory operand ("es:"), or ""
+void PrintOperand(Operand operand, bool wideOperation, const char* segment = "")
+{
+    switch (operand.type)
+    {
+        case OP_REGISTER:
+        {
+            // NOTE: Size of registers is implicitly known, so size specification is not needed
+            char* const* registerNames = (wideOperation? registers16bit : registers8bit);
+            Print("%s", registerNames[operand.regmemIndex]);
+        }
+        break;
+        case OP_SEGMENT_REGISTER:
+        {
+            Print("%s", registersSegment[operand.regmemIndex]);
+        }
+        break;
+        case OP_IMMEDIATE:
+        {
+            if (operand.outputWidth)
+            {
+                Print(wideOperation? "word " : "byte ");
+            }
+            Print("%d", (wideOperation? (i16)operand.value : (i8)operand.valueLow));
+        }
+        break;
+        case OP_MEMORY:
+        {
+            if (operand.outputWidth)
+            {
+                Print(wideOperation? "word " : "byte ");
+            }
+            if (operand.modField == MEMORY_0BIT_MODE)
+            {
+                if (operand.regmemIndex == MEM_DIRECT)
+                {
+                    Print("[%s%d]", segment, (i16)operand.value);
+                }
+                else
+                {
+                    Print("[%s%s]", segment, effectiveAddressTable[operand.regmemIndex]);
+                }
+            }
+            else if (operand.modField == MEMORY_8BIT_MODE)
+            {
+                PrintAddressOperand(segment, effectiveAddressTable[operand.regmemIndex], (i8)operand.valueLow);
+            }
+            else if (operand.modField == MEMORY_16BIT_MODE)
+            {
+                PrintAddressOperand(segment, effectiveAddressTable[operand.regmemIndex], (i16)operand.value);
+            }
+            else
+            {
+                Print("; error: memory operand in register mode\n");
+            }
+        }
+        break;
+    }
+}
+
+void PrintInstruction(Instruction* inst)
+{
+    Assert(inst->operandCount >= 0 && inst->operandCount <= 2);
+
+    const char* segment = "";
+    if (inst->type != DIS_NOOP)
+    {
+        if (inst->prefixes & PREFIX_LOCK) Print("lock ");
+        if (inst->prefixes & PREFIX_REP) Print("rep ");
+        if (inst->prefixes & PREFIX_REPNE) Print("repne ");
+
+        if (inst->prefixes & PREFIX_SEGMENT)
+        {
+            // NOTE: The override is written inside the brackets of the memory operand. Instructions without one
+            // (string instructions) get it as a prefix.
+            bool hasMemoryOperand = ((inst->operandCount >= 1 && inst->opDest.type == OP_MEMORY) ||
+                                     (inst->operandCount >= 2 && inst->opSrc.type == OP_MEMORY));
+            if (hasMemoryOperand) segment = segmentOverrideNames[inst->segmentOverride];
+            else Print("%s ", registersSegment[inst->segmentOverride]);
+        }
+
+        // Prefixes without an instruction
+        if (inst->type == DIS_LOCK || inst->type == DIS_REP || inst->type == DIS_SEGMENT) return;
+    }
+
+    Print("%s", operationNames[inst->type]);
+    if (inst->type == DIS_RET && inst->isFar) Print("f");
+    Print(" ");
+
+    switch (inst->type)
+    {
+        case DIS_JO:
+        case DIS_JNO:
+        case DIS_JB:
+        case DIS_JNB:
+        case DIS_JE:
+        case DIS_JNE:
+        case DIS_JBE:
+        case DIS_JNBE:
+        case DIS_JS:
+        case DIS_JNS:
+        case DIS_JP:
+        case DIS_JNP:
+        case DIS_JL:
+        case DIS_JNL:
+        case DIS_JLE:
+        case DIS_JNLE:
+        case DIS_LOOP:
+        case DIS_LOOPZ:
+        case DIS_LOOPNZ:
+        case DIS_JCXZ:
+        {
+            i32 displacement = BranchDisplacement(inst);
+            if (displacement >= 0)
+            {
+                Print(" $+%d", displacement);
+            }
+            else
+            {
+                Print(" $%d", displacement);
+            }
+        }
+        break;
+        
+        case DIS_SHL:
+        case DIS_SHR:
+        case DIS_SAR:
+        case DIS_ROL:
+        case DIS_ROR:
+        case DIS_RCL:
+        case DIS_RCR:
+        {
+            PrintOperand(inst->opDest, inst->isWide, segment);
+            Print(", ");
+            PrintOperand(inst->opSrc, false);
+        }
+        break;
+
+        case DIS_IN:
+        {
+            PrintOperand(inst->opDest, inst->isWide);
+            Print(", ");
+            PrintOperand(inst->opSrc, true);
+        } 
+        break;
+        case DIS_OUT:
+        {
+            PrintOperand(inst->opDest, true);
+            Print(", ");
+            PrintOperand(inst->opSrc, inst->isWide);
+        }
+        break;
+
+        default:
+        {
+            if (inst->operandCount == 1)
+            {
+                if (inst->isFar && inst->type != DIS_RET) Print("far ");
+                PrintOperand(inst->opDest, inst->isWide, segment);
+            }
+            else if (inst->operandCount == 2)
+            {
+                PrintOperand(inst->opDest, inst->isWide, segment);
+                Print(", ");
+                PrintOperand(inst->opSrc, inst->isWide, segment);
+            }
+
+        }
+        break;
+    }
+}
+
+
+void PrintBinary(u16 value)
+{
+    u16 index = (1 << 15);
+    while(index)
+    {
+        if (index == (1 << 7))
+            Print(" ");
+
+        Print((value & index) ? "1" : "0");
+        index >>= 1;
+    }
+}
@@ -0,0 +1,112 @@
+#include "common.cpp"
+
+// Where the parts of a large image are loaded in memory, as segment:offset.
+//
+// Firmware and disk images are made of pieces that each run in their own segment. A region starts at a file offset
+// and is loaded at a segment:offset base, it ends where the next region starts. A region is contiguous in physical
+// memory, bytes past the first 64 KiB of its segment are addressed through the following segments (+0x1000 per
+// 64 KiB). Relative branches wrap within the 64 KiB of their segment like on the CPU, so their targets are resolved
+// in that segment instead of as plain file offsets.
+
+#define REGION_MAX_COUNT 64
+#define REGION_OUTSIDE 0xFFFFFFFF
+
+struct ImageRegion
+{
+    u32 start; // File offset
+    u16 segment;
+    u16 base;  // Offset of the first byte in the segment
+};
+
+struct RegionMap
+{
+    ImageRegion* regions; // Sorted by start, the first one starts at 0
+    u32 count;
+    u32 size; // End of the last region
+};
+
+/// @brief Parses "<file offset>=<segment>:<offset>", segment and offset in hex
+bool Regions_Parse(char* text, ImageRegion* region)
+{
+    char* end;
+    u32 start = (u32)strtoul(text, &end, 0);
+    if (end == text || *end != '=') return false;
+
+    char* segmentText = end + 1;
+    u32 segment = (u32)strtoul(segmentText, &end, 16);
+    if (end == segmentText || *end != ':') return false;
+
+    char* baseText = end + 1;
+    u32 base = (u32)strtoul(baseText, &end, 16);
+    if (end == baseText || *end != 0 || segment > 0xFFFF || base > 0xFFFF) return false;
+
+    region->start = start;
+    region->segment = (u16)segment;
+    region->base = (u16)base;
+    return true;
+}
+
+/// @brief Sorts the given regions into a map. Bytes before the first region are in a region at 0000:0000.
+/// @param size image size
+/// @param[out] map free with Regions_Free()
+void Regions_Build(ImageRegion* regions, u32 count, u32 size, RegionMap* map)
+{
+    map->regions = (ImageRegion*)malloc((count + 1) * sizeof(ImageRegion));
+    map->count = 0;
+    map->size = size;
+
+    bool hasStart = false;
+    for (u32 index = 0; index < count; ++index) hasStart |= (regions[index].start == 0);
+    if (!hasStart) map->regions[map->count++] = {0, 0, 0};
+
+    for (u32 index = 0; index < count; ++index)
+    {
+        u32 position = map->count++;
+        while (position > 0 && map->regions[position - 1].start > regions[index].start)
+        {
+            map->regions[position] = map->regions[position - 1];
+            --position;
+        }
+        map->regions[position] = regions[index];
+    }
+}
+
+void Regions_Free(RegionMap* map)
+{
+    free(map->regions);
+    *map = {};
+}
+
+/// @brief Segment:offset of a file offset in a region
+/// NOTE: Past 1 MiB the segments wrap around, like physical addresses on the 8086.
+inline void Regions_Address(ImageRegion* region, u32 fileOffset, u16* segment, u16* offset)
+{
+    u32 position = region->base + (fileOffset - region->start);
+    *segment = (u16)(region->segment + (position >> 16) * 0x1000);
+    *offset = (u16)position;
+}
+
+/// @brief Resolves the target of a relative branch in its region
+/// @param[out] segment segment of the target
+/// @param[out] targetOffset offset of the target in the segment
+/// @param[out] fileOffset file offset of the target, REGION_OUTSIDE if it is not in the region
+/// @return false if the instruction is not a relative branch
+bool Regions_BranchTarget(RegionMap* map, u32 region, Instruction* instruction, u16* segment, u16* targetOffset,
+    u32* fileOffset)
+{
+    if (!IsConditionalJump(instruction->type) && !IsLoopInstruction(instruction->type)) return false;
+
+    ImageRegion* current = &map->regions[region];
+    u16 ip;
+    Regions_Address(current, instruction->offset, segment, &ip);
+    *targetOffset = (u16)(ip + BranchDisplacement(instruction));
+
+    // Position in the region's memory, the target is in the same 64 KiB
+    u32 position = current->base + (instruction->offset - current->start);
+    u32 targetPosition = (position & ~0xFFFFu) + *targetOffset;
+    u32 end = (region + 1 < map->count ? map->regions[region + 1].start : map->size);
+    u32 target = current->start + (targetPosition - current->base);
+
+    *fileOffset = (targetPosition >= current->base && target < end ? target : REGION_OUTSIDE);
+    return true;
+}
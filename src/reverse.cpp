@@ -0,0 +1,220 @@
+#include "common.cpp"
+
+// Reverse execution of a machine.
+//
+// Execution is split into segments of a fixed number of instructions with a snapshot (checkpoint) at the start of
+// each one. Within the current segment, every instruction logs the registers it started with and the old value of
+// every byte it wrote, so stepping back inside the segment is undoing log entries. Going back further restores the
+// checkpoint of the segment and replays forward, which rebuilds the log for that segment.
+//
+// NOTE: Replaying relies on execution being deterministic. The machine must not be modified from outside while a
+// timeline is attached to it.
+
+#define TIMELINE_DEFAULT_INTERVAL 65536
+
+struct UndoEntry
+{
+    CPU cpu;
+    u16 ip;
+    MachineStatus status;
+    u32 firstWrite; // Index of the first write log entry of the instruction
+};
+
+struct Timeline
+{
+    Machine* machine;
+    u64 origin;   // Instruction count where the timeline starts
+    u64 interval; // Instructions per segment
+
+    Snapshot** checkpoints; // checkpoints[index] is at instruction origin + index * interval
+    u32 checkpointCount;
+    u32 checkpointCapacity;
+    Snapshot* current;      // Snapshot the dirty pages of the machine are relative to
+
+    // Instructions since the start of the current segment
+    UndoEntry* entries;
+    u32 entryCount;
+    MemoryWriteLog writes;
+};
+
+/// @brief Attaches a timeline to a machine and takes the first checkpoint at its current instruction count
+void Timeline_Init(Timeline* timeline, Machine* machine, u64 interval)
+{
+    *timeline = {};
+    timeline->machine = machine;
+    timeline->origin = machine->instructionCount;
+    timeline->interval = (interval > 0 ? interval : TIMELINE_DEFAULT_INTERVAL);
+
+    timeline->checkpointCapacity = 16;
+    timeline->checkpoints = (Snapshot**)malloc(timeline->checkpointCapacity * sizeof(Snapshot*));
+    timeline->checkpoints[timeline->checkpointCount++] = timeline->current = Snapshot_Take(machine, nullptr);
+
+    timeline->entries = (UndoEntry*)malloc((u64)timeline->interval * sizeof(UndoEntry));
+    machine->memory.writeLog = &timeline->writes;
+}
+
+void Timeline_Free(Timeline* timeline)
+{
+    timeline->machine->memory.writeLog = nullptr;
+
+    // Children before parents
+    for (u32 index = timeline->checkpointCount; index > 0; --index) Snapshot_Free(timeline->checkpoints[index - 1]);
+    free(timeline->checkpoints);
+    free(timeline->entries);
+    free(timeline->writes.addresses);
+    free(timeline->writes.values);
+    *timeline = {};
+}
+
+/// @brief Executes one instruction with undo logging
+/// @return false if the machine did not execute an instruction or stopped
+bool Timeline_Step(Timeline* timeline)
+{
+    Machine* machine = timeline->machine;
+    if (machine->status != MACHINE_RUNNING) return false;
+
+    u64 position = machine->instructionCount - timeline->origin;
+    if (position % timeline->interval == 0)
+    {
+        // Start of a segment: take its checkpoint, or continue from it when replaying
+        u64 segment = position / timeline->interval;
+        if (segment == timeline->checkpointCount)
+        {
+            if (timeline->checkpointCount == timeline->checkpointCapacity)
+            {
+                timeline->checkpointCapacity *= 2;
+                timeline->checkpoints = (Snapshot**)realloc(timeline->checkpoints, timeline->checkpointCapacity * sizeof(Snapshot*));
+            }
+            timeline->checkpoints[timeline->checkpointCount++] = Snapshot_Take(machine, timeline->current);
+        }
+        else
+        {
+            Memory_WriteProtect(&machine->memory);
+        }
+
+        timeline->current = timeline->checkpoints[segment];
+        timeline->entryCount = 0;
+        timeline->writes.count = 0;
+    }
+
+    UndoEntry* entry = &timeline->entries[timeline->entryCount];
+    entry->cpu = machine->cpu;
+    entry->ip = machine->ip;
+    entry->status = machine->status;
+    entry->firstWrite = timeline->writes.count;
+
+    u64 before = machine->instructionCount;
+    bool running = Emulator_Step(machine);
+    if (machine->instructionCount != before) ++timeline->entryCount;
+    return running;
+}
+
+u64 Timeline_Run(Timeline* timeline, u64 maxInstructions)
+{
+    u64 start = timeline->machine->instructionCount;
+    while (timeline->machine->instructionCount - start < maxInstructions && Timeline_Step(timeline))
+    {
+    }
+    return timeline->machine->instructionCount - start;
+}
+
+/// @brief Undoes the last instruction of the current segment
+void Timeline_Undo(Timeline* timeline)
+{
+    Assert(timeline->entryCount > 0);
+    Machine* machine = timeline->machine;
+    UndoEntry* entry = &timeline->entries[--timeline->entryCount];
+
+    machine->memory.writeLog = nullptr;
+    for (u32 index = timeline->writes.count; index > entry->firstWrite; --index)
+    {
+        Memory_Write8(&machine->memory, timeline->writes.addresses[index - 1], timeline->writes.values[index - 1]);
+    }
+    machine->memory.writeLog = &timeline->writes;
+    timeline->writes.count = entry->firstWrite;
+
+    machine->cpu = entry->cpu;
+    machine->ip = entry->ip;
+    machine->status = entry->status;
+    --machine->instructionCount;
+}
+
+/// @brief Moves the machine to the state before the given instruction count
+/// @return false if the machine stops before reaching a later count
+bool Timeline_Seek(Timeline* timeline, u64 target)
+{
+    Machine* machine = timeline->machine;
+    u64 segmentStart = machine->instructionCount - timeline->entryCount;
+    if (target < timeline->origin) target = timeline->origin;
+
+    if (target < segmentStart)
+    {
+        u64 segment = (target - timeline->origin) / timeline->interval;
+        Snapshot_Restore(machine, timeline->current, timeline->checkpoints[segment]);
+        timeline->current = timeline->checkpoints[segment];
+        timeline->entryCount = 0;
+        timeline->writes.count = 0;
+    }
+
+    while (machine->instructionCount > target) Timeline_Undo(timeline);
+    Timeline_Run(timeline, target - machine->instructionCount);
+    return (machine->instructionCount == target);
+}
+
+/// @brief Finds the last instruction in the current segment that wrote a byte
+/// @return instruction index within the segment, or -1
+i64 Timeline_FindWrite(Timeline* timeline, u32 address)
+{
+    for (u32 index = timeline->writes.count; index > 0; --index)
+    {
+        if (timeline->writes.addresses[index - 1] != address) continue;
+
+        // Entries are in write order, find the instruction the write belongs to
+        u32 low = 0;
+        u32 high = timeline->entryCount;
+        while (high - low > 1)
+        {
+            u32 middle = low + (high - low) / 2;
+            if (timeline->entries[middle].firstWrite <= index - 1) low = middle;
+            else high = middle;
+        }
+        return low;
+    }
+    return -1;
+}
+
+/// @brief Goes back to just before the last instruction that wrote the byte at a physical address
+/// @return false if no earlier instruction wrote it, the machine is then where it started
+bool Timeline_RunBackToWrite(Timeline* timeline, u32 address)
+{
+    Machine* machine = timeline->machine;
+    address &= MEMORY_ADDRESS_MASK;
+    u64 start = machine->instructionCount;
+
+    i64 found = Timeline_FindWrite(timeline, address);
+    if (found >= 0)
+    {
+        Timeline_Seek(timeline, machine->instructionCount - timeline->entryCount + found);
+        return true;
+    }
+
+    // Replay earlier segments, newest first, until one of them has the write
+    u64 segment = (start - timeline->entryCount - timeline->origin) / timeline->interval;
+    while (segment > 0)
+    {
+        --segment;
+        u64 segmentStart = timeline->origin + segment * timeline->interval;
+        Timeline_Seek(timeline, segmentStart);
+        Timeline_Run(timeline, timeline->interval);
+
+        found = Timeline_FindWrite(timeline, address);
+        if (found >= 0)
+        {
+            Timeline_Seek(timeline, segmentStart + found);
+            return true;
+        }
+    }
+
+    Timeline_Seek(timeline, start);
+    return false;
+}
@@ -0,0 +1,221 @@
+#include "common.cpp"
+
+// Runs many independent programs on a pool of worker threads, a slice of instructions at a time.
+//
+// Every worker owns a queue of programs. A worker runs the program at the front of its queue for one slice and
+// puts it back at the end if it is still running, so long programs take turns with short ones instead of blocking
+// them. Workers with an empty queue steal from the end of another worker's queue. A worker that finds nothing to
+// steal parks until a program is put back in a queue or the last program finishes.
+
+struct ScheduledProgram
+{
+    char* fileName;
+    bool loaded;
+    MemoryImage image;
+    Machine machine;
+};
+
+// Ring buffer of program indices. Every program is in at most one queue, so programCount entries always fit.
+struct SchedulerQueue
+{
+    std::mutex lock;
+    u32* entries;
+    u32 capacity;
+    u32 head;
+    u32 count;
+};
+
+struct Scheduler
+{
+    ScheduledProgram* programs;
+    u32 programCount;
+    u64 sliceInstructions;
+    u64 instructionLimit; // Per program, programs that reach it are reported as running
+    bool fusion;          // Run cached blocks with fused instruction pairs, see fusion.cpp
+
+    SchedulerQueue* queues;
+    u32 queueCount;
+
+    std::atomic<u32> remaining;
+    std::atomic<u32> queued; // Programs in a queue, the others are running or finished
+    std::atomic<u64> totalInstructions;
+    std::mutex outputLock;
+
+    std::mutex idleLock;
+    std::condition_variable idle;
+};
+
+void SchedulerQueue_PushBack(SchedulerQueue* queue, u32 program)
+{
+    std::lock_guard<std::mutex> lock(queue->lock);
+    Assert(queue->count < queue->capacity);
+    queue->entries[(queue->head + queue->count) % queue->capacity] = program;
+    ++queue->count;
+}
+
+bool SchedulerQueue_PopFront(SchedulerQueue* queue, u32* program)
+{
+    std::lock_guard<std::mutex> lock(queue->lock);
+    if (queue->count == 0) return false;
+
+    *program = queue->entries[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    return true;
+}
+
+bool SchedulerQueue_PopBack(SchedulerQueue* queue, u32* program)
+{
+    std::lock_guard<std::mutex> lock(queue->lock);
+    if (queue->count == 0) return false;
+
+    --queue->count;
+    *program = queue->entries[(queue->head + queue->count) % queue->capacity];
+    return true;
+}
+
+/// @brief Loads the program at 0000:0000 on first use
+/// @return false if the file could not be read
+bool Scheduler_LoadProgram(ScheduledProgram* program, bool fusion)
+{
+    ByteStream file;
+    if (!LoadFile(program->fileName, &file)) return false;
+
+    MemoryImage_Init(&program->image);
+    MemoryImage_Load(&program->image, 0, file.data, file.size);
+    Machine_Init(&program->machine, &program->image, file.size);
+    if (fusion) Fusion_Attach(&program->machine);
+    program->loaded = true;
+
+    free(file.data);
+    return true;
+}
+
+void Scheduler_Report(Scheduler* scheduler, ScheduledProgram* program)
+{
+    std::lock_guard<std::mutex> lock(scheduler->outputLock);
+    if (!program->loaded)
+    {
+        printf("; %s: failed to open file\n", program->fileName);
+        return;
+    }
+
+    printf("; %s: ", program->fileName);
+    Emulator_PrintState(&program->machine);
+    printf("\n");
+    fflush(stdout);
+}
+
+/// @brief Wakes parked workers after a program was queued or the last one finished
+void Scheduler_Wake(Scheduler* scheduler, bool all)
+{
+    // NOTE: Taking the lock orders the change before the condition check of a worker that is about to park.
+    {
+        std::lock_guard<std::mutex> lock(scheduler->idleLock);
+    }
+    if (all) scheduler->idle.notify_all();
+    else scheduler->idle.notify_one();
+}
+
+void Scheduler_Worker(Scheduler* scheduler, u32 workerIndex)
+{
+    SchedulerQueue* own = &scheduler->queues[workerIndex];
+
+    while (scheduler->remaining.load() > 0)
+    {
+        u32 programIndex;
+        bool found = SchedulerQueue_PopFront(own, &programIndex);
+        for (u32 offset = 1; !found && offset < scheduler->queueCount; ++offset)
+        {
+            found = SchedulerQueue_PopBack(&scheduler->queues[(workerIndex + offset) % scheduler->queueCount], &programIndex);
+        }
+
+        if (!found)
+        {
+            // NOTE: The remaining programs are running on other workers and may come back to a queue.
+            std::unique_lock<std::mutex> lock(scheduler->idleLock);
+            scheduler->idle.wait(lock, [scheduler] {
+                return scheduler->queued.load() > 0 || scheduler->remaining.load() == 0;
+            });
+            continue;
+        }
+        --scheduler->queued;
+
+        ScheduledProgram* program = &scheduler->programs[programIndex];
+        if (program->loaded || Scheduler_LoadProgram(program, scheduler->fusion))
+        {
+            Machine* machine = &program->machine;
+            u64 budget = scheduler->instructionLimit - machine->instructionCount;
+            scheduler->totalInstructions += Emulator_Run(machine, (budget < scheduler->sliceInstructions ? budget : scheduler->sliceInstructions));
+            if (machine->status == MACHINE_RUNNING && machine->instructionCount < scheduler->instructionLimit)
+            {
+                SchedulerQueue_PushBack(own, programIndex);
+                ++scheduler->queued;
+                Scheduler_Wake(scheduler, false);
+                continue;
+            }
+        }
+
+        Scheduler_Report(scheduler, program);
+        if (program->loaded)
+        {
+            Fusion_Detach(&program->machine);
+            Machine_Free(&program->machine);
+            MemoryImage_Free(&program->image);
+        }
+        if (--scheduler->remaining == 0) Scheduler_Wake(scheduler, true);
+    }
+}
+
+/// @brief Runs every program to completion and reports each one as it finishes
+/// @param sliceInstructions instructions a program runs before the worker moves on to the next one
+/// @param instructionLimit instructions after which a program is stopped, 0 for no limit
+/// @param fusion run cached blocks with fused instruction pairs
+void Scheduler_RunFiles(char** fileNames, u32 fileCount, u64 sliceInstructions, u64 instructionLimit, bool fusion)
+{
+    Scheduler scheduler;
+    scheduler.programCount = fileCount;
+    scheduler.sliceInstructions = (sliceInstructions > 0 ? sliceInstructions : 1);
+    scheduler.instructionLimit = (instructionLimit > 0 ? instructionLimit : UINT64_MAX);
+    scheduler.fusion = fusion;
+    scheduler.remaining = fileCount;
+    scheduler.queued = fileCount;
+    scheduler.totalInstructions = 0;
+
+    scheduler.programs = (ScheduledProgram*)calloc(fileCount, sizeof(ScheduledProgram));
+    for (u32 index = 0; index < fileCount; ++index) scheduler.programs[index].fileName = fileNames[index];
+
+    u32 threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+    if (threadCount > fileCount) threadCount = fileCount;
+
+    scheduler.queueCount = threadCount;
+    scheduler.queues = new SchedulerQueue[threadCount];
+    for (u32 queueIndex = 0; queueIndex < threadCount; ++queueIndex)
+    {
+        SchedulerQueue* queue = &scheduler.queues[queueIndex];
+        queue->entries = (u32*)malloc(fileCount * sizeof(u32));
+        queue->capacity = fileCount;
+        queue->head = 0;
+        queue->count = 0;
+    }
+
+    for (u32 index = 0; index < fileCount; ++index) SchedulerQueue_PushBack(&scheduler.queues[index % threadCount], index);
+
+    clock_t start = clock();
+
+    std::thread* threads = new std::thread[threadCount];
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        threads[threadIndex] = std::thread(Scheduler_Worker, &scheduler, threadIndex);
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        threads[threadIndex].join();
+    delete[] threads;
+
+    double milliseconds = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    printf("; scheduler: %u programs, %llu instructions, %u workers, %.2f ms cpu\n", fileCount,
+        (unsigned long long)scheduler.totalInstructions.load(), threadCount, milliseconds);
+
+    for (u32 queueIndex = 0; queueIndex < threadCount; ++queueIndex) free(scheduler.queues[queueIndex].entries);
+    delete[] scheduler.queues;
+    free(scheduler.programs);
+}
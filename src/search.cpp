@@ -0,0 +1,527 @@
+#include "common.cpp"
+
+// Instruction-sequence pattern search.
+//
+// Pattern syntax: instructions separated by '/', each a mnemonic followed by optional operands.
+//   "mov ax, imm / int 0x21"    "rep movsb"    "* reg, [1000]"    "cmp *, 0 / je"
+// - prefixes: optional lock, rep and repne before the mnemonic. The instruction must have at least these prefixes.
+// - mnemonic: a name from operationNames, or '*' for any instruction
+// - operands: '*' (any), imm, a number (immediate value), reg, a register name, sreg, a segment register
+//   name, mem, or [number] (direct address). Without operands, any operands match.
+//
+// All patterns are compiled into a single bit-parallel NFA (shift-and): every pattern position is one bit,
+// and each decoded instruction is reduced to the mask of positions it satisfies. Stepping the automaton is a
+// shift, an or and an and per 64 positions, so all patterns are matched in one pass over the stream.
+
+#define INSTRUCTION_TYPE_COUNT (sizeof(operationNames) / sizeof(operationNames[0]))
+#define SEARCH_MAX_PATTERN_LENGTH 64
+
+enum PatternOperandKind
+{
+    PATTERN_ANY,
+    PATTERN_IMMEDIATE,
+    PATTERN_IMMEDIATE_VALUE,
+    PATTERN_REGISTER,
+    PATTERN_REGISTER_EXACT,
+    PATTERN_SEGMENT_REGISTER,
+    PATTERN_SEGMENT_REGISTER_EXACT,
+    PATTERN_MEMORY,
+    PATTERN_MEMORY_DIRECT,
+};
+
+struct PatternOperand
+{
+    PatternOperandKind kind;
+    u16 value;
+    RMField regmemIndex;
+    bool wide;
+};
+
+struct PatternElement
+{
+    bool anyType;
+    InstructionType type;
+    u8 prefixes; // InstructionPrefix bits the instruction must have
+
+    int operandCount; // -1 if operands are not constrained
+    PatternOperand operands[2];
+};
+
+struct SearchPattern
+{
+    char* text;
+    u32 firstPosition;
+    u32 length;
+};
+
+struct SearchAutomaton
+{
+    PatternElement* elements; // One per position, patterns are stored back to back
+    u32 positionCount;
+    u32 wordCount;
+
+    SearchPattern* patterns;
+    u32 patternCount;
+
+    u64* startMask;
+    u64* finalMask;
+
+    // Positions whose mnemonic matches the instruction type and which have no operand constraints
+    u64* typeMasks; // [INSTRUCTION_TYPE_COUNT * wordCount]
+
+    // Positions that need operand checks. Checked positions for type t are
+    // checkedPositions[checkedStart[t] .. checkedStart[t + 1]), wildcard mnemonics are in every type's list.
+    u32* checkedStart;
+    u32* checkedPositions;
+};
+
+struct SearchMatch
+{
+    u32 pattern;
+    u32 firstInstruction; // Index in the decoded image
+    u32 instructionCount;
+};
+
+bool Search_ParseNumber(char* text, u16* value)
+{
+    char* end;
+    long number;
+
+    size_t length = strlen(text);
+    if (length > 1 && (text[length - 1] == 'h' || text[length - 1] == 'H'))
+    {
+        number = strtol(text, &end, 16);
+        if (end != text + length - 1) return false;
+    }
+    else
+    {
+        number = strtol(text, &end, 0);
+        if (end == text || *end != 0) return false;
+    }
+
+    if (number < -0x8000 || number > 0xFFFF) return false;
+    *value = (u16)number;
+    return true;
+}
+
+bool Search_ParseOperand(char* text, PatternOperand* operand)
+{
+    *operand = {};
+
+    if (strcmp(text, "*") == 0) operand->kind = PATTERN_ANY;
+    else if (strcmp(text, "imm") == 0) operand->kind = PATTERN_IMMEDIATE;
+    else if (strcmp(text, "reg") == 0) operand->kind = PATTERN_REGISTER;
+    else if (strcmp(text, "sreg") == 0) operand->kind = PATTERN_SEGMENT_REGISTER;
+    else if (strcmp(text, "mem") == 0) operand->kind = PATTERN_MEMORY;
+    else if (text[0] == '[')
+    {
+        size_t length = strlen(text);
+        if (length < 3 || text[length - 1] != ']') return false;
+
+        text[length - 1] = 0;
+        bool valid = Search_ParseNumber(text + 1, &operand->value);
+        text[length - 1] = ']';
+
+        operand->kind = PATTERN_MEMORY_DIRECT;
+        return valid;
+    }
+    else
+    {
+        for (int index = 0; index < 8; ++index)
+        {
+            if (strcmp(text, registers16bit[index]) == 0 || strcmp(text, registers8bit[index]) == 0)
+            {
+                operand->kind = PATTERN_REGISTER_EXACT;
+                operand->regmemIndex = (RMField)index;
+                operand->wide = (strcmp(text, registers16bit[index]) == 0);
+                return true;
+            }
+        }
+        for (int index = 0; index < 4; ++index)
+        {
+            if (strcmp(text, registersSegment[index]) == 0)
+            {
+                operand->kind = PATTERN_SEGMENT_REGISTER_EXACT;
+                operand->regmemIndex = (RMField)index;
+                return true;
+            }
+        }
+
+        operand->kind = PATTERN_IMMEDIATE_VALUE;
+        return Search_ParseNumber(text, &operand->value);
+    }
+
+    return true;
+}
+
+/// @brief Parses a single instruction pattern. The text is modified.
+bool Search_ParseElement(char* text, PatternElement* element)
+{
+    *element = {};
+    element->operandCount = -1;
+
+    text = TrimWhitespace(text);
+    char* operands = strchr(text, ' ');
+    if (operands) *operands++ = 0;
+
+    // Prefix words, unless the prefix is all there is
+    while (operands)
+    {
+        u8 prefix = 0;
+        if (strcmp(text, "lock") == 0) prefix = PREFIX_LOCK;
+        else if (strcmp(text, "rep") == 0) prefix = PREFIX_REP;
+        else if (strcmp(text, "repne") == 0) prefix = PREFIX_REPNE;
+        if (!prefix) break;
+
+        element->prefixes |= prefix;
+        text = TrimWhitespace(operands);
+        operands = strchr(text, ' ');
+        if (operands) *operands++ = 0;
+    }
+
+    if (strcmp(text, "*") == 0)
+    {
+        element->anyType = true;
+    }
+    else
+    {
+        bool found = false;
+        for (u32 type = 1; type < INSTRUCTION_TYPE_COUNT; ++type)
+        {
+            if (strcmp(text, operationNames[type]) == 0)
+            {
+                element->type = (InstructionType)type;
+                found = true;
+                break;
+            }
+        }
+        if (!found) return false;
+    }
+
+    if (!operands) return true;
+
+    operands = TrimWhitespace(operands);
+    if (*operands == 0) return true;
+
+    element->operandCount = 0;
+    while (operands)
+    {
+        if (element->operandCount == 2) return false;
+
+        char* next = strchr(operands, ',');
+        if (next) *next++ = 0;
+
+        if (!Search_ParseOperand(TrimWhitespace(operands), &element->operands[element->operandCount++])) return false;
+        operands = next;
+    }
+    return true;
+}
+
+bool Search_MatchOperand(PatternOperand* pattern, Operand* operand, bool wide)
+{
+    switch (pattern->kind)
+    {
+        case PATTERN_ANY: return true;
+        case PATTERN_IMMEDIATE: return (operand->type == OP_IMMEDIATE);
+        case PATTERN_IMMEDIATE_VALUE:
+        {
+            u16 mask = (wide ? 0xFFFF : 0x00FF);
+            return (operand->type == OP_IMMEDIATE && ((operand->value ^ pattern->value) & mask) == 0);
+        }
+        case PATTERN_REGISTER: return (operand->type == OP_REGISTER);
+        case PATTERN_REGISTER_EXACT:
+            return (operand->type == OP_REGISTER && operand->regmemIndex == pattern->regmemIndex && wide == pattern->wide);
+        case PATTERN_SEGMENT_REGISTER: return (operand->type == OP_SEGMENT_REGISTER);
+        case PATTERN_SEGMENT_REGISTER_EXACT:
+            return (operand->type == OP_SEGMENT_REGISTER && operand->regmemIndex == pattern->regmemIndex);
+        case PATTERN_MEMORY: return (operand->type == OP_MEMORY);
+        case PATTERN_MEMORY_DIRECT: return (IsDirectAddress(operand) && operand->value == pattern->value);
+    }
+    return false;
+}
+
+/// @brief Checks the prefixes and operands of a pattern position whose mnemonic matches
+bool Search_MatchElement(PatternElement* element, Instruction* instruction)
+{
+    if ((instruction->prefixes & element->prefixes) != element->prefixes) return false;
+    if (element->operandCount < 0) return true;
+    if (element->operandCount != instruction->operandCount) return false;
+
+    Operand* operands[] = {&instruction->opDest, &instruction->opSrc};
+    for (int index = 0; index < element->operandCount; ++index)
+    {
+        if (!Search_MatchOperand(&element->operands[index], operands[index], GetOperandWidth(instruction, index))) return false;
+    }
+    return true;
+}
+
+/// @brief Compiles a set of patterns into a single automaton
+/// @param patterns pattern strings
+/// @param[out] automaton compiled automaton. Free with Search_Free().
+/// @return index of the first invalid pattern, or -1 on success
+int Search_Compile(char** patterns, u32 patternCount, SearchAutomaton* automaton)
+{
+    *automaton = {};
+    automaton->patterns = (SearchPattern*)calloc(patternCount, sizeof(SearchPattern));
+    automaton->elements = (PatternElement*)malloc(patternCount * SEARCH_MAX_PATTERN_LENGTH * sizeof(PatternElement));
+    automaton->patternCount = patternCount;
+
+    for (u32 patternIndex = 0; patternIndex < patternCount; ++patternIndex)
+    {
+        SearchPattern* pattern = &automaton->patterns[patternIndex];
+        pattern->text = patterns[patternIndex];
+        pattern->firstPosition = automaton->positionCount;
+
+        char* text = (char*)malloc(strlen(patterns[patternIndex]) + 1);
+        strcpy(text, patterns[patternIndex]);
+
+        bool valid = true;
+        char* element = text;
+        while (element && valid)
+        {
+            char* next = strchr(element, '/');
+            if (next) *next++ = 0;
+
+            valid = (pattern->length < SEARCH_MAX_PATTERN_LENGTH) &&
+                    Search_ParseElement(element, &automaton->elements[automaton->positionCount]);
+            ++pattern->length;
+            ++automaton->positionCount;
+            element = next;
+        }
+        free(text);
+
+        if (!valid) return (int)patternIndex;
+    }
+
+    u32 wordCount = (automaton->positionCount + 63) / 64;
+    automaton->wordCount = wordCount;
+    automaton->startMask = (u64*)calloc(wordCount, sizeof(u64));
+    automaton->finalMask = (u64*)calloc(wordCount, sizeof(u64));
+    automaton->typeMasks = (u64*)calloc(INSTRUCTION_TYPE_COUNT * wordCount, sizeof(u64));
+
+    for (u32 patternIndex = 0; patternIndex < patternCount; ++patternIndex)
+    {
+        SearchPattern* pattern = &automaton->patterns[patternIndex];
+        u32 first = pattern->firstPosition;
+        u32 last = pattern->firstPosition + pattern->length - 1;
+        automaton->startMask[first / 64] |= (1ull << (first % 64));
+        automaton->finalMask[last / 64] |= (1ull << (last % 64));
+    }
+
+    // Positions without operand or prefix constraints only depend on the mnemonic, everything else is checked per
+    // instruction
+    automaton->checkedStart = (u32*)calloc(INSTRUCTION_TYPE_COUNT + 1, sizeof(u32));
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        u32 checkedCount = 0;
+        for (u32 type = 0; type < INSTRUCTION_TYPE_COUNT; ++type)
+        {
+            if (pass == 0) automaton->checkedStart[type] = checkedCount;
+
+            for (u32 position = 0; position < automaton->positionCount; ++position)
+            {
+                PatternElement* element = &automaton->elements[position];
+                if (!element->anyType && element->type != (InstructionType)type) continue;
+
+                if (element->operandCount < 0 && !element->prefixes)
+                {
+                    if (pass == 0) automaton->typeMasks[type * wordCount + position / 64] |= (1ull << (position % 64));
+                }
+                else
+                {
+                    if (pass == 1) automaton->checkedPositions[checkedCount] = position;
+                    ++checkedCount;
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            automaton->checkedStart[INSTRUCTION_TYPE_COUNT] = checkedCount;
+            automaton->checkedPositions = (u32*)malloc((checkedCount + 1) * sizeof(u32));
+        }
+    }
+
+    return -1;
+}
+
+void Search_Free(SearchAutomaton* automaton)
+{
+    free(automaton->elements);
+    free(automaton->patterns);
+    free(automaton->startMask);
+    free(automaton->finalMask);
+    free(automaton->typeMasks);
+    free(automaton->checkedStart);
+    free(automaton->checkedPositions);
+    *automaton = {};
+}
+
+/// @brief Scans a decoded image for all patterns at once
+/// @param[out] matches matches in the order they end. Free with free().
+/// @return number of matches
+u32 Search_Scan(SearchAutomaton* automaton, DecodedImage* decoded, SearchMatch** matches)
+{
+    u32 wordCount = automaton->wordCount;
+    u64* state = (u64*)calloc(wordCount * 2, sizeof(u64));
+    u64* instructionMask = state + wordCount;
+
+    u32 matchCapacity = 16;
+    u32 matchCount = 0;
+    *matches = (SearchMatch*)malloc(matchCapacity * sizeof(SearchMatch));
+
+    for (u32 index = 0; index < decoded->count; ++index)
+    {
+        Instruction* instruction = &decoded->instructions[index];
+
+        // Positions this instruction satisfies
+        memcpy(instructionMask, &automaton->typeMasks[instruction->type * wordCount], wordCount * sizeof(u64));
+        for (u32 checked = automaton->checkedStart[instruction->type]; checked < automaton->checkedStart[instruction->type + 1]; ++checked)
+        {
+            u32 position = automaton->checkedPositions[checked];
+            if (Search_MatchElement(&automaton->elements[position], instruction))
+                instructionMask[position / 64] |= (1ull << (position % 64));
+        }
+
+        // state = ((state << 1) | start) & mask
+        u64 carry = 0;
+        bool anyFinal = false;
+        for (u32 word = 0; word < wordCount; ++word)
+        {
+            u64 shifted = (state[word] << 1) | carry;
+            carry = (state[word] >> 63);
+
+            state[word] = (shifted | automaton->startMask[word]) & instructionMask[word];
+            anyFinal |= ((state[word] & automaton->finalMask[word]) != 0);
+        }
+
+        if (!anyFinal) continue;
+
+        for (u32 patternIndex = 0; patternIndex < automaton->patternCount; ++patternIndex)
+        {
+            SearchPattern* pattern = &automaton->patterns[patternIndex];
+            u32 last = pattern->firstPosition + pattern->length - 1;
+            if (!(state[last / 64] & (1ull << (last % 64)))) continue;
+
+            if (matchCount == matchCapacity)
+            {
+                matchCapacity *= 2;
+                *matches = (SearchMatch*)realloc(*matches, matchCapacity * sizeof(SearchMatch));
+            }
+
+            SearchMatch* match = &(*matches)[matchCount++];
+            match->pattern = patternIndex;
+            match->firstInstruction = index + 1 - pattern->length;
+            match->instructionCount = pattern->length;
+        }
+    }
+
+    free(state);
+    return matchCount;
+}
+
+struct SearchJob
+{
+    SearchAutomaton* automaton;
+    char** fileNames;
+    u32 fileCount;
+
+    std::atomic<u32> nextFile;
+    std::atomic<u32>* matchCounts; // Per pattern
+    std::mutex outputLock; // Also guards arenaMetrics
+    ArenaMetrics arenaMetrics;
+};
+
+void Search_PrintMatch(SearchJob* job, DecodedImage* decoded, SearchMatch* match)
+{
+    Instruction* first = &decoded->instructions[match->firstInstruction];
+    printf("0x%04x: ", first->offset);
+
+    for (u32 index = 0; index < match->instructionCount; ++index)
+    {
+        if (index > 0) printf(" / ");
+        PrintInstruction(&decoded->instructions[match->firstInstruction + index]);
+    }
+    printf(" ; pattern %u: %s\n", match->pattern + 1, job->automaton->patterns[match->pattern].text);
+}
+
+void Search_Worker(SearchJob* job)
+{
+    // NOTE: The file and its decoded instructions are in the arena, it is reset before the next file.
+    Arena arena;
+    Arena_Init(&arena);
+
+    for (;;)
+    {
+        u32 fileIndex = job->nextFile.fetch_add(1);
+        if (fileIndex >= job->fileCount) break;
+
+        Arena_Reset(&arena);
+        char* fileName = job->fileNames[fileIndex];
+        ByteStream image;
+        if (!LoadFile(fileName, &image, &arena))
+        {
+            std::lock_guard<std::mutex> lock(job->outputLock);
+            printf("; search: failed to open file: %s\n", fileName);
+            continue;
+        }
+
+        DecodedImage decoded;
+        DecodeImage(image, &decoded, &arena);
+
+        SearchMatch* matches;
+        u32 matchCount = Search_Scan(job->automaton, &decoded, &matches);
+
+        for (u32 matchIndex = 0; matchIndex < matchCount; ++matchIndex)
+            job->matchCounts[matches[matchIndex].pattern].fetch_add(1);
+
+        if (matchCount > 0)
+        {
+            // NOTE: Each file's matches are printed together, files are printed in the order they finish.
+            std::lock_guard<std::mutex> lock(job->outputLock);
+            printf("; search: %s, %u matches\n", fileName, matchCount);
+            for (u32 matchIndex = 0; matchIndex < matchCount; ++matchIndex)
+                Search_PrintMatch(job, &decoded, &matches[matchIndex]);
+        }
+
+        free(matches);
+    }
+
+    std::lock_guard<std::mutex> lock(job->outputLock);
+    Arena_AddMetrics(&arena, &job->arenaMetrics);
+    Arena_Free(&arena);
+}
+
+/// @brief Searches all files for all patterns, one file per worker thread at a time
+void Search_RunFiles(SearchAutomaton* automaton, char** fileNames, u32 fileCount)
+{
+    SearchJob job;
+    job.automaton = automaton;
+    job.fileNames = fileNames;
+    job.fileCount = fileCount;
+    job.nextFile = 0;
+    job.arenaMetrics = {};
+    job.matchCounts = new std::atomic<u32>[automaton->patternCount];
+    for (u32 patternIndex = 0; patternIndex < automaton->patternCount; ++patternIndex) job.matchCounts[patternIndex] = 0;
+
+    u32 threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+    if (threadCount > fileCount) threadCount = fileCount;
+
+    std::thread* threads = new std::thread[threadCount];
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        threads[threadIndex] = std::thread(Search_Worker, &job);
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        threads[threadIndex].join();
+    delete[] threads;
+
+    printf("; search: %u files\n", fileCount);
+    for (u32 patternIndex = 0; patternIndex < automaton->patternCount; ++patternIndex)
+    {
+        printf(";   pattern %u: %s -- %u matches\n", patternIndex + 1,
+            automaton->patterns[patternIndex].text, job.matchCounts[patternIndex].load());
+    }
+    Arena_PrintMetrics(&job.arenaMetrics);
+
+    delete[] job.matchCounts;
+}
@@ -0,0 +1,547 @@
+#include "common.cpp"
+
+// Long-running server for editor integrations, listening on a Unix domain socket.
+//
+// Images stay loaded between requests together with their decoded instructions, cross-reference index and memory
+// image, so a request does not pay for process start, reading the file or decoding it. An image is loaded on first
+// use and never changes afterwards: requests on it run concurrently without locks, and every run gets its own
+// machine over the shared memory image. Changed files are not reloaded, restart the server to pick them up.
+//
+// Connections are served by a fixed pool of worker threads. A request is one line of text, the response is the
+// output followed by a line with a single ".". A connection can send any number of requests.
+//   disasm <file> [<start> [<end>]]  instructions starting in [start, end) with their offsets
+//   run <file> [<limit>]             runs the program from the start and prints the final state
+//   xref <file> <query>...           instructions that access registers or direct addresses (queries as -q)
+//   stats                            loaded images and requests served
+//   shutdown                         stops the server once the open connections are closed
+//
+// NOTE: File names are relative to the working directory of the server and cannot contain spaces.
+
+#ifdef _WIN32
+typedef SOCKET ServerSocket;
+#define INVALID_SERVER_SOCKET INVALID_SOCKET
+#define CloseServerSocket closesocket
+#define SEND_FLAGS 0
+#else
+typedef int ServerSocket;
+#define INVALID_SERVER_SOCKET -1
+#define CloseServerSocket close
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+#define SERVER_QUEUE_SIZE 64
+#define SERVER_LINE_SIZE 1024
+#define SERVER_DEFAULT_LIMIT 10000000 // Instructions per run request
+
+struct ServerImage
+{
+    char fileName[SERVER_LINE_SIZE];
+    std::once_flag loadOnce;
+    bool loaded; // false if the file could not be read
+    u32 unrecognizedCount; // Instructions with an invalid encoding
+
+    ByteStream file;
+    DecodedImage decoded;
+    XrefIndex xref;
+    MemoryImage memory;
+
+    ServerImage* next;
+};
+
+struct Server
+{
+    char* path;
+    ServerSocket listener;
+    std::atomic<bool> stopping;
+    std::atomic<u64> requestCount;
+
+    std::mutex imageLock;
+    ServerImage* images;
+    u32 imageCount;
+
+    // Accepted connections waiting for a worker
+    std::mutex queueLock;
+    std::condition_variable queueChanged;
+    ServerSocket pending[SERVER_QUEUE_SIZE];
+    u32 pendingHead;
+    u32 pendingCount;
+};
+
+bool Server_Startup()
+{
+#ifdef _WIN32
+    WSADATA data;
+    return (WSAStartup(MAKEWORD(2, 2), &data) == 0);
+#else
+    return true;
+#endif
+}
+
+void Server_Cleanup()
+{
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/// @return false if the path does not fit in a socket address
+bool Server_SocketAddress(char* path, sockaddr_un* address)
+{
+    *address = {};
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) return false;
+
+    memcpy(address->sun_path, path, strlen(path) + 1);
+    return true;
+}
+
+/// @brief Connects to a server socket
+/// @return INVALID_SERVER_SOCKET if nothing is listening on the path
+ServerSocket Server_Connect(char* path)
+{
+    sockaddr_un address;
+    if (!Server_SocketAddress(path, &address)) return INVALID_SERVER_SOCKET;
+
+    ServerSocket connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection == INVALID_SERVER_SOCKET) return INVALID_SERVER_SOCKET;
+
+    if (connect(connection, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        CloseServerSocket(connection);
+        return INVALID_SERVER_SOCKET;
+    }
+    return connection;
+}
+
+/// @brief Removes a socket file left behind by a server that is no longer running, which would make bind() fail
+/// @return false if the path is not a socket or a server is still listening on it
+bool Server_RemoveStaleSocket(char* path)
+{
+#ifdef _WIN32
+    // NOTE: Unix domain socket files are reparse points on Windows.
+    DWORD attributes = GetFileAttributesA(path);
+    if (attributes == INVALID_FILE_ATTRIBUTES) return true;
+    if (!(attributes & FILE_ATTRIBUTE_REPARSE_POINT)) return false;
+#else
+    struct stat status;
+    if (lstat(path, &status) != 0) return (errno == ENOENT);
+    if (!S_ISSOCK(status.st_mode)) return false;
+#endif
+
+    ServerSocket running = Server_Connect(path);
+    if (running != INVALID_SERVER_SOCKET)
+    {
+        CloseServerSocket(running);
+        return false;
+    }
+    return (remove(path) == 0);
+}
+
+/// @return true if accept() failed for that connection only, false if the listener cannot accept any more
+bool Server_IsTransientAcceptError()
+{
+#ifdef _WIN32
+    int error = WSAGetLastError();
+    return (error == WSAEINTR || error == WSAECONNRESET);
+#else
+    return (errno == EINTR || errno == ECONNABORTED);
+#endif
+}
+
+bool Server_Send(ServerSocket connection, char* data, u32 size)
+{
+    while (size > 0)
+    {
+        int sent = send(connection, data, (int)size, SEND_FLAGS);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= (u32)sent;
+    }
+    return true;
+}
+
+/// @brief Splits the next word off a line
+/// @return nullptr at the end of the line
+char* NextWord(char** text)
+{
+    char* word = *text;
+    while (*word == ' ') ++word;
+    if (*word == 0) return nullptr;
+
+    char* end = word;
+    while (*end != 0 && *end != ' ') ++end;
+    if (*end != 0) *end++ = 0;
+
+    *text = end;
+    return word;
+}
+
+void Server_LoadImage(ServerImage* image)
+{
+    if (!LoadFile(image->fileName, &image->file)) return;
+
+    image->unrecognizedCount = DecodeImage(image->file, &image->decoded);
+    Xref_Build(&image->decoded, &image->xref);
+    MemoryImage_Init(&image->memory);
+    MemoryImage_Load(&image->memory, 0, image->file.data, image->file.size);
+    image->loaded = true;
+}
+
+/// @brief Finds a loaded image, or loads it on first use
+/// @return nullptr if the file could not be read
+ServerImage* Server_GetImage(Server* server, char* fileName)
+{
+    ServerImage* image;
+    {
+        std::lock_guard<std::mutex> lock(server->imageLock);
+        for (image = server->images; image; image = image->next)
+        {
+            if (strcmp(image->fileName, fileName) == 0) break;
+        }
+
+        if (!image)
+        {
+            image = new ServerImage();
+            memcpy(image->fileName, fileName, strlen(fileName) + 1);
+            image->next = server->images;
+            server->images = image;
+            ++server->imageCount;
+        }
+    }
+
+    // NOTE: Other requests for the same image wait here while it is loaded, requests for other images do not.
+    std::call_once(image->loadOnce, Server_LoadImage, image);
+    return (image->loaded ? image : nullptr);
+}
+
+void Server_Disassemble(ServerImage* image, char* arguments)
+{
+    char* startText = NextWord(&arguments);
+    char* endText = NextWord(&arguments);
+    u32 start = (startText ? (u32)strtoul(startText, nullptr, 0) : 0);
+    u32 end = (endText ? (u32)strtoul(endText, nullptr, 0) : image->file.size);
+
+    // First instruction at or after start
+    DecodedImage* decoded = &image->decoded;
+    u32 low = 0;
+    u32 high = decoded->count;
+    while (low < high)
+    {
+        u32 middle = low + (high - low) / 2;
+        if (decoded->instructions[middle].offset < start) low = middle + 1;
+        else high = middle;
+    }
+
+    for (u32 index = low; index < decoded->count && decoded->instructions[index].offset < end; ++index)
+    {
+        Instruction* instruction = &decoded->instructions[index];
+        Print("0x%04x: ", instruction->offset);
+        if (instruction->type == DIS_NOOP) Print("; %x", image->file.data[instruction->offset + instruction->prefixLength]);
+        PrintInstruction(instruction);
+        Print("\n");
+    }
+}
+
+void Server_RunProgram(ServerImage* image, char* arguments)
+{
+    char* limitText = NextWord(&arguments);
+    u64 limit = (limitText ? strtoull(limitText, nullptr, 0) : 0);
+
+    Machine machine;
+    Machine_Init(&machine, &image->memory, image->file.size);
+    Emulator_Run(&machine, (limit > 0 ? limit : SERVER_DEFAULT_LIMIT));
+
+    // NOTE: Code that cannot be decoded stops the machine, the request fails instead of reporting a final state.
+    if (machine.status == MACHINE_UNSUPPORTED) Print("; run: unsupported instruction at %04x:%04x\n", machine.cpu.cs, machine.ip);
+    else
+    {
+        Emulator_PrintState(&machine);
+        Print("\n");
+    }
+    Machine_Free(&machine);
+}
+
+void Server_Xref(ServerImage* image, char* arguments)
+{
+    for (char* text = NextWord(&arguments); text; text = NextWord(&arguments))
+    {
+        XrefQuery query;
+        if (!Xref_ParseQuery(text, &query))
+        {
+            Print("; xref %s: invalid query\n", text);
+            continue;
+        }
+
+        XrefSpan result;
+        Xref_Run(&image->xref, &query, &result);
+
+        Print("; xref %s: %u instructions\n", text, result.count);
+        for (u32 entryIndex = 0; entryIndex < result.count; ++entryIndex)
+        {
+            Instruction* instruction = &image->decoded.instructions[result.entries[entryIndex]];
+            Print("0x%04x: ", instruction->offset);
+            PrintInstruction(instruction);
+            Print("\n");
+        }
+        free(result.entries);
+    }
+}
+
+/// @brief Executes one request line, the output goes to the print target of the thread
+void Server_HandleRequest(Server* server, char* line)
+{
+    ++server->requestCount;
+    char* command = NextWord(&line);
+    if (!command) return;
+
+    if (strcmp(command, "stats") == 0)
+    {
+        std::lock_guard<std::mutex> lock(server->imageLock);
+        Print("; %u images, %llu requests\n", server->imageCount, (unsigned long long)server->requestCount.load());
+        for (ServerImage* image = server->images; image; image = image->next)
+        {
+            if (image->loaded) Print("; %s: %u bytes, %u instructions\n", image->fileName, image->file.size, image->decoded.count);
+        }
+        return;
+    }
+
+    if (strcmp(command, "shutdown") == 0)
+    {
+        server->stopping = true;
+
+        // Wakes up the accepting thread
+        ServerSocket wake = Server_Connect(server->path);
+        if (wake != INVALID_SERVER_SOCKET) CloseServerSocket(wake);
+        Print("; shutting down\n");
+        return;
+    }
+
+    bool disassemble = (strcmp(command, "disasm") == 0);
+    bool run = (strcmp(command, "run") == 0);
+    bool xref = (strcmp(command, "xref") == 0);
+    if (!disassemble && !run && !xref)
+    {
+        Print("; %s: unknown request\n", command);
+        return;
+    }
+
+    char* fileName = NextWord(&line);
+    ServerImage* image = (fileName ? Server_GetImage(server, fileName) : nullptr);
+    if (!image)
+    {
+        Print("; %s: failed to open file\n", (fileName ? fileName : ""));
+        return;
+    }
+
+    // NOTE: Invalid encodings are listed as bytes, the response says the listing is not all code.
+    if (image->unrecognizedCount > 0 && !run) Print("; %s: %u invalid instructions\n", fileName, image->unrecognizedCount);
+
+    if (disassemble) Server_Disassemble(image, line);
+    else if (run) Server_RunProgram(image, line);
+    else Server_Xref(image, line);
+}
+
+void Server_ServeConnection(Server* server, ServerSocket connection)
+{
+    OutputBuffer response {0};
+    printTarget = &response;
+
+    char line[SERVER_LINE_SIZE];
+    u32 lineLength = 0;
+    char received[SERVER_LINE_SIZE];
+
+    for (;;)
+    {
+        int size = recv(connection, received, sizeof(received), 0);
+        if (size <= 0) break;
+
+        bool connected = true;
+        for (int index = 0; index < size && connected; ++index)
+        {
+            char c = received[index];
+            if (c == '\r') continue;
+            if (c != '\n')
+            {
+                // NOTE: Overlong lines are cut off.
+                if (lineLength < SERVER_LINE_SIZE - 1) line[lineLength++] = c;
+                continue;
+            }
+
+            line[lineLength] = 0;
+            lineLength = 0;
+
+            response.size = 0;
+            Server_HandleRequest(server, line);
+            Print(".\n");
+            connected = Server_Send(connection, response.data, response.size);
+        }
+        if (!connected) break;
+    }
+
+    printTarget = nullptr;
+    free(response.data);
+    CloseServerSocket(connection);
+}
+
+void Server_Worker(Server* server)
+{
+    for (;;)
+    {
+        ServerSocket connection;
+        {
+            std::unique_lock<std::mutex> lock(server->queueLock);
+            server->queueChanged.wait(lock, [server] { return server->pendingCount > 0 || server->stopping; });
+            if (server->pendingCount == 0) return;
+
+            connection = server->pending[server->pendingHead];
+            server->pendingHead = (server->pendingHead + 1) % SERVER_QUEUE_SIZE;
+            --server->pendingCount;
+        }
+        server->queueChanged.notify_all();
+
+        Server_ServeConnection(server, connection);
+    }
+}
+
+/// @brief Serves requests on a Unix domain socket until a shutdown request
+/// @return false if the socket could not be created, or the path is in use by another file or a running server
+bool Server_Run(char* path)
+{
+    sockaddr_un address;
+    if (!Server_SocketAddress(path, &address) || !Server_Startup()) return false;
+
+    Server* server = new Server();
+    server->path = path;
+    server->stopping = false;
+    server->requestCount = 0;
+
+    // NOTE: bind() fails on an existing file. Only a socket that no server listens on anymore is removed.
+    server->listener = (Server_RemoveStaleSocket(path) ? socket(AF_UNIX, SOCK_STREAM, 0) : INVALID_SERVER_SOCKET);
+    if (server->listener == INVALID_SERVER_SOCKET || bind(server->listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server->listener, SERVER_QUEUE_SIZE) != 0)
+    {
+        if (server->listener != INVALID_SERVER_SOCKET) CloseServerSocket(server->listener);
+        delete server;
+        Server_Cleanup();
+        return false;
+    }
+
+    u32 threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+
+    std::thread* threads = new std::thread[threadCount];
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex) threads[threadIndex] = std::thread(Server_Worker, server);
+
+    printf("; server: listening on %s, %u workers\n", path, threadCount);
+    fflush(stdout);
+
+    while (!server->stopping)
+    {
+        ServerSocket connection = accept(server->listener, nullptr, nullptr);
+        if (connection == INVALID_SERVER_SOCKET)
+        {
+            if (Server_IsTransientAcceptError()) continue;
+
+            // NOTE: Open connections are still served, like after a shutdown request.
+            printf("; server: accept failed, stopping\n");
+            server->stopping = true;
+            break;
+        }
+        if (server->stopping)
+        {
+            CloseServerSocket(connection);
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(server->queueLock);
+        server->queueChanged.wait(lock, [server] { return server->pendingCount < SERVER_QUEUE_SIZE; });
+        server->pending[(server->pendingHead + server->pendingCount) % SERVER_QUEUE_SIZE] = connection;
+        ++server->pendingCount;
+        lock.unlock();
+        server->queueChanged.notify_all();
+    }
+
+    CloseServerSocket(server->listener);
+    remove(path);
+    server->queueChanged.notify_all();
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex) threads[threadIndex].join();
+    delete[] threads;
+
+    printf("; server: %llu requests\n", (unsigned long long)server->requestCount.load());
+    for (ServerImage* image = server->images; image;)
+    {
+        ServerImage* next = image->next;
+        if (image->loaded)
+        {
+            MemoryImage_Free(&image->memory);
+            Xref_Free(&image->xref);
+            FreeDecodedImage(&image->decoded);
+            free(image->file.data);
+        }
+        delete image;
+        image = next;
+    }
+    delete server;
+    Server_Cleanup();
+    return true;
+}
+
+/// @brief Sends requests to a server and prints the responses
+/// @return false if no server is listening on the path or the connection closed before a response was complete
+bool Server_SendRequests(char* path, char** requests, int requestCount)
+{
+    if (!Server_Startup()) return false;
+
+    ServerSocket connection = Server_Connect(path);
+    if (connection == INVALID_SERVER_SOCKET)
+    {
+        Server_Cleanup();
+        return false;
+    }
+
+    char received[4096];
+    char line[SERVER_LINE_SIZE];
+    u32 lineLength = 0;
+    bool complete = true;
+
+    for (int requestIndex = 0; requestIndex < requestCount && complete; ++requestIndex)
+    {
+        if (!Server_Send(connection, requests[requestIndex], (u32)strlen(requests[requestIndex])) ||
+            !Server_Send(connection, "\n", 1))
+        {
+            complete = false;
+            break;
+        }
+
+        // Prints lines until the terminating "."
+        complete = false;
+        while (!complete)
+        {
+            int size = recv(connection, received, sizeof(received), 0);
+            if (size <= 0) break;
+
+            for (int index = 0; index < size; ++index)
+            {
+                if (received[index] != '\n')
+                {
+                    if (lineLength < SERVER_LINE_SIZE - 1) line[lineLength++] = received[index];
+                    continue;
+                }
+
+                line[lineLength] = 0;
+                lineLength = 0;
+                if (strcmp(line, ".") == 0)
+                {
+                    // NOTE: Requests are sent one at a time, nothing follows the terminator.
+                    complete = true;
+                    break;
+                }
+                printf("%s\n", line);
+            }
+        }
+    }
+
+    CloseServerSocket(connection);
+    Server_Cleanup();
+    return complete;
+}
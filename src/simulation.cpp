@@ -75,13 +75,13 @@ struct CPU
 
 void PrintFlags(CPU cpu)
 {
-    if (cpu.carry) printf("C");
-    if (cpu.parity) printf("P");
-    if (cpu.auxCarry) printf("A");
-    if (cpu.zero) printf("Z");
-    if (cpu.sign) printf("S");
-    if (cpu.overflow) printf("O");
-    if (cpu.interruptEnable) printf("I");
-    if (cpu.direction) printf("D");
-    if (cpu.trap) printf("T");
+    if (cpu.carry) Print("C");
+    if (cpu.parity) Print("P");
+    if (cpu.auxCarry) Print("A");
+    if (cpu.zero) Print("Z");
+    if (cpu.sign) Print("S");
+    if (cpu.overflow) Print("O");
+    if (cpu.interruptEnable) Print("I");
+    if (cpu.direction) Print("D");
+    if (cpu.trap) Print("T");
 }
\ No newline at end of file
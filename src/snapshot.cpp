@@ -0,0 +1,237 @@
+#include "common.cpp"
+
+// Snapshots of a machine: registers, flags, IP and memory.
+//
+// Snapshots form a tree. Each one stores only the pages that were written since its parent, found from the dirty
+// pages of the memory instance, which is write protected again after every snapshot and restore. Restoring
+// copies only the pages that differ between the current state and the target snapshot.
+
+#define SNAPSHOT_MAGIC 0x4E533638 // "86SN"
+#define SNAPSHOT_VERSION 1
+
+// Memory is compared and stored in lines of 16 bytes
+#define SNAPSHOT_LINE_SIZE 16
+#define SNAPSHOT_LINES_PER_PAGE (PAGE_SIZE / SNAPSHOT_LINE_SIZE)
+
+struct Snapshot
+{
+    Snapshot* parent;
+    u32 depth; // Number of ancestors
+
+    CPU cpu;
+    u16 ip;
+    u64 instructionCount;
+    MachineStatus status;
+
+    u8* pages[PAGE_COUNT]; // Contents of pages written since the parent, nullptr for unchanged pages
+    u32 pageCount;
+};
+
+/// @brief Captures the machine state
+/// @param parent the snapshot the machine was last taken at or restored to, nullptr for the first snapshot
+Snapshot* Snapshot_Take(Machine* machine, Snapshot* parent)
+{
+    Snapshot* snapshot = (Snapshot*)calloc(1, sizeof(Snapshot));
+    snapshot->parent = parent;
+    snapshot->depth = (parent ? parent->depth + 1 : 0);
+    snapshot->cpu = machine->cpu;
+    snapshot->ip = machine->ip;
+    snapshot->instructionCount = machine->instructionCount;
+    snapshot->status = machine->status;
+
+    Memory* memory = &machine->memory;
+    for (u32 page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!memory->writePages[page]) continue;
+
+        snapshot->pages[page] = (u8*)malloc(PAGE_SIZE);
+        memcpy(snapshot->pages[page], memory->writePages[page], PAGE_SIZE);
+        ++snapshot->pageCount;
+    }
+
+    Memory_WriteProtect(memory);
+    return snapshot;
+}
+
+/// @brief Frees a single snapshot. Snapshots that have it as their parent must be freed first.
+void Snapshot_Free(Snapshot* snapshot)
+{
+    for (u32 page = 0; page < PAGE_COUNT; ++page) free(snapshot->pages[page]);
+    free(snapshot);
+}
+
+/// @brief Contents of a page as of a snapshot
+/// @return nullptr if the page was never written up to the snapshot and matches the base image
+u8* Snapshot_FindPage(Snapshot* snapshot, u32 page)
+{
+    for (; snapshot; snapshot = snapshot->parent)
+    {
+        if (snapshot->pages[page]) return snapshot->pages[page];
+    }
+    return nullptr;
+}
+
+/// @brief Returns the machine to the state of a snapshot
+/// @param current the snapshot the machine was last taken at or restored to
+/// @param target snapshot in the same tree, or any snapshot if current is nullptr
+void Snapshot_Restore(Machine* machine, Snapshot* current, Snapshot* target)
+{
+    Memory* memory = &machine->memory;
+
+    // Pages that may differ: written since current, or changed on the path from current or target up to their
+    // common ancestor.
+    bool changed[PAGE_COUNT];
+    for (u32 page = 0; page < PAGE_COUNT; ++page) changed[page] = (memory->writePages[page] != nullptr);
+
+    if (current)
+    {
+        Snapshot* a = current;
+        Snapshot* b = target;
+        while (a != b)
+        {
+            Snapshot** deeper = (a->depth >= b->depth ? &a : &b);
+            for (u32 page = 0; page < PAGE_COUNT; ++page) changed[page] |= ((*deeper)->pages[page] != nullptr);
+            *deeper = (*deeper)->parent;
+        }
+    }
+    else
+    {
+        for (u32 page = 0; page < PAGE_COUNT; ++page) changed[page] |= (memory->privatePages[page] != nullptr);
+    }
+
+    for (u32 page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!changed[page]) continue;
+
+        u8* contents = Snapshot_FindPage(target, page);
+        if (contents) memcpy(Memory_PrepareWrite(memory, page), contents, PAGE_SIZE);
+        else Memory_ReleasePage(memory, page);
+    }
+    Memory_WriteProtect(memory);
+
+    machine->cpu = target->cpu;
+    machine->ip = target->ip;
+    machine->instructionCount = target->instructionCount;
+    machine->status = target->status;
+}
+
+#pragma pack(push, 1)
+struct SnapshotFileHeader
+{
+    u32 magic;
+    u16 version;
+    u16 headerSize;
+
+    u32 codeEnd; // Must match the machine the snapshot is loaded into
+    u16 registers[8];
+    u16 segments[4];
+    u16 flags;   // 8086 FLAGS layout
+    u16 ip;
+    u8 status;   // MachineStatus
+    u64 instructionCount;
+
+    u32 pageCount;
+};
+
+// Followed by the lines of the page that differ from the base image, in order
+struct SnapshotFilePage
+{
+    u16 page;
+    u8 lineMask[SNAPSHOT_LINES_PER_PAGE / 8];
+};
+#pragma pack(pop)
+
+/// @brief Writes the full state of a snapshot. Memory is stored as the 16-byte lines that differ from the base image.
+bool Snapshot_WriteFile(Snapshot* snapshot, MemoryImage* base, u32 codeEnd, char* fileName)
+{
+    FILE* file;
+    fopen_s(&file, fileName, "wb");
+    if (!file) return false;
+
+    SnapshotFileHeader header {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(SnapshotFileHeader);
+    header.codeEnd = codeEnd;
+    memcpy(header.registers, snapshot->cpu.reg16, sizeof(header.registers));
+    memcpy(header.segments, snapshot->cpu.regseg, sizeof(header.segments));
+    header.flags = Emulator_GetFlagsWord(&snapshot->cpu);
+    header.ip = snapshot->ip;
+    header.status = (u8)snapshot->status;
+    header.instructionCount = snapshot->instructionCount;
+
+    for (u32 page = 0; page < PAGE_COUNT; ++page) header.pageCount += (Snapshot_FindPage(snapshot, page) != nullptr);
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (u32 page = 0; page < PAGE_COUNT; ++page)
+    {
+        u8* contents = Snapshot_FindPage(snapshot, page);
+        if (!contents) continue;
+
+        SnapshotFilePage entry {0};
+        entry.page = (u16)page;
+        for (u32 line = 0; line < SNAPSHOT_LINES_PER_PAGE; ++line)
+        {
+            u32 offset = line * SNAPSHOT_LINE_SIZE;
+            if (memcmp(contents + offset, base->pages[page] + offset, SNAPSHOT_LINE_SIZE) != 0)
+                entry.lineMask[line / 8] |= (u8)(1 << (line % 8));
+        }
+
+        fwrite(&entry, sizeof(entry), 1, file);
+        for (u32 line = 0; line < SNAPSHOT_LINES_PER_PAGE; ++line)
+        {
+            if (entry.lineMask[line / 8] & (1 << (line % 8)))
+                fwrite(contents + line * SNAPSHOT_LINE_SIZE, SNAPSHOT_LINE_SIZE, 1, file);
+        }
+    }
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+    return success;
+}
+
+/// @brief Loads a snapshot file into a machine created from the same program
+/// @return false if the file is not a snapshot of this program
+bool Snapshot_ReadFile(Machine* machine, char* fileName)
+{
+    ByteStream file;
+    if (!LoadFile(fileName, &file)) return false;
+
+    SnapshotFileHeader* header = (SnapshotFileHeader*)file.data;
+    bool valid = (file.size >= sizeof(SnapshotFileHeader) && header->magic == SNAPSHOT_MAGIC &&
+                  header->version == SNAPSHOT_VERSION && header->codeEnd == machine->codeEnd);
+
+    u32 position = (valid ? header->headerSize : file.size);
+    for (u32 index = 0; valid && index < header->pageCount; ++index)
+    {
+        if (position + sizeof(SnapshotFilePage) > file.size) { valid = false; break; }
+        SnapshotFilePage* entry = (SnapshotFilePage*)(file.data + position);
+        position += sizeof(SnapshotFilePage);
+        if (entry->page >= PAGE_COUNT) { valid = false; break; }
+
+        u8* contents = Memory_PrepareWrite(&machine->memory, entry->page);
+        memcpy(contents, machine->memory.base->pages[entry->page], PAGE_SIZE);
+
+        for (u32 line = 0; line < SNAPSHOT_LINES_PER_PAGE; ++line)
+        {
+            if (!(entry->lineMask[line / 8] & (1 << (line % 8)))) continue;
+            if (position + SNAPSHOT_LINE_SIZE > file.size) { valid = false; break; }
+
+            memcpy(contents + line * SNAPSHOT_LINE_SIZE, file.data + position, SNAPSHOT_LINE_SIZE);
+            position += SNAPSHOT_LINE_SIZE;
+        }
+    }
+
+    if (valid)
+    {
+        memcpy(machine->cpu.reg16, header->registers, sizeof(header->registers));
+        memcpy(machine->cpu.regseg, header->segments, sizeof(header->segments));
+        Emulator_SetFlagsWord(&machine->cpu, header->flags);
+        machine->ip = header->ip;
+        machine->status = (MachineStatus)header->status;
+        machine->instructionCount = header->instructionCount;
+    }
+
+    free(file.data);
+    return valid;
+}
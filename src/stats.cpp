@@ -0,0 +1,286 @@
+#include "common.cpp"
+
+// Corpus statistics: how often each instruction type, memory operand form, prefix and opcode byte occurs.
+//
+// Files are decoded in parallel, one per worker thread at a time, and counted straight from the decoded stream
+// without formatting anything. Each worker counts a file into its own totals, which are added to the shared totals
+// once the file is done.
+
+#define STATS_TYPE_COUNT (sizeof(operationNames) / sizeof(operationNames[0]))
+#define STATS_FORM_COUNT 24 // Memory operand forms: mod (0-2) * 8 + r/m
+#define STATS_PREFIX_COUNT 7
+
+static const char* statsPrefixNames[STATS_PREFIX_COUNT] = {"lock", "rep", "repne", "es:", "cs:", "ss:", "ds:"};
+
+struct InstructionStats
+{
+    u64 files;
+    u64 bytes;
+    u64 instructions;
+
+    u64 types[STATS_TYPE_COUNT];
+    u64 forms[STATS_FORM_COUNT];
+    u64 registerOnly; // Instructions without a memory operand
+    u64 prefixes[STATS_PREFIX_COUNT];
+    u64 opcodes[256]; // First byte after the prefixes
+};
+
+/// @brief Adds the number of times each byte value occurs to counts
+void CountBytes(u8* data, u32 size, u64* counts)
+{
+    // NOTE: Four tables, so that runs of the same byte do not wait on the previous increment of one counter.
+    u32 tables[4][256] = {};
+
+    u32 index = 0;
+    for (; index + 4 <= size; index += 4)
+    {
+        u32 word;
+        memcpy(&word, data + index, sizeof(word));
+        ++tables[0][word & 0xFF];
+        ++tables[1][(word >> 8) & 0xFF];
+        ++tables[2][(word >> 16) & 0xFF];
+        ++tables[3][word >> 24];
+    }
+    for (; index < size; ++index) ++tables[0][data[index]];
+
+    for (u32 value = 0; value < 256; ++value)
+        counts[value] += (u64)tables[0][value] + tables[1][value] + tables[2][value] + tables[3][value];
+}
+
+/// @param arena allocates the decoded instructions, reset by the caller
+void Stats_CountImage(ByteStream image, InstructionStats* stats, Arena* arena)
+{
+    DecodedImage decoded;
+    DecodeImage(image, &decoded, arena);
+
+    ++stats->files;
+    stats->bytes += image.size;
+    stats->instructions += decoded.count;
+
+    // Opcode bytes are gathered first and counted in one pass
+    u8* opcodes = (u8*)Arena_Push(arena, decoded.count + 1);
+    u32 opcodeCount = 0;
+
+    for (u32 index = 0; index < decoded.count; ++index)
+    {
+        Instruction* instruction = &decoded.instructions[index];
+        ++stats->types[instruction->type];
+
+        u32 opcodeOffset = instruction->offset + instruction->prefixLength;
+        if (opcodeOffset < image.size) opcodes[opcodeCount++] = image.data[opcodeOffset];
+
+        if (instruction->prefixes & PREFIX_LOCK) ++stats->prefixes[0];
+        if (instruction->prefixes & PREFIX_REP) ++stats->prefixes[1];
+        if (instruction->prefixes & PREFIX_REPNE) ++stats->prefixes[2];
+        if (instruction->prefixes & PREFIX_SEGMENT) ++stats->prefixes[3 + instruction->segmentOverride];
+
+        // NOTE: An instruction has at most one memory operand.
+        Operand* memory = nullptr;
+        if (instruction->operandCount >= 1 && instruction->opDest.type == OP_MEMORY) memory = &instruction->opDest;
+        else if (instruction->operandCount >= 2 && instruction->opSrc.type == OP_MEMORY) memory = &instruction->opSrc;
+
+        if (memory && memory->modField != REGISTER_MODE) ++stats->forms[memory->modField * 8 + memory->regmemIndex];
+        else ++stats->registerOnly;
+    }
+
+    CountBytes(opcodes, opcodeCount, stats->opcodes);
+}
+
+void Stats_Add(InstructionStats* total, InstructionStats* stats)
+{
+    // NOTE: The struct is all counters.
+    u64* target = (u64*)total;
+    u64* source = (u64*)stats;
+    for (u32 index = 0; index < sizeof(InstructionStats) / sizeof(u64); ++index) target[index] += source[index];
+}
+
+struct StatsJob
+{
+    char** fileNames;
+    u32 fileCount;
+    std::atomic<u32> nextFile;
+
+    std::mutex lock; // Guards total, arenaMetrics and output
+    InstructionStats total;
+    ArenaMetrics arenaMetrics;
+};
+
+void Stats_Worker(StatsJob* job)
+{
+    InstructionStats* stats = (InstructionStats*)malloc(sizeof(InstructionStats));
+
+    // NOTE: Everything allocated for a file is in the arena, it is reset before the next file.
+    Arena arena;
+    Arena_Init(&arena);
+
+    for (;;)
+    {
+        u32 fileIndex = job->nextFile.fetch_add(1);
+        if (fileIndex >= job->fileCount) break;
+
+        Arena_Reset(&arena);
+        ByteStream image;
+        if (!LoadFile(job->fileNames[fileIndex], &image, &arena))
+        {
+            std::lock_guard<std::mutex> lock(job->lock);
+            printf("; stats: failed to open file: %s\n", job->fileNames[fileIndex]);
+            continue;
+        }
+
+        memset(stats, 0, sizeof(InstructionStats));
+        Stats_CountImage(image, stats, &arena);
+
+        std::lock_guard<std::mutex> lock(job->lock);
+        Stats_Add(&job->total, stats);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(job->lock);
+        Arena_AddMetrics(&arena, &job->arenaMetrics);
+    }
+    Arena_Free(&arena);
+    free(stats);
+}
+
+/// @brief Name of a memory operand form, e.g. "[bx + si + d8]"
+void Stats_FormName(u32 form, char* name, u32 size)
+{
+    u32 mod = form / 8;
+    u32 rm = form % 8;
+    if (mod == MEMORY_0BIT_MODE && rm == MEM_DIRECT) snprintf(name, size, "[d16]");
+    else if (mod == MEMORY_0BIT_MODE) snprintf(name, size, "[%s]", effectiveAddressTable[rm]);
+    else snprintf(name, size, "[%s + %s]", effectiveAddressTable[rm], (mod == MEMORY_8BIT_MODE ? "d8" : "d16"));
+}
+
+void Stats_PrintTable(InstructionStats* stats)
+{
+    double instructions = (double)(stats->instructions ? stats->instructions : 1);
+
+    printf("; stats: %llu files, %llu bytes, %llu instructions\n", (unsigned long long)stats->files,
+        (unsigned long long)stats->bytes, (unsigned long long)stats->instructions);
+
+    // Instruction types by count, most frequent first
+    u32 order[STATS_TYPE_COUNT];
+    u32 typeCount = 0;
+    for (u32 type = 0; type < STATS_TYPE_COUNT; ++type)
+    {
+        if (stats->types[type] == 0) continue;
+
+        u32 position = typeCount++;
+        while (position > 0 && stats->types[order[position - 1]] < stats->types[type])
+        {
+            order[position] = order[position - 1];
+            --position;
+        }
+        order[position] = type;
+    }
+
+    printf("\n; %-14s %10s %6s\n", "instruction", "count", "%");
+    for (u32 index = 0; index < typeCount; ++index)
+    {
+        u64 count = stats->types[order[index]];
+        printf("%-16s %10llu %6.2f\n", operationNames[order[index]], (unsigned long long)count, 100.0 * count / instructions);
+    }
+
+    printf("\n; %-14s %10s %6s\n", "operand form", "count", "%");
+    printf("%-16s %10llu %6.2f\n", "(no memory)", (unsigned long long)stats->registerOnly, 100.0 * stats->registerOnly / instructions);
+    for (u32 form = 0; form < STATS_FORM_COUNT; ++form)
+    {
+        if (stats->forms[form] == 0) continue;
+
+        char name[32];
+        Stats_FormName(form, name, sizeof(name));
+        printf("%-16s %10llu %6.2f\n", name, (unsigned long long)stats->forms[form], 100.0 * stats->forms[form] / instructions);
+    }
+
+    printf("\n; %-14s %10s %6s\n", "prefix", "count", "%");
+    for (u32 prefix = 0; prefix < STATS_PREFIX_COUNT; ++prefix)
+    {
+        printf("%-16s %10llu %6.2f\n", statsPrefixNames[prefix], (unsigned long long)stats->prefixes[prefix],
+            100.0 * stats->prefixes[prefix] / instructions);
+    }
+
+    printf("\n; opcode bytes (row: high nibble, column: low nibble)\n;   ");
+    for (u32 low = 0; low < 16; ++low) printf(" %7x", low);
+    printf("\n");
+    for (u32 high = 0; high < 16; ++high)
+    {
+        printf("; %x:", high);
+        for (u32 low = 0; low < 16; ++low) printf(" %7llu", (unsigned long long)stats->opcodes[high * 16 + low]);
+        printf("\n");
+    }
+}
+
+/// @brief Writes every counter as "kind,name,count" lines
+/// @return false if the file could not be written
+bool Stats_WriteFile(InstructionStats* stats, char* fileName)
+{
+    FILE* file;
+    fopen_s(&file, fileName, "wb");
+    if (!file) return false;
+
+    fprintf(file, "kind,name,count\n");
+    fprintf(file, "total,files,%llu\n", (unsigned long long)stats->files);
+    fprintf(file, "total,bytes,%llu\n", (unsigned long long)stats->bytes);
+    fprintf(file, "total,instructions,%llu\n", (unsigned long long)stats->instructions);
+
+    for (u32 type = 0; type < STATS_TYPE_COUNT; ++type)
+    {
+        // NOTE: "; NOOP" is the name of undecodable bytes in listings.
+        const char* name = (type == DIS_NOOP ? "unknown" : operationNames[type]);
+        fprintf(file, "type,%s,%llu\n", name, (unsigned long long)stats->types[type]);
+    }
+
+    fprintf(file, "form,none,%llu\n", (unsigned long long)stats->registerOnly);
+    for (u32 form = 0; form < STATS_FORM_COUNT; ++form)
+    {
+        char name[32];
+        Stats_FormName(form, name, sizeof(name));
+        fprintf(file, "form,%s,%llu\n", name, (unsigned long long)stats->forms[form]);
+    }
+
+    for (u32 prefix = 0; prefix < STATS_PREFIX_COUNT; ++prefix)
+        fprintf(file, "prefix,%s,%llu\n", statsPrefixNames[prefix], (unsigned long long)stats->prefixes[prefix]);
+
+    for (u32 value = 0; value < 256; ++value) fprintf(file, "opcode,%02x,%llu\n", value, (unsigned long long)stats->opcodes[value]);
+
+    bool success = (ferror(file) == 0);
+    fclose(file);
+    return success;
+}
+
+/// @brief Counts all files in parallel and prints the merged totals
+/// @param outputFileName machine-readable output, optional
+void Stats_RunFiles(char** fileNames, u32 fileCount, char* outputFileName)
+{
+    StatsJob* job = new StatsJob();
+    job->fileNames = fileNames;
+    job->fileCount = fileCount;
+    job->nextFile = 0;
+
+    u32 threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+    if (threadCount > fileCount) threadCount = fileCount;
+
+    clock_t start = clock();
+
+    std::thread* threads = new std::thread[threadCount];
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        threads[threadIndex] = std::thread(Stats_Worker, job);
+    for (u32 threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        threads[threadIndex].join();
+    delete[] threads;
+
+    double milliseconds = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+    Stats_PrintTable(&job->total);
+    printf("\n; %u workers, %.2f ms cpu\n", threadCount, milliseconds);
+    Arena_PrintMetrics(&job->arenaMetrics);
+
+    if (outputFileName && !Stats_WriteFile(&job->total, outputFileName))
+    {
+        printf("Failed to write stats file: %s\n", outputFileName);
+    }
+
+    delete job;
+}
@@ -0,0 +1,446 @@
+#include "common.cpp"
+
+// Listings in other assembler syntaxes, with optional address and byte columns.
+//
+// A syntax is a struct of static functions that print the parts of an instruction (registers, immediates, memory
+// operands, branch targets) and the columns are structs of the same kind. The listing is a template over all three,
+// so each combination is compiled into its own loop with the calls inlined, and nothing in the loop checks which
+// syntax or columns were chosen. Syntax_PrintFile() picks the instantiation once per file.
+//
+// NasmSyntax prints the same text as PrintInstruction().
+//
+// With an executed-code bitmap from a run (coverage.cpp), only the bytes where an executed instruction starts are
+// decoded, the bytes in between are printed as data lines without decoding them.
+
+template <typename Syntax> void Syntax_PrintInstruction(Instruction* inst, ByteStream* image);
+
+#define SYNTAX_DATA_LINE_SIZE 6 // Bytes per data line, fits the bytes column
+
+// Order of two operands, selects an overload of Syntax_PrintOperands()
+struct DestinationFirst {};
+struct SourceFirst {};
+
+static char* const attEffectiveAddressTable[] = {"%bx,%si", "%bx,%di", "%bp,%si", "%bp,%di", "%si", "%di", "%bp", "%bx"};
+
+/// @brief Prints bytes as a data directive
+/// @param format format of one byte
+void Syntax_PrintBytes(const char* directive, const char* format, u8* bytes, u32 count)
+{
+    Print("%s", directive);
+    for (u32 index = 0; index < count; ++index)
+    {
+        if (index > 0) Print(", ");
+        Print(format, bytes[index]);
+    }
+}
+
+struct NasmSyntax
+{
+    typedef DestinationFirst OperandOrder;
+
+    static const char* Comment() { return "; "; }
+    static const char* Header() { return "bits 16\n"; }
+    static void Unknown(u8 opcode) { Print("; %x", opcode); }
+    static void Data(u8* bytes, u32 count) { Syntax_PrintBytes("db ", "0x%02x", bytes, count); }
+
+    static void Mnemonic(Instruction* inst, bool)
+    {
+        // NOTE: Far CALL/JMP are marked on the operand, only RET has a far mnemonic.
+        Print("%s%s ", operationNames[inst->type], (inst->isFar && inst->type == DIS_RET ? "f" : ""));
+    }
+
+    static void SegmentPrefix(u8 segment) { Print("%s ", registersSegment[segment]); }
+    static void Register(const char* name) { Print("%s", name); }
+    static void Branch(i32 displacement) { Print(displacement >= 0 ? " $+%d" : " $%d", displacement); }
+    static void FarOperand() { Print("far "); }
+
+    static void Immediate(Operand* operand, bool wide, i16 value)
+    {
+        if (operand->outputWidth) Print(wide ? "word " : "byte ");
+        Print("%d", value);
+    }
+
+    static void Memory(Operand* operand, bool wide, bool, const char* segment)
+    {
+        if (operand->outputWidth) Print(wide ? "word " : "byte ");
+
+        i16 displacement = (operand->modField == MEMORY_8BIT_MODE ? (i8)operand->valueLow : (i16)operand->value);
+        if (operand->modField == MEMORY_0BIT_MODE && operand->regmemIndex == MEM_DIRECT) Print("[%s%d]", segment, displacement);
+        else if (operand->modField == MEMORY_0BIT_MODE || displacement == 0) Print("[%s%s]", segment, effectiveAddressTable[operand->regmemIndex]);
+        else
+        {
+            Print("[%s%s %s %d]", segment, effectiveAddressTable[operand->regmemIndex], (displacement >= 0 ? "+" : "-"),
+                (displacement < 0 ? -displacement : displacement));
+        }
+    }
+};
+
+// NOTE: The size goes on the memory operand as "word ptr", direct addresses need a segment to not be immediates.
+struct MasmSyntax
+{
+    typedef DestinationFirst OperandOrder;
+
+    static const char* Comment() { return "; "; }
+    static const char* Header() { return ".8086\n"; }
+    static void Unknown(u8 opcode) { Print("; %x", opcode); }
+    static void Data(u8* bytes, u32 count) { Syntax_PrintBytes("db ", "0%02xh", bytes, count); }
+
+    static void Mnemonic(Instruction* inst, bool)
+    {
+        Print("%s%s ", operationNames[inst->type], (inst->isFar && inst->type == DIS_RET ? "f" : ""));
+    }
+
+    static void SegmentPrefix(u8 segment) { Print("%s: ", registersSegment[segment]); }
+    static void Register(const char* name) { Print("%s", name); }
+    static void Branch(i32 displacement) { Print(displacement >= 0 ? "$+%d" : "$%d", displacement); }
+    static void FarOperand() { Print("dword ptr "); }
+    static void Immediate(Operand*, bool, i16 value) { Print("%d", value); }
+
+    static void Memory(Operand* operand, bool wide, bool sized, const char* segment)
+    {
+        if (sized) Print(wide ? "word ptr " : "byte ptr ");
+
+        i16 displacement = (operand->modField == MEMORY_8BIT_MODE ? (i8)operand->valueLow : (i16)operand->value);
+        if (operand->modField == MEMORY_0BIT_MODE && operand->regmemIndex == MEM_DIRECT)
+        {
+            Print("%s[%d]", (segment[0] ? segment : "ds:"), displacement);
+        }
+        else if (operand->modField == MEMORY_0BIT_MODE || displacement == 0)
+        {
+            Print("%s[%s]", segment, effectiveAddressTable[operand->regmemIndex]);
+        }
+        else
+        {
+            Print("%s[%s %s %d]", segment, effectiveAddressTable[operand->regmemIndex], (displacement >= 0 ? "+" : "-"),
+                (displacement < 0 ? -displacement : displacement));
+        }
+    }
+};
+
+// NOTE: Source first. The size is a mnemonic suffix, only where no register gives it.
+struct AttSyntax
+{
+    typedef SourceFirst OperandOrder;
+
+    static const char* Comment() { return "# "; }
+    static const char* Header() { return ".code16\n"; }
+    static void Unknown(u8 opcode) { Print("# %x", opcode); }
+    static void Data(u8* bytes, u32 count) { Syntax_PrintBytes(".byte ", "0x%02x", bytes, count); }
+
+    static void Mnemonic(Instruction* inst, bool sized)
+    {
+        if (inst->type == DIS_NOOP) Print("# NOOP ");
+        else if (inst->isFar) Print("l%s ", operationNames[inst->type]);
+        else if (sized) Print("%s%s ", operationNames[inst->type], (inst->isWide ? "w" : "b"));
+        else Print("%s ", operationNames[inst->type]);
+    }
+
+    static void SegmentPrefix(u8 segment) { Print("%s ", registersSegment[segment]); }
+    static void Register(const char* name) { Print("%%%s", name); }
+    static void Branch(i32 displacement) { Print(displacement >= 0 ? ".+%d" : ".%d", displacement); }
+    static void FarOperand() { Print("*"); }
+    static void Immediate(Operand*, bool, i16 value) { Print("$%d", value); }
+
+    static void Memory(Operand* operand, bool, bool, const char* segment)
+    {
+        if (segment[0]) Print("%%%s", segment);
+
+        i16 displacement = (operand->modField == MEMORY_8BIT_MODE ? (i8)operand->valueLow : (i16)operand->value);
+        if (operand->modField == MEMORY_0BIT_MODE && operand->regmemIndex == MEM_DIRECT) Print("%d", displacement);
+        else if (operand->modField == MEMORY_0BIT_MODE || displacement == 0) Print("(%s)", attEffectiveAddressTable[operand->regmemIndex]);
+        else Print("%d(%s)", displacement, attEffectiveAddressTable[operand->regmemIndex]);
+    }
+};
+
+// Every instruction as the bytes it was decoded from, reassembles to the same image with NASM
+struct RawSyntax
+{
+    static const char* Comment() { return "; "; }
+    static const char* Header() { return "bits 16\n"; }
+    static void Unknown(u8) {}
+    static void Data(u8* bytes, u32 count) { Syntax_PrintBytes("db ", "0x%02x", bytes, count); }
+};
+
+// State of a listing that the columns use
+struct Listing
+{
+    ByteStream image;
+    RegionMap* regions; // Segment:offset addresses, null for file offsets
+    u32 region;         // Region of the current instruction
+    u64* coverage;      // Instructions start only where a bit is set, the rest is data. Null to decode everything.
+};
+
+// A column is printed before the instruction text, and can add a comment after it.
+struct NoColumn
+{
+    static void Print(Instruction*, Listing*) {}
+    static void Comment(Instruction*, Listing*, const char*) {}
+};
+
+struct AddressColumn
+{
+    static void Print(Instruction* inst, Listing*) { ::Print("%08x  ", inst->offset); }
+    static void Comment(Instruction*, Listing*, const char*) {}
+};
+
+// Segment:offset in the instruction's region, and the resolved target of relative branches
+struct SegmentAddressColumn
+{
+    static void Print(Instruction* inst, Listing* listing)
+    {
+        // NOTE: Instructions are listed in order, the region only moves forward.
+        RegionMap* regions = listing->regions;
+        while (listing->region + 1 < regions->count && regions->regions[listing->region + 1].start <= inst->offset)
+            ++listing->region;
+
+        u16 segment;
+        u16 offset;
+        Regions_Address(&regions->regions[listing->region], inst->offset, &segment, &offset);
+        ::Print("%04x:%04x  ", segment, offset);
+    }
+
+    static void Comment(Instruction* inst, Listing* listing, const char* comment)
+    {
+        u16 segment;
+        u16 offset;
+        u32 fileOffset;
+        if (!Regions_BranchTarget(listing->regions, listing->region, inst, &segment, &offset, &fileOffset)) return;
+
+        if (fileOffset == REGION_OUTSIDE) ::Print("  %s-> %04x:%04x (outside the region)", comment, segment, offset);
+        else ::Print("  %s-> %04x:%04x", comment, segment, offset);
+    }
+};
+
+struct BytesColumn
+{
+    static void Print(Instruction* inst, Listing* listing)
+    {
+        // NOTE: Wide enough for 6 byte instructions, longer ones (many prefixes) push the text to the right.
+        ByteStream* image = &listing->image;
+        u32 end = inst->offset + inst->length;
+        if (end > image->size) end = image->size;
+        for (u32 offset = inst->offset; offset < end; ++offset) ::Print("%02x", image->data[offset]);
+        for (u32 length = end - inst->offset; length < 7; ++length) ::Print("  ");
+    }
+
+    static void Comment(Instruction*, Listing*, const char*) {}
+};
+
+template <typename Syntax>
+void Syntax_PrintOperand(Operand* operand, bool wide, bool sized, const char* segment)
+{
+    switch (operand->type)
+    {
+        case OP_REGISTER: Syntax::Register((wide ? registers16bit : registers8bit)[operand->regmemIndex]); break;
+        case OP_SEGMENT_REGISTER: Syntax::Register(registersSegment[operand->regmemIndex]); break;
+        case OP_IMMEDIATE: Syntax::Immediate(operand, wide, (wide ? (i16)operand->value : (i8)operand->valueLow)); break;
+        case OP_MEMORY: Syntax::Memory(operand, wide, sized, segment); break;
+    }
+}
+
+template <typename Syntax>
+void Syntax_PrintOperands(DestinationFirst, Operand* dest, bool destWide, Operand* src, bool srcWide, bool sized,
+    const char* destSegment, const char* srcSegment)
+{
+    Syntax_PrintOperand<Syntax>(dest, destWide, sized, destSegment);
+    Print(", ");
+    Syntax_PrintOperand<Syntax>(src, srcWide, sized, srcSegment);
+}
+
+template <typename Syntax>
+void Syntax_PrintOperands(SourceFirst, Operand* dest, bool destWide, Operand* src, bool srcWide, bool sized,
+    const char* destSegment, const char* srcSegment)
+{
+    Syntax_PrintOperand<Syntax>(src, srcWide, sized, srcSegment);
+    Print(", ");
+    Syntax_PrintOperand<Syntax>(dest, destWide, sized, destSegment);
+}
+
+/// @brief Prints an instruction the way PrintInstruction() does, with the syntax's spelling of each part
+template <typename Syntax>
+void Syntax_PrintInstruction(Instruction* inst, ByteStream*)
+{
+    bool hasMemoryOperand = ((inst->operandCount >= 1 && inst->opDest.type == OP_MEMORY) ||
+                             (inst->operandCount >= 2 && inst->opSrc.type == OP_MEMORY));
+
+    const char* segment = "";
+    if (inst->type != DIS_NOOP)
+    {
+        if (inst->prefixes & PREFIX_LOCK) Print("lock ");
+        if (inst->prefixes & PREFIX_REP) Print("rep ");
+        if (inst->prefixes & PREFIX_REPNE) Print("repne ");
+
+        if (inst->prefixes & PREFIX_SEGMENT)
+        {
+            if (hasMemoryOperand) segment = segmentOverrideNames[inst->segmentOverride];
+            else Syntax::SegmentPrefix(inst->segmentOverride);
+        }
+
+        // Prefixes without an instruction
+        if (inst->type == DIS_LOCK || inst->type == DIS_REP || inst->type == DIS_SEGMENT) return;
+    }
+
+    // Size written out: the decoder marks where NASM needs it, only memory operands need it in other syntaxes
+    bool sized = hasMemoryOperand &&
+        ((inst->operandCount >= 1 && inst->opDest.outputWidth) || (inst->operandCount >= 2 && inst->opSrc.outputWidth));
+    Syntax::Mnemonic(inst, sized);
+
+    bool destWide = inst->isWide;
+    bool srcWide = inst->isWide;
+    const char* srcSegment = segment;
+
+    switch (inst->type)
+    {
+        case DIS_JO: case DIS_JNO: case DIS_JB: case DIS_JNB: case DIS_JE: case DIS_JNE: case DIS_JBE: case DIS_JNBE:
+        case DIS_JS: case DIS_JNS: case DIS_JP: case DIS_JNP: case DIS_JL: case DIS_JNL: case DIS_JLE: case DIS_JNLE:
+        case DIS_LOOP: case DIS_LOOPZ: case DIS_LOOPNZ: case DIS_JCXZ:
+            Syntax::Branch(BranchDisplacement(inst));
+            return;
+
+        // Shift count, port number
+        case DIS_SHL: case DIS_SHR: case DIS_SAR: case DIS_ROL: case DIS_ROR: case DIS_RCL: case DIS_RCR:
+            srcWide = false;
+            srcSegment = "";
+            break;
+        case DIS_IN:
+            srcWide = true;
+            srcSegment = "";
+            segment = "";
+            break;
+        case DIS_OUT:
+            destWide = true;
+            srcSegment = "";
+            segment = "";
+            break;
+
+        default: break;
+    }
+
+    if (inst->operandCount == 1)
+    {
+        if (inst->isFar && inst->type != DIS_RET) Syntax::FarOperand();
+        Syntax_PrintOperand<Syntax>(&inst->opDest, destWide, sized, segment);
+    }
+    else if (inst->operandCount == 2)
+    {
+        Syntax_PrintOperands<Syntax>(typename Syntax::OperandOrder(), &inst->opDest, destWide, &inst->opSrc, srcWide, sized,
+            segment, srcSegment);
+    }
+}
+
+template <>
+void Syntax_PrintInstruction<RawSyntax>(Instruction* inst, ByteStream* image)
+{
+    u32 end = inst->offset + inst->length;
+    if (end > image->size) end = image->size;
+    RawSyntax::Data(image->data + inst->offset, end - inst->offset);
+}
+
+/// @brief Decodes and prints the instruction at the position of the image
+template <typename Syntax, typename Address, typename Bytes>
+void Syntax_PrintNextInstruction(Listing* listing)
+{
+    ByteStream* image = &listing->image;
+    Instruction instruction;
+    bool recognized = DecodeInstruction(image, &instruction);
+
+    Address::Print(&instruction, listing);
+    Bytes::Print(&instruction, listing);
+    if (!recognized) Syntax::Unknown(image->data[instruction.offset + instruction.prefixLength]);
+    Syntax_PrintInstruction<Syntax>(&instruction, image);
+    Address::Comment(&instruction, listing, Syntax::Comment());
+    Print("\n");
+}
+
+/// @brief Prints [start, end) of the image as data lines
+template <typename Syntax, typename Address, typename Bytes>
+void Syntax_PrintData(Listing* listing, u32 start, u32 end)
+{
+    for (u32 offset = start; offset < end; offset += SYNTAX_DATA_LINE_SIZE)
+    {
+        // NOTE: The columns take the line as an instruction of that many bytes.
+        Instruction line = {};
+        line.offset = offset;
+        line.length = (end - offset < SYNTAX_DATA_LINE_SIZE ? end - offset : SYNTAX_DATA_LINE_SIZE);
+
+        Address::Print(&line, listing);
+        Bytes::Print(&line, listing);
+        Syntax::Data(listing->image.data + offset, line.length);
+        Print("\n");
+    }
+}
+
+template <typename Syntax, typename Address, typename Bytes>
+void Syntax_PrintListing(char* fileName, Listing* listing)
+{
+    Print("%sDisassembly: %s\n", Syntax::Comment(), fileName);
+    Print("%s", Syntax::Header());
+
+    ByteStream* image = &listing->image;
+    image->position = 0;
+    while (image->position < image->size) Syntax_PrintNextInstruction<Syntax, Address, Bytes>(listing);
+}
+
+/// @brief Prints the instructions that start at bits of the coverage, and the bytes between them as data
+/// NOTE: An instruction runs to its end even if another covered instruction starts inside it (overlapping code),
+/// the listing continues after it.
+template <typename Syntax, typename Address, typename Bytes>
+void Syntax_PrintCoveredListing(char* fileName, Listing* listing)
+{
+    Print("%sDisassembly: %s (coverage: %u instructions)\n", Syntax::Comment(), fileName,
+        Coverage_CountStarts(listing->coverage));
+    Print("%s", Syntax::Header());
+
+    ByteStream* image = &listing->image;
+    image->position = 0;
+    while (image->position < image->size)
+    {
+        if (Coverage_IsCode(listing->coverage, image->position))
+        {
+            Syntax_PrintNextInstruction<Syntax, Address, Bytes>(listing);
+            continue;
+        }
+
+        u32 end = Coverage_NextCode(listing->coverage, image->position, image->size);
+        Syntax_PrintData<Syntax, Address, Bytes>(listing, image->position, end);
+        image->position = end;
+    }
+}
+
+template <typename Syntax, typename Address>
+void Syntax_PrintListingWithAddress(char* fileName, Listing* listing, bool bytes)
+{
+    if (listing->coverage && bytes) Syntax_PrintCoveredListing<Syntax, Address, BytesColumn>(fileName, listing);
+    else if (listing->coverage) Syntax_PrintCoveredListing<Syntax, Address, NoColumn>(fileName, listing);
+    else if (bytes) Syntax_PrintListing<Syntax, Address, BytesColumn>(fileName, listing);
+    else Syntax_PrintListing<Syntax, Address, NoColumn>(fileName, listing);
+}
+
+template <typename Syntax>
+void Syntax_PrintListingWithColumns(char* fileName, Listing* listing, bool addresses, bool bytes)
+{
+    if (addresses && listing->regions) Syntax_PrintListingWithAddress<Syntax, SegmentAddressColumn>(fileName, listing, bytes);
+    else if (addresses) Syntax_PrintListingWithAddress<Syntax, AddressColumn>(fileName, listing, bytes);
+    else Syntax_PrintListingWithAddress<Syntax, NoColumn>(fileName, listing, bytes);
+}
+
+/// @brief Prints the listing of an image
+/// @param syntax "nasm", "masm", "att" or "raw"
+/// @param addresses start each line with the address of the instruction
+/// @param bytes start each line with the bytes of the instruction
+/// @param regions addresses are segment:offset in these regions, file offsets if null
+/// @param coverage executed-code bitmap of a run of the image, bytes that were not executed are listed as data.
+/// Optional, see coverage.cpp.
+/// @return false if the syntax is not known
+bool Syntax_PrintFile(char* fileName, ByteStream image, const char* syntax, bool addresses, bool bytes,
+    RegionMap* regions = nullptr, u64* coverage = nullptr)
+{
+    Listing listing = {image, regions, 0, coverage};
+
+    if (strcmp(syntax, "nasm") == 0) Syntax_PrintListingWithColumns<NasmSyntax>(fileName, &listing, addresses, bytes);
+    else if (strcmp(syntax, "masm") == 0) Syntax_PrintListingWithColumns<MasmSyntax>(fileName, &listing, addresses, bytes);
+    else if (strcmp(syntax, "att") == 0) Syntax_PrintListingWithColumns<AttSyntax>(fileName, &listing, addresses, bytes);
+    else if (strcmp(syntax, "raw") == 0) Syntax_PrintListingWithColumns<RawSyntax>(fileName, &listing, addresses, bytes);
+    else return false;
+    return true;
+}
@@ -0,0 +1,238 @@
+#include "common.cpp"
+
+// Cross-reference index over a decoded image.
+//
+// Both indexes are stored in a compressed sparse row layout: the entries for key k are
+// entries[start[k] .. start[k + 1]), and each entry is an instruction index in ascending order.
+// Building the index is two linear passes (count, then fill), a query is two array reads.
+
+enum XrefAccessKind
+{
+    XREF_READ,
+    XREF_WRITE,
+
+    XREF_ACCESS_COUNT
+};
+
+#define XREF_REGISTER_KEYS (REGID_COUNT * XREF_ACCESS_COUNT)
+#define XREF_MEMORY_KEYS (0x10000 * XREF_ACCESS_COUNT)
+
+struct XrefIndex
+{
+    // Key: RegisterId * XREF_ACCESS_COUNT + XrefAccessKind
+    u32 registerStart[XREF_REGISTER_KEYS + 1];
+    u32* registerEntries;
+
+    // Key: direct address * XREF_ACCESS_COUNT + XrefAccessKind. Word accesses are listed under both bytes.
+    u32* memoryStart;
+    u32* memoryEntries;
+};
+
+struct XrefSpan
+{
+    u32* entries;
+    u32 count;
+};
+
+inline u32 Xref_RegisterKey(RegisterId id, XrefAccessKind kind) { return id * XREF_ACCESS_COUNT + kind; }
+inline u32 Xref_MemoryKey(u16 address, XrefAccessKind kind) { return address * XREF_ACCESS_COUNT + kind; }
+
+struct XrefKeys
+{
+    u32 registerKeys[XREF_REGISTER_KEYS];
+    u32 registerCount;
+    u32 memoryKeys[2 * XREF_ACCESS_COUNT];
+    u32 memoryCount;
+};
+
+/// @brief Lists the index keys an instruction belongs to
+XrefKeys Xref_GetKeys(Instruction* instruction)
+{
+    XrefKeys keys;
+    keys.registerCount = 0;
+    keys.memoryCount = 0;
+
+    InstructionAccess access = GetInstructionAccess(instruction);
+
+    for (int id = 0; id < REGID_COUNT; ++id)
+    {
+        if (access.reads & REGSET(id)) keys.registerKeys[keys.registerCount++] = Xref_RegisterKey((RegisterId)id, XREF_READ);
+        if (access.writes & REGSET(id)) keys.registerKeys[keys.registerCount++] = Xref_RegisterKey((RegisterId)id, XREF_WRITE);
+    }
+
+    if (access.hasDirectAddress)
+    {
+        int byteCount = (access.memoryWide ? 2 : 1);
+        for (int byteIndex = 0; byteIndex < byteCount; ++byteIndex)
+        {
+            u16 address = (u16)(access.directAddress + byteIndex);
+            if (access.memoryRead) keys.memoryKeys[keys.memoryCount++] = Xref_MemoryKey(address, XREF_READ);
+            if (access.memoryWrite) keys.memoryKeys[keys.memoryCount++] = Xref_MemoryKey(address, XREF_WRITE);
+        }
+    }
+
+    return keys;
+}
+
+/// @brief Builds the register and direct-address indexes
+/// @param decoded decoded image
+/// @param[out] index built index. Free with Xref_Free().
+void Xref_Build(DecodedImage* decoded, XrefIndex* index)
+{
+    *index = {};
+    index->memoryStart = (u32*)calloc(XREF_MEMORY_KEYS + 1, sizeof(u32));
+
+    // Count entries per key, shifted by one so the prefix sum produces start offsets
+    u32* memoryCounts = index->memoryStart + 1;
+    u32* registerCounts = index->registerStart + 1;
+    for (u32 instructionIndex = 0; instructionIndex < decoded->count; ++instructionIndex)
+    {
+        XrefKeys keys = Xref_GetKeys(&decoded->instructions[instructionIndex]);
+        for (u32 keyIndex = 0; keyIndex < keys.registerCount; ++keyIndex) ++registerCounts[keys.registerKeys[keyIndex]];
+        for (u32 keyIndex = 0; keyIndex < keys.memoryCount; ++keyIndex) ++memoryCounts[keys.memoryKeys[keyIndex]];
+    }
+
+    for (u32 key = 0; key < XREF_REGISTER_KEYS; ++key)
+        index->registerStart[key + 1] += index->registerStart[key];
+    for (u32 key = 0; key < XREF_MEMORY_KEYS; ++key)
+        index->memoryStart[key + 1] += index->memoryStart[key];
+
+    index->registerEntries = (u32*)malloc((index->registerStart[XREF_REGISTER_KEYS] + 1) * sizeof(u32));
+    index->memoryEntries = (u32*)malloc((index->memoryStart[XREF_MEMORY_KEYS] + 1) * sizeof(u32));
+
+    // Fill. Instructions are visited in order, so every key's entries end up sorted.
+    u32 registerCursor[XREF_REGISTER_KEYS];
+    memcpy(registerCursor, index->registerStart, sizeof(registerCursor));
+    u32* memoryCursor = (u32*)malloc(XREF_MEMORY_KEYS * sizeof(u32));
+    memcpy(memoryCursor, index->memoryStart, XREF_MEMORY_KEYS * sizeof(u32));
+
+    for (u32 instructionIndex = 0; instructionIndex < decoded->count; ++instructionIndex)
+    {
+        XrefKeys keys = Xref_GetKeys(&decoded->instructions[instructionIndex]);
+        for (u32 keyIndex = 0; keyIndex < keys.registerCount; ++keyIndex)
+            index->registerEntries[registerCursor[keys.registerKeys[keyIndex]]++] = instructionIndex;
+        for (u32 keyIndex = 0; keyIndex < keys.memoryCount; ++keyIndex)
+            index->memoryEntries[memoryCursor[keys.memoryKeys[keyIndex]]++] = instructionIndex;
+    }
+
+    free(memoryCursor);
+}
+
+void Xref_Free(XrefIndex* index)
+{
+    free(index->registerEntries);
+    free(index->memoryStart);
+    free(index->memoryEntries);
+    *index = {};
+}
+
+inline XrefSpan Xref_GetRegister(XrefIndex* index, RegisterId id, XrefAccessKind kind)
+{
+    u32 key = Xref_RegisterKey(id, kind);
+    return {index->registerEntries + index->registerStart[key], index->registerStart[key + 1] - index->registerStart[key]};
+}
+
+inline XrefSpan Xref_GetMemory(XrefIndex* index, u16 address, XrefAccessKind kind)
+{
+    u32 key = Xref_MemoryKey(address, kind);
+    return {index->memoryEntries + index->memoryStart[key], index->memoryStart[key + 1] - index->memoryStart[key]};
+}
+
+// Queries:
+// - "bx", "bl"     -- instructions that read or write the register
+// - "r:bx", "w:bx" -- only reads or only writes
+// - "[1000]"       -- instructions that access the direct address (also with r:/w:)
+struct XrefQuery
+{
+    bool isMemory;
+    RegisterId id;
+    u16 address;
+    bool reads;
+    bool writes;
+};
+
+/// @brief Parses a query string
+/// @return false if the query is malformed
+bool Xref_ParseQuery(char* text, XrefQuery* query)
+{
+    *query = {};
+    query->reads = query->writes = true;
+
+    if ((text[0] == 'r' || text[0] == 'w') && text[1] == ':')
+    {
+        query->reads = (text[0] == 'r');
+        query->writes = (text[0] == 'w');
+        text += 2;
+    }
+
+    if (text[0] == '[')
+    {
+        char* end;
+        long address = strtol(text + 1, &end, 0);
+        if (end == text + 1 || end[0] != ']' || end[1] != 0 || address < 0 || address > 0xFFFF) return false;
+
+        query->isMemory = true;
+        query->address = (u16)address;
+        return true;
+    }
+
+    for (int id = 0; id < REGID_COUNT; ++id)
+    {
+        if (strcmp(text, registerIdNames[id]) == 0)
+        {
+            query->id = (RegisterId)id;
+            return true;
+        }
+    }
+
+    // 8-bit registers are indexed as their 16-bit register
+    static const char* lowNames[] = {"al", "cl", "dl", "bl"};
+    static const char* highNames[] = {"ah", "ch", "dh", "bh"};
+    for (int id = 0; id < 4; ++id)
+    {
+        if (strcmp(text, lowNames[id]) == 0 || strcmp(text, highNames[id]) == 0)
+        {
+            query->id = (RegisterId)id;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// @brief Runs a query
+/// @param[out] result instruction indices in ascending order. Free result.entries with free().
+void Xref_Run(XrefIndex* index, XrefQuery* query, XrefSpan* result)
+{
+    XrefSpan reads {0};
+    XrefSpan writes {0};
+
+    if (query->isMemory)
+    {
+        if (query->reads) reads = Xref_GetMemory(index, query->address, XREF_READ);
+        if (query->writes) writes = Xref_GetMemory(index, query->address, XREF_WRITE);
+    }
+    else
+    {
+        if (query->reads) reads = Xref_GetRegister(index, query->id, XREF_READ);
+        if (query->writes) writes = Xref_GetRegister(index, query->id, XREF_WRITE);
+    }
+
+    // Merge both sorted lists. Read-modify-write instructions appear in both, keep one copy.
+    result->entries = (u32*)malloc((reads.count + writes.count + 1) * sizeof(u32));
+    result->count = 0;
+
+    u32 readIndex = 0;
+    u32 writeIndex = 0;
+    while (readIndex < reads.count || writeIndex < writes.count)
+    {
+        u32 next;
+        if (writeIndex == writes.count || (readIndex < reads.count && reads.entries[readIndex] <= writes.entries[writeIndex]))
+            next = reads.entries[readIndex++];
+        else
+            next = writes.entries[writeIndex++];
+
+        if (result->count == 0 || result->entries[result->count - 1] != next)
+            result->entries[result->count++] = next;
+    }
+}
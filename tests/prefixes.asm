@@ -0,0 +1,34 @@
+; LOCK, REP/REPNE and segment override prefixes are fields of the instruction they apply to.
+; The listing has to put them back where NASM expects them: lock/rep/repne before the mnemonic,
+; the override inside the brackets of a memory operand, or before a string instruction.
+; Branch displacements count from the first prefix byte.
+
+bits 16
+
+mov ax, [es:bx]
+mov [cs:bx + si], cx
+mov dl, [es:bp + di + 4]
+mov [ds:bp], ax
+add word [es:1000], 5
+inc byte [cs:si - 2]
+push word [ss:bx + 300]
+
+lock xchg [bx], ax
+lock add [es:di], dx
+lock inc word [cs:bp + 8]
+
+rep movsb
+rep stosw
+rep lodsb
+repne scasb
+rep cmpsw
+es movsb
+cs lodsw
+rep ss movsw
+repne es cmpsb
+
+cs je $+5
+inc ax
+inc ax
+ds jnz $-3
+es loop $+6
@@ -0,0 +1,20 @@
+; Word operations with a sign-extended 8-bit immediate (opcode 83).
+; Negative immediates have to be listed and executed as negative words:
+; add ax, -1 must not become add ax, 32767.
+
+bits 16
+
+mov ax, 1
+add ax, -1
+mov bx, 0
+sub bx, -128
+mov cx, 0x100
+add cx, 127
+and cx, -2
+cmp cx, -1
+or dx, -16
+adc si, -3
+sbb di, -4
+xor word [bx + si], -5
+add word [bp + 2], -100
+cmp word [1000], 1